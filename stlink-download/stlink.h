@@ -0,0 +1,93 @@
+/* stlink.h: The libstlink programming interface. */
+/*
+  The STLink transport, target and flash code of stlinkv2-util, built as
+  a library with 'make libstlink.a'.  All probe generations share the
+  same code, with a transport backend for each:
+   the STLink v1 over SCSI Generic (SG_IO),
+   the STLink v2 over libusb bulk transfers,
+   a simulated STLink and STM32 target, and
+   the replay of a recorded transaction trace.
+
+  The probe context is opaque.  Allocate it with stl_alloc(), open it with
+  one of the stl_*_open() calls, then stl_connect() to identify the probe
+  and target.  Finish with stl_close() and free().
+  A context must only be used by one thread at a time, but independent
+  probes may be driven from separate threads.
+
+  Functions returning int return zero on success.
+
+  This program may be used under the terms of the Gnu General Public License,
+  (GPL) v2 or v3.  Distribution under other terms requires an explicit
+  license from the authors.
+*/
+#ifndef _STLINK_H
+#define _STLINK_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+struct stlink;
+
+/* The default message level for newly opened probes. */
+extern int stl_verbose;
+
+struct stlink *stl_alloc(void);
+/* Open a STLink v2 by USB location or serial number, or the first found
+ * if PROBE_SEL is NULL.  RESET does a USB reset first. */
+struct stlink *stl_usb_scan(struct stlink *sl, const char *probe_sel,
+							int reset);
+/* Open a STLink v1 by its SCSI Generic device, e.g. /dev/sg2. */
+struct stlink *stl_sg_open(struct stlink *sl, const char *dev_name);
+/* Open a simulated STLink and target, see the --sim option. */
+struct stlink *stl_sim_open(struct stlink *sl, const char *spec);
+/* Open a recorded trace for replay, see the --replay option. */
+struct stlink *stl_replay_open(struct stlink *sl, const char *path);
+int stl_trace_open(struct stlink *sl, const char *path);
+int stl_connect(struct stlink *sl);
+void stl_close(struct stlink *sl);
+
+/* Run stlinkv2-util commands such as "program=<file>" or "status", from
+ * a NULL-terminated list.  Returns the number that failed. */
+int stl_run_cmds(struct stlink *sl, char **cmds);
+
+/* Target memory and flash. */
+int stl_read(struct stlink *sl, uint32_t addr, void *buf, ssize_t size);
+int stl_fread(struct stlink *sl, const char *path, uint32_t addr,
+			  size_t size);
+int stlink_fverify(struct stlink *sl, const char *path, uint32_t addr);
+int stl_flash_erase_page(struct stlink *sl, uint32_t addr_page);
+/* Erase the pages or sectors that SIZE bytes at ADDR will be written to,
+ * or mass erase when they are most of the flash and that is quicker. */
+int stl_flash_erase_range(struct stlink *sl, uint32_t addr, uint32_t size);
+int stl_flash_write(struct stlink *sl, uint32_t flash_addr,
+					const void *buf, int size);
+int stl_flash_fwrite(struct stlink *sl, const char *path, uint32_t addr,
+					 int max_size);
+/* Write an image, erasing and programming only the pages that differ from
+ * what is already in the flash. */
+int stl_flash_update(struct stlink *sl, uint32_t addr, const void *buf,
+					 int size);
+int stl_flash_fupdate(struct stlink *sl, const char *path, uint32_t addr,
+					  int max_size);
+
+/* Add a flash algorithm from a file, as with the --algo option.  It is
+ * used for its device ahead of the built-in loader. */
+int stl_algo_load(const char *path);
+
+/* Transaction statistics, as with the --stats option. */
+int stl_stats_enable(struct stlink *sl);
+void stl_stats_report(struct stlink *sl, FILE *fp, int json);
+
+/* The attached STLink v2 probes, and recorded trace summaries. */
+int stl_usb_list(char (*list)[32], int max);
+int stl_trace_show(const char *path);
+
+#endif
+/*
+ * Local variables:
+ *  c-indent-level: 4
+ *  c-basic-offset: 4
+ *  tab-width: 4
+ * End:
+ */
@@ -72,19 +72,24 @@ Usage notes on the original STLink v1 firmware only:
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 #include <getopt.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
 
 #if defined(__linux__)
 /* We use the libusb API for the STLink v2. */
 #include <libusb-1.0/libusb.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <poll.h>
 #include <scsi/sg.h>
 
 #elif defined(__ms_windows__)
@@ -92,10 +97,13 @@ Usage notes on the original STLink v1 firmware only:
 
 #elif defined(__APPLE__)
 #include <libusb-1.0/libusb.h>
+#include <sys/mman.h>
 #else
 #error "No host OS defined."
 #endif
+#include "stlink.h"
 
+#if ! defined(STLINK_LIBRARY)
 /* $Vbase: 1.54 14 January 2011 00:25:11 becker$ */
 static const char version_msg[] =
 	"STLink programmer/debugging utility.  Written by Donald Becker and "
@@ -107,10 +115,17 @@ static const char usage_msg[] =
 #if defined(__ms_windows__)
  	"\nUsage: %s \\\\.\\E: <command> ...\n\n"
 #else
-	"\nUsage: %s [/dev/stlink] <command> ...\n\n"
+	"\nUsage: %s [--probe=<usb-path|serial|/dev/sgN>] [--fast] "
+	"[--compress] [--vpp] [--algo=<file>] [--parallel|--daemon] "
+	"[--stats[=text|json|<file>]] <command> ...\n"
+	"       %s --sim[=<chip>] | --replay=<trace> [--trace=<trace>] "
+	"<command> ...\n"
+	"       %s --show-trace=<trace>\n"
+	"       %s --list\n\n"
 #endif
 	"Commands are:\n"
-	"  program=<file>           Erase whole flash and write firmware file\n"
+	"  program=<file>           Erase and write the flash pages that differ\n"
+	"                           from the firmware file, then verify\n"
 	"  info version blink\n"
 	"  debug reg<regnum> wreg<regnum>=<value> regs reset run step status\n"
 	"  erase=<addr> erase=all<addr>\n"
@@ -125,23 +140,37 @@ static const char usage_msg[] =
 	"sudo modprobe usb-storage quirks=483:3744:lrwsro\n"
 ;
 
-static char short_opts[] = "BC:D:U:huvV";
+static char short_opts[] = "A:BC:D:LPR:S::T:U:dfp:hs::uvVz";
 static struct option long_options[] = {
+    {"algo",	1, NULL, 	'A'},	/* Load a flash algorithm file. */
     {"blink",	0, NULL, 	'B'},
     {"check",	1, NULL, 	'C'},
     {"verify",	1, NULL, 	'C'},
     {"download", 1, NULL, 	'D'},
     {"upload",	1, NULL, 	'U'},
+    {"list",	0, NULL, 	'L'},	/* List the attached STLink probes. */
+    {"parallel", 0, NULL, 	'P'},	/* Run on every attached probe at once. */
+    {"daemon",	0, NULL, 	'd'},	/* Run on each STLink/target that appears. */
+    {"probe",	1, NULL, 	'p'},	/* Select a probe by USB path or serial. */
+    {"fast",	0, NULL, 	'f'},	/* Attach without reset, use cached IDs. */
+    {"compress", 0, NULL, 	'z'},	/* Send flash blocks LZ4 compressed. */
+    {"vpp",		0, NULL, 	'W'},	/* F4 VPP is supplied: program x64. */
+    {"sim",		2, NULL, 	'S'},	/* Use a simulated STLink and target. */
+    {"trace",	1, NULL, 	'T'},	/* Record the transactions to a file. */
+    {"replay",	1, NULL, 	'R'},	/* Run against a recorded trace. */
+    {"show-trace", 1, NULL, 	'Z'},	/* Analyse a recorded trace. */
+    {"stats",	2, NULL, 	's'},	/* Report transaction statistics. */
     {"help",	0, NULL,	'h'},	/* Print a long usage message. */
     {"usage",	0, NULL,	'u'},
     {"verbose", 0, NULL,	'v'},	/* Report each action taken.  */
     {"version", 0, NULL,	'V'},	/* Emit version information.  */
     {NULL,		0, NULL,	0},
 };
+#endif
 
 /* A global verbose flag, although most places use the object-local copy
  * sl->verbose. */
-int verbose = 0;
+int stl_verbose = 0;
 
 /* There are several IDs at different points inside the chip.
  * STMicro wants the debugger writers to 'lock' their code to only work with
@@ -152,7 +181,7 @@ int verbose = 0;
 
 /* This maps from the DBG interface ID to the chip ID.
  * COREID is register 14 in SWD space. */
-struct core_id_cap_table {
+static struct core_id_cap_table {
 	const char *name;
 	int cap_flags;
 	uint32_t core_id;
@@ -169,8 +198,9 @@ struct core_id_cap_table {
 
 enum chip_capabilities {
 	ChipCapF4Flash=1,
+	ChipCapL1Flash=2,			/* The 32L1 flash, erased to zero. */
 };
-struct stm_chip_params {			/* Unused/placeholder parameter table. */
+static struct stm_chip_params {	/* Unused/placeholder parameter table. */
 	const char *name;
 	int cap_flags;				/* Bitmapped capability indicators. */
 	uint32_t core_id, dbgmcu_idcode;
@@ -216,10 +246,10 @@ struct stm_chip_params {			/* Unused/placeholder parameter table. */
 	  0x20000000, 8*1024},
 	{ "STM32F10x", 0,
 	  0x1ba01477, 0x10016414,	/* High-density devices. */
-	  0x08000000, 512*1024, 1024,
+	  0x08000000, 512*1024, 2048,
 	  0x1ffff000, 2*1024, 1024,
 	  0x20000000, 8*1024},
-	{ "STM32F10x", 0,
+	{ "STM32F10x-XL", 0,
 	  0x1ba01477, 0x10016430,	/* XL-density devices. */
 	  0x08000000, 1024*1024, 2048,
 	  0x1fffe000, 6*1024, 1024,
@@ -229,9 +259,9 @@ struct stm_chip_params {			/* Unused/placeholder parameter table. */
 	  0x08000000, 256*1024, 2048,
 	  0x1fffb000, 18*1024, 1024,
 	  0x20000000, 8*1024},
-	{ "STM32L152", 0,
+	{ "STM32L152", ChipCapL1Flash,
 	  0x1ba01477, 0x10186416,	/* L152RBT6 as on 32L-Discovery. */
-	  0x08000000, 128*1024, 2048,
+	  0x08000000, 128*1024, 256,
 	  0x1fffb000, 16*1024, 1024,
 	  0x20000000, 8*1024},
 	{ "STM32F303VCT6", 0,
@@ -272,11 +302,11 @@ enum STLinkParamDirection {
  * milliseconds, with a more complex ones taking about 250 ms.
  */
 #define TIMEOUT_MSEC	800
-/* The maximum number of times to loop waiting for the flash page write
- * program to finish.  This is under 50 cycles for a 1 millisecond USB 1.0
- * poll, but takes 120-140 cycles for a 250 microsecond poll 
- */
-#define FLASH_POLL_LIMIT 200
+/* Waits for flash operations, see stl_await().  The shortest poll
+ * interval, and the allowance beyond four times the expected duration
+ * before giving up. */
+#define AWAIT_MIN_POLL_NS	100000
+#define AWAIT_SLACK_NS		100000000
 
 /* The v1 device presents itself as a USB mass storage device.  Debug access
  * is through additional SCSI Command Descriptor Blocks (CDB) commands.
@@ -304,6 +334,26 @@ enum STLinkParamDirection {
 #define USB_PIPE_ERR 0x83	   /* An apparently-unused bulk endpoint. */
 #define USB_TIMEOUT_MSEC	800		/* Generous */
 
+/* Each transaction gets a timeout sized from the measured round-trip time
+ * and the bytes it, and those queued ahead of it, must move.  A dropped
+ * transfer is then noticed in milliseconds rather than after the full
+ * USB_TIMEOUT_MSEC, which remains the ceiling and is used until we have
+ * measured a few round trips.
+ */
+#define STL_TIMEOUT_MIN_MSEC	50
+/* Resynchronizing waits this long for more late responses. */
+#define STL_RESYNC_MSEC			50
+#define STL_TIMEOUT_BYTE_NS		2000	/* Allow for 500KB/sec */
+#define STL_RTT_SAMPLES			8
+/* A failed block of a read or flash write is retried this many times. */
+#define STL_RETRY_LIMIT			3
+
+/* Errors beyond the libusb codes, see stl_err_name(). */
+#define STL_ERR_SHORT		-201	/* A short data phase */
+#define STL_ERR_STATUS		-202	/* The STLink reported a failure */
+#define STL_ERR_SCSI		-203	/* The v1 SCSI command failed */
+#define STL_ERR_RESYNC		-204	/* Queued behind a failed transaction */
+
 /* The maximum data transfer seems to be about 6KB, likely limited by
  * the RAM on the STLink 32F103 chip.  This is not a painful limit.  There
  * is usually only 4KB or 8KB of RAM on the target chip.  The only
@@ -338,6 +388,7 @@ enum STLink_Cmds {
 	STLinkV2Command=0xF4,		/* Command set 2, used for the STM8 */
 	STLinkGetCurrentMode=0xF5,	/* Returns 2 byte STLink mode */
 	STLinkV3Command=0xF6,		/* Command set 3, used for the Cortex-M4 */
+	STLinkGetTargetVoltage=0xF7,	/* Returns two 32 bit ADC readings */
 };
 
 enum STLink_Device_Modes {		/* Response to STLinkGetCurrentMode */
@@ -413,22 +464,141 @@ struct STLinkVersion {
 /* Hmmm, briefly seemed like a good idea. */
 typedef uint32_t stm32_addr_t;
 
+/* The number of STLink transactions we keep queued in the USB stack.
+ * The STLink processes commands strictly in order, so there is no benefit
+ * to queuing more than it takes to hide the host round-trip time.
+ * Eight covers a USB 2.0 host controller plus a hub or two.
+ */
+#define STL_XFER_DEPTH	8
+
+enum stl_xfer_state {
+	XferFree=0, XferQueued, XferDone,
+};
+
+/* A single queued STLink transaction: a command block and an optional data
+ * phase.  Both are submitted to the USB stack at once, with the completion
+ * reported through the DONE callback and/or by waiting on the transaction.
+ * Transactions on a STLink complete in the order submitted.
+ */
+struct stl_xfer {
+	struct stlink *sl;
+	enum stl_xfer_state state;
+	int complete;				/* Set at completion, for libusb. */
+	int hold;					/* Keep after completion, for waiting. */
+	int pending;				/* USB transfers still outstanding. */
+	int status;					/* Zero or the libusb error code. */
+	enum STLinkParamDirection dir;
+	int cmd_len;
+	int timeout_ms;				/* See stl_xfer_timeout() */
+	unsigned seq;				/* Submission order */
+	unsigned char cmd_buf[16];
+	unsigned char *data;		/* Data phase buffer. */
+	int data_len, actual_len;
+	void (*done)(struct stl_xfer *xf);	/* Completion callback, or NULL. */
+	void *priv;					/* Destination for the completion callback. */
+	int priv_len;
+	struct libusb_transfer *cmd_urb, *data_urb;
+	/* Queued and completed timestamps.  The engine uses the host clock,
+	 * unless the backend has its own, such as the simulator. */
+	uint64_t submit_ns, done_ns;
+	unsigned char xbuf[Q_BUF_LEN];	/* Transaction-local data buffer. */
+};
+
+/* Transaction statistics, enabled with --stats.
+ * Each STLink opcode has counters and a latency histogram.  The histogram
+ * is HDR-style: eight linear sub-buckets per power of two microseconds,
+ * so every value is kept to within 12.5% from 1us to over a minute.
+ * Time is also split by phase, such as the flash programming poll loop,
+ * to show whether it goes into USB round-trips or into waiting on the
+ * target.
+ */
+#define STL_HIST_BUCKETS	208
+#define STL_STAT_OPS		0x50	/* Debug sub-commands, then the rest */
+
+enum stl_phase {
+	PhaseOther, PhaseConnect, PhaseRead, PhaseVerify, PhaseErase,
+	PhaseErasePoll, PhaseFlashLoad, PhaseFlashPoll, PhaseCount,
+};
+
+struct stl_op_stats {
+	unsigned long calls, errors, retries;
+	uint64_t bytes_out, bytes_in;
+	uint64_t lat_sum_ns, lat_max_ns;
+	uint32_t hist[STL_HIST_BUCKETS];
+};
+
+/* The flash operations with a modelled duration, see stl_await(). */
+enum stl_await_op {
+	AwaitErase, AwaitMassErase, AwaitProgram, AwaitCrc, AwaitOps,
+};
+
+struct stl_stats {
+	struct stl_op_stats op[STL_STAT_OPS];
+	enum stl_phase phase;
+	uint64_t phase_start;
+	struct {
+		uint64_t ns, wait_ns;
+		unsigned long xfers, waits;
+	} phases[PhaseCount];
+	struct {
+		unsigned long count, polls;
+		uint64_t ns, max_ns, expect_ns;
+	} awaits[AwaitOps];
+};
+
+/* The transport backend that carries the queued transactions.
+ * The libusb backend talks to a real STLink v2, the simulator backend
+ * (see stl_sim_open()) emulates a STLink and target in-process.
+ */
+struct stl_backend {
+	const char *name;
+	/* Start a queued transaction.  Completion is reported by calling
+	 * stl_xfer_finish(), possibly before this returns. */
+	int (*submit)(struct stl_xfer *xf);
+	/* Process completions until *COMPLETE is set, or for a single pass
+	 * when COMPLETE is NULL. */
+	int (*events)(struct stlink *sl, int *complete);
+	/* The caller has waited for XF, or for everything when XF is NULL. */
+	void (*waited)(struct stlink *sl, struct stl_xfer *xf);
+	void (*close)(struct stlink *sl);
+	/* Resynchronize after a failed transaction, or NULL. */
+	void (*recover)(struct stlink *sl);
+	/* Abort the transactions queued after SEQ, or NULL. */
+	void (*cancel)(struct stlink *sl, unsigned seq);
+	/* The session clock in nanoseconds, or NULL for the host clock. */
+	uint64_t (*clock)(struct stlink *sl);
+	/* Let NS of session time pass, or NULL to sleep on the host. */
+	void (*sleep)(struct stlink *sl, uint64_t ns);
+};
+
 struct stlink {
 	const char *dev_path;
 #if defined(__linux__) || defined(__APPLE__)
 	int fd;
+	libusb_context *usb_ctx;	/* Private to this probe, for threading. */
 	libusb_device_handle *usb_hand;
+	char usb_path[32];			/* USB location e.g. "2-1.4" */
+	char serial[64];			/* Probe serial number, see stl_usb_serial(). */
 #elif defined(__ms_windows__)
 	HANDLE fd;
 #else
 #warning "Undefined OS."
 	int fd;
 #endif
-	int verbose;				/* A local copy of 'verbose'. */
-
-	int chip_index;				/* Index into stm_devids[], if known. */
+	int verbose;				/* A local copy of 'stl_verbose'. */
+
+	int chip_index;				/* Index into stm_devids[], see stl_chip(). */
+	int chip_known;				/* The target has been identified. */
+	int fast;					/* Fast connect, see stl_connect(). */
+	int compress;				/* Send flash blocks LZ4 compressed. */
+	int vpp;					/* F4 VPP is supplied, allowing x64 writes. */
+	int f4_psize;				/* F4 bytes per program, see stl_flash_unit() */
+	int id_from_cache;			/* The identity came from the ID cache. */
+	uint32_t core_id;			/* SWD core ID */
 	uint32_t cpu_idcode;		/* DBGMC_IDCODE */
 	int flash_mem_size;			/* Reported flash memory size in KB. */
+	int read_blk, write_blk;	/* Calibrated transfer sizes, or 0. */
+	uint32_t await_ns[AwaitOps];	/* Measured flash timing, per unit. */
 	stm32_addr_t flash_base;
 
 	/* Information we keep about the device state and recent transfers. */
@@ -442,9 +612,45 @@ struct stlink {
 	unsigned char cmd_buf[CDB_SIZE];
 	int data_len;
 	unsigned char data_buf[Q_BUF_LEN];
+
+	/* Queued asynchronous transactions, see stl_xfer_submit(). */
+	const struct stl_backend *backend;
+	struct stl_sim *sim;		/* Simulated STLink and target, if used. */
+	struct stl_sg *sg;			/* STLink v1 request headers, if used. */
+	int xfer_inflight, xfer_inflight_bytes;
+	int xfer_err;				/* First error since the last drain. */
+	int cmd_err;				/* Error of the last stl_do_cmd(). */
+	/* A transport failure, after which no read queued behind it is
+	 * trusted until the backend is resynchronized, see stl_xfer_submit(). */
+	int xfer_resync;
+	unsigned xfer_seq, resync_seq;
+	unsigned recoveries;		/* Count of stl_xfer_recover() calls. */
+	uint64_t srtt_ns, rttvar_ns;	/* Smoothed round-trip time estimate */
+	int rtt_samples;
+	/* Blocks of the current stl_read() that failed, to retry, and those
+	 * retried in this round.  Each has room for every block of the read. */
+	struct stl_read_fail {
+		stm32_addr_t addr;
+		void *buf;
+		int len;
+		int tries;				/* The times it has been retried. */
+	} *read_fail, *read_retry;
+	int read_fails, read_fail_max;
+	int usb_gone;				/* The probe has been unplugged. */
+	struct stl_xfer xfer[STL_XFER_DEPTH];
+
+	/* Transaction trace recording and replay, see stl_trace_open(). */
+	FILE *trace;
+	uint64_t trace_t0;
+	FILE *replay;
+	unsigned long replay_rec;
+	int replay_diverged;
+	uint64_t replay_clock;
+
+	struct stl_stats *stats;	/* Transaction statistics, if enabled. */
 };
 
-int stl_do_cmd(struct stlink *stl);
+static int stl_do_cmd(struct stlink *stl);
 
 // Endianness
 // http://www.ibm.com/developerworks/aix/library/au-endianc/index.html
@@ -501,65 +707,49 @@ static uint32_t read_uint32(const unsigned char *c, const int pt)
 	return ui;
 }
 
-struct stlink global_stlink;		/* Yes, there can be only one. */
-
-/* Open the STLink device at path DEV_NAME.
- * The program expects to open a SCSI Generic device, but
- * we do not verify that we have opened such a device.
- */
-struct stlink *stl_init(struct stlink *sl, const char *dev_name)
+/* Allocate a cleared probe context, for callers that do not see the
+ * structure.  It is released with free() after stl_close(). */
+struct stlink *stl_alloc(void)
 {
-#if defined(__ms_windows__)
-	HANDLE fd = CreateFile(dev_name, GENERIC_READ | GENERIC_WRITE,
-						FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
-						OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-#else
-	int fd = open(dev_name, O_RDWR);
-#endif
-
-	if (sl->fd < 0) {
-		fprintf(stderr, "Failed to open STLink device %s: %s.\n",
-				dev_name, strerror(errno));
-		return NULL;
-	}
-
-	memset(sl, 0, sizeof *sl);
-	sl->dev_path = dev_name;
-	sl->fd = fd;
-	if (sl->fd < 0) {
-		fprintf(stderr, "Error opening the STLink '%s': %s\n",
-				dev_name, strerror(errno));
-		return NULL;
-	} else if (verbose)
-		fprintf(stderr, " Open the STLink '%s': %s\n",
-				dev_name, strerror(errno));
-
-	sl->verbose = verbose;
-	sl->core_state = STLINK_CORE_UNKNOWN_STATE;
-
-	return sl;
+	return calloc(1, sizeof(struct stlink));
 }
 
-/* Close the device.
- * We are always exiting and thus do not need to free any structures. */
+/* Close the device, recording the probe identity for a later fast
+ * connect.
+ * The caller owns, and frees, the struct stlink itself. */
+static void stl_id_cache_save(struct stlink *sl);
 void stl_close(struct stlink *sl)
 {
+	stl_id_cache_save(sl);
 #if defined(__ms_windows__)
 	CloseHandle(sl->fd);
 #else
+	if (sl->backend)
+		sl->backend->close(sl);
 	if (sl->usb_hand)
 		libusb_close(sl->usb_hand);
 	if (sl->fd >= 0)
 		close(sl->fd);
-	libusb_exit(NULL);
+	if (sl->usb_ctx)
+		libusb_exit(sl->usb_ctx);
 #endif
+	if (sl->trace)
+		fclose(sl->trace);
+	if (sl->replay)
+		fclose(sl->replay);
+	free(sl->stats);
+	free(sl->read_fail);
+	free(sl->read_retry);
+	sl->read_fail = sl->read_retry = NULL;
+	sl->read_fail_max = 0;
 }
 
 /* Execute a general command, with arbitrary parameters.
  * This is only used for commands to the STLink device itself, not for
  * commands to the target processor.
  */
-int st_gcmd(struct stlink *sl, uint8_t st_cmd0, uint8_t st_cmd1, int resp_len)
+static int st_gcmd(struct stlink *sl, uint8_t st_cmd0, uint8_t st_cmd1,
+				   int resp_len)
 {
 	sl->cmd_buf[0] = st_cmd0;
 	sl->cmd_buf[1] = st_cmd1;
@@ -578,8 +768,8 @@ int st_gcmd(struct stlink *sl, uint8_t st_cmd0, uint8_t st_cmd1, int resp_len)
 /* Execute a regular-form STLink Debug command.
  * This is the generic operation for most simple commands.
  */
-int stlink_cmd(struct stlink *sl, uint8_t st_cmd1, uint8_t st_cmd2,
-			   int resp_len)
+static int stlink_cmd(struct stlink *sl, uint8_t st_cmd1, uint8_t st_cmd2,
+					  int resp_len)
 {
 	sl->cmd_buf[0] = STLinkDebugCommand;
 	sl->cmd_buf[1] = st_cmd1;
@@ -665,7 +855,7 @@ static inline void sl_wr32(struct stlink* sl, uint32_t addr, uint32_t val)
  * or we get residue errors.  Also, there may be an issue with reads that
  * are exact 1K multiples.
  */
-uint32_t stl_rd32_cmd(struct stlink* sl, uint32_t addr, uint16_t len)
+static uint32_t stl_rd32_cmd(struct stlink* sl, uint32_t addr, uint16_t len)
 {
 #if 1
 	/* This version forces alignment, which should never be needed as
@@ -689,837 +879,4250 @@ static inline uint32_t sl_rd32(struct stlink *sl, uint32_t addr)
 	return *(uint32_t*)sl->data_buf;
 }
 
-#if 1							/* Force libusb-1.0 transport during devel */
-/* Enqueue a command to the STLink.
- * v1 uses SCSI transport over USB.
- * v2 uses USB bulk endpoints.
- * stl->cmd_buf
- * stl->data_buf, stl->data_len
- */
-int stl_do_cmd(struct stlink *stl)
+/* A monotonic host clock in nanoseconds, for timestamps and latency. */
+static uint64_t stl_clock_ns(void)
 {
-	int ret, actual_xfer_len;
+	struct timespec ts;
 
-	if (stl->verbose > 3)
-		printf("Starting command %2.2x %2.2x ..., data length %d.\n",
-			   stl->cmd_buf[0], stl->cmd_buf[1],
-			   stl->data_len);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-	/* The stl->cmd_len value doesn't need to be precise.  Bytes after
-	 * the command are ignored. */
-	ret = libusb_bulk_transfer(stl->usb_hand, USB_PIPE_OUT,
-							   stl->cmd_buf, stl->cmd_len, &actual_xfer_len,
-							   USB_TIMEOUT_MSEC);
-	if (stl->verbose && actual_xfer_len != stl->cmd_len)
-		fprintf(stderr, "Mismatched USB transfer for command, tried %d "
-				"vs %d sent.\n",
-				stl->cmd_len, actual_xfer_len);
-	if (stl->verbose > 3)
-		printf("Sent command, status %d length %d.\n", ret, actual_xfer_len);
-
-	if (stl->xfer_dir == STLinkParamToDev) {
-		ret = libusb_bulk_transfer(stl->usb_hand, USB_PIPE_OUT,
-								   stl->data_buf, stl->data_len,
-								   &actual_xfer_len, USB_TIMEOUT_MSEC);
-		if (ret != 0 || actual_xfer_len != stl->data_len)
-			printf(" * Failed USB output, %d, Command %2.2x %2.2x transfer "
-				   "length %d vs %d expected.\n",
-				   ret, stl->cmd_buf[0], stl->cmd_buf[1],
-				   actual_xfer_len, stl->data_len);
-		if (stl->verbose > 3)
-			printf("Transfer done, status %d write length %d of %d.\n",
-				   ret, actual_xfer_len, stl->data_len);
-	} else if (stl->data_len != 0) {
-		ret = libusb_bulk_transfer(stl->usb_hand, USB_PIPE_IN,
-								   stl->data_buf, stl->data_len,
-								   &actual_xfer_len, USB_TIMEOUT_MSEC);
-		if (ret != 0 || actual_xfer_len != stl->data_len) {
-			printf(" * Failed USB input, status %d, Command %2.2x %2.2x "
-				   "expected %d bytes, received %d.\n",
-				   ret, stl->cmd_buf[0], stl->cmd_buf[1],
-				   stl->data_len, actual_xfer_len);
-		}
-		if (stl->verbose > 3)
-			printf("Transfer done, status %d read length %d of %d.\n",
-				   ret, actual_xfer_len, stl->data_len);
+static const char *stl_err_name(int err)
+{
+	switch (err) {
+	case STL_ERR_SHORT:		return "short transfer";
+	case STL_ERR_STATUS:	return "STLink command failed";
+	case STL_ERR_SCSI:		return "SCSI command failed";
+	case STL_ERR_RESYNC:	return "queued behind a failure";
 	}
-
-	return ret;
+	return libusb_error_name(err);
 }
-#elif defined(linux)
-/* Enqueue a command to the SCSI Generic driver.
- * Most of the work is filling in the struct sg_io_hdr.
+
+/* The transaction trace file format.
+ * A trace records every transaction of a session: the command block, the
+ * direction, the data payload in either direction, the completion status
+ * and the queued and completed times.  It is used to find where the
+ * wall-clock time goes on a particular host, and the replay backend can
+ * feed a recorded session back to the program without a probe.
+ * The file is a header followed by a record for each transaction, in
+ * completion order (which is also the submission order).  Each record is
+ * immediately followed by its ACTUAL_LEN bytes of data.
+ * Values are in host byte order.  A trace from a host of the other byte
+ * order fails the version check.
  */
-int stl_do_cmd(struct stlink *stl)
+#define STL_TRACE_MAGIC		"STLT"
+#define STL_TRACE_VERSION	1
+
+struct stl_trace_hdr {
+	char magic[4];
+	uint16_t version;
+	uint16_t rec_size;			/* sizeof(struct stl_trace_rec) */
+	uint64_t start_time;		/* Wall clock seconds at the start. */
+	char probe[32];				/* USB path, or the backend name. */
+	char serial[64];
+} __attribute__((packed));
+
+struct stl_trace_rec {
+	uint64_t submit_ns;			/* Queued, relative to the trace start. */
+	uint32_t latency_ns;		/* Queued to completed. */
+	int16_t status;				/* Zero or a libusb error code. */
+	uint8_t dir;				/* enum STLinkParamDirection */
+	uint8_t cmd_len;
+	uint16_t data_len, actual_len;
+	uint8_t cmd[16];
+} __attribute__((packed));
+
+/* Start recording a trace of the transactions on SL into PATH. */
+int stl_trace_open(struct stlink *sl, const char *path)
 {
-    struct sg_io_hdr io_hdr = {0,};
-	/* Sense (error information) data */
-	unsigned char sense_buf[SENSE_BUF_LEN];
-	int ret;
+	struct stl_trace_hdr hdr;
 
-	io_hdr.interface_id = 'S';
-    io_hdr.pack_id = 0;
+	sl->trace = fopen(path, "wb");
+	if (sl->trace == NULL) {
+		fprintf(stderr, "Failed to create trace file '%s': %s.\n",
+				path, strerror(errno));
+		return -1;
+	}
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, STL_TRACE_MAGIC, 4);
+	hdr.version = STL_TRACE_VERSION;
+	hdr.rec_size = sizeof(struct stl_trace_rec);
+	hdr.start_time = time(NULL);
+	strncpy(hdr.probe, sl->usb_path[0] ? sl->usb_path : sl->backend->name,
+			sizeof hdr.probe - 1);
+	strncpy(hdr.serial, sl->serial, sizeof hdr.serial - 1);
+	fwrite(&hdr, sizeof hdr, 1, sl->trace);
+	sl->trace_t0 = stl_clock_ns();
+	return 0;
+}
 
-	/* Provide buffers for the SCSI transfer.
-	 * The Request Sense (error info) command is used for responses.
-	 * http://en.wikipedia.org/wiki/SCSI_Request_Sense_Command
-	 */
-	io_hdr.cmdp = stl->cmd_buf;
-	io_hdr.cmd_len = sizeof(stl->cmd_buf);
-	io_hdr.sbp = stl->sense_buf;
-	io_hdr.mx_sb_len = sizeof(stl->sense_buf);
-	memset(io_hdr.sbp, 0, io_hdr.sb_len_wr);
-
-	/* Set a buffer to be used for data transferred from/to device */
-	io_hdr.iovec_count = 0;
-	io_hdr.dxferp = stl->data_buf;
-	io_hdr.dxfer_len = stl->data_len;
-	io_hdr.dxfer_direction =
-		(stl->xfer_dir == STLinkParamToDev ? SG_DXFER_TO_DEV:SG_DXFER_FROM_DEV);
-
-	io_hdr.timeout = TIMEOUT_MSEC;
-	io_hdr.flags = 0;
-	ret = ioctl(stl->fd, SG_IO, &io_hdr);
-	/* Report SCSI results.  Really, note useful variable if we need
-	 * to write better reporting code. */
-	if (stl->verbose) {
-		if (stl->verbose > 3)
-			fprintf(stderr, " SCSI command status %4.4x, took %d ms.\n",
-					io_hdr.status, io_hdr.duration);
-		if (io_hdr.resid || io_hdr.sb_len_wr)
-			fprintf(stderr, " SCSI residue was %d, sense length %d.\n",
-					io_hdr.resid, io_hdr.sb_len_wr);
+/* Append the completed transaction XF to the trace. */
+static void stl_trace_write(struct stl_xfer *xf)
+{
+	struct stlink *sl = xf->sl;
+	struct stl_trace_rec rec;
+	int len = xf->dir == STLinkParamToDev ? xf->data_len : xf->actual_len;
+
+	/* A backend with its own clock may start before the trace. */
+	if (sl->trace_t0 > xf->submit_ns)
+		sl->trace_t0 = xf->submit_ns;
+	memset(&rec, 0, sizeof rec);
+	rec.submit_ns = xf->submit_ns - sl->trace_t0;
+	rec.latency_ns = xf->done_ns - xf->submit_ns > 0xffffffff ? 0xffffffff
+		: xf->done_ns - xf->submit_ns;
+	rec.status = xf->status;
+	rec.dir = xf->dir;
+	rec.cmd_len = xf->cmd_len;
+	rec.data_len = xf->data_len;
+	rec.actual_len = len;
+	memcpy(rec.cmd, xf->cmd_buf, sizeof rec.cmd);
+	fwrite(&rec, sizeof rec, 1, sl->trace);
+	if (len > 0)
+		fwrite(xf->data, len, 1, sl->trace);
+}
+
+/* The statistics slot for a command block. */
+static int stl_stat_op(const uint8_t *cmd)
+{
+	if (cmd[0] == STLinkDebugCommand && cmd[1] < 0x40)
+		return cmd[1];
+	return 0x40 | (cmd[0] & 0x0f);
+}
+
+static const char *stl_stat_op_name(int op)
+{
+	static const char *debug_names[0x40] = {
+		[STLinkDebugGetStatus] = "GetStatus",
+		[STLinkDebugForceDebug] = "ForceDebug",
+		[STLinkDebugResetSys] = "ResetSys",
+		[STLinkDebugReadAllRegs] = "ReadAllRegs",
+		[STLinkDebugReadOneReg] = "ReadOneReg",
+		[STLinkDebugWriteReg] = "WriteReg",
+		[STLinkDebugReadMem32bit] = "ReadMem32",
+		[STLinkDebugWriteMem32bit] = "WriteMem32",
+		[STLinkDebugRunCore] = "RunCore",
+		[STLinkDebugStepCore] = "StepCore",
+		[STLinkDebugSetFP] = "SetFP",
+		[STLinkDebugWriteMem8bit] = "WriteMem8",
+		[STLinkDebugClearFP] = "ClearFP",
+		[STLinkDebugWriteDebugReg] = "WriteDebugReg",
+		[STLinkDebugEnterMode] = "EnterMode",
+		[STLinkDebugExit] = "Exit",
+		[STLinkDebugReadCoreID] = "ReadCoreID",
+	};
+	static char unknown[STL_STAT_OPS][12];
+
+	if (op < 0x40 && debug_names[op])
+		return debug_names[op];
+	switch (op) {
+	case 0x40 | (STLinkGetVersion & 0x0f): return "GetVersion";
+	case 0x40 | (STLinkDFUCommand & 0x0f): return "DFUCommand";
+	case 0x40 | (STLinkGetCurrentMode & 0x0f): return "GetCurrentMode";
+	case 0x40 | (STLinkGetTargetVoltage & 0x0f): return "GetTargetVoltage";
 	}
-	return ret;
+	if (unknown[op][0] == 0)
+		snprintf(unknown[op], sizeof unknown[op], op < 0x40 ? "Debug%2.2x"
+				 : "Cmd%2.2x", op < 0x40 ? op : 0xF0 | (op & 0x0f));
+	return unknown[op];
 }
-#elif defined(MS_WINDOWS)
-#endif
 
-static void stl_print_version(struct STLinkVersion *ver)
+static const char *stl_phase_names[PhaseCount] = {
+	"other", "connect", "read", "verify", "erase", "erase-poll",
+	"flash-load", "flash-poll",
+};
+
+static const char *stl_await_names[AwaitOps] = {
+	"erase", "mass-erase", "program", "crc",
+};
+
+/* The histogram bucket for a latency in microseconds, and the reverse. */
+static int stl_hist_bucket(uint64_t usec)
 {
-	if (ver->ST_VendorID == USB_ST_VID &&
-		(ver->ST_ProductID == USB_STLINK_PID ||
-		 ver->ST_ProductID == USB_STLINKv2_PID))
-		fprintf(stderr, "STMicro Vendor/Product ID 0x%04x 0x%04x\n",
-				ver->ST_VendorID, ver->ST_ProductID);
-	else
-		fprintf(stderr, "Incorrect Vendor/Product ID 0x%04x 0x%04x "
-				"(%04x %04x expected)\n",
-				ver->ST_VendorID, ver->ST_ProductID,
-				USB_ST_VID, USB_STLINK_PID);
-	/* Expected versions  STLink: 3  JTAG: 2  SWIM: 0x20 */
-	fprintf(stderr, " Versions  STLink: 0x%x  JTAG: 0x%x  SWIM: 0x%x\n"
-			"    The firmware %s a JTAG/SWD interface.\n"
-			"    The firmware %s a SWIM interface.\n",
-			ver->STLink_ver, ver->JTAG_ver, ver->SWIM_ver,
-			ver->JTAG_ver == 0 ? "does not support" : "supports",
-			ver->SWIM_ver == 0 ? "does not support" : "supports");
+	int exp = 3;
+
+	if (usec < 8)
+		return usec;
+	while (exp < 27 && (usec >> (exp + 1)))
+		exp++;
+	if (usec >> (exp + 1))
+		return STL_HIST_BUCKETS - 1;
+	return (exp - 2) * 8 + ((usec >> (exp - 3)) & 7);
+}
+
+static uint64_t stl_hist_value(int bucket)
+{
+	if (bucket < 8)
+		return bucket;
+	return (uint64_t)(8 + (bucket & 7)) << (bucket/8 - 1);
 }
 
-void stlink_print_arm_regs(struct ARMcoreRegs *regs)
+/* The latency in microseconds at percentile PCT.  This is the upper
+ * limit of the bucket, or the maximum seen if that is lower. */
+static uint64_t stl_hist_pct(const struct stl_op_stats *os, double pct)
 {
+	unsigned long want = os->calls * pct / 100.0, seen = 0;
+	uint64_t max = os->lat_max_ns / 1000, val = max;
 	int i;
-	for (i = 0; i < 16; i++)
-		fprintf(stderr, "r%02d=0x%08x%c", i, regs->r[i], i%4 == 3 ? '\n' : ' ');
-	fprintf(stderr,
-			"xPSR       = 0x%08x\n"
-			"main_sp    = 0x%08x  process_sp = 0x%08x\n"
-			"rw         = 0x%08x  rw2        = 0x%08x\n",
-			regs->xpsr, regs->main_sp, regs->process_sp, regs->rw, regs->rw2);
-	return;
+
+	for (i = 0; i + 1 < STL_HIST_BUCKETS; i++) {
+		seen += os->hist[i];
+		if (seen > want || seen == os->calls) {
+			val = stl_hist_value(i + 1) - 1;
+			break;
+		}
+	}
+	return val < max ? val : max;
 }
 
-/*
- * Set and clear hardware breakpoints.
- * A breakpoint is set with the "flash patch" module.
- * When executing from Flash instead of RAM, we need hardware support
- * to implement breakpoints.  We only get four registers, but that is
- * enough for most debugging.
- * 2  The index, 0..3, of the Flash Patch register.
- * 3-6 Address of the breakpoint (LSB first)
- * 7 FP_ALL (0x02) / FP_UPPER (0x01) / FP_LOWER (0x00)
+/* The session clock: the host clock, unless the backend has its own. */
+static uint64_t stl_now(struct stlink *sl)
+{
+	if (sl->backend && sl->backend->clock)
+		return sl->backend->clock(sl);
+	return stl_clock_ns();
+}
+
+/* Let NS nanoseconds of session time pass. */
+static void stl_sleep(struct stlink *sl, uint64_t ns)
+{
+	if (sl->backend && sl->backend->sleep)
+		sl->backend->sleep(sl, ns);
+	else if (ns >= 1000)
+		usleep(ns / 1000);
+}
+
+/* Switch to PHASE, charging the time so far to the previous phase.
+ * Returns the previous phase, to restore when the caller is done.
  */
-int stl_set_breakpoint(struct stlink *sl, int fp_nr, uint32_t addr, int fp)
+static enum stl_phase stl_phase(struct stlink *sl, enum stl_phase phase)
 {
-	write_uint32(sl->data_buf+3, addr);
-	sl->data_buf[7] = fp;
-	return stl_set_fp(sl, fp_nr);
+	struct stl_stats *st = sl->stats;
+	enum stl_phase prev;
+	uint64_t now;
+
+	if (st == NULL)
+		return PhaseOther;
+	now = stl_now(sl);
+	prev = st->phase;
+	st->phases[prev].ns += now - st->phase_start;
+	st->phase_start = now;
+	st->phase = phase;
+	return prev;
 }
 
-/* FPEC flash controller interface, PM0063 or PM0075 manual. */
-#define FLASH_REGS_ADDR 0x40022000
+static void stl_stats_retry(struct stlink *sl, uint8_t debug_op)
+{
+	if (sl->stats)
+		sl->stats->op[debug_op].retries++;
+}
 
-#define FLASH_ACR	(FLASH_REGS_ADDR + 0x00)
-#define FLASH_KEYR	(FLASH_REGS_ADDR + 0x04)
-#define FLASH_SR	(FLASH_REGS_ADDR + 0x0c)
-#define FLASH_CR	(FLASH_REGS_ADDR + 0x10)
-#define FLASH_AR	(FLASH_REGS_ADDR + 0x14)
-#define FLASH_OBR	(FLASH_REGS_ADDR + 0x1c)
-#define FLASH_WRPR	(FLASH_REGS_ADDR + 0x20)
+/* Record the completed transaction XF. */
+static void stl_stats_xfer(struct stl_xfer *xf)
+{
+	struct stl_stats *st = xf->sl->stats;
+	struct stl_op_stats *os = &st->op[stl_stat_op(xf->cmd_buf)];
+	uint64_t lat = xf->done_ns - xf->submit_ns;
+
+	os->calls++;
+	if (xf->status)
+		os->errors++;
+	if (xf->dir == STLinkParamToDev)
+		os->bytes_out += xf->data_len;
+	else
+		os->bytes_in += xf->actual_len;
+	os->lat_sum_ns += lat;
+	if (lat > os->lat_max_ns)
+		os->lat_max_ns = lat;
+	os->hist[stl_hist_bucket(lat / 1000)]++;
+	st->phases[st->phase].xfers++;
+}
 
-/* Flash unlock key values from PM0075 2.3.1 */
-#define FLASH_RDPTR_KEY 0x00a5
-#define FLASH_KEY1 0x45670123
-#define FLASH_KEY2 0xcdef89ab
+/* Record that the host blocked from START until now. */
+static void stl_stats_wait(struct stlink *sl, uint64_t start)
+{
+	struct stl_stats *st = sl->stats;
+	uint64_t now = stl_now(sl);
 
-/* 32L15x flash controller. */
-#define L15_FLASH_REGS 0x40023C00
-#define L15_FLASH_ACR		(FLASH_REGS_ADDR + 0x00)
-#define L15_FLASH_PECR		(FLASH_REGS_ADDR + 0x04)
-#define L15_FLASH_PDKEYR	(FLASH_REGS_ADDR + 0x08)
-#define L15_FLASH_PEKEYR	(FLASH_REGS_ADDR + 0x0C)
+	if (now <= start)
+		return;
+	st->phases[st->phase].waits++;
+	st->phases[st->phase].wait_ns += now - start;
+}
 
-#define L15_FLASH_WRPR	(FLASH_REGS_ADDR + 0x20)
+/* Start collecting statistics on SL. */
+int stl_stats_enable(struct stlink *sl)
+{
+	if (sl->stats == NULL && (sl->stats = calloc(1, sizeof *sl->stats)) == NULL)
+		return -1;
+	sl->stats->phase_start = stl_now(sl);
+	return 0;
+}
 
-#define FLASH_PEKEY1 0x89abcdef
-#define FLASH_PEKEY2 0x02030405
+void stl_stats_report(struct stlink *sl, FILE *fp, int json)
+{
+	struct stl_stats *st = sl->stats;
+	int i, first = 1;
+
+	stl_phase(sl, st->phase);
+	if (json) {
+		fprintf(fp, "{\"probe\": \"%s\", \"backend\": \"%s\",\n"
+				" \"commands\": [", sl->usb_path[0] ? sl->usb_path
+				: sl->dev_path, sl->backend->name);
+	} else
+		fprintf(fp, "Transaction statistics for %s:\n"
+				" Command          Calls Errs Retry  Bytes out   Bytes in"
+				"   Mean(us)    p50    p90    p99    Max\n",
+				sl->usb_path[0] ? sl->usb_path : sl->dev_path);
+	for (i = 0; i < STL_STAT_OPS; i++) {
+		struct stl_op_stats *os = &st->op[i];
+		uint64_t mean;
+		if (os->calls == 0)
+			continue;
+		mean = os->lat_sum_ns / os->calls / 1000;
+		if (json) {
+			int b, hfirst = 1;
+			fprintf(fp, "%s\n  {\"name\": \"%s\", \"calls\": %lu, "
+					"\"errors\": %lu, \"retries\": %lu, \"bytes_out\": %llu, "
+					"\"bytes_in\": %llu, \"mean_us\": %llu, \"p50_us\": %llu, "
+					"\"p90_us\": %llu, \"p99_us\": %llu, \"max_us\": %llu,\n"
+					"   \"histogram_us\": [", first ? "" : ",",
+					stl_stat_op_name(i), os->calls, os->errors, os->retries,
+					(unsigned long long)os->bytes_out,
+					(unsigned long long)os->bytes_in,
+					(unsigned long long)mean,
+					(unsigned long long)stl_hist_pct(os, 50),
+					(unsigned long long)stl_hist_pct(os, 90),
+					(unsigned long long)stl_hist_pct(os, 99),
+					(unsigned long long)(os->lat_max_ns / 1000));
+			for (b = 0; b < STL_HIST_BUCKETS; b++)
+				if (os->hist[b]) {
+					fprintf(fp, "%s[%llu, %u]", hfirst ? "" : ", ",
+							(unsigned long long)stl_hist_value(b), os->hist[b]);
+					hfirst = 0;
+				}
+			fprintf(fp, "]}");
+		} else
+			fprintf(fp, " %-15s %6lu %4lu %5lu %10llu %10llu %10llu %6llu "
+					"%6llu %6llu %6llu\n", stl_stat_op_name(i), os->calls,
+					os->errors, os->retries,
+					(unsigned long long)os->bytes_out,
+					(unsigned long long)os->bytes_in,
+					(unsigned long long)mean,
+					(unsigned long long)stl_hist_pct(os, 50),
+					(unsigned long long)stl_hist_pct(os, 90),
+					(unsigned long long)stl_hist_pct(os, 99),
+					(unsigned long long)(os->lat_max_ns / 1000));
+		first = 0;
+	}
+	if (json)
+		fprintf(fp, "],\n \"phases\": [");
+	else
+		fprintf(fp, " Phase            Time(ms) Transactions  Waits  "
+				"Waiting(ms)\n");
+	first = 1;
+	for (i = 0; i < PhaseCount; i++) {
+		if (st->phases[i].ns == 0 && st->phases[i].xfers == 0)
+			continue;
+		if (json)
+			fprintf(fp, "%s\n  {\"name\": \"%s\", \"ms\": %.3f, "
+					"\"transactions\": %lu, \"waits\": %lu, "
+					"\"wait_ms\": %.3f}", first ? "" : ",",
+					stl_phase_names[i], st->phases[i].ns / 1e6,
+					st->phases[i].xfers, st->phases[i].waits,
+					st->phases[i].wait_ns / 1e6);
+		else
+			fprintf(fp, " %-15s %9.3f %12lu %6lu %12.3f\n",
+					stl_phase_names[i], st->phases[i].ns / 1e6,
+					st->phases[i].xfers, st->phases[i].waits,
+					st->phases[i].wait_ns / 1e6);
+		first = 0;
+	}
+	if (json)
+		fprintf(fp, "],\n \"waits\": [");
+	else if (st->awaits[AwaitErase].count + st->awaits[AwaitMassErase].count
+			 + st->awaits[AwaitProgram].count + st->awaits[AwaitCrc].count)
+		fprintf(fp, " Wait             Count  Polls   Mean(ms)    Max(ms)  "
+				"Model(ms)\n");
+	first = 1;
+	for (i = 0; i < AwaitOps; i++) {
+		unsigned long n = st->awaits[i].count;
+		if (n == 0)
+			continue;
+		if (json)
+			fprintf(fp, "%s\n  {\"name\": \"%s\", \"count\": %lu, "
+					"\"polls\": %lu, \"mean_ms\": %.3f, \"max_ms\": %.3f, "
+					"\"model_ms\": %.3f}", first ? "" : ",",
+					stl_await_names[i], n, st->awaits[i].polls,
+					st->awaits[i].ns / 1e6 / n, st->awaits[i].max_ns / 1e6,
+					st->awaits[i].expect_ns / 1e6 / n);
+		else
+			fprintf(fp, " %-15s %6lu %6lu %10.3f %10.3f %10.3f\n",
+					stl_await_names[i], n, st->awaits[i].polls,
+					st->awaits[i].ns / 1e6 / n, st->awaits[i].max_ns / 1e6,
+					st->awaits[i].expect_ns / 1e6 / n);
+		first = 0;
+	}
+	if (json)
+		fprintf(fp, "]}\n");
+}
 
+/* The asynchronous transaction engine.
+ * The blocking libusb_bulk_transfer() calls leave the STLink idle for a
+ * full host round-trip between every command and its data.  Instead we
+ * queue a command and its data phase together, and keep several
+ * transactions in flight at once.  The USB stack preserves the order of
+ * transfers on each endpoint, and the STLink handles commands in order,
+ * so a queued read response always matches the queued read command.
+ *
+ * Callers either set xf->hold and wait for the transaction with
+ * stl_xfer_wait(), or provide a xf->done completion callback and later
+ * call stl_xfer_drain() to wait for everything outstanding.
+ * The transport itself is in sl->backend.
+ */
 
-#define FLASH_SR_BSY 0x0001
-#define FLASH_SR_PGERR 0x0004
-#define FLASH_SR_WRPRTERR 0x0010
-#define FLASH_SR_EOP 0x0020
+/* Commands that return a STLINK_OK status byte. */
+static int stl_cmd_has_status(const uint8_t *cmd)
+{
+	if (cmd[0] != STLinkDebugCommand)
+		return 0;
+	switch (cmd[1]) {
+	case STLinkDebugForceDebug: case STLinkDebugResetSys:
+	case STLinkDebugWriteReg: case STLinkDebugRunCore:
+	case STLinkDebugStepCore: case STLinkDebugSetFP: case STLinkDebugClearFP:
+		return 1;
+	}
+	return 0;
+}
 
-/* Names and definitions from PM0075 sec 3.5 */
-#define FLASH_CR_PG  0x0001
-#define FLASH_CR_PER 0x0002
-#define FLASH_CR_MER 0x0004
-#define FLASH_CR_OPTPG 0x0010
-#define FLASH_CR_OPTER 0x0020
-#define FLASH_CR_STRT 0x0040
-#define FLASH_CR_LOCK 0x0080
+/* Commands that may legitimately take a long time on the STLink. */
+static int stl_cmd_is_slow(const uint8_t *cmd)
+{
+	return cmd[0] != STLinkDebugCommand ||
+		cmd[1] == STLinkDebugEnterMode || cmd[1] == STLinkDebugExit ||
+		cmd[1] == STLinkDebugResetSys;
+}
 
-/* Names and definitions from PM0081 (STM32F4). */
-#define F4_FLASH_REGS 0x40023C00
+/* The timeout for XF, in milliseconds. */
+static int stl_xfer_timeout(struct stlink *sl, struct stl_xfer *xf)
+{
+	uint64_t ns;
+	int ms;
+
+	if (sl->rtt_samples < STL_RTT_SAMPLES || stl_cmd_is_slow(xf->cmd_buf))
+		return USB_TIMEOUT_MSEC;
+	ns = 2 * (sl->srtt_ns + 4 * sl->rttvar_ns) +
+		(uint64_t)(xf->data_len + sl->xfer_inflight_bytes) *
+		STL_TIMEOUT_BYTE_NS;
+	ms = ns / 1000000;
+	if (ms < STL_TIMEOUT_MIN_MSEC)
+		return STL_TIMEOUT_MIN_MSEC;
+	return ms > USB_TIMEOUT_MSEC ? USB_TIMEOUT_MSEC : ms;
+}
 
-#define F4_FLASH_ACR	(F4_FLASH_REGS + 0x00)
-#define F4_FLASH_KEYR	(F4_FLASH_REGS + 0x04)
-#define F4_FLASH_OPTKEYR 	(F4_FLASH_REGS + 0x08)
-#define F4_FLASH_SR	(F4_FLASH_REGS + 0x0c)
-#define  F4_FLASH_SR_BSY 0x00010000
-#define F4_FLASH_CR	(F4_FLASH_REGS + 0x10)
-#define  F4_FLASH_CR_STRT 0x00010000
+/* Update the round-trip estimate, in the style of the TCP RTO. */
+static void stl_rtt_sample(struct stlink *sl, uint64_t rtt)
+{
+	if (sl->rtt_samples++ == 0) {
+		sl->srtt_ns = rtt;
+		sl->rttvar_ns = rtt / 2;
+		return;
+	}
+	sl->rttvar_ns = (3 * sl->rttvar_ns +
+					 (rtt > sl->srtt_ns ? rtt - sl->srtt_ns
+					  : sl->srtt_ns - rtt)) / 4;
+	sl->srtt_ns = (7 * sl->srtt_ns + rtt) / 8;
+}
 
-/* Unlock the flash.  This takes two write cycles with two key values.
- * The two key values are sequentially written to the FLASH_KEYR register.
- */
+/* The transaction has a response to receive. */
+static int stl_xfer_is_read(struct stl_xfer *xf)
+{
+	return xf->dir == STLinkParamFromDev && xf->data_len != 0;
+}
 
-/*
- * After much experimentation, I finally came to understand that the
- * STLink cannot generate the 16 bit memory cycle needed to directly
- * write the flash.
- * You have to download a program that writes it.
- *
- * This was confirmed by reading the OpenOCD code.
- * My implementation uses a similar approach, with a better implementation.
- * They download a program, the data, pass parameters using registers
- * (individually written) and run the program.  This might seem
- * efficient, but the cost is largely in triggering a transfer, not how
- * much is in each transfer.
- *
- * It's a bit more work to embed the parameters in the program and pack
- * it together with the data into a single transfer, but the better
- * performance is worth it.
- *
- * Note: RAM starts at 0x20000000.  Some chips have up to 32KB, but we
- * must support the devices with only 4KB.
+/* Mark the transaction complete, and release it unless someone is waiting.
+ * Called by the backend. */
+static void stl_xfer_finish(struct stl_xfer *xf)
+{
+	struct stlink *sl = xf->sl;
+
+	if (xf->status == 0 && stl_cmd_has_status(xf->cmd_buf) &&
+		xf->actual_len > 0 && xf->data[0] != STLINK_OK) {
+		fprintf(stderr, " * STLink command %2.2x %2.2x failed, status "
+				"%2.2x.\n", xf->cmd_buf[0], xf->cmd_buf[1], xf->data[0]);
+		xf->status = STL_ERR_STATUS;
+	}
+	if (xf->done_ns == 0)
+		xf->done_ns = stl_clock_ns();
+	/* A late response to a lost one arrives as the answer to the next
+	 * read on the pipe, and every read after is shifted.  So after a
+	 * transport failure, the reads queued behind it are aborted or failed,
+	 * whatever they received.  Writes have nothing to receive and go on.
+	 * A failure reported by the STLink itself leaves the pipe in step. */
+	if (sl->xfer_resync && (int)(xf->seq - sl->resync_seq) > 0) {
+		if (xf->status == 0 && stl_xfer_is_read(xf))
+			xf->status = STL_ERR_RESYNC;
+	} else if (xf->status && xf->status != STL_ERR_STATUS &&
+			   xf->status != STL_ERR_RESYNC) {
+		sl->xfer_resync = 1;
+		sl->resync_seq = xf->seq;
+		if (sl->backend->cancel)
+			sl->backend->cancel(sl, xf->seq);
+	}
+	if (xf->status == 0)
+		stl_rtt_sample(sl, xf->done_ns - xf->submit_ns);
+	/* A held transaction's error goes to its waiter instead. */
+	if (xf->status && ! xf->hold && sl->xfer_err == 0)
+		sl->xfer_err = xf->status;
+	if (xf->status == LIBUSB_ERROR_NO_DEVICE)
+		sl->usb_gone = 1;
+	if (sl->trace)
+		stl_trace_write(xf);
+	if (sl->stats)
+		stl_stats_xfer(xf);
+	sl->xfer_inflight--;
+	sl->xfer_inflight_bytes -= xf->data_len;
+	xf->state = XferDone;
+	if (xf->done)
+		xf->done(xf);
+	xf->complete = 1;
+	if ( ! xf->hold)
+		xf->state = XferFree;
+}
+
+/* Get a free transaction slot, waiting for an old one to complete if all
+ * are in flight.  The returned transaction is cleared.
+ * Returns NULL if USB event handling failed.  The probe is then treated
+ * as gone, with the error left for the next drain, so that only this
+ * probe's operation fails.
  */
+static struct stl_xfer *stl_xfer_get(struct stlink *sl)
+{
+	int i, ret;
+
+	for (;;) {
+		for (i = 0; i < STL_XFER_DEPTH; i++) {
+			struct stl_xfer *xf = &sl->xfer[i];
+			if (xf->state != XferFree)
+				continue;
+			xf->sl = sl;
+			xf->complete = xf->hold = xf->pending = xf->status = 0;
+			xf->done = NULL;
+			xf->priv = NULL;
+			xf->priv_len = xf->actual_len = 0;
+			xf->data = xf->xbuf;
+			xf->data_len = 0;
+			xf->submit_ns = xf->done_ns = 0;
+			xf->dir = STLinkParamFromDev;
+			memset(xf->cmd_buf, 0, sizeof xf->cmd_buf);
+			return xf;
+		}
+		if ((ret = sl->backend->events(sl, NULL)) < 0) {
+			if (sl->xfer_err == 0)
+				sl->xfer_err = ret;
+			sl->usb_gone = 1;
+			return NULL;
+		}
+	}
+}
 
-/* The OpenOCD code. Someday I'll do a speed comparisons.
- * From openocd, contrib/loaders/flash/stm32.s
- * i = STM32_FLASH_BASE;      0x08+r3  0x0800,0000
- * r0 = fl->buf_addr;//source
- * r1 = target;		// target
- * r2 = count;		// count (16 bits half words)
- * r3 = 0;			// flash bank 0 (input)
- * r15 = fl->loader_addr;  // pc register
+/* Queue the transaction, returning without waiting for completion.
+ * After a transport failure, reads fail here until those queued ahead
+ * have completed.  The backend is then resynchronized, discarding any
+ * late responses, before the next is sent.
  */
+static int stl_xfer_submit(struct stl_xfer *xf)
+{
+	struct stlink *sl = xf->sl;
 
-static const uint8_t loader_code[] = {
-	0x08, 0x4c,			/* ldr	r4, STM32_FLASH_BASE */
-	0x1c, 0x44,			/* add	r4, r3 */
-	/* write_half_word: */
-	0x01, 0x23,			/* movs	r3, #0x01 */
-	0x23, 0x61,			/* str	r3, [r4, #STM32_FLASH_CR_OFFSET] */
-	0x30, 0xf8, 0x02, 0x3b,	/* ldrh	r3, [r0], #0x02 */
-	0x21, 0xf8, 0x02, 0x3b,	/* strh	r3, [r1], #0x02 */
-	/* busy: */
-	0xe3, 0x68,			/* ldr	r3, [r4, #STM32_FLASH_SR_OFFSET] */
-	0x13, 0xf0, 0x01, 0x0f,	/* tst	r3, #0x01 */
-	0xfb, 0xd0,			/* beq	busy */
-	0x13, 0xf0, 0x14, 0x0f,	/* tst	r3, #0x14 */
-	0x01, 0xd1,			/* bne	exit */
-	0x01, 0x3a,			/* subs	r2, r2, #0x01 */
-	0xf0, 0xd1,			/* bne	write_half_word */
-	/* exit: */
-	0x00, 0xbe,			/* bkpt	#0x00 */
-	 0x00, 0x20, 0x02, 0x40,	/* STM32_FLASH_BASE: .word 0x40022000 */
- };
-
-/* A working version of our ARM code.  Here as a back-up since we break it
- * so frequently. */
- static const uint16_t db_loader_code_working[] = {
-	 0x480B,			/* ldr	r0, .SRC_ADDR */
-	 0x490C,			/* ldr	r1, .TARGET_ADDR */
-	 0x4A0C,			/* ldr	r2, .COUNT  */
-	 0x4c09,			/* ldr	r4, .STM32_FLASH_BASE */
-	 0x2501,			/* movs	r5, #FLASH_CR_PG_BIT  0x0001 */
-	 0x6125,			/* str	r5, [r4, #STM32_FLASH_CR_OFFSET] */
-	 /* write_hword: */
-	 0xf830, 0x3b02,	/* ldrh	r3, [r0], #0x02 */
-	 0xf821, 0x3b02,	/* strh	r3, [r1], #0x02 */
-	 /* busy: */
-#if 0
-	 0x3201,			/* add	r2, r2, #0x01 */
-#endif
-	 0x68e3,			/* ldr	r3, [r4, #STM32_FLASH_SR_OFFSET] */
-	 0xf013, 0x0f01,	/* tst	r3, #0x01 */
-	 0xd1fb,			/* bne	busy */
-	 0xf013, 0x0f14,	/* tst	r3, #0x14 */
-	 0xd101,			/* bne	exit */
-	 0x3a01,			/* subs	r2, r2, #0x01 */
-	 0xd1f2,			/* bne	write_hword */
-	 /* Normal completion, clear #FLASH_CR_PG_BIT.  Note that r2 is now 0. */
-#if 0
-	 0x6122,			/* str	r2, [r4, #STM32_FLASH_CR_OFFSET] */
-#endif
-	 /* exit: */
-	 0xbe00,			/* bkpt	#0x00 */
-	 0x0000, 0x0000,
-	 0x2000, 0x4002,	/* .STM32_FLASH_BASE: .word 0x40022000 */
-	 0x0040, 0x2000,	/* .SRC_ADDR: .word 0x20000040 */
-	 0x0bd0, 0x0800,	/* .TARGET_ADDR: .word 0x0800xxxx */
-	 0x0006, 0x0000,	/* .COUNT: .word 0x00000100 */
- };
+	if (sl->xfer_resync && sl->xfer_inflight == 0) {
+		if (sl->backend->recover && ! sl->usb_gone)
+			sl->backend->recover(sl);
+		sl->xfer_resync = 0;
+	}
+	if (sl->verbose > 3)
+		printf("Queuing command %2.2x %2.2x ..., data length %d.\n",
+			   xf->cmd_buf[0], xf->cmd_buf[1], xf->data_len);
+	xf->state = XferQueued;
+	xf->seq = ++sl->xfer_seq;
+	xf->submit_ns = stl_clock_ns();
+	xf->timeout_ms = stl_xfer_timeout(sl, xf);
+	sl->xfer_inflight++;
+	sl->xfer_inflight_bytes += xf->data_len;
+	if (sl->xfer_resync && stl_xfer_is_read(xf)) {
+		xf->status = STL_ERR_RESYNC;
+		xf->done_ns = xf->submit_ns;
+		stl_xfer_finish(xf);
+		return STL_ERR_RESYNC;
+	}
+	return sl->backend->submit(xf);
+}
 
-/* The flash write program.
- * The STLink apparently cannot directly generate the memory operations
- * required to write the flash.  So we download and run a small program that
- * writes the flash for us.
- *
- * While inconvenient, this does result in much faster writes.  To improve
- * the performance even more, we download the program, parameters and data to
- * write in a single transfer.
- * The program finishes by turning off the flash programming enable in
- * FLASH_CR and calling breakpoint#0 -- halting.
- * The status is reflected in the registers.
- * A successful completion leaves R2 with a count of zero.
- * The final FLASH_SR status is returned in R3.
- * A count of the busy loop iterations in kept in R5 -- a rough estimation
- * of the write speed.
+/* Wait for a held transaction to complete, then release it.
+ * Its error is returned here only, not left for the next drain.
  */
-static const uint16_t db_loader_code[] = {
-	 0x480B,			/* ldr	r0, .SRC_ADDR */
-	 0x490C,			/* ldr	r1, .TARGET_ADDR */
-	 0x4A0C,			/* ldr	r2, .COUNT  */
-	 0x4c09,			/* ldr	r4, .STM32_FLASH_BASE */
-	 0x2501,			/* movs	r5, #FLASH_CR_PG_BIT  0x0001, then busy_count */
-	 0x6125,			/* str	r5, [r4, #STM32_FLASH_CR_OFFSET] */
-	 /* copy_hword: */
-	 0xf830, 0x3b02,	/* ldrh	r3, [r0], #0x02 */
-	 0xf821, 0x3b02,	/* strh	r3, [r1], #0x02 */
-	 /* busy: */
-	 0x3501,			/* add	r5, r5, #0x01 ; Increment busy_count */
-	 0x68e3,			/* ldr	r3, [r4, #STM32_FLASH_SR_OFFSET] */
-	 0xf013, 0x0f01,	/* tst	r3, #0x01 ;  check FLASH_SR_BSY */
-	 0xd1fa,			/* bne	busy */
-	 0xf013, 0x0f14,	/* tst	r3, #0x14 ; check for WRPRTERR/PGERR errors */
-	 0xd102,			/* bne	exit */
-	 0x3a01,			/* subs	r2, r2, #0x01 ;  Decrement COUNT*/
-	 0xd1f1,			/* bne	copy_hword */
-	 /* Normal completion, clear #FLASH_CR_PG_BIT.  Note that r2 is now 0. */
-	 0x6122,			/* str	r2, [r4, #STM32_FLASH_CR_OFFSET] */
-	 /* exit: */
-	 0xbe00,			/* bkpt	#0x00 */
-	 /* The following parameters will be overwritten before download. */
-	 0x2000, 0x4002,	/* .STM32_FLASH_BASE: .word 0x40022000 */
-	 0x0040, 0x2000,	/* .SRC_ADDR: .word 0x20000040 */
-	 0x0bd0, 0x0800,	/* .TARGET_ADDR: .word 0x0800xxxx */
-	 0x0006, 0x0000,	/* .COUNT: .word 0x00000100 */
- };
+static int stl_xfer_wait(struct stl_xfer *xf)
+{
+	struct stlink *sl = xf->sl;
+	uint64_t start = sl->stats ? stl_now(sl) : 0;
+	int ret;
+
+	while (xf->state == XferQueued)
+		if ((ret = sl->backend->events(sl, &xf->complete)) < 0)
+			return ret;
+	if (sl->backend->waited)
+		sl->backend->waited(sl, xf);
+	if (sl->stats)
+		stl_stats_wait(sl, start);
+	xf->state = XferFree;
+	return xf->status;
+}
 
-/* The same code for the STM32F4 flash peripheral.
- * The code is similar, but status bit positions and write size differences
- * make it unwise to use the same code.
- * The F4 can do 8/16/32 bit writes (even 64 bits, with 8 Volt Vpp)
- * We use 32 bit writes for best speed.
+/* Wait for every outstanding transaction.
+ * Returns the first error seen since the previous drain, or zero.
  */
-static const uint16_t f4_loader_code[] = {
-	 0x480B,			/* ldr	r0, .SRC_ADDR */
-	 0x490C,			/* ldr	r1, .TARGET_ADDR */
-	 0x4A0C,			/* ldr	r2, .COUNT  */
-	 0x4c09,			/* ldr	r4, .STM32_FLASH_BASE */
-	 0x2501,			/* movs	r5, #FLASH_CR_PG_BIT  0x0001, then busy_count */
-	 0x6125,			/* str	r5, [r4, #STM32_FLASH_CR_OFFSET] */
-	 /* copy_hword: */
-	 0xf830, 0x3b02,	/* ldrh	r3, [r0], #0x02 */
-	 0xf821, 0x3b02,	/* strh	r3, [r1], #0x02 */
-	 /* busy: */
-	 0x3501,			/* add	r5, r5, #0x01 ; Increment busy_count */
-	 0x68e3,			/* ldr	r3, [r4, #STM32_FLASH_SR_OFFSET] */
-	 0xf013, 0x0f01,	/* tst	r3, #0x01 ;  check FLASH_SR_BSY */
-	 0xd1fa,			/* bne	busy */
-	 0xf013, 0x0ff0,	/* tst	r3, #0xF0 ; check for PG*ERR errors */
-	 0xd102,			/* bne	exit */
-	 0x3a01,			/* subs	r2, r2, #0x01 ;  Decrement COUNT*/
-	 0xd1f1,			/* bne	copy_hword */
-	 /* Normal completion, clear #FLASH_CR_PG_BIT.  Note that r2 is now 0. */
-	 0x6122,			/* str	r2, [r4, #STM32_FLASH_CR_OFFSET] */
-	 /* exit: */
-	 0xbe00,			/* bkpt	#0x00 */
-	 /* The following parameters will be overwritten before download. */
-	 0x2000, 0x4002,	/* .STM32_FLASH_BASE: .word 0x40022000 */
-	 0x0040, 0x2000,	/* .SRC_ADDR: .word 0x20000040 */
-	 0x0bd0, 0x0800,	/* .TARGET_ADDR: .word 0x0800xxxx */
-	 0x0006, 0x0000,	/* .COUNT: .word 0x00000100 */
- };
+static int stl_xfer_drain(struct stlink *sl)
+{
+	uint64_t start = sl->stats ? stl_now(sl) : 0;
+	int ret;
 
-/*
- * Write the flash at FLASH_ADDR with data BUF of SIZE bytes.
- * This routine downloads the flash-write program, parameters
- * and data to be written, then runs the program.
- * It assumes that the flash address, size and any rounding has been
- * checked by the caller.
- * The flash needs to be unlocked by the caller, but the downloaded code
- * writes FLASH_CR_PG_BIT to enable and disable user flash programing.
+	while (sl->xfer_inflight > 0)
+		if ((ret = sl->backend->events(sl, NULL)) < 0)
+			return ret;
+	if (sl->backend->waited)
+		sl->backend->waited(sl, NULL);
+	if (sl->stats)
+		stl_stats_wait(sl, start);
+	ret = sl->xfer_err;
+	sl->xfer_err = 0;
+	return ret;
+}
+
+/* Wait for everything outstanding, then put the transport back into a
+ * known state after a failure, so that the failed part can be retried.
  */
-static int stl_loader(struct stlink *sl, stm32_addr_t flash_addr,
-					  const void *buf, int size)
+static void stl_xfer_recover(struct stlink *sl)
 {
-	int offset = 0;
-	uint32_t prog_base = stm_devids[0].sram_base;
-	uint32_t *params;
-	uint32_t flash_ctrl_base;
+	stl_xfer_drain(sl);
+	if (sl->backend->recover && ! sl->usb_gone)
+		sl->backend->recover(sl);
+	sl->xfer_resync = 0;
+	sl->xfer_err = 0;
+	sl->recoveries++;
+}
 
-	if (stm_devids[sl->chip_index].cap_flags & ChipCapF4Flash) {
-		offset = sizeof(f4_loader_code);
-		memcpy(sl->data_buf, f4_loader_code, offset);
-		flash_ctrl_base = F4_FLASH_REGS;
+/* Fill in a target memory read or write command.
+ * Writes must be 32 bit multiples, or under 64 bytes.
+ */
+static void stl_xfer_mem_cmd(struct stl_xfer *xf, uint8_t op,
+							 uint32_t addr, uint16_t len)
+{
+	xf->cmd_buf[0] = STLinkDebugCommand;
+	xf->cmd_buf[1] = op;
+	write_uint32(xf->cmd_buf + 2, addr);
+	write_uint16(xf->cmd_buf + 6, len);
+	if (op == STLinkDebugReadMem32bit) {
+		xf->cmd_len = 16;
+		xf->dir = STLinkParamFromDev;
 	} else {
-		offset = sizeof(db_loader_code);
-		memcpy(sl->data_buf, db_loader_code, offset);
-		if (stm_devids[sl->chip_index].flash_size > 256*1024  &&
-			flash_addr >= 0x08080000)
-			flash_ctrl_base = 0x40022040;
-		else
-			flash_ctrl_base = FLASH_REGS_ADDR;
+		xf->cmd_len = 8;
+		xf->dir = STLinkParamToDev;
 	}
-	params = (uint32_t *)(sl->data_buf+offset);
+	xf->data_len = len;
+}
 
-	/* Write params[-4] to change the FLASH_REGS_ADDR base.
-	 * Connectivity devices use an offset of +0x40 e.g. 0x40022040
-	 * for a second bank of flash. */
-	params[-4] = flash_ctrl_base;
-	params[-3] = prog_base + offset;
-	params[-2] = flash_addr;
-	params[-1] = size>>1;
-	memcpy(params, buf, size);
+/* Execute the command in stl->cmd_buf, with the data phase using
+ * stl->data_buf and stl->data_len.
+ * This is a synchronous wrapper around the transaction queue.  Any
+ * previously queued transactions complete first.
+ * The result is also kept in stl->cmd_err, for the wrappers that return
+ * the response instead.
+ */
+static int stl_do_cmd(struct stlink *stl)
+{
+	struct stl_xfer *xf = stl_xfer_get(stl);
 
-	/* Transfer both the loader and data at once. */
-	stl_wr32_cmd(sl, prog_base, offset + size);
-	/* Run the program by setting the PC aka r15. */
-	stl_write_reg(sl, prog_base, 15);
-	stl_state_run(sl);
+	if (xf == NULL) {
+		stl->cmd_err = -1;
+		return -1;
+	}
+	xf->hold = 1;
+	memcpy(xf->cmd_buf, stl->cmd_buf, sizeof stl->cmd_buf);
+	xf->cmd_len = stl->cmd_len;
+	xf->dir = stl->xfer_dir;
+	xf->data = stl->data_buf;
+	xf->data_len = stl->data_len;
+	stl_xfer_submit(xf);
+	stl->cmd_err = stl_xfer_wait(xf);
+	return stl->cmd_err;
+}
 
-	return 0;
+#if defined(__linux__) || defined(__APPLE__)
+/* The libusb transport for the STLink v2.
+ * v1 uses SCSI transport over USB.
+ * v2 uses USB bulk endpoints, with the command block and data phase each
+ * an asynchronous libusb transfer.
+ */
+static int stl_urb_status(enum libusb_transfer_status status)
+{
+	switch (status) {
+	case LIBUSB_TRANSFER_COMPLETED: return 0;
+	case LIBUSB_TRANSFER_TIMED_OUT: return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_STALL:		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE: return LIBUSB_ERROR_NO_DEVICE;
+	case LIBUSB_TRANSFER_OVERFLOW:	return LIBUSB_ERROR_OVERFLOW;
+	case LIBUSB_TRANSFER_CANCELLED: return LIBUSB_ERROR_INTERRUPTED;
+	default:						return LIBUSB_ERROR_IO;
+	}
 }
 
-#define FLASH_WR_BLK_SIZE 2048
+static void LIBUSB_CALL stl_urb_done(struct libusb_transfer *urb)
+{
+	struct stl_xfer *xf = urb->user_data;
+	int status = stl_urb_status(urb->status);
+
+	if (urb == xf->data_urb)
+		xf->actual_len = urb->actual_length;
+	if (status == 0 && urb->actual_length != urb->length) {
+		printf(" * Failed USB %s, Command %2.2x %2.2x transfer "
+			   "length %d vs %d expected.\n",
+			   urb == xf->cmd_urb ? "command" :
+			   (xf->dir == STLinkParamToDev ? "output" : "input"),
+			   xf->cmd_buf[0], xf->cmd_buf[1],
+			   urb->actual_length, urb->length);
+		status = STL_ERR_SHORT;
+	}
+	if (status && xf->status == 0) {
+		xf->status = status;
+		printf(" * Failed USB transfer, status %d, Command %2.2x %2.2x.\n",
+			   status, xf->cmd_buf[0], xf->cmd_buf[1]);
+	}
+	if (xf->sl->verbose > 3)
+		printf("Transfer done, status %d length %d of %d.\n",
+			   status, urb->actual_length, urb->length);
+	if (--xf->pending == 0)
+		stl_xfer_finish(xf);
+}
 
-static int stl_flash_write(struct stlink *sl, stm32_addr_t flash_addr,
-						   const void *buf, int size)
+static int stl_usb_submit(struct stl_xfer *xf)
 {
-	int offset = 0;
-	int status;
+	struct stlink *sl = xf->sl;
+	int ret;
 
-	if (sl->verbose)
-		printf("Flash write %8.8x..%8.8x.\n", flash_addr, flash_addr+size);
-	/* Unlock the flash register. */
-	sl_wr32(sl, FLASH_KEYR, FLASH_KEY1);
-	sl_wr32(sl, FLASH_KEYR, FLASH_KEY2);
-	/* Clear the error bits in the control register. */
-	sl_wr32(sl, FLASH_SR, 0x34);
-	if (sl->verbose)
-		printf("Flash status %2.2x, control %4.4x.\n",
-			   sl_rd32(sl, FLASH_SR), sl_rd32(sl, FLASH_CR));
+	if (xf->cmd_urb == NULL) {
+		xf->cmd_urb = libusb_alloc_transfer(0);
+		xf->data_urb = libusb_alloc_transfer(0);
+		if (xf->cmd_urb == NULL || xf->data_urb == NULL) {
+			fprintf(stderr, "Failed to allocate a USB transfer.\n");
+			libusb_free_transfer(xf->cmd_urb);
+			libusb_free_transfer(xf->data_urb);
+			xf->cmd_urb = xf->data_urb = NULL;
+			xf->status = LIBUSB_ERROR_NO_MEM;
+			stl_xfer_finish(xf);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+	}
+	xf->pending = 1;
+	/* The cmd_len value doesn't need to be precise.  Bytes after
+	 * the command are ignored. */
+	libusb_fill_bulk_transfer(xf->cmd_urb, sl->usb_hand, USB_PIPE_OUT,
+							  xf->cmd_buf, xf->cmd_len, stl_urb_done, xf,
+							  xf->timeout_ms);
+	ret = libusb_submit_transfer(xf->cmd_urb);
+	if (ret) {
+		fprintf(stderr, "Failed to queue USB command %2.2x %2.2x: %s.\n",
+				xf->cmd_buf[0], xf->cmd_buf[1], libusb_error_name(ret));
+		xf->status = ret;
+		xf->pending = 0;
+		stl_xfer_finish(xf);
+		return ret;
+	}
+	if (xf->data_len != 0) {
+		libusb_fill_bulk_transfer(xf->data_urb, sl->usb_hand,
+								  xf->dir == STLinkParamToDev ?
+								  USB_PIPE_OUT : USB_PIPE_IN,
+								  xf->data, xf->data_len, stl_urb_done, xf,
+								  xf->timeout_ms);
+		xf->pending++;
+		ret = libusb_submit_transfer(xf->data_urb);
+		if (ret) {
+			/* The command itself still completes through the callback. */
+			fprintf(stderr, "Failed to queue USB data for command "
+					"%2.2x %2.2x: %s.\n", xf->cmd_buf[0], xf->cmd_buf[1],
+					libusb_error_name(ret));
+			xf->status = ret;
+			xf->pending--;
+		}
+	}
+	return ret;
+}
 
-	do {
-		int this_size;
-		int failcount = 0;
-		if (size > FLASH_WR_BLK_SIZE)
-			this_size = FLASH_WR_BLK_SIZE;
-		else if (size & 1)
-			this_size = size+1;
-		else
-			this_size = size;
-		stl_loader(sl, flash_addr + offset, buf + offset, this_size);
-		/* Writing 2KB takes 40-70 msec according to sec. 5.3.9 */
-		while (stl_get_status(sl) != STLINK_CORE_HALTED)
-			if (++failcount > FLASH_POLL_LIMIT) {
-				if (sl->verbose)
-					printf("Flash status %2.2x, control %4.4x status %x.\n",
-						   sl_rd32(sl, FLASH_SR), sl_rd32(sl, FLASH_CR),
-						   stl_get_status(sl));
-				return 0;
-			}
-		offset += this_size;
-		size -= this_size;
-	} while (size > 0);
+static int stl_usb_events(struct stlink *sl, int *complete)
+{
+	struct timeval tv = {0, 100*1000};
+	int ret;
 
-	status = sl_rd32(sl, FLASH_SR) & 0x15;
-	if (status) {
-		if (status & 0x04)
-			fprintf(stderr, "Flash write failed: trying to write a location "
-					"that was not erased. (%2.2x)\n", status);
-		else if (status & 0x10)
-			fprintf(stderr, "Flash write failed: trying to modify a "
-					"write-protected region. (%2.2x)\n", status);
+	ret = libusb_handle_events_timeout_completed(sl->usb_ctx, &tv, complete);
+	if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED) {
+		fprintf(stderr, "USB event handling failed: %s.\n",
+				libusb_error_name(ret));
+		return ret;
 	}
-	/* Re-lock the flash. */
-	sl_wr32(sl, FLASH_CR, 0x80);
-	return status;
+	return 0;
 }
 
-/* Erase flash memory.
- * Typical use: erase the page of flash memory that contains address ADDR.
- * Pass the address 0xA11 to do a mass erase ("user flash" only).
- * The flash controller should be idle at entry, and this waits for idle
- * before exit.
- */
-static int stl_f4_flash_erase_page(struct stlink *sl, stm32_addr_t addr_page);
-static int stl_flash_erase_page(struct stlink *sl, stm32_addr_t addr_page)
+static void stl_usb_close(struct stlink *sl)
 {
-	int i = 0, status;
+	int i;
 
-	if (stm_devids[sl->chip_index].cap_flags & ChipCapF4Flash)
-		return stl_f4_flash_erase_page(sl, addr_page);
+	stl_xfer_drain(sl);
+	for (i = 0; i < STL_XFER_DEPTH; i++) {
+		if (sl->xfer[i].cmd_urb)
+			libusb_free_transfer(sl->xfer[i].cmd_urb);
+		if (sl->xfer[i].data_urb)
+			libusb_free_transfer(sl->xfer[i].data_urb);
+		sl->xfer[i].cmd_urb = sl->xfer[i].data_urb = NULL;
+	}
+}
 
-	/* Unlock the flash register and clear any previous errors. */
-	sl_wr32(sl, FLASH_KEYR, FLASH_KEY1);
-	sl_wr32(sl, FLASH_KEYR, FLASH_KEY2);
-	sl_wr32(sl, FLASH_SR, FLASH_SR_EOP | FLASH_SR_WRPRTERR | FLASH_SR_PGERR);
+/* Clear any endpoint stall, and discard the late responses to a
+ * transaction that timed out and to any cancelled after it whose command
+ * had already gone out, so that none is taken as the answer to the next. */
+static void stl_usb_recover(struct stlink *sl)
+{
+	unsigned char junk[Q_BUF_LEN];
+	int len;
+
+	libusb_clear_halt(sl->usb_hand, USB_PIPE_IN);
+	libusb_clear_halt(sl->usb_hand, USB_PIPE_OUT);
+	while (libusb_bulk_transfer(sl->usb_hand, USB_PIPE_IN, junk, sizeof junk,
+								&len, STL_RESYNC_MSEC) == 0 && len > 0)
+		;
+}
 
-	if (sl->verbose > 1)
-		fprintf(stderr, "STLink erase flash: status %8.8x "
-				"Flash_CR %8.8x.\n",
-				sl_rd32(sl, FLASH_SR), sl_rd32(sl, FLASH_CR));
+/* Cancel the USB transfers of the reads queued after SEQ.  They
+ * complete through stl_urb_done() as interrupted. */
+static void stl_usb_cancel(struct stlink *sl, unsigned seq)
+{
+	int i;
 
-	if (addr_page == 0xa11) {
-		/* Start the erase-all operation, PM0075 sec 3.5. */
-		sl_wr32(sl, FLASH_CR, FLASH_CR_MER);
-		sl_wr32(sl, FLASH_CR, FLASH_CR_STRT | FLASH_CR_MER);
-	} else {
-		/* Select the page to erase PM0075 sec 3.6 */
-		sl_wr32(sl, FLASH_AR, addr_page);
-		/* Start the erase operation, PM0075 sec 3.5.
-		 * Note that a single combined write will not work! */
-		sl_wr32(sl, FLASH_CR, FLASH_CR_PER);
-		sl_wr32(sl, FLASH_CR, FLASH_CR_STRT | FLASH_CR_PER);
-	}
-	/* Monitor the busy bit to check for completion.  This typically takes
-	 * only two iterations. */
-	do {
-		status = sl_rd32(sl, FLASH_SR);
-		i++;
-	} while ((status & FLASH_SR_BSY) && i < 1000);
-	if ( ! (status & FLASH_SR_EOP)) {
-		fprintf(stderr, "STLink erase flash page failed, status %8.8x "
-				"Flash_CR %8.8x (%d checks).\n",
-				status, sl_rd32(sl, FLASH_SR), i);
-		return 1;
+	for (i = 0; i < STL_XFER_DEPTH; i++) {
+		struct stl_xfer *xf = &sl->xfer[i];
+		if (xf->state != XferQueued || (int)(xf->seq - seq) <= 0 ||
+			xf->pending == 0 || ! stl_xfer_is_read(xf))
+			continue;
+		/* The one already finished just reports not found. */
+		libusb_cancel_transfer(xf->cmd_urb);
+		libusb_cancel_transfer(xf->data_urb);
 	}
-	if (sl->verbose)
-		fprintf(stderr, "STLink erase flash page %8.8x: %d status checks to "
-				"complete %8.8x.\n", addr_page, i, status);
-	return 0;
 }
 
-static int stl_f4_flash_erase_page(struct stlink *sl, stm32_addr_t addr_page)
-{
-	int i = 0, status;
+static const struct stl_backend stl_usb_backend = {
+	"libusb", stl_usb_submit, stl_usb_events, NULL, stl_usb_close,
+	stl_usb_recover, stl_usb_cancel, NULL,
+};
+#endif
 
-	if (sl->verbose > 1)
-		fprintf(stderr, "STLink STM32F4 erase flash: Flash_SR %8.8x "
-				"Flash_CR %8.8x.\n",
-				sl_rd32(sl, F4_FLASH_SR), sl_rd32(sl, F4_FLASH_CR));
+#if defined(__linux__)
+/* The SCSI Generic transport for the STLink v1.
+ * The v1 firmware presents a USB mass storage device, and each STLink
+ * command is a vendor-specific SCSI command block with an optional data
+ * phase.
+ * Rather than a blocking SG_IO ioctl() per command, transactions are
+ * queued to the sg driver with write() and reaped with read(), tagged with
+ * their slot number as the pack_id.  The usb-storage driver still runs
+ * them one at a time and in order, but without a host round trip between
+ * them.  Each slot has a request header and sense buffer that are set up
+ * at open and reused.
+ * Data phases ask for direct I/O into the caller's buffer, which the
+ * driver quietly turns into a copy when it is not allowed.  We do not use
+ * SG_FLAG_MMAP_IO: it maps the one reserved buffer of the file, so only a
+ * single queued command at a time could use it.
+ */
+#define SG_DID_TIME_OUT		0x03	/* io_hdr.host_status */
 
+struct stl_sg {
+	struct sg_io_hdr req[STL_XFER_DEPTH];	/* Indexed by slot */
+	unsigned char sense[STL_XFER_DEPTH][SENSE_BUF_LEN];
+};
 
-	/* Unlock the flash register and clear any previous errors. */
-	sl_wr32(sl, F4_FLASH_KEYR, FLASH_KEY1);
-	sl_wr32(sl, F4_FLASH_KEYR, FLASH_KEY2);
-	sl_wr32(sl, F4_FLASH_SR, 0xF3); 		/* Clear error bits. */
+/* Allow more than one queued command on the file.  This does not
+ * survive a re-open. */
+static void stl_sg_setup(struct stlink *sl)
+{
+	int one = 1;
 
-	if (sl->verbose > 1)
-		fprintf(stderr, "STLink STM32F4 erase flash: status %8.8x "
-				"Flash_CR %8.8x.\n",
-				sl_rd32(sl, F4_FLASH_SR), sl_rd32(sl, F4_FLASH_CR));
+	if (ioctl(sl->fd, SG_SET_COMMAND_Q, &one) < 0 && sl->verbose)
+		fprintf(stderr, " Command queuing is not available on %s: %s.\n",
+				sl->dev_path, strerror(errno));
+}
 
-	if (addr_page == 0xa11) {
-		/* Start the erase-all operation, PM0075 sec 3.5. */
-		sl_wr32(sl, F4_FLASH_CR, FLASH_CR_MER);
-		sl_wr32(sl, F4_FLASH_CR, F4_FLASH_CR_STRT | FLASH_CR_MER);
-	} else {
-		int sector = addr_page & 0x0f;
-		/* Select the sector to erase. */
-		sl_wr32(sl, F4_FLASH_CR, 0x00202 | (sector<<3));
-		sl_wr32(sl, F4_FLASH_CR, 0x10202 | (sector<<3));
+/* Complete the transaction for one finished request.
+ * Returns 0, or a negative errno if the read failed. */
+static int stl_sg_reap(struct stlink *sl)
+{
+	struct sg_io_hdr hdr;
+	struct stl_xfer *xf;
+
+	memset(&hdr, 0, sizeof hdr);
+	hdr.interface_id = 'S';
+	hdr.pack_id = -1;
+	if (read(sl->fd, &hdr, sizeof hdr) < 0)
+		return errno == EINTR || errno == EAGAIN ? 0 : -errno;
+	if (hdr.pack_id < 0 || hdr.pack_id >= STL_XFER_DEPTH ||
+		sl->xfer[hdr.pack_id].state != XferQueued) {
+		fprintf(stderr, "Unexpected SCSI completion, pack_id %d.\n",
+				hdr.pack_id);
+		return 0;
 	}
-	/* Monitor the busy bit to check for completion.  This typically takes
-	 * only two iterations. */
-	do {
-		status = sl_rd32(sl, F4_FLASH_SR);
-		i++;
-	} while ((status & F4_FLASH_SR_BSY) && i < 1000);
-	if (sl->verbose)
-		fprintf(stderr, "STLink erase flash page %8.8x: %d status checks to "
-				"complete %8.8x.\n", addr_page, i, status);
+	xf = &sl->xfer[hdr.pack_id];
+	xf->actual_len = xf->data_len - hdr.resid;
+	if ((hdr.info & SG_INFO_OK_MASK) == SG_INFO_OK)
+		xf->status = 0;
+	else if (hdr.host_status == SG_DID_TIME_OUT)
+		xf->status = LIBUSB_ERROR_TIMEOUT;
+	else
+		xf->status = STL_ERR_SCSI;
+	/* Report SCSI results. */
+	if (sl->verbose > 3)
+		fprintf(stderr, " SCSI command %2.2x %2.2x status %4.4x, took %d "
+				"ms.\n", xf->cmd_buf[0], xf->cmd_buf[1], hdr.status,
+				hdr.duration);
+	if (sl->verbose && (hdr.resid || hdr.sb_len_wr))
+		fprintf(stderr, " SCSI residue was %d, sense length %d.\n",
+				hdr.resid, hdr.sb_len_wr);
+	stl_xfer_finish(xf);
 	return 0;
 }
 
-/* Read from device memory at ADDR into BUF for SIZE bytes.
- * This handles alignment and block size internally.
- */
-#define READ_BLK_SIZE 1024
-int stl_read(struct stlink* sl, stm32_addr_t addr, void *buf, ssize_t size)
+static int stl_sg_submit(struct stl_xfer *xf)
 {
-	size_t offset = 0;
+	struct stlink *sl = xf->sl;
+	struct sg_io_hdr *req = &sl->sg->req[xf - sl->xfer];
+	int ret;
 
-	if (addr & 3) {
-		int psz = 4 - (addr & 3);
-		stl_rd32_cmd(sl, addr & ~3, sizeof(uint32_t));
-		memcpy(buf, sl->data_buf + (addr & 3), psz);
-		offset = psz;
-	}
-	do {
-		int xfer_size;
-		if (size > READ_BLK_SIZE)
-			xfer_size = READ_BLK_SIZE;
+	req->dxferp = xf->data;
+	req->dxfer_len = xf->data_len;
+	req->dxfer_direction =
+		(xf->dir == STLinkParamToDev ? SG_DXFER_TO_DEV : SG_DXFER_FROM_DEV);
+	req->flags = xf->data_len ? SG_FLAG_DIRECT_IO : 0;
+	req->timeout = xf->timeout_ms;
+
+	while (write(sl->fd, req, sizeof *req) < 0) {
+		/* The driver queue is full: complete something and try again. */
+		if (errno == EDOM || errno == EAGAIN) {
+			if ((ret = stl_sg_reap(sl)) == 0)
+				continue;
+		} else if (errno == EINTR)
+			continue;
 		else
-			xfer_size = (size+3)&~3;
-		stl_rd32_cmd(sl, addr+offset, xfer_size);
-		if (size & 3)
-			xfer_size = size;
-		memcpy(buf + offset, sl->data_buf, xfer_size);
-		offset += xfer_size;
-		size -= xfer_size;
-	} while (size > 0);
-	return size;
+			ret = -errno;
+		fprintf(stderr, "Failed to queue SCSI command %2.2x %2.2x: %s.\n",
+				xf->cmd_buf[0], xf->cmd_buf[1], strerror(-ret));
+		xf->status = ret == -ENODEV ? LIBUSB_ERROR_NO_DEVICE : STL_ERR_SCSI;
+		stl_xfer_finish(xf);
+		return xf->status;
+	}
+	return 0;
 }
 
-
-/* Write the contents of file PATH into flash starting at ADDR. */
-static int stl_flash_fwrite(struct stlink *sl, const char* path,
-							stm32_addr_t addr, int max_size)
+/* Wait up to 100 msec for a completion, then reap everything finished. */
+static int stl_sg_events(struct stlink *sl, int *complete)
 {
-	char buf[128*1024];
+	struct pollfd pfd = {sl->fd, POLLIN, 0};
+	int timeout = 100;
 	int ret;
-	ssize_t size;
-	const int fd = open(path, O_RDONLY);
 
-	if (fd < 0) {
-		fprintf(stderr, " Failed to open '%s': %s\n", path, strerror(errno));
-		return -1;
-	}
-	size = read(fd, buf, sizeof buf);
-	if (size < 0) {
-		fprintf(stderr, " Failed to read '%s': %s\n", path, strerror(errno));
-		return -1;
-	}
-	if (size > max_size) {
-		fprintf(stderr, " Program is LARGER THAN FLASH and may not fit."
-				"  Trying anyway.\n"
-				"  Program at %s is %#8.8x bytes, flash is %#8.8x bytes.\n",
-				path, (int)size, max_size);
+	while (sl->xfer_inflight > 0 && (ret = poll(&pfd, 1, timeout)) > 0) {
+		if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+			fprintf(stderr, "The STLink device %s failed.\n", sl->dev_path);
+			return -EIO;
+		}
+		if ((ret = stl_sg_reap(sl)) < 0) {
+			fprintf(stderr, "Failed to read a SCSI completion: %s.\n",
+					strerror(-ret));
+			return ret;
+		}
+		timeout = 0;
 	}
+	return 0;
+}
 
-	ret = stl_flash_write(sl, addr, buf, size);
-	close(fd);
-	if (ret & 0x0004) {
-		fprintf(stderr, "\n");
-	}
-	return ret;
+static void stl_sg_close(struct stlink *sl)
+{
+	int i;
+
+	/* Nothing may be left queued against the buffers. */
+	for (i = 0; sl->xfer_inflight > 0 && i < 20; i++)
+		if (stl_sg_events(sl, NULL) < 0)
+			break;
+	free(sl->sg);
+	sl->sg = NULL;
 }
 
-/* Routines still left to implement. */
+static const struct stl_backend stl_sg_backend = {
+	"sg", stl_sg_submit, stl_sg_events, NULL, stl_sg_close, stl_sg_setup,
+	NULL, NULL,
+};
 
-/* Read from the ARM memory starting at offet ADDR, writing SIZE bytes
- * into file PATH.
+/* Open the STLink v1 at DEV_NAME, a SCSI Generic device such as
+ * /dev/sg2, filling in the caller-allocated probe context SL.
+ * We do not verify that we have opened such a device, stl_connect()
+ * checks that it answers as a STLink.
  */
-int stl_fread(struct stlink* sl, const char* path,
-				 stm32_addr_t addr, size_t size)
+struct stlink *stl_sg_open(struct stlink *sl, const char *dev_name)
 {
-	char buf[size+8];
-	const int fd = open(path, O_RDWR | O_TRUNC | O_CREAT, 0664);
-	size_t wsize, offset;
+	int fd = open(dev_name, O_RDWR);
+	struct stl_sg *sg;
+	int i;
 
 	if (fd < 0) {
-		fprintf(stderr, " Failed to open '%s': %s\n", path, strerror(errno));
-		return -1;
-	}
-
-	stl_read(sl, addr, buf, size);
-
-	/* Should loop until error. */
-	offset = 0;
-	wsize = size;
-	while (wsize > 0) {
-		int res = write(fd, buf+offset, wsize);
-		if (res < 0) break;
-		offset += res;
-		wsize -= res;
+		fprintf(stderr, "Failed to open STLink device %s: %s.\n",
+				dev_name, strerror(errno));
+		return NULL;
 	}
-	if (wsize != 0) {
-		fprintf(stderr, " Failed to write '%s': %s\n", path, strerror(errno));
+	if (stl_verbose)
+		fprintf(stderr, " Opened the STLink '%s'.\n", dev_name);
+	if ((sg = calloc(1, sizeof *sg)) == NULL) {
 		close(fd);
-		return -1;
+		return NULL;
 	}
-	close(fd);
-	return 0;
-}
-
-
-#if 0
-/* Verify that ARM memory starting at ADDR matches the next chunk from FD.
- * Return the number of bytes successfully compared, zero if finished,
- * or -1 if a mismatch occured.
- */
-
-int stlink_verify_chunk(struct stlink* sl, int fd, stm32_addr_t addr)
-{
-	char filebuf[128*1024], flashbuf[128*1024];
-	ssize_t file_rdsize, flash_rdsize;
-
-	file_rdsize = read(fd, filebuf, sizeof filebuf);
-	if (size < 0) {
-		fprintf(stderr, " Failed to read file '%s' during verify: %s\n",
-				path, strerror(errno));
-		return -1;
-		}
-		if (size == 0)
-			return 0;
-
-		flash_rdsize = stl_read(sl, addr, flashbuf, file_rdsize);
-		/* Unlikely, but check anyway. */
-		if (flash_rdsize != file_rdsize) {
-			fprintf(stderr, " Mismatched read size during verify, %d vs %d.\n",
-					flash_rdsize, file_rdsize);
-			return -1;
-		}
 
-		/* Extremely uninformative about the failure. */
-		if (memcmp(filebuf, flashbuf, file_rdsize) != 0) {
-			fprintf(stderr, " Failed flash verify.\n");
-			return -1;
-		}
-		addr += file_rdsize;
+	memset(sl, 0, sizeof *sl);
+	sl->dev_path = dev_name;
+	sl->fd = fd;
+	sl->verbose = stl_verbose;
+	sl->sg = sg;
+	sl->backend = &stl_sg_backend;
+	sl->core_state = STLINK_CORE_UNKNOWN_STATE;
+	for (i = 0; i < STL_XFER_DEPTH; i++) {
+		sg->req[i].interface_id = 'S';
+		sg->req[i].pack_id = i;
+		sg->req[i].cmdp = sl->xfer[i].cmd_buf;
+		sg->req[i].cmd_len = CDB_SIZE;
+		sg->req[i].sbp = sg->sense[i];
+		sg->req[i].mx_sb_len = SENSE_BUF_LEN;
 	}
+	stl_sg_setup(sl);
+	return sl;
+}
 #endif
 
-/* Verify that ARM memory starting at ADDR matches the contents of file PATH. */
-int stlink_fverify(struct stlink* sl, const char* path,
-						stm32_addr_t addr)
+/* Command batches.
+ * Register-level sequences, such as unlocking the flash controller and
+ * starting an erase, are long strings of 32 bit writes and reads.  Rather
+ * than wait a full host round-trip for each, the stl_batch_* calls queue
+ * them as transactions and stl_batch_run() waits once for the whole set.
+ * Queued commands start immediately and run in order, so a batched read
+ * sees the effect of all earlier batched writes.
+ * The read results are only valid after stl_batch_run() returns zero.
+ */
+static void stl_batch_wr32(struct stlink *sl, uint32_t addr, uint32_t val)
 {
-	char filebuf[128*1024], flashbuf[128*1024];
-	ssize_t file_rdsize, flash_rdsize;
-	const int fd = open(path, O_RDONLY);
-
-	if (fd < 0) {
-		fprintf(stderr, " Failed to open '%s': %s\n", path, strerror(errno));
-		return -1;
-	}
-
-	while ((file_rdsize = read(fd, filebuf, sizeof filebuf)) > 0) {
-		flash_rdsize = stl_read(sl, addr, flashbuf, file_rdsize);
-		/* Unlikely, but check anyway. */
-		if (flash_rdsize != 0 && flash_rdsize != file_rdsize) {
-			fprintf(stderr, " Mismatched read size during verify, %d vs %d.\n",
-					flash_rdsize, file_rdsize);
-			goto fail;
-		}
+	struct stl_xfer *xf = stl_xfer_get(sl);
 
-		/* Extremely uninformative about the failure. */
-		if (memcmp(filebuf, flashbuf, file_rdsize) != 0) {
-			fprintf(stderr, " Failed flash verify.\n");
-			goto fail;
-		}
-		addr += file_rdsize;
-	}
-	if (file_rdsize < 0) {
-		fprintf(stderr, " Failed to read file '%s' during verify: %s\n",
-				path, strerror(errno));
-		goto fail;
-	}
-	close(fd);
-	return 0;
- fail:
-	close(fd);
-	return -1;
+	if (xf == NULL)
+		return;
+	stl_xfer_mem_cmd(xf, STLinkDebugWriteMem32bit, addr, sizeof(uint32_t));
+	write_uint32(xf->data, val);
+	stl_xfer_submit(xf);
 }
 
-#if 0
-#define STLINK_XFER_BLKSZ 2048
-static int stl_fread(struct stlink* sl, const char* path,
-						stm32_addr_t addr, size_t size)
+static void stl_batch_rd32_done(struct stl_xfer *xf)
 {
-	size_t off;
-
-	const int fd = open(path, O_RDWR | O_TRUNC | O_CREAT, 00664);
-	if (fd == -1) {
-		fprintf(stderr, " Failed to open '%s': %s\n", path, strerror(errno));
-		return -1;
-	}
+	if (xf->status == 0)
+		*(uint32_t *)xf->priv = read_uint32(xf->data, 0);
+}
 
-	/* Copy using 1K/2K/4K blocks. */
-	for (off = 0; off < size; off += STLINK_XFER_BLKSZ) {
-		size_t read_size = STLINK_XFER_BLKSZ;
-		if ((off + read_size) > size)
-			read_size = off + read_size;
+static void stl_batch_rd32(struct stlink *sl, uint32_t addr, uint32_t *result)
+{
+	struct stl_xfer *xf = stl_xfer_get(sl);
 
-		/* Round up size to always read whole words. */
-		if (read_size & 3)
-			read_size = (read_size + 4) & ~(3);
+	if (xf == NULL)
+		return;
+	stl_xfer_mem_cmd(xf, STLinkDebugReadMem32bit, addr, sizeof(uint32_t));
+	xf->done = stl_batch_rd32_done;
+	xf->priv = result;
+	stl_xfer_submit(xf);
+}
 
-		stlink_read_mem32(sl, addr + off, read_size);
+/* Wait for the batch to complete, returning the first USB error or zero. */
+static int stl_batch_run(struct stlink *sl)
+{
+	return stl_xfer_drain(sl);
+}
 
-		if (write(fd, sl->data_buf, read_size) != (ssize_t)read_size) {
-			fprintf(stderr, "write() != read_size\n");
-			close(fd);
-			return -1;
-		}
-	}
+static void stl_print_version(struct STLinkVersion *ver)
+{
+	if (ver->ST_VendorID == USB_ST_VID &&
+		(ver->ST_ProductID == USB_STLINK_PID ||
+		 ver->ST_ProductID == USB_STLINKv2_PID))
+		fprintf(stderr, "STMicro Vendor/Product ID 0x%04x 0x%04x\n",
+				ver->ST_VendorID, ver->ST_ProductID);
+	else
+		fprintf(stderr, "Incorrect Vendor/Product ID 0x%04x 0x%04x "
+				"(%04x %04x expected)\n",
+				ver->ST_VendorID, ver->ST_ProductID,
+				USB_ST_VID, USB_STLINK_PID);
+	/* Expected versions  STLink: 3  JTAG: 2  SWIM: 0x20 */
+	fprintf(stderr, " Versions  STLink: 0x%x  JTAG: 0x%x  SWIM: 0x%x\n"
+			"    The firmware %s a JTAG/SWD interface.\n"
+			"    The firmware %s a SWIM interface.\n",
+			ver->STLink_ver, ver->JTAG_ver, ver->SWIM_ver,
+			ver->JTAG_ver == 0 ? "does not support" : "supports",
+			ver->SWIM_ver == 0 ? "does not support" : "supports");
+}
 
-	return 0;
+static void stlink_print_arm_regs(struct ARMcoreRegs *regs)
+{
+	int i;
+	for (i = 0; i < 16; i++)
+		fprintf(stderr, "r%02d=0x%08x%c", i, regs->r[i], i%4 == 3 ? '\n' : ' ');
+	fprintf(stderr,
+			"xPSR       = 0x%08x\n"
+			"main_sp    = 0x%08x  process_sp = 0x%08x\n"
+			"rw         = 0x%08x  rw2        = 0x%08x\n",
+			regs->xpsr, regs->main_sp, regs->process_sp, regs->rw, regs->rw2);
+	return;
 }
-#endif
 
 /*
- * Kick a STLink until it is in a workable mode.
- * If the STLink is not in an expected mode, attempt to have it exit back
- * to mass storage mode.
- * The only known unexpected mode is DFU mode, which requires a reset
- * and re-plug process to exit.
- * This has many status messages sinces it's ugly, bogus and flakey.
+ * Set and clear hardware breakpoints.
+ * A breakpoint is set with the "flash patch" module.
+ * When executing from Flash instead of RAM, we need hardware support
+ * to implement breakpoints.  We only get four registers, but that is
+ * enough for most debugging.
+ * 2  The index, 0..3, of the Flash Patch register.
+ * 3-6 Address of the breakpoint (LSB first)
+ * 7 FP_ALL (0x02) / FP_UPPER (0x01) / FP_LOWER (0x00)
  */
-int stl_kick_mode(struct stlink *sl)
+int stl_set_breakpoint(struct stlink *sl, int fp_nr, uint32_t addr, int fp)
 {
-	int i;
-	int stlink_mode = stl_mode(sl);
+	write_uint32(sl->data_buf+3, addr);
+	sl->data_buf[7] = fp;
+	return stl_set_fp(sl, fp_nr);
+}
 
-	/* Check if we are already in a usable mode. */
-	if (stlink_mode == STLinkDevMode_Debug ||
-		stlink_mode == STLinkDevMode_Mass)
-		return 0;
+/* FPEC flash controller interface, PM0063 or PM0075 manual. */
+#define FLASH_REGS_ADDR 0x40022000
 
-#if 0
-	if (sl->verbose) {
-		sl->core_state = stl_get_status(sl);
-		fprintf(stderr, " STLink mode is %4.4x.\n"
-				" ARM status is 0x%4.4x: %s.\n",
-				stlink_mode, sl->core_state,
-				sl->core_state==STLINK_CORE_RUNNING ? "running" :
-				(sl->core_state==STLINK_CORE_HALTED ? "halted" : "unknown"));
-	}
-#endif
+#define FLASH_ACR	(FLASH_REGS_ADDR + 0x00)
+#define FLASH_KEYR	(FLASH_REGS_ADDR + 0x04)
+#define FLASH_SR	(FLASH_REGS_ADDR + 0x0c)
+#define FLASH_CR	(FLASH_REGS_ADDR + 0x10)
+#define FLASH_AR	(FLASH_REGS_ADDR + 0x14)
+#define FLASH_OBR	(FLASH_REGS_ADDR + 0x1c)
+#define FLASH_WRPR	(FLASH_REGS_ADDR + 0x20)
+/* XL-density devices control the flash above 512KB with a second set of
+ * registers, at the same offsets. */
+#define FLASH_BANK2_REGS 0x40022040
+#define FLASH_BANK2_BASE 0x08080000
+
+/* Flash unlock key values from PM0075 2.3.1 */
+#define FLASH_RDPTR_KEY 0x00a5
+#define FLASH_KEY1 0x45670123
+#define FLASH_KEY2 0xcdef89ab
+
+/* 32L15x flash controller, from RM0038.  Erased flash reads as zero. */
+#define L15_FLASH_REGS 0x40023C00
+#define L15_FLASH_ACR		(L15_FLASH_REGS + 0x00)
+#define L15_FLASH_PECR		(L15_FLASH_REGS + 0x04)
+#define  L15_FLASH_PECR_PELOCK 0x0001
+#define  L15_FLASH_PECR_PRGLOCK 0x0002
+#define  L15_FLASH_PECR_PROG 0x0008
+#define  L15_FLASH_PECR_ERASE 0x0200
+#define  L15_FLASH_PECR_FPRG 0x0400
+#define L15_FLASH_PDKEYR	(L15_FLASH_REGS + 0x08)
+#define L15_FLASH_PEKEYR	(L15_FLASH_REGS + 0x0C)
+#define L15_FLASH_PRGKEYR	(L15_FLASH_REGS + 0x10)
+#define L15_FLASH_SR		(L15_FLASH_REGS + 0x18)
+#define  L15_FLASH_SR_BSY 0x0001
+#define  L15_FLASH_SR_EOP 0x0002
+#define  L15_FLASH_SR_WRPERR 0x0100
+#define  L15_FLASH_SR_PGAERR 0x0200
+#define  L15_FLASH_SR_SIZERR 0x0400
+#define  L15_FLASH_SR_ERRS 0x0F00
+
+#define L15_FLASH_WRPR	(L15_FLASH_REGS + 0x20)
+/* Program memory is written 32 words at a time. */
+#define L15_HALF_PAGE 128
+
+#define FLASH_PEKEY1 0x89abcdef
+#define FLASH_PEKEY2 0x02030405
+#define FLASH_PRGKEY1 0x8c9daebf
+#define FLASH_PRGKEY2 0x13141516
+
+
+#define FLASH_SR_BSY 0x0001
+#define FLASH_SR_PGERR 0x0004
+#define FLASH_SR_WRPRTERR 0x0010
+#define FLASH_SR_EOP 0x0020
+
+/* Names and definitions from PM0075 sec 3.5 */
+#define FLASH_CR_PG  0x0001
+#define FLASH_CR_PER 0x0002
+#define FLASH_CR_MER 0x0004
+#define FLASH_CR_OPTPG 0x0010
+#define FLASH_CR_OPTER 0x0020
+#define FLASH_CR_STRT 0x0040
+#define FLASH_CR_LOCK 0x0080
+
+/* Names and definitions from PM0081 (STM32F4). */
+#define F4_FLASH_REGS 0x40023C00
+
+#define F4_FLASH_ACR	(F4_FLASH_REGS + 0x00)
+#define F4_FLASH_KEYR	(F4_FLASH_REGS + 0x04)
+#define F4_FLASH_OPTKEYR 	(F4_FLASH_REGS + 0x08)
+#define F4_FLASH_SR	(F4_FLASH_REGS + 0x0c)
+#define  F4_FLASH_SR_BSY 0x00010000
+#define  F4_FLASH_SR_WRPERR 0x0010
+#define  F4_FLASH_SR_PGAERR 0x0020
+#define  F4_FLASH_SR_PGPERR 0x0040
+#define  F4_FLASH_SR_PGSERR 0x0080
+#define  F4_FLASH_SR_ERRS 0x00F0
+#define F4_FLASH_CR	(F4_FLASH_REGS + 0x10)
+#define  F4_FLASH_CR_PG 0x0001
+#define  F4_FLASH_CR_SER 0x0002
+#define  F4_FLASH_CR_PSIZE(bytes) (((bytes) == 8 ? 3 : (bytes) >> 1) << 8)
+#define  F4_FLASH_CR_STRT 0x00010000
+#define  F4_FLASH_CR_LOCK 0x80000000
+
+/* Unlock the flash.  This takes two write cycles with two key values.
+ * The two key values are sequentially written to the FLASH_KEYR register.
+ */
+
+/*
+ * After much experimentation, I finally came to understand that the
+ * STLink cannot generate the 16 bit memory cycle needed to directly
+ * write the flash.
+ * You have to download a program that writes it.
+ *
+ * This was confirmed by reading the OpenOCD code.
+ * My implementation uses a similar approach, with a better implementation.
+ * They download a program, the data, pass parameters using registers
+ * (individually written) and run the program.  This might seem
+ * efficient, but the cost is largely in triggering a transfer, not how
+ * much is in each transfer.
+ *
+ * It's a bit more work to embed the parameters in the program and pack
+ * it together with the data into a single transfer, but the better
+ * performance is worth it.
+ *
+ * Note: RAM starts at 0x20000000.  Some chips have up to 32KB, but we
+ * must support the devices with only 4KB.
+ */
+
+/* The OpenOCD code. Someday I'll do a speed comparisons.
+ * From openocd, contrib/loaders/flash/stm32.s
+ * i = STM32_FLASH_BASE;      0x08+r3  0x0800,0000
+ * r0 = fl->buf_addr;//source
+ * r1 = target;		// target
+ * r2 = count;		// count (16 bits half words)
+ * r3 = 0;			// flash bank 0 (input)
+ * r15 = fl->loader_addr;  // pc register
+ */
+
+static const uint8_t loader_code[] = {
+	0x08, 0x4c,			/* ldr	r4, STM32_FLASH_BASE */
+	0x1c, 0x44,			/* add	r4, r3 */
+	/* write_half_word: */
+	0x01, 0x23,			/* movs	r3, #0x01 */
+	0x23, 0x61,			/* str	r3, [r4, #STM32_FLASH_CR_OFFSET] */
+	0x30, 0xf8, 0x02, 0x3b,	/* ldrh	r3, [r0], #0x02 */
+	0x21, 0xf8, 0x02, 0x3b,	/* strh	r3, [r1], #0x02 */
+	/* busy: */
+	0xe3, 0x68,			/* ldr	r3, [r4, #STM32_FLASH_SR_OFFSET] */
+	0x13, 0xf0, 0x01, 0x0f,	/* tst	r3, #0x01 */
+	0xfb, 0xd0,			/* beq	busy */
+	0x13, 0xf0, 0x14, 0x0f,	/* tst	r3, #0x14 */
+	0x01, 0xd1,			/* bne	exit */
+	0x01, 0x3a,			/* subs	r2, r2, #0x01 */
+	0xf0, 0xd1,			/* bne	write_half_word */
+	/* exit: */
+	0x00, 0xbe,			/* bkpt	#0x00 */
+	 0x00, 0x20, 0x02, 0x40,	/* STM32_FLASH_BASE: .word 0x40022000 */
+ };
+
+/* A working version of our ARM code.  Here as a back-up since we break it
+ * so frequently. */
+ static const uint16_t db_loader_code_working[] = {
+	 0x480B,			/* ldr	r0, .SRC_ADDR */
+	 0x490C,			/* ldr	r1, .TARGET_ADDR */
+	 0x4A0C,			/* ldr	r2, .COUNT  */
+	 0x4c09,			/* ldr	r4, .STM32_FLASH_BASE */
+	 0x2501,			/* movs	r5, #FLASH_CR_PG_BIT  0x0001 */
+	 0x6125,			/* str	r5, [r4, #STM32_FLASH_CR_OFFSET] */
+	 /* write_hword: */
+	 0xf830, 0x3b02,	/* ldrh	r3, [r0], #0x02 */
+	 0xf821, 0x3b02,	/* strh	r3, [r1], #0x02 */
+	 /* busy: */
+#if 0
+	 0x3201,			/* add	r2, r2, #0x01 */
+#endif
+	 0x68e3,			/* ldr	r3, [r4, #STM32_FLASH_SR_OFFSET] */
+	 0xf013, 0x0f01,	/* tst	r3, #0x01 */
+	 0xd1fb,			/* bne	busy */
+	 0xf013, 0x0f14,	/* tst	r3, #0x14 */
+	 0xd101,			/* bne	exit */
+	 0x3a01,			/* subs	r2, r2, #0x01 */
+	 0xd1f2,			/* bne	write_hword */
+	 /* Normal completion, clear #FLASH_CR_PG_BIT.  Note that r2 is now 0. */
+#if 0
+	 0x6122,			/* str	r2, [r4, #STM32_FLASH_CR_OFFSET] */
+#endif
+	 /* exit: */
+	 0xbe00,			/* bkpt	#0x00 */
+	 0x0000, 0x0000,
+	 0x2000, 0x4002,	/* .STM32_FLASH_BASE: .word 0x40022000 */
+	 0x0040, 0x2000,	/* .SRC_ADDR: .word 0x20000040 */
+	 0x0bd0, 0x0800,	/* .TARGET_ADDR: .word 0x0800xxxx */
+	 0x0006, 0x0000,	/* .COUNT: .word 0x00000100 */
+ };
+
+/* The flash write program.
+ * The STLink apparently cannot directly generate the memory operations
+ * required to write the flash.  So we download and run a small program that
+ * writes the flash for us.
+ *
+ * While inconvenient, this does result in much faster writes.  To improve
+ * the performance even more, we download the program, parameters and data to
+ * write in a single transfer.
+ * The program finishes by turning off the flash programming enable in
+ * FLASH_CR and calling breakpoint#0 -- halting.
+ * The status is reflected in the registers.
+ * A successful completion leaves R2 with a count of zero.
+ * The final FLASH_SR status is returned in R3.
+ * A count of the busy loop iterations in kept in R5 -- a rough estimation
+ * of the write speed.
+ */
+static const uint16_t db_loader_code[] = {
+	 0x480B,			/* ldr	r0, .SRC_ADDR */
+	 0x490C,			/* ldr	r1, .TARGET_ADDR */
+	 0x4A0C,			/* ldr	r2, .COUNT  */
+	 0x4c09,			/* ldr	r4, .STM32_FLASH_BASE */
+	 0x2501,			/* movs	r5, #FLASH_CR_PG_BIT  0x0001, then busy_count */
+	 0x6125,			/* str	r5, [r4, #STM32_FLASH_CR_OFFSET] */
+	 /* copy_hword: */
+	 0xf830, 0x3b02,	/* ldrh	r3, [r0], #0x02 */
+	 0xf821, 0x3b02,	/* strh	r3, [r1], #0x02 */
+	 /* busy: */
+	 0x3501,			/* add	r5, r5, #0x01 ; Increment busy_count */
+	 0x68e3,			/* ldr	r3, [r4, #STM32_FLASH_SR_OFFSET] */
+	 0xf013, 0x0f01,	/* tst	r3, #0x01 ;  check FLASH_SR_BSY */
+	 0xd1fa,			/* bne	busy */
+	 0xf013, 0x0f14,	/* tst	r3, #0x14 ; check for WRPRTERR/PGERR errors */
+	 0xd102,			/* bne	exit */
+	 0x3a01,			/* subs	r2, r2, #0x01 ;  Decrement COUNT*/
+	 0xd1f1,			/* bne	copy_hword */
+	 /* Normal completion, clear #FLASH_CR_PG_BIT.  Note that r2 is now 0. */
+	 0x6122,			/* str	r2, [r4, #STM32_FLASH_CR_OFFSET] */
+	 /* exit: */
+	 0xbe00,			/* bkpt	#0x00 */
+	 /* The following parameters will be overwritten before download. */
+	 0x2000, 0x4002,	/* .STM32_FLASH_BASE: .word 0x40022000 */
+	 0x0040, 0x2000,	/* .SRC_ADDR: .word 0x20000040 */
+	 0x0bd0, 0x0800,	/* .TARGET_ADDR: .word 0x0800xxxx */
+	 0x0006, 0x0000,	/* .COUNT: .word 0x00000100 */
+ };
+
+/* The loader for the STM32F4 flash peripheral.
+ * The status bit positions differ from the F1, and the F4 programs 8, 16,
+ * 32 or 64 bits at a time, set by FLASH_CR PSIZE.  The widest allowed by
+ * the supply voltage is the quickest, as each write takes the same time.
+ * So this is the same loop with a write of .UNIT bytes, which is four
+ * for both x32 and x64: the flash programs a double-word after the second
+ * word is written.  .COUNT is the number of writes.
+ */
+static const uint16_t f4_loader_code[] = {
+	 0x4811,			/* ldr	r0, .SRC_ADDR */
+	 0x4912,			/* ldr	r1, .TARGET_ADDR */
+	 0x4A12,			/* ldr	r2, .COUNT ; program operations */
+	 0x4C0F,			/* ldr	r4, .STM32_FLASH_BASE */
+	 0x4E0D,			/* ldr	r6, .UNIT ; bytes per operation: 1, 2 or 4 */
+	 0x4D0C,			/* ldr	r5, .FLASH_CR ; PG, with PSIZE */
+	 0x6125,			/* str	r5, [r4, #16] ; STM32_FLASH_CR_OFFSET */
+	 /* copy: */
+	 0x2E02,			/* cmp	r6, #2 */
+	 0xD003,			/* beq	copy_hword */
+	 0xD805,			/* bhi	copy_word */
+	 0x7805,			/* ldrb	r5, [r0, #0] */
+	 0x700D,			/* strb	r5, [r1, #0] */
+	 0xE004,			/* b	busy */
+	 /* copy_hword: */
+	 0x8805,			/* ldrh	r5, [r0, #0] */
+	 0x800D,			/* strh	r5, [r1, #0] */
+	 0xE001,			/* b	busy */
+	 /* copy_word: */
+	 0x6805,			/* ldr	r5, [r0, #0] */
+	 0x600D,			/* str	r5, [r1, #0] */
+	 /* busy: */
+	 0x68E3,			/* ldr	r3, [r4, #12] ; STM32_FLASH_SR_OFFSET */
+	 0x03DD,			/* lsls	r5, r3, #15 ; F4_FLASH_SR_BSY into the sign bit */
+	 0xD4FC,			/* bmi	busy */
+	 0x25F0,			/* movs	r5, #0xF0 */
+	 0x422B,			/* tst	r3, r5 ; check for PG*ERR/WRPERR errors */
+	 0xD104,			/* bne	exit */
+	 0x1980,			/* adds	r0, r0, r6 */
+	 0x1989,			/* adds	r1, r1, r6 */
+	 0x3A01,			/* subs	r2, #1 ; Decrement COUNT */
+	 0xD1EA,			/* bne	copy */
+	 0x6122,			/* str	r2, [r4, #16] ; clear PG, r2 is now 0 */
+	 /* exit: */
+	 0xBE00,			/* bkpt	#0x00 */
+	 /* The following parameters will be overwritten before download. */
+	 0x0201, 0x0000,	/* .FLASH_CR: .word 0x00000201 */
+	 0x0004, 0x0000,	/* .UNIT: .word 0x00000004 */
+	 0x3C00, 0x4002,	/* .STM32_FLASH_BASE: .word 0x40023C00 */
+	 0x0058, 0x2000,	/* .SRC_ADDR: .word 0x20000058 */
+	 0x0000, 0x0800,	/* .TARGET_ADDR: .word 0x08000000 */
+	 0x0100, 0x0000,	/* .COUNT: .word 0x00000100 */
+ };
+
+/* The resident flash loader for the F1-type flash controller.
+ * This is downloaded once, and programs blocks from a ring of data slots
+ * in SRAM, so that the next block is transferred while the current one
+ * is being programmed.  It is Thumb-1 only, so it runs on any core.
+ * The mailbox follows the code:
+ *  +0 the staging buffer for expanded blocks
+ *  +4 head: the count of blocks queued, written by the host
+ *  +8 tail: the count of blocks programmed, written by the loader
+ *  +12 status: the FLASH_SR error bits, if programming failed
+ *  +16 the slot size in bytes, +20 the slot index mask
+ *  +24 the slots: flash address, half-word count, flash registers,
+ *   compressed length, data
+ * A block with a compressed length is a LZ4 block, which is first
+ * expanded into the staging buffer, see stl_lz4_compress().
+ * On an error the loader stores the status and halts at the breakpoint.
+ */
+static const uint16_t resident_loader_code[] = {
+	 0x4F2D,			/* ldr	r7, .MAILBOX */
+	 /* wait: */
+	 0x6879,			/* ldr	r1, [r7, #4] ; head */
+	 0x68BA,			/* ldr	r2, [r7, #8] ; tail */
+	 0x4291,			/* cmp	r1, r2 */
+	 0xD0FB,			/* beq	wait */
+	 0x697B,			/* ldr	r3, [r7, #20] ; slot mask */
+	 0x4013,			/* ands	r3, r2 */
+	 0x693D,			/* ldr	r5, [r7, #16] ; slot size */
+	 0x436B,			/* muls	r3, r5 */
+	 0x3318,			/* adds	r3, #24 */
+	 0x19DB,			/* adds	r3, r3, r7 ; r3 = slot */
+	 0x6819,			/* ldr	r1, [r3, #0] ; flash address */
+	 0x685A,			/* ldr	r2, [r3, #4] ; half-word count */
+	 0x689C,			/* ldr	r4, [r3, #8] ; flash registers */
+	 0x68DE,			/* ldr	r6, [r3, #12] ; compressed length, or 0 */
+	 0x3310,			/* adds	r3, #16 */
+	 0x2E00,			/* cmp	r6, #0 */
+	 0xD031,			/* beq	program */
+	 0x4688,			/* mov	r8, r1 */
+	 0x4691,			/* mov	r9, r2 */
+	 0x18F6,			/* adds	r6, r6, r3 ; r6 = input end */
+	 0x6838,			/* ldr	r0, [r7, #0] ; r0 = output, the staging buffer */
+	 /* sequence: */
+	 0x781D,			/* ldrb	r5, [r3, #0] ; token */
+	 0x3301,			/* adds	r3, #1 */
+	 0x0929,			/* lsrs	r1, r5, #4 ; literal length */
+	 0x290F,			/* cmp	r1, #15 */
+	 0xD104,			/* bne	literals */
+	 /* lit_ext: */
+	 0x781A,			/* ldrb	r2, [r3, #0] */
+	 0x3301,			/* adds	r3, #1 */
+	 0x1889,			/* adds	r1, r1, r2 */
+	 0x2AFF,			/* cmp	r2, #255 */
+	 0xD0FA,			/* beq	lit_ext */
+	 /* literals: */
+	 0x2900,			/* cmp	r1, #0 */
+	 0xD005,			/* beq	lit_done */
+	 /* lit_copy: */
+	 0x781A,			/* ldrb	r2, [r3, #0] */
+	 0x3301,			/* adds	r3, #1 */
+	 0x7002,			/* strb	r2, [r0, #0] */
+	 0x3001,			/* adds	r0, #1 */
+	 0x3901,			/* subs	r1, #1 */
+	 0xD1F9,			/* bne	lit_copy */
+	 /* lit_done: */
+	 0x42B3,			/* cmp	r3, r6 */
+	 0xD216,			/* bcs	expanded ; the last sequence has no match */
+	 0x7819,			/* ldrb	r1, [r3, #0] ; match offset */
+	 0x785A,			/* ldrb	r2, [r3, #1] */
+	 0x0212,			/* lsls	r2, r2, #8 */
+	 0x4311,			/* orrs	r1, r2 */
+	 0x3302,			/* adds	r3, #2 */
+	 0x1A41,			/* subs	r1, r0, r1 ; r1 = match source */
+	 0x220F,			/* movs	r2, #15 */
+	 0x402A,			/* ands	r2, r5 ; match length - 4 */
+	 0x2A0F,			/* cmp	r2, #15 */
+	 0xD104,			/* bne	match */
+	 /* match_ext: */
+	 0x781D,			/* ldrb	r5, [r3, #0] */
+	 0x3301,			/* adds	r3, #1 */
+	 0x1952,			/* adds	r2, r2, r5 */
+	 0x2DFF,			/* cmp	r5, #255 */
+	 0xD0FA,			/* beq	match_ext */
+	 /* match: */
+	 0x3204,			/* adds	r2, #4 */
+	 /* match_copy: */
+	 0x780D,			/* ldrb	r5, [r1, #0] */
+	 0x3101,			/* adds	r1, #1 */
+	 0x7005,			/* strb	r5, [r0, #0] */
+	 0x3001,			/* adds	r0, #1 */
+	 0x3A01,			/* subs	r2, #1 */
+	 0xD1F9,			/* bne	match_copy */
+	 0xE7D4,			/* b	sequence */
+	 /* expanded: */
+	 0x4641,			/* mov	r1, r8 */
+	 0x464A,			/* mov	r2, r9 */
+	 0x683B,			/* ldr	r3, [r7, #0] ; program from the staging buffer */
+	 /* program: */
+	 0x2501,			/* movs	r5, #1 ; FLASH_CR_PG_BIT */
+	 0x6125,			/* str	r5, [r4, #16] ; STM32_FLASH_CR_OFFSET */
+	 /* copy_hword: */
+	 0x881D,			/* ldrh	r5, [r3, #0] */
+	 0x800D,			/* strh	r5, [r1, #0] */
+	 0x3302,			/* adds	r3, #2 */
+	 0x3102,			/* adds	r1, #2 */
+	 /* busy: */
+	 0x68E5,			/* ldr	r5, [r4, #12] ; STM32_FLASH_SR_OFFSET */
+	 0x086E,			/* lsrs	r6, r5, #1 ; FLASH_SR_BSY into carry */
+	 0xD2FC,			/* bcs	busy */
+	 0x2614,			/* movs	r6, #0x14 */
+	 0x4235,			/* tst	r5, r6 ; check for WRPRTERR/PGERR errors */
+	 0xD106,			/* bne	error */
+	 0x3A01,			/* subs	r2, #1 */
+	 0xD1F3,			/* bne	copy_hword */
+	 0x6122,			/* str	r2, [r4, #16] */
+	 0x68BA,			/* ldr	r2, [r7, #8] */
+	 0x3201,			/* adds	r2, #1 */
+	 0x60BA,			/* str	r2, [r7, #8] ; tail++ */
+	 0xE7A9,			/* b	wait */
+	 /* error: */
+	 0x60FD,			/* str	r5, [r7, #12] ; status */
+	 0x2500,			/* movs	r5, #0 */
+	 0x6125,			/* str	r5, [r4, #16] */
+	 0xBE00,			/* bkpt	#0x00 */
+	 0x0000,
+	 /* This parameter will be overwritten before download. */
+	 0x00BC, 0x2000,	/* .MAILBOX: .word 0x200000BC */
+ };
+
+/* The resident loader for the 32L1, with the same mailbox and slots.
+ * Each slot is programmed a half-page at a time, with FPRG and PROG set
+ * in PECR: 32 word writes, then one 3.3 msec program cycle.  The slot
+ * count is of half-pages, and the compressed length is ignored.
+ */
+static const uint16_t l1_loader_code[] = {
+	 0x4F15,			/* ldr	r7, .MAILBOX */
+	 /* wait: */
+	 0x6879,			/* ldr	r1, [r7, #4] ; head */
+	 0x68BA,			/* ldr	r2, [r7, #8] ; tail */
+	 0x4291,			/* cmp	r1, r2 */
+	 0xD0FB,			/* beq	wait */
+	 0x697B,			/* ldr	r3, [r7, #20] ; slot mask */
+	 0x4013,			/* ands	r3, r2 */
+	 0x693D,			/* ldr	r5, [r7, #16] ; slot size */
+	 0x436B,			/* muls	r3, r5 */
+	 0x3318,			/* adds	r3, #24 */
+	 0x19DB,			/* adds	r3, r3, r7 ; r3 = slot */
+	 0x6819,			/* ldr	r1, [r3, #0] ; flash address, half-page aligned */
+	 0x685A,			/* ldr	r2, [r3, #4] ; half-page count */
+	 0x689C,			/* ldr	r4, [r3, #8] ; flash registers */
+	 0x3310,			/* adds	r3, #16 */
+	 0x2581,			/* movs	r5, #0x81 */
+	 0x00ED,			/* lsls	r5, r5, #3 ; FPRG | PROG */
+	 0x6065,			/* str	r5, [r4, #4] ; L15_FLASH_PECR */
+	 /* half_page: */
+	 0x2620,			/* movs	r6, #32 */
+	 /* copy_word: */
+	 0x681D,			/* ldr	r5, [r3, #0] */
+	 0x600D,			/* str	r5, [r1, #0] */
+	 0x3304,			/* adds	r3, #4 */
+	 0x3104,			/* adds	r1, #4 */
+	 0x3E01,			/* subs	r6, #1 */
+	 0xD1F9,			/* bne	copy_word */
+	 /* busy: */
+	 0x69A5,			/* ldr	r5, [r4, #24] ; L15_FLASH_SR */
+	 0x086E,			/* lsrs	r6, r5, #1 ; L15_FLASH_SR_BSY into carry */
+	 0xD2FC,			/* bcs	busy */
+	 0x2607,			/* movs	r6, #7 */
+	 0x0236,			/* lsls	r6, r6, #8 ; WRPERR, PGAERR, SIZERR */
+	 0x4235,			/* tst	r5, r6 */
+	 0xD106,			/* bne	error */
+	 0x3A01,			/* subs	r2, #1 */
+	 0xD1EF,			/* bne	half_page */
+	 0x6062,			/* str	r2, [r4, #4] ; clear FPRG and PROG */
+	 0x68BA,			/* ldr	r2, [r7, #8] */
+	 0x3201,			/* adds	r2, #1 */
+	 0x60BA,			/* str	r2, [r7, #8] ; tail++ */
+	 0xE7D9,			/* b	wait */
+	 /* error: */
+	 0x60FD,			/* str	r5, [r7, #12] ; status */
+	 0x2500,			/* movs	r5, #0 */
+	 0x6065,			/* str	r5, [r4, #4] */
+	 0xBE00,			/* bkpt	#0x00 */
+	 0x0000,
+	 /* This parameter will be overwritten before download. */
+	 0x0070, 0x2000,	/* .MAILBOX: .word 0x20000070 */
+ };
+
+/* The resident loader for both banks of the XL-density F1 at once.  The
+ * host queues slots in pairs, the first for bank 1 and the second for
+ * bank 2, each with its own flash registers; a slot with a zero count
+ * is idle.  One half-word is written to each active bank before either
+ * is polled, so the two controllers program in parallel.  The clen word
+ * of each slot becomes its data pointer.
+ */
+static const uint16_t dual_loader_code[] = {
+	 0x4F25,			/* ldr	r7, .MAILBOX */
+	 /* wait: */
+	 0x6879,			/* ldr	r1, [r7, #4] ; head */
+	 0x68BA,			/* ldr	r2, [r7, #8] ; tail */
+	 0x1A89,			/* subs	r1, r1, r2 */
+	 0x2902,			/* cmp	r1, #2 */
+	 0xD3FA,			/* bcc	wait ; slots are queued in pairs */
+	 0x697B,			/* ldr	r3, [r7, #20] ; slot mask */
+	 0x4013,			/* ands	r3, r2 */
+	 0x693D,			/* ldr	r5, [r7, #16] ; slot size */
+	 0x46A9,			/* mov	r9, r5 */
+	 0x436B,			/* muls	r3, r5 */
+	 0x3318,			/* adds	r3, #24 */
+	 0x19DB,			/* adds	r3, r3, r7 ; r3 = the bank 1 slot, then bank 2 */
+	 0x4698,			/* mov	r8, r3 */
+	 0x2602,			/* movs	r6, #2 */
+	 /* source: */
+	 0x4618,			/* mov	r0, r3 */
+	 0x3010,			/* adds	r0, #16 */
+	 0x60D8,			/* str	r0, [r3, #12] ; the data pointer, in the clen word */
+	 0x464D,			/* mov	r5, r9 */
+	 0x195B,			/* adds	r3, r3, r5 */
+	 0x3E01,			/* subs	r6, #1 */
+	 0xD1F8,			/* bne	source */
+	 /* program: */
+	 0x4643,			/* mov	r3, r8 */
+	 0x2602,			/* movs	r6, #2 */
+	 /* write: */
+	 0x6859,			/* ldr	r1, [r3, #4] ; half-words left */
+	 0x2900,			/* cmp	r1, #0 */
+	 0xD00A,			/* beq	next_write */
+	 0x689C,			/* ldr	r4, [r3, #8] ; flash registers */
+	 0x2501,			/* movs	r5, #1 ; FLASH_CR_PG_BIT */
+	 0x6125,			/* str	r5, [r4, #16] ; STM32_FLASH_CR_OFFSET */
+	 0x68DA,			/* ldr	r2, [r3, #12] */
+	 0x6818,			/* ldr	r0, [r3, #0] */
+	 0x8815,			/* ldrh	r5, [r2, #0] */
+	 0x8005,			/* strh	r5, [r0, #0] */
+	 0x3202,			/* adds	r2, #2 */
+	 0x3002,			/* adds	r0, #2 */
+	 0x60DA,			/* str	r2, [r3, #12] */
+	 0x6018,			/* str	r0, [r3, #0] */
+	 /* next_write: */
+	 0x464D,			/* mov	r5, r9 */
+	 0x195B,			/* adds	r3, r3, r5 */
+	 0x3E01,			/* subs	r6, #1 */
+	 0xD1ED,			/* bne	write */
+	 0x4643,			/* mov	r3, r8 */
+	 0x2602,			/* movs	r6, #2 */
+	 0x2200,			/* movs	r2, #0 ; half-words left in both slots */
+	 /* check: */
+	 0x6859,			/* ldr	r1, [r3, #4] */
+	 0x2900,			/* cmp	r1, #0 */
+	 0xD00C,			/* beq	next_check */
+	 0x689C,			/* ldr	r4, [r3, #8] */
+	 /* busy: */
+	 0x68E5,			/* ldr	r5, [r4, #12] ; STM32_FLASH_SR_OFFSET */
+	 0x0868,			/* lsrs	r0, r5, #1 ; FLASH_SR_BSY into carry */
+	 0xD2FC,			/* bcs	busy */
+	 0x2014,			/* movs	r0, #0x14 */
+	 0x4205,			/* tst	r5, r0 ; check for WRPRTERR/PGERR errors */
+	 0xD10F,			/* bne	error */
+	 0x3901,			/* subs	r1, #1 */
+	 0x6059,			/* str	r1, [r3, #4] */
+	 0x1852,			/* adds	r2, r2, r1 */
+	 0x2900,			/* cmp	r1, #0 */
+	 0xD100,			/* bne	next_check */
+	 0x6121,			/* str	r1, [r4, #16] ; clear PG at the end of the slot */
+	 /* next_check: */
+	 0x464D,			/* mov	r5, r9 */
+	 0x195B,			/* adds	r3, r3, r5 */
+	 0x3E01,			/* subs	r6, #1 */
+	 0xD1EB,			/* bne	check */
+	 0x2A00,			/* cmp	r2, #0 */
+	 0xD1D2,			/* bne	program */
+	 0x68BA,			/* ldr	r2, [r7, #8] */
+	 0x3202,			/* adds	r2, #2 */
+	 0x60BA,			/* str	r2, [r7, #8] ; tail += 2 */
+	 0xE7B9,			/* b	wait */
+	 /* error: */
+	 0x60FD,			/* str	r5, [r7, #12] ; status */
+	 0x2500,			/* movs	r5, #0 */
+	 0x6125,			/* str	r5, [r4, #16] */
+	 0xBE00,			/* bkpt	#0x00 */
+	 0x0000,
+	 /* This parameter will be overwritten before download. */
+	 0x009C, 0x2000,	/* .MAILBOX: .word 0x2000009C */
+ };
+
+#define MBOX_HEAD 4
+#define MBOX_TAIL 8
+#define MBOX_STATUS 12
+#define MBOX_SLOTS 24
+#define SLOT_HDR 16
+#define RING_SLOTS 2
+
+/* The flash algorithms: resident loaders on the mailbox ring above.
+ * The built-in loaders serve a flash controller family.  Others may be
+ * loaded from files with --algo, and serve the device with their
+ * DBGMCU_IDCODE device ID, ahead of the built-in one.
+ * The code is position independent, and ends with the .MAILBOX word,
+ * which is set before download.  Each entry point is a byte offset into
+ * the code, and is run with the core halted by the host:
+ *  init, if present, once before programming, e.g. to set wait states,
+ *  erase, if present, to erase the page at the address in slot 0, using
+ *   the flash registers in slot 0,
+ *  program, the ring loop.
+ * Init and erase store any error in the mailbox status and halt at a
+ * breakpoint.  The mass erase, unlocking and the page CRC verify are done
+ * by the host as for the built-in loaders.
+ */
+#define ALGO_NONE 0xffffffff
+enum algo_flags {
+	AlgoLZ4=1,					/* The program entry expands LZ4 blocks. */
+};
+struct stl_flash_algo {
+	const char *name;
+	int cap_flags;				/* The built-in family, as stm_chip_params. */
+	uint32_t idcode;			/* The loaded algorithm's device ID. */
+	int flags;
+	uint32_t unit;				/* Bytes per slot count. */
+	uint32_t init, erase, program;	/* Entry point offsets, or ALGO_NONE. */
+	uint32_t blk_max;			/* The largest block it takes, or 0. */
+	uint32_t work;				/* SRAM it uses between code and mailbox. */
+	const void *code;
+	int code_len;
+	struct stl_flash_algo *next;
+};
+
+static const struct stl_flash_algo flash_algos[] = {
+	{ "F1 resident", 0, 0, AlgoLZ4, 2, ALGO_NONE, ALGO_NONE, 0, 0, 0,
+	  resident_loader_code, sizeof(resident_loader_code), NULL},
+	{ "L1 half-page", ChipCapL1Flash, 0, 0, L15_HALF_PAGE,
+	  ALGO_NONE, ALGO_NONE, 0, 0, 0,
+	  l1_loader_code, sizeof(l1_loader_code), NULL},
+	{ NULL, },
+};
+/* Used in place of the F1 resident loader for writes that span both
+ * banks of an XL-density part. */
+static const struct stl_flash_algo dual_algo =
+	{ "F1 dual-bank", 0, 0, 0, 2, ALGO_NONE, ALGO_NONE, 0, 0, 0,
+	  dual_loader_code, sizeof(dual_loader_code), NULL};
+static struct stl_flash_algo *loaded_algos;
+
+/* The header of a flash algorithm file, as little-endian words, followed
+ * by the code.  See stl_flash_algo for the fields. */
+#define ALGO_MAGIC 0x414C5453	/* "STLA" */
+enum algo_hdr_words {
+	AlgoMagic, AlgoIdcode, AlgoFlags, AlgoUnit, AlgoInit, AlgoErase,
+	AlgoProgram, AlgoBlkMax, AlgoWork, AlgoCodeLen, AlgoHdrWords,
+};
+
+/* Add the flash algorithm in the file at PATH to the registry.
+ * It is used for its device ahead of any loaded before it. */
+int stl_algo_load(const char *path)
+{
+	uint8_t hdr[AlgoHdrWords * 4];
+	uint32_t w[AlgoHdrWords];
+	struct stl_flash_algo *algo;
+	const char *name;
+	uint8_t *code;
+	FILE *fp;
+	int i;
+
+	if ((fp = fopen(path, "rb")) == NULL) {
+		fprintf(stderr, "Unable to open flash algorithm %s: %s.\n", path,
+				strerror(errno));
+		return -1;
+	}
+	if (fread(hdr, sizeof hdr, 1, fp) != 1)
+		memset(hdr, 0, sizeof hdr);
+	for (i = 0; i < AlgoHdrWords; i++)
+		w[i] = read_uint32(hdr, i * 4);
+	if (w[AlgoMagic] != ALGO_MAGIC ||
+		w[AlgoCodeLen] < 8 || w[AlgoCodeLen] > 2048 ||
+		(w[AlgoCodeLen] & 3) || w[AlgoProgram] >= w[AlgoCodeLen] ||
+		(w[AlgoInit] != ALGO_NONE && w[AlgoInit] >= w[AlgoCodeLen]) ||
+		(w[AlgoErase] != ALGO_NONE && w[AlgoErase] >= w[AlgoCodeLen]) ||
+		w[AlgoUnit] == 0 || w[AlgoUnit] > 1024 ||
+		(w[AlgoUnit] & (w[AlgoUnit] - 1)) || (w[AlgoWork] & 3) ||
+		w[AlgoBlkMax] % (w[AlgoUnit] < 4 ? 4 : w[AlgoUnit]) ||
+		w[AlgoWork] > 2048) {
+		fprintf(stderr, "%s is not a flash algorithm.\n", path);
+		fclose(fp);
+		return -1;
+	}
+	name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+	algo = calloc(1, sizeof(*algo) + w[AlgoCodeLen] + strlen(name) + 1);
+	code = algo ? (uint8_t *)(algo + 1) : NULL;
+	if (algo == NULL || fread(code, w[AlgoCodeLen], 1, fp) != 1) {
+		fprintf(stderr, "Unable to read flash algorithm %s.\n", path);
+		free(algo);
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+	algo->name = strcpy((char *)code + w[AlgoCodeLen], name);
+	algo->idcode = w[AlgoIdcode] & 0xfff;
+	algo->flags = w[AlgoFlags];
+	algo->unit = w[AlgoUnit];
+	algo->init = w[AlgoInit];
+	algo->erase = w[AlgoErase];
+	algo->program = w[AlgoProgram];
+	algo->blk_max = w[AlgoBlkMax];
+	algo->work = w[AlgoWork];
+	algo->code = code;
+	algo->code_len = w[AlgoCodeLen];
+	algo->next = loaded_algos;
+	loaded_algos = algo;
+	return 0;
+}
+
+/*
+ * Write the flash at FLASH_ADDR with data BUF of SIZE bytes.
+ * This routine downloads the flash-write program, parameters
+ * and data to be written, then runs the program.
+ * It assumes that the flash address, size and any rounding has been
+ * checked by the caller.
+ * The flash needs to be unlocked by the caller, but the downloaded code
+ * writes FLASH_CR_PG_BIT to enable and disable user flash programing.
+ */
+static int stl_chip(struct stlink *sl);
+
+/* The flash controller registers for the flash at FLASH_ADDR.
+ * Connectivity and XL devices use an offset of +0x40 e.g. 0x40022040
+ * for a second bank of flash. */
+static uint32_t stl_flash_regs(struct stlink *sl, stm32_addr_t flash_addr)
+{
+	if (stm_devids[stl_chip(sl)].cap_flags & ChipCapF4Flash)
+		return F4_FLASH_REGS;
+	if (stm_devids[stl_chip(sl)].cap_flags & ChipCapL1Flash)
+		return L15_FLASH_REGS;
+	if (stm_devids[sl->chip_index].flash_size > 512*1024  &&
+		flash_addr >= FLASH_BANK2_BASE)
+		return FLASH_BANK2_REGS;
+	return FLASH_REGS_ADDR;
+}
+
+/* Whether SIZE bytes at FLASH_ADDR span both banks of an XL-density part,
+ * each with its own controller. */
+static int stl_flash_dual(struct stlink *sl, stm32_addr_t flash_addr,
+						  uint32_t size)
+{
+	return size > 0 && stl_flash_regs(sl, flash_addr) !=
+		stl_flash_regs(sl, flash_addr + size - 1);
+}
+
+/* The flash algorithm for the target: one loaded for its device, else the
+ * built-in loader for its flash controller, or NULL for the F4, which is
+ * programmed block by block. */
+static const struct stl_flash_algo *stl_flash_algo(struct stlink *sl)
+{
+	int caps = stm_devids[stl_chip(sl)].cap_flags;
+	const struct stl_flash_algo *algo;
+
+	for (algo = loaded_algos; algo; algo = algo->next)
+		if (algo->idcode == (sl->cpu_idcode & 0xfff))
+			return algo;
+	for (algo = flash_algos; algo->name; algo++)
+		if (algo->cap_flags == caps)
+			return algo;
+	return NULL;
+}
+
+/* Queue setting the PC aka r15 to ADDR and running the core. */
+static void stl_run_at(struct stlink *sl, uint32_t addr)
+{
+	struct stl_xfer *xf = stl_xfer_get(sl);
+
+	if (xf == NULL)
+		return;
+	xf->cmd_buf[0] = STLinkDebugCommand;
+	xf->cmd_buf[1] = STLinkDebugWriteReg;
+	xf->cmd_buf[2] = 15;
+	write_uint32(xf->cmd_buf + 3, addr);
+	xf->cmd_len = 16;
+	xf->data_len = 2;
+	stl_xfer_submit(xf);
+	if ((xf = stl_xfer_get(sl)) == NULL)
+		return;
+	xf->cmd_buf[0] = STLinkDebugCommand;
+	xf->cmd_buf[1] = STLinkDebugRunCore;
+	xf->cmd_len = 16;
+	xf->data_len = 2;
+	stl_xfer_submit(xf);
+}
+
+/* The target supply voltage in millivolts, as measured by the STLink, or
+ * 0 if the probe cannot report it.  The two readings are of the internal
+ * 1.2V reference and of half the target VDD.  The STLink v1 and early v2
+ * firmware do not have the command. */
+static int stl_target_voltage(struct stlink *sl)
+{
+	uint32_t ref, vdd;
+
+	if (sl->ver.STLink_ver < 2 || sl->ver.JTAG_ver < 13)
+		return 0;
+	if (st_gcmd(sl, STLinkGetTargetVoltage, 0, 8))
+		return 0;
+	ref = read_uint32(sl->data_buf, 0);
+	vdd = read_uint32(sl->data_buf, 4);
+	return ref ? 2 * 1200 * vdd / ref : 0;
+}
+
+/* The bytes written by each flash program operation: a half-word on the
+ * F1-type controller, and a half-page on the L1.  The F4 parallelism is limited by the supply
+ * voltage, RM0090 sec 3.6.2: x32 from 2.7V, x16 from 2.1V, else x8.  x64
+ * also needs an external VPP, which the STLink cannot see, so that is
+ * only used with --vpp.  Without a voltage reading we assume the usual
+ * 3.3V board.
+ */
+static int stl_flash_unit(struct stlink *sl)
+{
+	int mv;
+
+	if (stm_devids[stl_chip(sl)].cap_flags & ChipCapL1Flash)
+		return L15_HALF_PAGE;
+	if ( ! (stm_devids[stl_chip(sl)].cap_flags & ChipCapF4Flash))
+		return 2;
+	if (sl->f4_psize)
+		return sl->f4_psize;
+	mv = stl_target_voltage(sl);
+	if (sl->vpp)
+		sl->f4_psize = 8;
+	else if (mv == 0 || mv >= 2700)
+		sl->f4_psize = 4;
+	else
+		sl->f4_psize = mv >= 2100 ? 2 : 1;
+	if (sl->verbose)
+		fprintf(stderr, " Target VDD %d.%2.2dV, programming the flash "
+				"x%d.\n", mv / 1000, (mv % 1000) / 10, sl->f4_psize * 8);
+	return sl->f4_psize;
+}
+
+/* The value of erased flash: ones, except on the L1. */
+static uint8_t stl_flash_erased(struct stlink *sl)
+{
+	return stm_devids[stl_chip(sl)].cap_flags & ChipCapL1Flash ? 0 : 0xff;
+}
+
+static int stl_loader(struct stlink *sl, stm32_addr_t flash_addr,
+					  const void *buf, int size)
+{
+	int offset = 0;
+	uint32_t prog_base = stm_devids[stl_chip(sl)].sram_base;
+	uint32_t *params;
+	uint32_t flash_ctrl_base = stl_flash_regs(sl, flash_addr);
+	int unit = stl_flash_unit(sl);
+	int wr = unit == 8 ? 4 : unit;	/* x64 is two word writes. */
+	int len = (size + unit - 1) & ~(unit - 1);
+	struct stl_xfer *xf = stl_xfer_get(sl);
+
+	if (xf == NULL)
+		return -1;
+	if (stm_devids[stl_chip(sl)].cap_flags & ChipCapF4Flash) {
+		offset = sizeof(f4_loader_code);
+		memcpy(xf->xbuf, f4_loader_code, offset);
+	} else {
+		offset = sizeof(db_loader_code);
+		memcpy(xf->xbuf, db_loader_code, offset);
+	}
+	params = (uint32_t *)(xf->xbuf+offset);
+
+	/* Write params[-4] to change the FLASH_REGS_ADDR base. */
+	params[-4] = flash_ctrl_base;
+	params[-3] = prog_base + offset;
+	params[-2] = flash_addr;
+	params[-1] = len / wr;
+	if (stm_devids[stl_chip(sl)].cap_flags & ChipCapF4Flash) {
+		params[-6] = F4_FLASH_CR_PG | F4_FLASH_CR_PSIZE(unit);
+		params[-5] = wr;
+	}
+	/* Pad a partial write with the erased value. */
+	memcpy(params, buf, size);
+	memset((uint8_t *)params + size, 0xff, len - size);
+
+	/* Transfer both the loader and data at once.
+	 * The three steps are queued back-to-back without waiting.  The
+	 * caller's status poll completes only after all three have. */
+	stl_xfer_mem_cmd(xf, STLinkDebugWriteMem32bit, prog_base,
+					 (offset + len + 3) & ~3);
+	stl_xfer_submit(xf);
+	stl_run_at(sl, prog_base);
+
+	return 0;
+}
+
+#define FLASH_WR_BLK_SIZE 2048
+#define FLASH_WR_BLK_MAX (Q_BUF_LEN - 1024)
+
+/* The flash block size: the default, or what fits in the calibrated
+ * write transfer size alongside the loader, in whole KB.  The loader and
+ * block must also fit in the target SRAM. */
+static int stl_flash_blk_size(struct stlink *sl)
+{
+	const struct stm_chip_params *chip = &stm_devids[stl_chip(sl)];
+	int loader_len = chip->cap_flags & ChipCapF4Flash ?
+		sizeof(f4_loader_code) : sizeof(db_loader_code);
+	int blk;
+
+	if (sl->write_blk == 0)
+		return FLASH_WR_BLK_SIZE;
+	blk = (sl->write_blk - loader_len) & ~1023;
+	if (blk > (int)chip->sram_size - loader_len)
+		blk = ((int)chip->sram_size - loader_len) & ~1023;
+	if (blk > FLASH_WR_BLK_MAX)
+		blk = FLASH_WR_BLK_MAX;
+	return blk < 1024 ? 1024 : blk;
+}
+
+/* Typical flash timing from the datasheets, per unit of each operation:
+ * a page erase, a mass erase, and a half-word program on the F1-type
+ * controller; a KB of sector or mass erase and a program operation of
+ * any width on the F4; a page erase, the erase of each page in place of
+ * a mass erase, and a half-page program on the L1.  The CRC of a KB of
+ * flash runs at the reset clock speed, which is 2MHz on the L1.
+ * These are replaced by measurements as operations complete. */
+static const uint32_t flash_timing_ns[3][AwaitOps] = {
+	{ 20000000, 20000000, 52500, 250000 },
+	{ 16000000, 16000000, 16000, 125000 },
+	{ 3280000, 3280000, 3280000, 1000000 },
+};
+
+/* The expected duration of one unit of OP. */
+static uint64_t stl_await_model(struct stlink *sl, enum stl_await_op op)
+{
+	int caps = stm_devids[stl_chip(sl)].cap_flags;
+
+	if (sl->await_ns[op])
+		return sl->await_ns[op];
+	return flash_timing_ns[caps & ChipCapF4Flash ? 1 :
+						   caps & ChipCapL1Flash ? 2 : 0][op];
+}
+
+/* Wait for a flash operation of UNITS, which started at START, to finish.
+ * Polling flat out costs a USB round-trip each time, so first sleep for
+ * most of the expected duration, then poll at a doubling interval.
+ * DONE returns 1 when the operation is complete, 0 while it is busy, or
+ * -1 on a transfer error.  The measured duration refines the model.
+ * Returns 0 when complete, or -1 if DONE failed or the operation took
+ * far longer than expected.
+ */
+static int stl_await(struct stlink *sl, enum stl_await_op op, unsigned units,
+					 uint64_t start, int (*done)(struct stlink *sl, void *arg),
+					 void *arg)
+{
+	uint64_t expect = stl_await_model(sl, op) * (units ? units : 1);
+	uint64_t deadline = start + 4*expect + AWAIT_SLACK_NS;
+	uint64_t interval = expect / 16, now, elapsed;
+	unsigned recoveries = sl->recoveries, before;
+	int polls = 0, lost = 0, status;
+
+	if (interval < AWAIT_MIN_POLL_NS)
+		interval = AWAIT_MIN_POLL_NS;
+	now = stl_now(sl);
+	if (start + expect - expect/8 > now)
+		stl_sleep(sl, start + expect - expect/8 - now);
+	for (;;) {
+		polls++;
+		before = sl->recoveries;
+		if ((status = done(sl, arg)) != 0)
+			break;
+		/* A lost poll response says nothing, so poll again, within
+		 * reason, rather than give up on it. */
+		if (stl_now(sl) > deadline &&
+			(sl->recoveries == before || lost++ >= STL_RETRY_LIMIT)) {
+			status = -1;
+			break;
+		}
+		stl_sleep(sl, interval);
+		if (interval < expect / 8)
+			interval *= 2;
+	}
+	elapsed = stl_now(sl) - start;
+	/* A lost poll response adds a timeout, so only learn from clean runs. */
+	if (status > 0 && units && sl->recoveries == recoveries)
+		sl->await_ns[op] = (3*stl_await_model(sl, op) + elapsed/units) / 4;
+	if (sl->stats) {
+		sl->stats->awaits[op].count++;
+		sl->stats->awaits[op].polls += polls;
+		sl->stats->awaits[op].ns += elapsed;
+		sl->stats->awaits[op].expect_ns += expect;
+		if (elapsed > sl->stats->awaits[op].max_ns)
+			sl->stats->awaits[op].max_ns = elapsed;
+	}
+	if (sl->verbose > 1)
+		fprintf(stderr, " Flash %s %s in %llu usec, expected %llu usec, "
+				"%d polls.\n", stl_await_names[op],
+				status > 0 ? "completed" : "failed",
+				(unsigned long long)(elapsed / 1000),
+				(unsigned long long)(expect / 1000), polls);
+	return status > 0 ? 0 : -1;
+}
+
+/* Completion checks for stl_await(). */
+static int stl_await_halted(struct stlink *sl, void *arg)
+{
+	int status = stl_get_status(sl);
+
+	if (sl->cmd_err)
+		return -1;
+	return status == STLINK_CORE_HALTED;
+}
+
+/* Wait for the busy bit BSY to clear in the flash status register SR. */
+struct stl_flash_poll {
+	uint32_t sr, bsy;
+	uint32_t status;
+};
+
+static int stl_await_flash_idle(struct stlink *sl, void *arg)
+{
+	struct stl_flash_poll *fp = arg;
+
+	fp->status = sl_rd32(sl, fp->sr);
+	if (sl->cmd_err && ! sl->usb_gone) {
+		/* A lost poll response, not the end of the operation. */
+		stl_xfer_recover(sl);
+		stl_stats_retry(sl, STLinkDebugReadMem32bit);
+		return 0;
+	}
+	return sl->usb_gone ? -1 : (fp->status & fp->bsy) == 0;
+}
+
+/* Read back a block after an interrupted write, and advance ADDR, BUF and
+ * SIZE past the program units that were already written.
+ * Returns 1 if the whole block is written, 0 if the rest remains to be
+ * programmed, or -1 if a partly written unit makes that impossible.
+ */
+static int stl_flash_skip_done(struct stlink *sl, stm32_addr_t *addr,
+							   const uint8_t **buf, int *size)
+{
+	uint8_t check[FLASH_WR_BLK_MAX + 8];
+	int unit = stl_flash_unit(sl);
+	int len = (*size + unit - 1) & ~(unit - 1);
+	int i, j;
+
+	if (stl_read(sl, *addr, check, len))
+		return 0;					/* Rewrite the whole block. */
+	for (i = 0; i < *size; i += unit)
+		if (memcmp(check + i, *buf + i, *size - i < unit ? *size - i : unit))
+			break;
+	if (i >= *size)
+		return 1;
+	for (j = i; j < i + unit; j++)
+		if (check[j] != stl_flash_erased(sl)) {
+			fprintf(stderr, "Flash write at %8.8x was interrupted, and the "
+					"partly written unit at %8.8x cannot be retried.\n",
+					*addr, *addr + i);
+			return -1;
+		}
+	if (sl->verbose && i)
+		fprintf(stderr, " Flash write at %8.8x was interrupted, resuming "
+				"at %8.8x.\n", *addr, *addr + i);
+	*addr += i;
+	*buf += i;
+	*size -= i;
+	return 0;
+}
+
+/* Program one block with the loader, waiting for it to finish.
+ * If a transfer fails part way, the core is halted and the block is read
+ * back.  Programming resumes from the first half-word that does not match,
+ * as long as it is still erased.  RESUME starts with that read-back, for a
+ * block that may be partly written already.
+ * Returns 0 on success, 1 if the loader did not finish, or -1 if the
+ * block could not be written.
+ */
+static int stl_flash_block(struct stlink *sl, stm32_addr_t addr,
+						   const uint8_t *buf, int size, int resume)
+{
+	int tries = 0;
+
+	for (;;) {
+		int status;
+
+		if (resume) {
+			status = stl_flash_skip_done(sl, &addr, &buf, &size);
+			if (status)
+				return status > 0 ? 0 : -1;
+		}
+
+		stl_phase(sl, PhaseFlashLoad);
+		stl_loader(sl, addr, buf, size);
+		if (stl_xfer_drain(sl) == 0) {
+			/* Writing 2KB takes 40-70 msec according to sec. 5.3.9 */
+			stl_phase(sl, PhaseFlashPoll);
+			int unit = stl_flash_unit(sl);
+			uint32_t regs = stl_flash_regs(sl, addr);
+
+			if (stl_await(sl, AwaitProgram, (size + unit - 1) / unit,
+						  stl_now(sl), stl_await_halted, NULL) == 0)
+				return 0;
+			if (sl->cmd_err == 0) {
+				if (sl->verbose)
+					printf("Flash status %2.2x, control %4.4x status %x.\n",
+						   sl_rd32(sl, regs + 0x0c), sl_rd32(sl, regs + 0x10),
+						   stl_get_status(sl));
+				return 1;
+			}
+		}
+		if (sl->usb_gone || tries++ >= STL_RETRY_LIMIT)
+			break;
+		stl_xfer_recover(sl);
+		stl_stats_retry(sl, STLinkDebugWriteMem32bit);
+		stl_phase(sl, PhaseFlashLoad);
+		stl_enter_debug(sl);
+		resume = 1;
+	}
+	fprintf(stderr, "Flash write at %8.8x failed.\n", addr);
+	return -1;
+}
+
+/* Compress SIZE bytes at SRC into DST as a LZ4 block, for the resident
+ * loader to expand.  This is a greedy match search through a small hash
+ * table: quick, and good at the fill and tables of a firmware image.
+ * As the format requires, the last five bytes are literals and the last
+ * match starts at least twelve bytes before the end.
+ * Returns the compressed size, or 0 if it would not be under MAX bytes.
+ */
+#define LZ4_HASH_BITS 12
+static int stl_lz4_len(uint8_t *dst, int op, int len)
+{
+	for (; len >= 255; len -= 255)
+		dst[op++] = 255;
+	dst[op++] = len;
+	return op;
+}
+
+static int stl_lz4_compress(const uint8_t *src, int size, uint8_t *dst,
+							int max)
+{
+	int table[1 << LZ4_HASH_BITS];
+	int ip = 0, anchor = 0, op = 0;
+	int lits, len, ref;
+
+	memset(table, 0, sizeof table);
+	while (ip + 12 < size) {
+		uint32_t seq = read_uint32((uint8_t *)src, ip);
+		int h = (seq * 2654435761U) >> (32 - LZ4_HASH_BITS);
+		ref = table[h] - 1;
+		table[h] = ip + 1;
+		if (ref < 0 || ip - ref > 65535 || memcmp(src + ref, src + ip, 4)) {
+			ip++;
+			continue;
+		}
+		for (len = 4; ip + len < size - 5 && src[ref+len] == src[ip+len]; )
+			len++;
+		lits = ip - anchor;
+		if (op + lits + lits/255 + len/255 + 5 >= max)
+			return 0;
+		dst[op++] = (lits < 15 ? lits : 15) << 4 | (len-4 < 15 ? len-4 : 15);
+		if (lits >= 15)
+			op = stl_lz4_len(dst, op, lits - 15);
+		memcpy(dst + op, src + anchor, lits);
+		op += lits;
+		dst[op++] = ip - ref;
+		dst[op++] = (ip - ref) >> 8;
+		if (len - 4 >= 15)
+			op = stl_lz4_len(dst, op, len - 4 - 15);
+		ip += len;
+		anchor = ip;
+	}
+	lits = size - anchor;
+	if (op + lits + lits/255 + 2 >= max)
+		return 0;
+	dst[op++] = (lits < 15 ? lits : 15) << 4;
+	if (lits >= 15)
+		op = stl_lz4_len(dst, op, lits - 15);
+	memcpy(dst + op, src + anchor, lits);
+	return op + lits;
+}
+
+/* Wait for the resident loader to finish the block at the ring tail. */
+struct stl_ring_poll {
+	uint32_t mbox;
+	int tail;
+	uint32_t status;
+};
+
+static int stl_await_ring(struct stlink *sl, void *arg)
+{
+	struct stl_ring_poll *rp = arg;
+	uint32_t state[2];				/* The tail and status. */
+
+	if (stl_read(sl, rp->mbox + MBOX_TAIL, state, sizeof(state)))
+		return -1;
+	rp->status = read_uint32((uint8_t *)state, 4);
+	if (rp->status)
+		return 1;
+	if ((int)read_uint32((uint8_t *)state, 0) > rp->tail) {
+		rp->tail = read_uint32((uint8_t *)state, 0);
+		return 1;
+	}
+	return 0;
+}
+
+/* The shortest run of erased program units worth skipping, where each
+ * block costs ROUND_TRIPS extra round trips. */
+static int stl_flash_gap(struct stlink *sl, int round_trips)
+{
+	uint64_t rtt = sl->srtt_ns ? sl->srtt_ns : 1000000;
+
+	return round_trips * rtt / stl_await_model(sl, AwaitProgram) + 1;
+}
+
+/* Plan the next block to write of an image of SIZE bytes, from *OFFSET.
+ * Erased flash need not be written with the erased value, so runs of at
+ * least GAP program units of it are skipped, as is any at the end.
+ * *OFFSET is advanced past a skipped run, and the block ends before the
+ * next, or at BLK bytes.  Returns the block length, or 0 at the end.
+ */
+static int stl_flash_next_blk(struct stlink *sl, const uint8_t *buf,
+							  int size, int *offset, int blk, int unit,
+							  int gap)
+{
+	uint8_t erased = stl_flash_erased(sl);
+	int start = *offset, len, end;
+
+	for (len = 0; start + len < size && len < blk; len += unit) {
+		/* The length of the erased run here, in whole units. */
+		for (end = start + len; end < size && buf[end] == erased; end++)
+			;
+		if (end < size)
+			end &= ~(unit - 1);
+		if (end - (start + len) < gap * unit && end < size)
+			continue;
+		if (len)
+			break;
+		start = end;			/* A gap before the block. */
+		len = -unit;
+	}
+	*offset = start;
+	return start + len > size ? size - start : len;
+}
+
+/* Queue the download of ALGO to the start of SRAM, with an empty mailbox
+ * for slots of SLOT_SIZE, and slot 0 set to ADDR and the flash REGS for
+ * the init and erase entries.  Returns the mailbox address. */
+static uint32_t stl_algo_download(struct stlink *sl,
+								  const struct stl_flash_algo *algo,
+								  int nslots, int slot_size, stm32_addr_t addr,
+								  uint32_t regs)
+{
+	uint32_t prog_base = stm_devids[stl_chip(sl)].sram_base;
+	int mb = algo->code_len + algo->work;
+	uint32_t mbox = prog_base + mb;
+	struct stl_xfer *xf = stl_xfer_get(sl);
+
+	if (xf == NULL)				/* The next drain fails. */
+		return mbox;
+	memcpy(xf->xbuf, algo->code, algo->code_len);
+	write_uint32(xf->xbuf + algo->code_len - 4, mbox);
+	memset(xf->xbuf + algo->code_len, 0, algo->work + MBOX_SLOTS + SLOT_HDR);
+	write_uint32(xf->xbuf + mb, mbox + MBOX_SLOTS + nslots*slot_size);
+	write_uint32(xf->xbuf + mb + 16, slot_size);
+	write_uint32(xf->xbuf + mb + 20, nslots - 1);
+	write_uint32(xf->xbuf + mb + MBOX_SLOTS, addr);
+	write_uint32(xf->xbuf + mb + MBOX_SLOTS + 8, regs);
+	stl_xfer_mem_cmd(xf, STLinkDebugWriteMem32bit, prog_base,
+					 mb + MBOX_SLOTS + (addr || regs ? SLOT_HDR : 0));
+	stl_xfer_submit(xf);
+	return mbox;
+}
+
+/* Run the downloaded algorithm from the ENTRY offset until it halts,
+ * expecting it to take UNITS of OP.  Returns the mailbox status, or -1
+ * if it did not halt. */
+static int stl_algo_call(struct stlink *sl, uint32_t entry, uint32_t mbox,
+						 enum stl_await_op op, unsigned units)
+{
+	uint32_t status;
+
+	stl_run_at(sl, stm_devids[stl_chip(sl)].sram_base + entry);
+	if (stl_xfer_drain(sl) ||
+		stl_await(sl, op, units, stl_now(sl), stl_await_halted, NULL) ||
+		stl_read(sl, mbox + MBOX_STATUS, &status, 4)) {
+		stl_xfer_recover(sl);
+		stl_enter_debug(sl);
+		return -1;
+	}
+	return read_uint32((uint8_t *)&status, 0);
+}
+
+/* Program SIZE bytes with the resident loader.
+ * The loader and mailbox are downloaded once, then each block is written
+ * to a free ring slot and queued by advancing the head count.  The host
+ * transfers the next block while the target programs the current one.
+ * With sl->compress, blocks that compress are sent as LZ4 blocks.
+ * A write spanning both banks of an XL-density part instead queues the
+ * slots in pairs, a bank 1 block and a bank 2 block, for the dual-bank
+ * loader to program at the same time.
+ * *DONE is set to the count of bytes confirmed as programmed.
+ * Returns 0 on success, the FLASH_SR error bits if the loader stopped on
+ * a flash error, or -1 if a transfer failed or the loader stalled, with
+ * the core halted.
+ */
+static int stl_flash_stream(struct stlink *sl, stm32_addr_t flash_addr,
+							const uint8_t *buf, int size, int *done)
+{
+	const struct stm_chip_params *chip = &stm_devids[stl_chip(sl)];
+	const struct stl_flash_algo *algo = stl_flash_algo(sl);
+	uint32_t prog_base = chip->sram_base, mbox;
+	struct stl_ring_poll rp = { 0, 0, 0 };
+	int blk = stl_flash_blk_size(sl), unit, compress;
+	int gap = stl_flash_gap(sl, 1);
+	int banks = 1, nslots, slot_size, b, units;
+	int head = 0, tail = 0, status, bank1_done = 0;
+	struct { int next, end, len; } plan[2];	/* The next block of each bank. */
+	struct { int offset, len; } blks[2*RING_SLOTS];	/* The queued blocks. */
+	uint64_t tail_ns, raw_bytes = 0, sent_bytes = 0;
+	uint8_t block[FLASH_WR_BLK_MAX];
+	struct stl_xfer *xf;
+
+	plan[0].next = 0;
+	plan[0].end = plan[1].next = plan[1].end = size;
+	if (algo == &flash_algos[0] && stl_flash_dual(sl, flash_addr, size)) {
+		algo = &dual_algo;
+		banks = 2;
+		plan[0].end = plan[1].next = FLASH_BANK2_BASE - flash_addr;
+	}
+	nslots = banks*RING_SLOTS;
+	mbox = rp.mbox = prog_base + algo->code_len + algo->work;
+	unit = algo->unit;
+	compress = sl->compress && (algo->flags & AlgoLZ4);
+
+	/* The slots, and the staging buffer when compressing, must fit in
+	 * the SRAM after the loader and mailbox. */
+	while (blk > 1024 && mbox - prog_base + MBOX_SLOTS +
+		   nslots*(SLOT_HDR + blk) + (compress ? blk : 0) > chip->sram_size)
+		blk -= 1024;
+	if (algo->blk_max && blk > (int)algo->blk_max)
+		blk = algo->blk_max;
+	slot_size = SLOT_HDR + blk;
+	*done = 0;
+	for (b = 0; b < 2; b++)
+		plan[b].len = stl_flash_next_blk(sl, buf, plan[b].end, &plan[b].next,
+										 blk, unit, gap);
+	if (plan[0].len == 0 && plan[1].len == 0) {
+		*done = size;
+		return 0;
+	}
+
+	/* Download the loader with an empty mailbox, and start it. */
+	stl_algo_download(sl, algo, nslots, slot_size, 0, 0);
+	if (algo->init != ALGO_NONE &&
+		(status = stl_algo_call(sl, algo->init, mbox, AwaitProgram, 0)) != 0)
+		return status;
+	stl_run_at(sl, prog_base + algo->program);
+	tail_ns = stl_now(sl);
+
+	while (tail < head || plan[0].len || plan[1].len) {
+		/* Fill the free slots, a block for each bank.  An idle bank has
+		 * an empty slot.  The head update follows the slot data in the
+		 * same queue, so the loader never sees a partial block. */
+		while ((plan[0].len || plan[1].len) && head - tail < nslots) {
+			for (b = 0; b < banks; b++) {
+				int offset = plan[b].next, len = plan[b].len;
+				int clen = 0, xlen;
+
+				stl_phase(sl, PhaseFlashLoad);
+				if ((xf = stl_xfer_get(sl)) == NULL)
+					return -1;
+				write_uint32(xf->xbuf, flash_addr + offset);
+				write_uint32(xf->xbuf + 4, (len + unit - 1) / unit);
+				write_uint32(xf->xbuf + 8,
+							 stl_flash_regs(sl, flash_addr + offset));
+				if (compress) {
+					/* Compress the block padded to whole half-words. */
+					memcpy(block, buf + offset, len);
+					block[len] = 0xff;
+					clen = stl_lz4_compress(block, (len + 1) & ~1,
+											xf->xbuf + SLOT_HDR, len);
+				}
+				write_uint32(xf->xbuf + 12, clen);
+				xlen = (SLOT_HDR + (clen ? clen : (len + unit - 1) & ~(unit-1))
+						+ 3) & ~3;
+				if (clen == 0) {
+					memset(xf->xbuf + SLOT_HDR, stl_flash_erased(sl),
+						   xlen - SLOT_HDR);
+					memcpy(xf->xbuf + SLOT_HDR, buf + offset, len);
+				}
+				raw_bytes += len;
+				sent_bytes += xlen - SLOT_HDR;
+				stl_xfer_mem_cmd(xf, STLinkDebugWriteMem32bit,
+								 mbox + MBOX_SLOTS +
+								 (head & (nslots - 1)) * slot_size, xlen);
+				stl_xfer_submit(xf);
+				blks[head & (nslots - 1)].offset = offset;
+				blks[head & (nslots - 1)].len = len;
+				head++;
+				if (len) {
+					plan[b].next += len;
+					plan[b].len = stl_flash_next_blk(sl, buf, plan[b].end,
+													 &plan[b].next, blk, unit,
+													 gap);
+				}
+			}
+			stl_batch_wr32(sl, mbox + MBOX_HEAD, head);
+		}
+		/* Wait for the oldest block, or pair, which started when the one
+		 * before it finished. */
+		stl_phase(sl, PhaseFlashPoll);
+		for (units = 0, b = 0; b < banks; b++)
+			if (blks[(tail + b) & (nslots - 1)].len > units)
+				units = blks[(tail + b) & (nslots - 1)].len;
+		if (stl_await(sl, AwaitProgram, (units + unit - 1) / unit,
+					  tail_ns, stl_await_ring, &rp)) {
+			if (sl->verbose)
+				printf("Flash loader stopped at %8.8x.\n", flash_addr + *done);
+			break;
+		}
+		if (rp.status) {
+			stl_enter_debug(sl);
+			return rp.status;
+		}
+		/* Only bank 1 is counted as done until it is finished, as an
+		 * empty bank 1 slot shows. */
+		for (; tail < rp.tail; tail++) {
+			b = tail & (banks - 1);
+			if (b == 0 && blks[tail & (nslots - 1)].len == 0)
+				bank1_done = 1;
+			if (blks[tail & (nslots - 1)].len && (b == 0 || bank1_done))
+				*done = blks[tail & (nslots - 1)].offset +
+					blks[tail & (nslots - 1)].len;
+		}
+		tail_ns = stl_now(sl);
+	}
+	if (tail == head) {
+		*done = size;
+		stl_phase(sl, PhaseFlashLoad);
+		stl_enter_debug(sl);
+		if (sl->verbose && banks > 1)
+			fprintf(stderr, " Programmed both flash banks in parallel.\n");
+		if (sl->verbose && raw_bytes < (uint64_t)size)
+			fprintf(stderr, " Skipped %llu bytes of erased flash.\n",
+					(unsigned long long)(size - raw_bytes));
+		if (sl->verbose && compress)
+			fprintf(stderr, " Flash blocks of %llu bytes compressed to %llu "
+					"bytes.\n", (unsigned long long)raw_bytes,
+					(unsigned long long)sent_bytes);
+		return 0;
+	}
+	stl_xfer_recover(sl);
+	stl_stats_retry(sl, STLinkDebugWriteMem32bit);
+	stl_phase(sl, PhaseFlashLoad);
+	stl_enter_debug(sl);
+	return -1;
+}
+
+/* Unlock the L1 PECR, then the program memory, and clear any errors. */
+static void stl_l1_unlock(struct stlink *sl)
+{
+	stl_batch_wr32(sl, L15_FLASH_PEKEYR, FLASH_PEKEY1);
+	stl_batch_wr32(sl, L15_FLASH_PEKEYR, FLASH_PEKEY2);
+	stl_batch_wr32(sl, L15_FLASH_PRGKEYR, FLASH_PRGKEY1);
+	stl_batch_wr32(sl, L15_FLASH_PRGKEYR, FLASH_PRGKEY2);
+	stl_batch_wr32(sl, L15_FLASH_SR, L15_FLASH_SR_ERRS);
+}
+
+/* Write the L1 flash with the resident half-page loader.
+ * Only whole half-pages are written, so a partial half-page at either end
+ * is filled in from the flash.  If the stream fails part way, it restarts
+ * after the half-pages confirmed as written.
+ */
+static int stl_l1_flash_write(struct stlink *sl, stm32_addr_t flash_addr,
+							  const uint8_t *buf, int size)
+{
+	stm32_addr_t base = flash_addr & ~(L15_HALF_PAGE - 1);
+	int len = (flash_addr - base + size + L15_HALF_PAGE - 1) &
+		~(L15_HALF_PAGE - 1);
+	int offset = 0, tries = 0, status;
+	uint32_t fsr = 0;
+	uint8_t *image = (uint8_t *)buf;
+	enum stl_phase phase = stl_phase(sl, PhaseFlashLoad);
+
+	if (sl->verbose)
+		printf("Flash write %8.8x..%8.8x.\n", flash_addr, flash_addr+size);
+	if (base != flash_addr || len != size) {
+		image = malloc(len);
+		if (image == NULL ||
+			stl_read(sl, base, image, L15_HALF_PAGE) ||
+			stl_read(sl, base + len - L15_HALF_PAGE,
+					 image + len - L15_HALF_PAGE, L15_HALF_PAGE)) {
+			free(image);
+			stl_phase(sl, phase);
+			return -1;
+		}
+		memcpy(image + (flash_addr - base), buf, size);
+	}
+	stl_l1_unlock(sl);
+	stl_batch_run(sl);
+	for (;;) {
+		int done;
+
+		status = stl_flash_stream(sl, base + offset, image + offset,
+								  len - offset, &done);
+		offset += done;
+		if (status >= 0 || sl->usb_gone || tries++ >= STL_RETRY_LIMIT)
+			break;
+		if (sl->verbose)
+			fprintf(stderr, " Flash write was interrupted, resuming at "
+					"%8.8x.\n", base + offset);
+	}
+	/* Read the final status and re-lock the flash in one batch. */
+	stl_phase(sl, PhaseFlashLoad);
+	stl_batch_rd32(sl, L15_FLASH_SR, &fsr);
+	stl_batch_wr32(sl, L15_FLASH_PECR, L15_FLASH_PECR_PELOCK);
+	stl_batch_run(sl);
+	stl_phase(sl, phase);
+	if (image != buf)
+		free(image);
+	if (status < 0) {
+		fprintf(stderr, "Flash write at %8.8x failed.\n", base + offset);
+		return -1;
+	}
+	status = (status | fsr) & L15_FLASH_SR_ERRS;
+	if (status & L15_FLASH_SR_WRPERR)
+		fprintf(stderr, "Flash write failed: trying to modify a "
+				"write-protected region. (%4.4x)\n", status);
+	else if (status)
+		fprintf(stderr, "Flash write failed: a half-page alignment or size "
+				"error. (%4.4x)\n", status);
+	return status;
+}
+
+int stl_flash_write(struct stlink *sl, stm32_addr_t flash_addr,
+						   const void *buf, int size)
+{
+	int offset = 0, blk_size, this_size, gap, resume = 0;
+	int status, stream_status = 0;
+	int f4 = stm_devids[stl_chip(sl)].cap_flags & ChipCapF4Flash;
+	int unit = stl_flash_unit(sl);
+	uint32_t regs = stl_flash_regs(sl, flash_addr);
+	uint32_t lock = f4 ? F4_FLASH_CR_LOCK : FLASH_CR_LOCK;
+	uint32_t fsr = 0, fcr = 0, fsr2 = 0;
+	int dual = stl_flash_dual(sl, flash_addr, size);
+	enum stl_phase phase;
+
+	if (stm_devids[stl_chip(sl)].cap_flags & ChipCapL1Flash)
+		return stl_l1_flash_write(sl, flash_addr, buf, size);
+	if (flash_addr & (unit - 1)) {
+		fprintf(stderr, "Flash write at %8.8x is not aligned to the %d byte "
+				"program size.\n", flash_addr, unit);
+		return -1;
+	}
+	phase = stl_phase(sl, PhaseFlashLoad);
+	if (sl->verbose)
+		printf("Flash write %8.8x..%8.8x.\n", flash_addr, flash_addr+size);
+	/* Unlock the flash register, and that of bank 2 for a write that
+	 * reaches it. */
+	stl_batch_wr32(sl, regs + 0x04, FLASH_KEY1);
+	stl_batch_wr32(sl, regs + 0x04, FLASH_KEY2);
+	if (dual) {
+		stl_batch_wr32(sl, FLASH_BANK2_REGS + 0x04, FLASH_KEY1);
+		stl_batch_wr32(sl, FLASH_BANK2_REGS + 0x04, FLASH_KEY2);
+		stl_batch_wr32(sl, FLASH_BANK2_REGS + 0x0c, 0x34);
+	}
+	/* Clear the error bits in the status register. */
+	stl_batch_wr32(sl, regs + 0x0c, f4 ? 0xF3 : 0x34);
+	stl_batch_rd32(sl, regs + 0x0c, &fsr);
+	stl_batch_rd32(sl, regs + 0x10, &fcr);
+	stl_batch_run(sl);
+	if (sl->verbose)
+		printf("Flash status %2.2x, control %4.4x.\n", fsr, fcr);
+
+	/* The F1-type controller streams blocks to the resident loader, as
+	 * does the F4 with a loaded algorithm.  If that fails part way, the
+	 * rest is written block by block, resuming after what was confirmed
+	 * as written.  The banks of a dual-bank write were programmed together,
+	 * so every block is read back first. */
+	if (stl_flash_algo(sl)) {
+		status = stl_flash_stream(sl, flash_addr, buf, size, &offset);
+		if (sl->usb_gone) {
+			stl_phase(sl, phase);
+			return -1;
+		}
+		if (status >= 0) {
+			stream_status = status;
+			offset = size;
+		} else
+			resume = 1;
+	}
+
+	/* Each block costs a loader download, a run and the polls, so only
+	 * longer erased runs are skipped.  The loader pads a partial program
+	 * unit at the end. */
+	blk_size = stl_flash_blk_size(sl);
+	gap = stl_flash_gap(sl, 4);
+	while ((this_size = stl_flash_next_blk(sl, buf, size, &offset, blk_size,
+										   unit, gap)) > 0) {
+		/* A block is programmed with the controller of its first bank. */
+		if (dual && flash_addr + offset < FLASH_BANK2_BASE &&
+			flash_addr + offset + this_size > FLASH_BANK2_BASE)
+			this_size = FLASH_BANK2_BASE - (flash_addr + offset);
+		status = stl_flash_block(sl, flash_addr + offset, buf + offset,
+								 this_size, resume);
+		if (status > 0) {
+			stl_phase(sl, phase);
+			return 0;
+		} else if (status < 0) {
+			stl_batch_wr32(sl, regs + 0x10, lock);
+			if (dual)
+				stl_batch_wr32(sl, FLASH_BANK2_REGS + 0x10, lock);
+			stl_batch_run(sl);
+			stl_phase(sl, phase);
+			return -1;
+		}
+		offset += this_size;
+		resume = resume && dual;
+	}
+
+	/* Read the final status and re-lock the flash in one batch. */
+	stl_phase(sl, PhaseFlashLoad);
+	stl_batch_rd32(sl, regs + 0x0c, &fsr);
+	stl_batch_wr32(sl, regs + 0x10, lock);
+	if (dual) {
+		stl_batch_rd32(sl, FLASH_BANK2_REGS + 0x0c, &fsr2);
+		stl_batch_wr32(sl, FLASH_BANK2_REGS + 0x10, lock);
+	}
+	stl_batch_run(sl);
+	stl_phase(sl, phase);
+	if (f4) {
+		status = (fsr | stream_status) & F4_FLASH_SR_ERRS;
+		if (status & F4_FLASH_SR_WRPERR)
+			fprintf(stderr, "Flash write failed: trying to modify a "
+					"write-protected region. (%2.2x)\n", status);
+		else if (status & (F4_FLASH_SR_PGAERR | F4_FLASH_SR_PGPERR))
+			fprintf(stderr, "Flash write failed: an alignment or parallelism "
+					"error, check the supply voltage. (%2.2x)\n", status);
+		else if (status)
+			fprintf(stderr, "Flash write failed: a programming sequence "
+					"error. (%2.2x)\n", status);
+		return status;
+	}
+	status = (fsr | fsr2 | stream_status) & 0x15;
+	if (status) {
+		if (status & 0x04)
+			fprintf(stderr, "Flash write failed: trying to write a location "
+					"that was not erased. (%2.2x)\n", status);
+		else if (status & 0x10)
+			fprintf(stderr, "Flash write failed: trying to modify a "
+					"write-protected region. (%2.2x)\n", status);
+	}
+	return status;
+}
+
+/* Erase flash memory.
+ * Typical use: erase the page of flash memory that contains address ADDR.
+ * Pass the address 0xA11 to do a mass erase ("user flash" only).
+ * The flash controller should be idle at entry, and this waits for idle
+ * before exit.
+ */
+static int stl_f4_flash_erase_page(struct stlink *sl, stm32_addr_t addr_page);
+static int stl_l1_flash_erase_page(struct stlink *sl, stm32_addr_t addr_page);
+static int stl_f1_flash_erase(struct stlink *sl, int n, const uint32_t *regs,
+							  const stm32_addr_t *pages);
+static int stl_algo_erase(struct stlink *sl, const struct stl_flash_algo *algo,
+						  stm32_addr_t addr_page);
+static uint32_t stl_flash_page(struct stlink *sl, stm32_addr_t addr,
+							   stm32_addr_t *base);
+int stl_flash_erase_page(struct stlink *sl, stm32_addr_t addr_page)
+{
+	const struct stm_chip_params *chip = &stm_devids[stl_chip(sl)];
+	const struct stl_flash_algo *algo = stl_flash_algo(sl);
+	uint32_t regs[2] = { FLASH_REGS_ADDR, FLASH_BANK2_REGS };
+	stm32_addr_t pages[2] = { addr_page, addr_page };
+
+	if (algo && algo->erase != ALGO_NONE && addr_page >= chip->flash_base &&
+		addr_page - chip->flash_base < chip->flash_size)
+		return stl_algo_erase(sl, algo, addr_page);
+	if (stm_devids[stl_chip(sl)].cap_flags & ChipCapF4Flash)
+		return stl_f4_flash_erase_page(sl, addr_page);
+	if (stm_devids[stl_chip(sl)].cap_flags & ChipCapL1Flash)
+		return stl_l1_flash_erase_page(sl, addr_page);
+	if (addr_page != 0xa11) {
+		regs[0] = stl_flash_regs(sl, addr_page);
+		return stl_f1_flash_erase(sl, 1, regs, pages);
+	}
+	/* A mass erase only erases the bank of the controller it is started on,
+	 * so both banks of the XL-density parts are erased together. */
+	return stl_f1_flash_erase(sl, chip->flash_size > 512*1024 ? 2 : 1,
+							  regs, pages);
+}
+
+/* Erase PAGES[i], or mass erase with 0xa11, with the F1-type controller
+ * at REGS[i], for N of up to two banks.  Both are started in one batch,
+ * so the banks of the XL-density parts erase in parallel. */
+static int stl_f1_flash_erase(struct stlink *sl, int n, const uint32_t *regs,
+							  const stm32_addr_t *pages)
+{
+	struct stl_flash_poll fp[2];
+	uint32_t fsr = 0, fcr = 0;
+	uint64_t start;
+	enum stl_phase phase;
+	int i;
+
+	phase = stl_phase(sl, PhaseErase);
+
+	/* The whole unlock and start sequence, plus the first status check,
+	 * is a single batch.  The register offsets are as FLASH_KEYR etc. */
+	for (i = 0; i < n; i++) {
+		fp[i].sr = regs[i] + 0x0c;
+		fp[i].bsy = FLASH_SR_BSY;
+		/* Unlock the flash register and clear any previous errors. */
+		stl_batch_wr32(sl, regs[i] + 0x04, FLASH_KEY1);
+		stl_batch_wr32(sl, regs[i] + 0x04, FLASH_KEY2);
+		stl_batch_wr32(sl, regs[i] + 0x0c,
+					   FLASH_SR_EOP | FLASH_SR_WRPRTERR | FLASH_SR_PGERR);
+		if (sl->verbose > 1 && i == 0) {
+			stl_batch_rd32(sl, regs[i] + 0x0c, &fsr);
+			stl_batch_rd32(sl, regs[i] + 0x10, &fcr);
+		}
+
+		if (pages[i] == 0xa11) {
+			/* Start the erase-all operation, PM0075 sec 3.5. */
+			stl_batch_wr32(sl, regs[i] + 0x10, FLASH_CR_MER);
+			stl_batch_wr32(sl, regs[i] + 0x10, FLASH_CR_STRT | FLASH_CR_MER);
+		} else {
+			/* Select the page to erase PM0075 sec 3.6 */
+			stl_batch_wr32(sl, regs[i] + 0x14, pages[i]);
+			/* Start the erase operation, PM0075 sec 3.5.
+			 * Note that a single combined write will not work! */
+			stl_batch_wr32(sl, regs[i] + 0x10, FLASH_CR_PER);
+			stl_batch_wr32(sl, regs[i] + 0x10, FLASH_CR_STRT | FLASH_CR_PER);
+		}
+	}
+	for (i = 0; i < n; i++)
+		stl_batch_rd32(sl, regs[i] + 0x0c, &fp[i].status);
+	if (stl_batch_run(sl)) {
+		/* A lost response: the erase may be running, so poll for it. */
+		stl_xfer_recover(sl);
+		for (i = 0; i < n; i++)
+			fp[i].status = fp[i].bsy;
+	}
+	start = stl_now(sl);
+	if (sl->verbose > 1)
+		fprintf(stderr, "STLink erase flash: status %8.8x "
+				"Flash_CR %8.8x.\n", fsr, fcr);
+
+	/* Wait for the busy bits to clear, 20-40 msec.  The second bank
+	 * started with the first, so is usually idle by then. */
+	stl_phase(sl, PhaseErasePoll);
+	for (i = 0; i < n; i++)
+		if (fp[i].status & FLASH_SR_BSY)
+			stl_await(sl, pages[i] == 0xa11 ? AwaitMassErase : AwaitErase, 1,
+					  start, stl_await_flash_idle, &fp[i]);
+	stl_phase(sl, phase);
+	for (i = 0; i < n; i++) {
+		if ( ! (fp[i].status & FLASH_SR_EOP)) {
+			fprintf(stderr, "STLink erase flash page failed, status %8.8x "
+					"Flash_CR %8.8x (after %d msec).\n", fp[i].status,
+					sl_rd32(sl, regs[i] + 0x10),
+					(int)((stl_now(sl) - start) / 1000000));
+			return 1;
+		}
+		if (sl->verbose)
+			fprintf(stderr, "STLink erase flash page %8.8x: complete %8.8x in "
+					"%d usec.\n", pages[i], fp[i].status,
+					(int)((stl_now(sl) - start) / 1000));
+	}
+	return 0;
+}
+
+/* Erase the page or sector at ADDR_PAGE with the erase entry of ALGO.
+ * The host unlocks and re-locks the flash around it. */
+static int stl_algo_erase(struct stlink *sl, const struct stl_flash_algo *algo,
+						  stm32_addr_t addr_page)
+{
+	int caps = stm_devids[stl_chip(sl)].cap_flags;
+	uint32_t regs = stl_flash_regs(sl, addr_page);
+	stm32_addr_t base;
+	uint32_t len = stl_flash_page(sl, addr_page, &base), mbox;
+	int tries = 0, status;
+	enum stl_phase phase = stl_phase(sl, PhaseErase);
+
+	do {
+		if (caps & ChipCapL1Flash)
+			stl_l1_unlock(sl);
+		else {
+			stl_batch_wr32(sl, regs + 0x04, FLASH_KEY1);
+			stl_batch_wr32(sl, regs + 0x04, FLASH_KEY2);
+		}
+		mbox = stl_algo_download(sl, algo, 1, SLOT_HDR, base, regs);
+		stl_phase(sl, PhaseErasePoll);
+		status = stl_algo_call(sl, algo->erase, mbox, AwaitErase,
+							   caps & ChipCapF4Flash ? len / 1024 : 1);
+		stl_phase(sl, PhaseErase);
+		if (status < 0)
+			stl_stats_retry(sl, STLinkDebugRunCore);
+	} while (status < 0 && ! sl->usb_gone && tries++ < STL_RETRY_LIMIT);
+	if (caps & ChipCapL1Flash)
+		stl_batch_wr32(sl, L15_FLASH_PECR, L15_FLASH_PECR_PELOCK);
+	else
+		stl_batch_wr32(sl, regs + 0x10, caps & ChipCapF4Flash ?
+					   F4_FLASH_CR_LOCK : FLASH_CR_LOCK);
+	stl_batch_run(sl);
+	stl_phase(sl, phase);
+	if (status)
+		fprintf(stderr, "STLink erase flash page %8.8x with %s failed, "
+				"status %8.8x.\n", base, algo->name, status);
+	else if (sl->verbose > 1)
+		fprintf(stderr, "STLink erase flash page %8.8x with %s: "
+				"complete.\n", base, algo->name);
+	return status ? -1 : 0;
+}
+
+/* The F4 sector layout: four 16K, one 64K, then 128K sectors. */
+static int stl_f4_sector(uint32_t offset)
+{
+	if (offset < 64*1024)
+		return offset / (16*1024);
+	if (offset < 128*1024)
+		return 4;
+	return 4 + offset / (128*1024);
+}
+
+static uint32_t stl_f4_sector_size(int sector)
+{
+	return sector < 4 ? 16*1024 : sector == 4 ? 64*1024 : 128*1024;
+}
+
+/* The size of the target flash in bytes.  The F4 table entry holds the
+ * smallest part of the line, so the F4 uses the size the part reports at
+ * 0x1FFF7A22, as stm_info() does, up to the twelve sectors of 1MB that
+ * stl_f4_sector() describes.  It is read once per identified target.
+ */
+static uint32_t stl_flash_size(struct stlink *sl)
+{
+	const struct stm_chip_params *chip = &stm_devids[stl_chip(sl)];
+
+	if ( ! (chip->cap_flags & ChipCapF4Flash))
+		return chip->flash_size;
+	if (sl->flash_mem_size == 0) {
+		uint32_t reg = sl_rd32(sl, 0x1FFF7A20);
+		/* Unreadable or unset, 0xffff, takes the table value. */
+		sl->flash_mem_size = sl->cmd_err || (reg >> 16) == 0 ? 0xffff
+			: reg >> 16;
+	}
+	if (sl->flash_mem_size < 16 || sl->flash_mem_size == 0xffff)
+		return chip->flash_size;
+	if (sl->flash_mem_size > 1024)
+		return 1024*1024;
+	return sl->flash_mem_size * 1024;
+}
+
+/* The F4 erases sectors, selected by either a sector number below 16, or
+ * an address within the sector.  The erase uses the program parallelism,
+ * as that also sets how many bits are erased at once.
+ * Returns nonzero if the erase reported an error, such as a write
+ * protected sector, or did not finish. */
+static int stl_f4_flash_erase_page(struct stlink *sl, stm32_addr_t addr_page)
+{
+	const struct stm_chip_params *chip = &stm_devids[stl_chip(sl)];
+	struct stl_flash_poll fp = { F4_FLASH_SR, F4_FLASH_SR_BSY, 0 };
+	uint32_t fsr = 0, fcr = 0;
+	uint32_t psize = F4_FLASH_CR_PSIZE(stl_flash_unit(sl));
+	uint32_t flash_size = stl_flash_size(sl);
+	int sector = addr_page;
+	unsigned kbytes;
+	uint64_t start;
+	enum stl_phase phase;
+
+	if (addr_page >= 16 && addr_page != 0xa11) {
+		/* Addresses below the flash are in its boot alias at zero. */
+		uint32_t offset = addr_page < chip->flash_base ?
+			addr_page : addr_page - chip->flash_base;
+		sector = offset < flash_size ? stl_f4_sector(offset) : 16;
+	}
+	if (addr_page != 0xa11 && sector > stl_f4_sector(flash_size - 1)) {
+		fprintf(stderr, "STLink STM32F4 erase flash: %8.8x is not a sector "
+				"number or flash address.\n", addr_page);
+		return -1;
+	}
+	phase = stl_phase(sl, PhaseErase);
+	if (sl->verbose > 1)
+		fprintf(stderr, "STLink STM32F4 erase flash: Flash_SR %8.8x "
+				"Flash_CR %8.8x.\n",
+				sl_rd32(sl, F4_FLASH_SR), sl_rd32(sl, F4_FLASH_CR));
+
+
+	/* Unlock the flash register and clear any previous errors. */
+	stl_batch_wr32(sl, F4_FLASH_KEYR, FLASH_KEY1);
+	stl_batch_wr32(sl, F4_FLASH_KEYR, FLASH_KEY2);
+	stl_batch_wr32(sl, F4_FLASH_SR, 0xF3); 		/* Clear error bits. */
+	if (sl->verbose > 1) {
+		stl_batch_rd32(sl, F4_FLASH_SR, &fsr);
+		stl_batch_rd32(sl, F4_FLASH_CR, &fcr);
+	}
+
+	if (addr_page == 0xa11) {
+		/* Start the erase-all operation, PM0075 sec 3.5. */
+		stl_batch_wr32(sl, F4_FLASH_CR, psize | FLASH_CR_MER);
+		stl_batch_wr32(sl, F4_FLASH_CR,
+					   psize | F4_FLASH_CR_STRT | FLASH_CR_MER);
+		kbytes = stl_flash_size(sl) / 1024;
+	} else {
+		/* Select the sector to erase. */
+		uint32_t cr = psize | F4_FLASH_CR_SER | (sector<<3);
+		stl_batch_wr32(sl, F4_FLASH_CR, cr);
+		stl_batch_wr32(sl, F4_FLASH_CR, F4_FLASH_CR_STRT | cr);
+		kbytes = stl_f4_sector_size(sector) / 1024;
+	}
+	stl_batch_rd32(sl, F4_FLASH_SR, &fp.status);
+	if (stl_batch_run(sl)) {
+		/* A lost response: the erase may be running, so poll for it. */
+		stl_xfer_recover(sl);
+		fp.status = fp.bsy;
+	}
+	start = stl_now(sl);
+	if (sl->verbose > 1)
+		fprintf(stderr, "STLink STM32F4 erase flash: status %8.8x "
+				"Flash_CR %8.8x.\n", fsr, fcr);
+
+	/* Wait for the busy bit to clear, 0.25-2 sec for a sector. */
+	stl_phase(sl, PhaseErasePoll);
+	if ((fp.status & F4_FLASH_SR_BSY) &&
+		stl_await(sl, addr_page == 0xa11 ? AwaitMassErase : AwaitErase,
+				  kbytes, start, stl_await_flash_idle, &fp))
+		fp.status |= F4_FLASH_SR_BSY;		/* Timed out or gone. */
+	stl_phase(sl, phase);
+	if (fp.status & (F4_FLASH_SR_BSY | F4_FLASH_SR_ERRS)) {
+		fprintf(stderr, "STLink STM32F4 erase flash %8.8x failed, status "
+				"%8.8x.\n", addr_page, fp.status);
+		return -1;
+	}
+	if (sl->verbose)
+		fprintf(stderr, "STLink erase flash page %8.8x: complete %8.8x in "
+				"%d usec.\n", addr_page, fp.status,
+				(int)((stl_now(sl) - start) / 1000));
+	return 0;
+}
+
+/* The L1 erases a page by writing a word to it with ERASE and PROG set in
+ * PECR.  Erasing all of the program memory takes a read protection level
+ * change, which also erases the data EEPROM, so a mass erase instead
+ * erases each page.
+ */
+static int stl_l1_flash_erase_page(struct stlink *sl, stm32_addr_t addr_page)
+{
+	const struct stm_chip_params *chip = &stm_devids[stl_chip(sl)];
+	struct stl_flash_poll fp = { L15_FLASH_SR, L15_FLASH_SR_BSY, 0 };
+	uint64_t start;
+	enum stl_phase phase;
+
+	if (addr_page == 0xa11) {
+		stm32_addr_t base;
+		for (base = chip->flash_base;
+			 base < chip->flash_base + stl_flash_size(sl);
+			 base += chip->flash_pgsize)
+			if (stl_l1_flash_erase_page(sl, base))
+				return -1;
+		return 0;
+	}
+	phase = stl_phase(sl, PhaseErase);
+	stl_l1_unlock(sl);
+	stl_batch_wr32(sl, L15_FLASH_PECR,
+				   L15_FLASH_PECR_ERASE | L15_FLASH_PECR_PROG);
+	stl_batch_wr32(sl, addr_page & ~(chip->flash_pgsize - 1), 0);
+	stl_batch_rd32(sl, L15_FLASH_SR, &fp.status);
+	if (stl_batch_run(sl)) {
+		/* A lost response: the erase may be running, so poll for it. */
+		stl_xfer_recover(sl);
+		fp.status = fp.bsy;
+	}
+	start = stl_now(sl);
+
+	/* Wait for the busy bit to clear, about 3.3 msec. */
+	stl_phase(sl, PhaseErasePoll);
+	if (fp.status & L15_FLASH_SR_BSY)
+		stl_await(sl, AwaitErase, 1, start, stl_await_flash_idle, &fp);
+	stl_phase(sl, PhaseErase);
+	stl_batch_wr32(sl, L15_FLASH_PECR, L15_FLASH_PECR_PELOCK);
+	stl_batch_run(sl);
+	stl_phase(sl, phase);
+	if (sl->verbose > 1)
+		fprintf(stderr, "STLink erase flash page %8.8x: complete %8.8x in "
+				"%d usec.\n", addr_page, fp.status,
+				(int)((stl_now(sl) - start) / 1000));
+	return fp.status & L15_FLASH_SR_ERRS ? -1 : 0;
+}
+
+/* The flash page or F4 sector containing ADDR, as its base and size. */
+static uint32_t stl_flash_page(struct stlink *sl, stm32_addr_t addr,
+							   stm32_addr_t *base)
+{
+	const struct stm_chip_params *chip = &stm_devids[stl_chip(sl)];
+	uint32_t offset = addr - chip->flash_base;
+
+	if (chip->cap_flags & ChipCapF4Flash) {
+		int sector = stl_f4_sector(offset);
+		offset = sector < 4 ? sector * 16*1024 :
+			sector == 4 ? 64*1024 : (sector - 4) * 128*1024;
+		*base = chip->flash_base + offset;
+		return stl_f4_sector_size(sector);
+	}
+	*base = chip->flash_base + (offset & ~(chip->flash_pgsize - 1));
+	return chip->flash_pgsize;
+}
+
+/* The estimated time to erase the page or sector of LEN bytes, or with
+ * LEN of 0, to mass erase.  Each erase also costs a batch round-trip and
+ * a final poll. */
+static uint64_t stl_erase_cost(struct stlink *sl, uint32_t len)
+{
+	const struct stm_chip_params *chip = &stm_devids[stl_chip(sl)];
+	int f4 = chip->cap_flags & ChipCapF4Flash;
+	uint64_t overhead = sl->srtt_ns ? 2*sl->srtt_ns : 1000000;
+
+	if (len)
+		return stl_await_model(sl, AwaitErase) * (f4 ? len / 1024 : 1) +
+			overhead;
+	if (f4)
+		return stl_await_model(sl, AwaitMassErase) *
+			(stl_flash_size(sl) / 1024) + overhead;
+	/* The L1 erases each page in turn. */
+	if (chip->cap_flags & ChipCapL1Flash)
+		return (stl_await_model(sl, AwaitMassErase) + overhead) *
+			(stl_flash_size(sl) / chip->flash_pgsize);
+	/* The XL-density parts erase both banks at once. */
+	return stl_await_model(sl, AwaitMassErase) + overhead;
+}
+
+/* Whether a mass erase may be used in place of erasing the pages from
+ * ADDR to END, at a cost of MASS_NS against PAGE_NS.  It loses the rest of
+ * the flash, so the image must cover most of it, and the mass erase must
+ * be clearly quicker.  A single F1 page costs the same as a mass erase. */
+static int stl_mass_erase_wins(struct stlink *sl, stm32_addr_t addr,
+							   stm32_addr_t end, uint64_t mass_ns,
+							   uint64_t page_ns)
+{
+	return end - addr > stl_flash_size(sl) / 2 &&
+		mass_ns + mass_ns / 4 < page_ns;
+}
+
+/* Where the pages from ADDR to END split between the two XL-density
+ * banks, for erasing a page of each at a time, or END. */
+static stm32_addr_t stl_erase_split(struct stlink *sl, stm32_addr_t addr,
+									stm32_addr_t end)
+{
+	const struct stl_flash_algo *algo = stl_flash_algo(sl);
+
+	if (stl_flash_dual(sl, addr, end - addr) &&
+		( ! algo || algo->erase == ALGO_NONE))
+		return FLASH_BANK2_BASE;
+	return end;
+}
+
+/* Erase each page from ADDR to END, retrying a page once.  Pages of the
+ * two XL-density banks are erased in pairs, one with each controller at
+ * the same time. */
+static int stl_flash_erase_pages(struct stlink *sl, stm32_addr_t addr,
+								 stm32_addr_t end)
+{
+	stm32_addr_t base, base2, split = stl_erase_split(sl, addr, end);
+	uint32_t len;
+	int status = 0;
+
+	for (base = addr, base2 = split; (base < split || base2 < end) &&
+			 status == 0; ) {
+		uint32_t regs[2];
+		stm32_addr_t pages[2];
+		int n = 0;
+
+		if (base < split) {
+			len = stl_flash_page(sl, base, &base);
+			pages[n++] = base;
+			base += len;
+		}
+		if (base2 < end) {
+			len = stl_flash_page(sl, base2, &base2);
+			pages[n++] = base2;
+			base2 += len;
+		}
+		if (n == 1) {
+			if (stl_flash_erase_page(sl, pages[0]) != 0)
+				status = stl_flash_erase_page(sl, pages[0]);
+			continue;
+		}
+		regs[0] = FLASH_REGS_ADDR;
+		regs[1] = FLASH_BANK2_REGS;
+		if (stl_f1_flash_erase(sl, 2, regs, pages) != 0)
+			status = stl_f1_flash_erase(sl, 2, regs, pages);
+	}
+	return status;
+}
+
+/* Erase the flash for an image of SIZE bytes at ADDR.
+ * This erases only the pages or sectors the image overlaps, unless it
+ * covers most of the flash and a mass erase is expected to be clearly
+ * quicker.  A page erase on the F1 takes as long as a mass erase, while a
+ * F4 mass erase takes many seconds.
+ * Returns zero on success.
+ */
+int stl_flash_erase_range(struct stlink *sl, stm32_addr_t addr, uint32_t size)
+{
+	const struct stm_chip_params *chip = &stm_devids[stl_chip(sl)];
+	int f4 = chip->cap_flags & ChipCapF4Flash;
+	uint32_t flash_end = chip->flash_base + stl_flash_size(sl);
+	uint64_t page_ns[2] = { 0, 0 }, mass_ns;
+	stm32_addr_t end, base, split;
+	int npages = 0, status = 0, b;
+	uint32_t len;
+
+	if (addr < chip->flash_base)
+		addr = chip->flash_base;
+	end = size > flash_end - addr ? flash_end : addr + size;
+	if (addr >= end)
+		return 0;
+	/* Paired bank 1 and bank 2 pages take the time of the longer bank. */
+	split = stl_erase_split(sl, addr, end);
+	for (base = addr; base < end; base += len) {
+		len = stl_flash_page(sl, base, &base);
+		page_ns[base >= split] += stl_erase_cost(sl, len);
+		npages++;
+	}
+	b = page_ns[1] > page_ns[0];
+	mass_ns = stl_erase_cost(sl, 0);
+	if (sl->verbose)
+		fprintf(stderr, " Erasing %8.8x..%8.8x: %d %s, about %d msec, or a "
+				"mass erase of about %d msec.\n", addr, end, npages,
+				f4 ? "sectors" : "pages", (int)(page_ns[b] / 1000000),
+				(int)(mass_ns / 1000000));
+
+	if (stl_mass_erase_wins(sl, addr, end, mass_ns, page_ns[b])) {
+		if (stl_flash_erase_page(sl, 0xa11) != 0)
+			status = stl_flash_erase_page(sl, 0xa11);
+		return status;
+	}
+	return stl_flash_erase_pages(sl, addr, end);
+}
+
+/* The STM32 CRC unit: CRC-32 with the polynomial 0x04C11DB7, starting
+ * from 0xFFFFFFFF, taking 32 bit words most significant bit first, and
+ * without a final inversion.  Memory words are little-endian. */
+#define CRC_REGS 0x40023000
+
+static uint32_t stm_crc32_word(uint32_t crc, uint32_t data)
+{
+	int i;
+
+	crc ^= data;
+	for (i = 0; i < 32; i++)
+		crc = crc & 0x80000000 ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+	return crc;
+}
+
+/* The CRC of the LEN bytes of flash at BASE once the SIZE byte image at
+ * ADDR is written, with anything outside the image erased to ERASED. */
+static uint32_t stl_image_crc(stm32_addr_t base, uint32_t len,
+							  stm32_addr_t addr, const uint8_t *buf, int size,
+							  uint8_t erased)
+{
+	uint32_t crc = 0xffffffff;
+	uint32_t i, word;
+	int j;
+
+	for (i = 0; i < len; i += 4) {
+		for (word = 0, j = 3; j >= 0; j--) {
+			stm32_addr_t a = base + i + j;
+			word = (word << 8) | (a >= addr && a - addr < (uint32_t)size ?
+								  buf[a - addr] : erased);
+		}
+		crc = stm_crc32_word(crc, word);
+	}
+	return crc;
+}
+
+/* The page CRC helper.  This runs the flash through the CRC unit a page
+ * at a time, leaving the CRC of each page in the results that follow the
+ * parameters.  It is Thumb-1 only, so it runs on any core.
+ * The parameters are: the RCC register to enable the CRC unit clock and
+ * its bit, the flash address, the words per page, and the page count.
+ */
+static const uint16_t crc_helper_code[] = {
+	 0x480D,			/* ldr	r0, .PARAMS */
+	 0x6801,			/* ldr	r1, [r0, #0] ; RCC enable register */
+	 0x680A,			/* ldr	r2, [r1, #0] */
+	 0x6843,			/* ldr	r3, [r0, #4] */
+	 0x431A,			/* orrs	r2, r3 */
+	 0x600A,			/* str	r2, [r1, #0] */
+	 0x6881,			/* ldr	r1, [r0, #8] ; flash address */
+	 0x68C4,			/* ldr	r4, [r0, #12] ; words per page */
+	 0x6905,			/* ldr	r5, [r0, #16] ; page count */
+	 0x3014,			/* adds	r0, #20 ; results */
+	 0x4F07,			/* ldr	r7, .CRC_REGS */
+	 /* page: */
+	 0x2201,			/* movs	r2, #1 */
+	 0x60BA,			/* str	r2, [r7, #8] ; CRC_CR reset */
+	 0x0023,			/* movs	r3, r4 */
+	 /* word: */
+	 0x680A,			/* ldr	r2, [r1, #0] */
+	 0x603A,			/* str	r2, [r7, #0] ; CRC_DR */
+	 0x3104,			/* adds	r1, #4 */
+	 0x3B01,			/* subs	r3, #1 */
+	 0xD1FA,			/* bne	word */
+	 0x683A,			/* ldr	r2, [r7, #0] */
+	 0x6002,			/* str	r2, [r0, #0] */
+	 0x3004,			/* adds	r0, #4 */
+	 0x3D01,			/* subs	r5, #1 */
+	 0xD1F2,			/* bne	page */
+	 0xBE00,			/* bkpt	#0x00 */
+	 0x0000,
+	 0x3000, 0x4002,	/* .CRC_REGS: .word 0x40023000 */
+	 /* This parameter will be overwritten before download. */
+	 0x003C, 0x2000,	/* .PARAMS: .word 0x2000003C */
+ };
+
+/* The register and bit that enable the CRC unit clock. */
+static void stl_crc_clock(struct stlink *sl, uint32_t *reg, uint32_t *bit)
+{
+	const struct stm_chip_params *chip = &stm_devids[stl_chip(sl)];
+
+	if (chip->cap_flags & ChipCapF4Flash) {
+		*reg = 0x40023830;			/* RCC_AHB1ENR */
+		*bit = 1 << 12;
+	} else if ((chip->dbgmcu_idcode & 0xfff) == 0x416) {
+		*reg = 0x4002381C;			/* L1 RCC_AHBENR */
+		*bit = 1 << 12;
+	} else {
+		*reg = 0x40021014;			/* RCC_AHBENR */
+		*bit = 1 << 6;
+	}
+}
+
+/* Compute the CRC of NPAGES flash pages of PGSIZE bytes from ADDR on the
+ * target, into CRCS.  Returns zero on success.
+ * The helper overwrites the start of SRAM and runs on the core, so this
+ * fails rather than disturb a core that is not halted.
+ */
+static int stl_flash_crc(struct stlink *sl, stm32_addr_t addr,
+						 uint32_t pgsize, int npages, uint32_t *crcs)
+{
+	const struct stm_chip_params *chip = &stm_devids[stl_chip(sl)];
+	uint32_t prog_base = chip->sram_base;
+	uint32_t params = prog_base + sizeof(crc_helper_code);
+	int max_pages = (chip->sram_size - sizeof(crc_helper_code) - 20) / 4;
+	uint32_t rcc_reg, rcc_bit;
+	int tries = 0;
+	enum stl_phase phase = stl_phase(sl, PhaseVerify);
+
+	if ( ! is_core_halted(sl)) {
+		if (sl->verbose)
+			fprintf(stderr, " The core is running, not computing flash "
+					"CRCs.\n");
+		stl_phase(sl, phase);
+		return -1;
+	}
+	stl_crc_clock(sl, &rcc_reg, &rcc_bit);
+	if (max_pages > Q_BUF_LEN / 4)
+		max_pages = Q_BUF_LEN / 4;
+	while (npages > 0) {
+		int n = npages < max_pages ? npages : max_pages;
+		struct stl_xfer *xf = stl_xfer_get(sl);
+		uint8_t *p;
+
+		if (xf == NULL) {
+			stl_phase(sl, phase);
+			return -1;
+		}
+		p = xf->xbuf + sizeof(crc_helper_code);
+		memcpy(xf->xbuf, crc_helper_code, sizeof(crc_helper_code));
+		write_uint32(p - 4, params);
+		write_uint32(p, rcc_reg);
+		write_uint32(p + 4, rcc_bit);
+		write_uint32(p + 8, addr);
+		write_uint32(p + 12, pgsize / 4);
+		write_uint32(p + 16, n);
+		stl_xfer_mem_cmd(xf, STLinkDebugWriteMem32bit, prog_base,
+						 sizeof(crc_helper_code) + 20);
+		stl_xfer_submit(xf);
+		stl_run_at(sl, prog_base);
+		if (stl_xfer_drain(sl) ||
+			stl_await(sl, AwaitCrc, n * pgsize / 1024, stl_now(sl),
+					  stl_await_halted, NULL) ||
+			stl_read(sl, params + 20, crcs, n * 4)) {
+			stl_xfer_recover(sl);
+			stl_enter_debug(sl);
+			if (sl->usb_gone || tries++ >= STL_RETRY_LIMIT) {
+				stl_phase(sl, phase);
+				return -1;
+			}
+			stl_stats_retry(sl, STLinkDebugRunCore);
+			continue;
+		}
+		for (p = (uint8_t *)crcs; p < (uint8_t *)(crcs + n); p += 4)
+			*(uint32_t *)p = read_uint32(p, 0);
+		addr += n * pgsize;
+		crcs += n;
+		npages -= n;
+	}
+	stl_phase(sl, phase);
+	return 0;
+}
+
+/* Write the SIZE byte image at ADDR, erasing and programming only the
+ * flash pages or sectors that differ from it.  The page CRCs are computed
+ * on the target and compared with those of the image.  When the image
+ * covers most of the flash and most pages differ, a mass erase and
+ * writing everything may be quicker.
+ * Returns zero on success.
+ */
+int stl_flash_update(struct stlink *sl, stm32_addr_t addr,
+					 const void *buf, int size)
+{
+	const struct stm_chip_params *chip = &stm_devids[stl_chip(sl)];
+	uint32_t flash_end = chip->flash_base + stl_flash_size(sl);
+	uint64_t prog_ns = stl_await_model(sl, AwaitProgram) /	/* Per byte */
+		stl_flash_unit(sl);
+	uint64_t full_ns = ~(uint64_t)0, mass_ns, delta_ns = 0, page_ns = 0;
+	stm32_addr_t end, base;
+	struct stl_page {
+		stm32_addr_t base;
+		uint32_t len, crc;
+	} *pages;
+	uint32_t *crcs;
+	int npages = 0, ndiff = 0, status = 0, i, n;
+
+	if (addr < chip->flash_base || addr >= flash_end || size <= 0)
+		return stl_flash_write(sl, addr, buf, size);
+	end = (uint32_t)size > flash_end - addr ? flash_end : addr + size;
+	for (base = addr; base < end; npages++) {
+		uint32_t len = stl_flash_page(sl, base, &base);
+		base += len;
+	}
+	pages = malloc(npages * sizeof *pages);
+	crcs = malloc(npages * sizeof *crcs);
+	if (pages == NULL || crcs == NULL) {
+		free(pages);
+		free(crcs);
+		return -1;
+	}
+	for (base = addr, i = 0; i < npages; i++) {
+		pages[i].len = stl_flash_page(sl, base, &pages[i].base);
+		base = pages[i].base + pages[i].len;
+	}
+
+	/* Pages of the same size are done in a single run of the helper.
+	 * The flash is about to be written, so halt the core as programming
+	 * does rather than let stl_flash_crc() refuse.
+	 */
+	stl_enter_debug(sl);
+	for (i = 0; i < npages; i += n) {
+		for (n = 1; i + n < npages && pages[i+n].len == pages[i].len; n++)
+			;
+		if (stl_flash_crc(sl, pages[i].base, pages[i].len, n, crcs + i))
+			break;
+	}
+	if (i < npages) {
+		if (sl->verbose)
+			fprintf(stderr, " Flash page CRCs failed, writing the whole "
+					"image.\n");
+		ndiff = npages;
+		delta_ns = ~(uint64_t)0;
+	}
+
+	/* Find the pages that differ, and compare the costs. */
+	for (i = 0; i < npages && delta_ns != ~(uint64_t)0; i++) {
+		page_ns += stl_erase_cost(sl, pages[i].len);
+		pages[i].crc = stl_image_crc(pages[i].base, pages[i].len, addr,
+									 buf, size, stl_flash_erased(sl));
+		if (pages[i].crc == crcs[i])
+			continue;
+		ndiff++;
+		delta_ns += stl_erase_cost(sl, pages[i].len) + pages[i].len * prog_ns;
+	}
+	/* Rewriting everything only differs from erasing every page when it
+	 * can mass erase. */
+	mass_ns = stl_erase_cost(sl, 0);
+	if (stl_mass_erase_wins(sl, addr, end, mass_ns, page_ns))
+		full_ns = mass_ns + (uint64_t)(end - addr) * prog_ns;
+	if (sl->verbose && delta_ns != ~(uint64_t)0) {
+		fprintf(stderr, " Flash update: %d of %d %s differ, about %d msec",
+				ndiff, npages,
+				chip->cap_flags & ChipCapF4Flash ? "sectors" : "pages",
+				(int)(delta_ns / 1000000));
+		if (full_ns != ~(uint64_t)0)
+			fprintf(stderr, ", or %d msec to mass erase and rewrite "
+					"everything", (int)(full_ns / 1000000));
+		fprintf(stderr, ".\n");
+	}
+	if (delta_ns == ~(uint64_t)0 || full_ns < delta_ns) {
+		free(pages);
+		free(crcs);
+		if (delta_ns != ~(uint64_t)0) {
+			if (stl_flash_erase_page(sl, 0xa11) != 0 &&
+				stl_flash_erase_page(sl, 0xa11) != 0)
+				return -1;
+		} else
+			stl_flash_erase_range(sl, addr, size);
+		return stl_flash_write(sl, addr, buf, size);
+	}
+
+	/* Erase each run of differing pages, then write it. */
+	for (i = 0; i < npages && status == 0; i += n) {
+		stm32_addr_t from, to;
+		if (pages[i].crc == crcs[i]) {
+			n = 1;
+			continue;
+		}
+		for (n = 0; i + n < npages && pages[i+n].crc != crcs[i+n]; n++)
+			;
+		to = pages[i+n-1].base + pages[i+n-1].len;
+		if ((status = stl_flash_erase_pages(sl, pages[i].base, to)) != 0)
+			break;
+		from = pages[i].base > addr ? pages[i].base : addr;
+		if (to > end)
+			to = end;
+		status = stl_flash_write(sl, from, (const uint8_t *)buf +
+								 (from - addr), to - from);
+	}
+	free(pages);
+	free(crcs);
+	return status;
+}
+
+/* Read from device memory at ADDR into BUF for SIZE bytes.
+ * This handles alignment and block size internally.
+ * The block reads are pipelined: we queue up to STL_XFER_DEPTH reads.
+ * Whole words are read by USB directly into BUF.  Only a partial word at
+ * the unaligned start or the end goes through a transaction buffer.
+ * Failed blocks are remembered and only those are read again, each up
+ * to STL_RETRY_LIMIT times.
+ * Returns zero on success, or the first USB error.
+ */
+#define READ_BLK_SIZE 1024
+static void stl_read_failed(struct stlink *sl, stm32_addr_t addr,
+							void *buf, int len)
+{
+	/* There is room for every block, unless it could not be allocated.
+	 * An overflow is noted by the count, and retries the whole read. */
+	if (sl->read_fails < sl->read_fail_max) {
+		sl->read_fail[sl->read_fails].addr = addr;
+		sl->read_fail[sl->read_fails].buf = buf;
+		sl->read_fail[sl->read_fails].len = len;
+		sl->read_fail[sl->read_fails].tries = 0;
+	}
+	sl->read_fails++;
+}
+
+static void stl_read_done(struct stl_xfer *xf)
+{
+	if (xf->status == 0)
+		memcpy(xf->priv, xf->data + (xf->priv_len >> 8), xf->priv_len & 0xff);
+	else
+		stl_read_failed(xf->sl, read_uint32(xf->cmd_buf, 2) +
+						(xf->priv_len >> 8), xf->priv, xf->priv_len & 0xff);
+}
+
+static void stl_read_block_done(struct stl_xfer *xf)
+{
+	if (xf->status)
+		stl_read_failed(xf->sl, read_uint32(xf->cmd_buf, 2), xf->data,
+						xf->data_len);
+}
+
+/* Queue a read of the partial word at ADDR for LEN (< 4) bytes. */
+static void stl_read_partial(struct stlink *sl, stm32_addr_t addr,
+							 void *buf, int len)
+{
+	struct stl_xfer *xf = stl_xfer_get(sl);
+
+	if (xf == NULL)
+		return;
+	stl_xfer_mem_cmd(xf, STLinkDebugReadMem32bit, addr & ~3, 4);
+	xf->done = stl_read_done;
+	xf->priv = buf;
+	/* Pack the offset into the word with the length, both are tiny. */
+	xf->priv_len = ((addr & 3) << 8) | len;
+	stl_xfer_submit(xf);
+}
+
+/* Queue the reads for the range, without waiting. */
+static void stl_read_queue(struct stlink* sl, stm32_addr_t addr, void *buf,
+						   ssize_t size)
+{
+	size_t offset = 0;
+
+	if (addr & 3) {
+		int psz = 4 - (addr & 3);
+		if (psz > size)
+			psz = size;
+		stl_read_partial(sl, addr, buf, psz);
+		offset = psz;
+		size -= psz;
+	}
+	while (size >= 4) {
+		struct stl_xfer *xf = stl_xfer_get(sl);
+		int blk = sl->read_blk ? sl->read_blk : READ_BLK_SIZE;
+		int xfer_size = size > blk ? blk : (size & ~3);
+
+		if (xf == NULL)
+			return;
+		stl_xfer_mem_cmd(xf, STLinkDebugReadMem32bit, addr + offset,
+						 xfer_size);
+		xf->data = buf + offset;
+		xf->done = stl_read_block_done;
+		stl_xfer_submit(xf);
+		offset += xfer_size;
+		size -= xfer_size;
+	}
+	if (size > 0)
+		stl_read_partial(sl, addr + offset, buf + offset, size);
+}
+
+/* Make room in the failed block lists for every block of a read of SIZE
+ * bytes: the whole blocks, and a partial word at each end. */
+static void stl_read_fail_alloc(struct stlink *sl, ssize_t size)
+{
+	int blk = sl->read_blk ? sl->read_blk : READ_BLK_SIZE;
+	int n = size / blk + 3;
+	struct stl_read_fail *fail, *retry;
+
+	if (n <= sl->read_fail_max)
+		return;
+	fail = realloc(sl->read_fail, n * sizeof *fail);
+	if (fail)
+		sl->read_fail = fail;
+	retry = realloc(sl->read_retry, n * sizeof *retry);
+	if (retry)
+		sl->read_retry = retry;
+	if (fail && retry)
+		sl->read_fail_max = n;
+}
+
+int stl_read(struct stlink* sl, stm32_addr_t addr, void *buf, ssize_t size)
+{
+	struct stl_read_fail *retry;
+	int nfail, nretry = 0, i, j, tries = 0;
+	int ret;
+
+	stl_read_fail_alloc(sl, size);
+	sl->read_fails = 0;
+	stl_read_queue(sl, addr, buf, size);
+	while ((ret = stl_xfer_drain(sl)) != 0 && ! sl->usb_gone) {
+		nfail = sl->read_fails;
+		sl->read_fails = 0;
+		stl_xfer_recover(sl);
+		stl_stats_retry(sl, STLinkDebugReadMem32bit);
+		if (nfail == 0 || nfail > sl->read_fail_max) {
+			/* Not known which blocks failed, so read everything again. */
+			if (tries++ >= STL_RETRY_LIMIT)
+				break;
+			if (sl->verbose)
+				fprintf(stderr, " Read of %8.8x..%8.8x failed (%s), "
+						"retrying it all.\n", addr, addr + (int)size,
+						stl_err_name(ret));
+			nretry = 0;
+			stl_read_queue(sl, addr, buf, size);
+			continue;
+		}
+		/* A block that failed again counts another try.  Both lists
+		 * are in address order. */
+		for (i = j = 0; i < nfail; i++) {
+			while (j < nretry && sl->read_retry[j].addr < sl->read_fail[i].addr)
+				j++;
+			if (j < nretry && sl->read_retry[j].addr == sl->read_fail[i].addr)
+				sl->read_fail[i].tries = sl->read_retry[j].tries + 1;
+			if (sl->read_fail[i].tries >= STL_RETRY_LIMIT)
+				break;
+		}
+		if (i < nfail)
+			break;
+		if (sl->verbose)
+			fprintf(stderr, " Read of %8.8x..%8.8x failed (%s), retrying %d "
+					"blocks.\n", addr, addr + (int)size, stl_err_name(ret),
+					nfail);
+		/* Swap the lists, then queue the failed blocks again. */
+		retry = sl->read_retry;
+		sl->read_retry = sl->read_fail;
+		sl->read_fail = retry;
+		nretry = nfail;
+		for (i = 0; i < nretry; i++)
+			stl_read_queue(sl, sl->read_retry[i].addr, sl->read_retry[i].buf,
+						   sl->read_retry[i].len);
+	}
+	if (ret)
+		fprintf(stderr, "Read of %8.8x..%8.8x failed: %s.\n",
+				addr, addr + (int)size, stl_err_name(ret));
+	return ret;
+}
+
+
+/* Transfer size calibration.
+ * The STLink accepts memory transfers up to the Q_BUF_LEN buffer, but
+ * some firmware versions mis-handle particular sizes, notably with a
+ * residue at 1KB boundaries.  This writes and reads back patterns in the
+ * target SRAM at increasing sizes, timing each, and stops at the first
+ * size that fails.  The fastest reliable read and write sizes are used by
+ * stl_read() and the flash loader, and kept in the probe ID cache.
+ * The target is halted and its SRAM contents are lost.
+ */
+#define CAL_REPS	4
+
+/* Write, then read back, SIZE bytes of pattern SEED at ADDR.
+ * Returns 0 if the data came back intact, adding the elapsed times. */
+static int stl_cal_pass(struct stlink *sl, stm32_addr_t addr, int size,
+						int seed, uint64_t *wr_ns, uint64_t *rd_ns)
+{
+	struct stl_xfer *xf;
+	uint8_t *pattern;
+	uint64_t t0, t1;
+	int i, ret;
+
+	if ((xf = stl_xfer_get(sl)) == NULL)
+		return -1;
+	stl_xfer_mem_cmd(xf, STLinkDebugWriteMem32bit, addr, size);
+	for (i = 0; i < size; i++)
+		xf->data[i] = (i * 7 + seed) ^ (i >> 8);
+	t0 = stl_now(sl);
+	stl_xfer_submit(xf);
+	if (stl_xfer_drain(sl))
+		return -1;
+	t1 = stl_now(sl);
+	*wr_ns += t1 - t0;
+
+	if ((xf = stl_xfer_get(sl)) == NULL)
+		return -1;
+	xf->hold = 1;
+	stl_xfer_mem_cmd(xf, STLinkDebugReadMem32bit, addr, size);
+	stl_xfer_submit(xf);
+	ret = stl_xfer_wait(xf);
+	*rd_ns += stl_now(sl) - t1;
+	if (ret || xf->actual_len != size)
+		return -1;
+	pattern = xf->data;
+	for (i = 0; i < size; i++)
+		if (pattern[i] != (uint8_t)((i * 7 + seed) ^ (i >> 8)))
+			return -1;
+	return 0;
+}
+
+static int stl_calibrate(struct stlink *sl)
+{
+	const struct stm_chip_params *chip = &stm_devids[stl_chip(sl)];
+	double best_rd = 0, best_wr = 0;
+	int size, rep, failed = 0;
+
+	stl_enter_debug(sl);
+	sl->read_blk = sl->write_blk = 0;
+	printf(" Transfer size calibration, %s firmware v%d J%d:\n"
+		   "   Size    Read KB/s   Write KB/s\n",
+		   sl->dev_path, sl->ver.STLink_ver, sl->ver.JTAG_ver);
+	for (size = 1024; size <= Q_BUF_LEN - 4 && size <= (int)chip->sram_size;
+		 size += 1024) {
+		uint64_t wr_ns = 0, rd_ns = 0;
+		double rd, wr;
+
+		for (rep = 0; rep < CAL_REPS && ! failed; rep++)
+			failed = stl_cal_pass(sl, chip->sram_base, size, size + rep,
+								  &wr_ns, &rd_ns);
+		if (failed) {
+			printf("  %5d    failed\n", size);
+			stl_xfer_recover(sl);
+			break;
+		}
+		/* Bytes per nsec is GB/sec, scale to KB/sec. */
+		rd = rd_ns ? (double)size * CAL_REPS / rd_ns * 1e9 / 1024 : 0;
+		wr = wr_ns ? (double)size * CAL_REPS / wr_ns * 1e9 / 1024 : 0;
+		printf("  %5d  %10.1f   %10.1f\n", size, rd, wr);
+		if (rd > best_rd)
+			best_rd = rd, sl->read_blk = size;
+		if (wr > best_wr)
+			best_wr = wr, sl->write_blk = size;
+	}
+	if (sl->read_blk == 0) {
+		fprintf(stderr, "Transfer calibration failed, keeping the default "
+				"sizes.\n");
+		sl->write_blk = 0;
+		return -1;
+	}
+	printf(" Using %d byte reads and %d byte writes, %d byte flash "
+		   "blocks.\n", sl->read_blk, sl->write_blk, stl_flash_blk_size(sl));
+	return 0;
+}
+
+/* Map the program file PATH read-only, with its size in *SIZE, so that
+ * the flash code reads it in block-sized pieces straight from the page
+ * cache, whatever the image size.  A file that cannot be mapped, such as
+ * a pipe, is read into a buffer instead, of at most MAX_SIZE bytes, and
+ * *MAPPED is cleared.  Only program= needs that, as it compares the page
+ * CRCs of the whole image; writing and verifying stream a pipe instead.
+ * Release it with stl_unmap_image().
+ */
+static uint8_t *stl_map_image(const char *path, int max_size, int *size,
+							  int *mapped)
+{
+	struct stat st;
+	uint8_t *buf = NULL, *more;
+	ssize_t len = 0, alloc = 0, res = 0;
+	const int fd = open(path, O_RDONLY);
+
+	if (fd < 0) {
+		fprintf(stderr, " Failed to open '%s': %s\n", path, strerror(errno));
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0) {
+		fprintf(stderr, " Failed to stat '%s': %s\n", path, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	*mapped = S_ISREG(st.st_mode) && st.st_size > 0 &&
+		(int)st.st_size == st.st_size &&
+		(buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+		!= MAP_FAILED;
+	if (*mapped)
+		len = st.st_size;
+	else
+		for (buf = NULL; len <= max_size; len += res) {
+			if (len == alloc) {
+				if ((int)(alloc + 64*1024) != alloc + 64*1024 ||
+					(more = realloc(buf, alloc + 64*1024)) == NULL) {
+					res = -1;
+					errno = EFBIG;
+					break;
+				}
+				buf = more;
+				alloc += 64*1024;
+			}
+			if ((res = read(fd, buf + len, alloc - len)) <= 0)
+				break;
+		}
+	close(fd);
+	if (res < 0) {
+		fprintf(stderr, " Failed to read '%s': %s\n", path, strerror(errno));
+		free(buf);
+		return NULL;
+	}
+	if ( ! *mapped && len > max_size) {
+		fprintf(stderr, " Program at %s is LARGER THAN FLASH, %#8.8x "
+				"bytes.\n", path, max_size);
+		free(buf);
+		return NULL;
+	}
+	if (len > max_size) {
+		fprintf(stderr, " Program is LARGER THAN FLASH and may not fit."
+				"  Trying anyway.\n"
+				"  Program at %s is %#8.8x bytes, flash is %#8.8x bytes.\n",
+				path, (int)len, max_size);
+	}
+	*size = len;
+	return buf;
+}
+
+static void stl_unmap_image(uint8_t *buf, int size, int mapped)
+{
+	if (mapped)
+		munmap(buf, size);
+	else
+		free(buf);
+}
+
+/* Open PATH if it is a pipe or other file that can only be read through
+ * once, for the callers that then take it STREAM_BLOCK bytes at a time.
+ * Returns the descriptor, or -1 for a regular file or on an error, with
+ * *ERR set for the latter.
+ */
+#define STREAM_BLOCK (64*1024)
+static int stl_open_stream(const char *path, int *err)
+{
+	struct stat st;
+	int fd;
+
+	*err = 0;
+	if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+		return -1;
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		fprintf(stderr, " Failed to open '%s': %s\n", path, strerror(errno));
+		*err = 1;
+	}
+	return fd;
+}
+
+/* Read up to LEN bytes from FD, stopping short only at the end of the
+ * input.  Returns the number read, or -1. */
+static int stl_read_block(int fd, uint8_t *buf, int len)
+{
+	int n = 0, res;
+
+	while (n < len && (res = read(fd, buf + n, len - n)) != 0) {
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		n += res;
+	}
+	return n;
+}
+
+/* Write the contents of file PATH into flash starting at ADDR.
+ * A pipe is written a block at a time as it is read.
+ */
+int stl_flash_fwrite(struct stlink *sl, const char* path,
+					 stm32_addr_t addr, int max_size)
+{
+	int ret, size, mapped, fd, err, n = 0;
+	uint8_t *buf;
+
+	if ((fd = stl_open_stream(path, &err)) >= 0) {
+		buf = malloc(STREAM_BLOCK);
+		ret = buf ? 0 : -1;
+		for (size = 0; ret == 0 &&
+				 (n = stl_read_block(fd, buf, STREAM_BLOCK)) > 0; size += n) {
+			if (n > max_size - size) {
+				fprintf(stderr, " Program at %s is LARGER THAN FLASH, "
+						"%#8.8x bytes.\n", path, max_size);
+				ret = -1;
+			} else
+				ret = stl_flash_write(sl, addr + size, buf, n);
+		}
+		if (ret == 0 && n < 0) {
+			fprintf(stderr, " Failed to read '%s': %s\n", path,
+					strerror(errno));
+			ret = -1;
+		}
+		free(buf);
+		close(fd);
+		return ret;
+	}
+	if (err || (buf = stl_map_image(path, max_size, &size, &mapped)) == NULL)
+		return -1;
+	ret = stl_flash_write(sl, addr, buf, size);
+	stl_unmap_image(buf, size, mapped);
+	if (ret & 0x0004) {
+		fprintf(stderr, "\n");
+	}
+	return ret;
+}
+
+/* Update the flash with the program file PATH, see stl_flash_update(). */
+int stl_flash_fupdate(struct stlink *sl, const char* path,
+					  stm32_addr_t addr, int max_size)
+{
+	int ret, size, mapped;
+	uint8_t *buf = stl_map_image(path, max_size, &size, &mapped);
+
+	if (buf == NULL)
+		return -1;
+	ret = stl_flash_update(sl, addr, buf, size);
+	stl_unmap_image(buf, size, mapped);
+	return ret;
+}
+
+/* Routines still left to implement. */
+
+/* Read from the ARM memory starting at offet ADDR, writing SIZE bytes
+ * into file PATH.
+ * The file is sized and mapped, so that the USB transfers land directly in
+ * the page cache.  Output that cannot be mapped, such as a pipe, is read
+ * into a buffer of READ_WINDOW bytes at a time and written normally, so
+ * memory use does not grow with SIZE.
+ */
+#define READ_WINDOW (64*1024)
+int stl_fread(struct stlink* sl, const char* path,
+				 stm32_addr_t addr, size_t size)
+{
+	const int fd = open(path, O_RDWR | O_TRUNC | O_CREAT, 0664);
+	size_t wsize, offset, done;
+	char *buf;
+	int ret = 0;
+
+	if (fd < 0) {
+		fprintf(stderr, " Failed to open '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (ftruncate(fd, size) == 0 &&
+		(buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0))
+		!= MAP_FAILED) {
+		ret = stl_read(sl, addr, buf, size);
+		munmap(buf, size);
+		close(fd);
+		if (ret) {
+			fprintf(stderr, " Failed to read target memory into '%s'.\n",
+					path);
+			return -1;
+		}
+		return 0;
+	}
+
+	buf = malloc(READ_WINDOW);
+	if (buf == NULL) {
+		fprintf(stderr, " Failed to allocate %d bytes for '%s'.\n",
+				READ_WINDOW, path);
+		close(fd);
+		return -1;
+	}
+	wsize = 0;
+	for (done = 0; done < size && ret == 0 && wsize == 0; done += offset) {
+		size_t len = size - done < READ_WINDOW ? size - done : READ_WINDOW;
+
+		ret = stl_read(sl, addr + done, buf, len);
+		offset = 0;
+		wsize = ret ? 0 : len;
+		while (wsize > 0) {
+			int res = write(fd, buf+offset, wsize);
+			if (res < 0) break;
+			offset += res;
+			wsize -= res;
+		}
+	}
+	free(buf);
+	if (ret || wsize != 0) {
+		fprintf(stderr, " Failed to write '%s': %s\n", path,
+				ret ? "target read failed" : strerror(errno));
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+
+#if 0
+/* Verify that ARM memory starting at ADDR matches the next chunk from FD.
+ * Return the number of bytes successfully compared, zero if finished,
+ * or -1 if a mismatch occured.
+ */
+
+int stlink_verify_chunk(struct stlink* sl, int fd, stm32_addr_t addr)
+{
+	char filebuf[128*1024], flashbuf[128*1024];
+	ssize_t file_rdsize, flash_rdsize;
+
+	file_rdsize = read(fd, filebuf, sizeof filebuf);
+	if (size < 0) {
+		fprintf(stderr, " Failed to read file '%s' during verify: %s\n",
+				path, strerror(errno));
+		return -1;
+		}
+		if (size == 0)
+			return 0;
+
+		flash_rdsize = stl_read(sl, addr, flashbuf, file_rdsize);
+		/* Unlikely, but check anyway. */
+		if (flash_rdsize != file_rdsize) {
+			fprintf(stderr, " Mismatched read size during verify, %d vs %d.\n",
+					flash_rdsize, file_rdsize);
+			return -1;
+		}
+
+		/* Extremely uninformative about the failure. */
+		if (memcmp(filebuf, flashbuf, file_rdsize) != 0) {
+			fprintf(stderr, " Failed flash verify.\n");
+			return -1;
+		}
+		addr += file_rdsize;
+	}
+#endif
+
+/* Check the SIZE bytes of flash at ADDR against BUF, using page CRCs
+ * computed on the target rather than reading it back.
+ * Returns 0 if everything matches, 1 with *BAD set to the offset of the
+ * first page that differs, or -1 if the CRCs could not be computed.
+ */
+static int stl_flash_check(struct stlink *sl, stm32_addr_t addr,
+						   const uint8_t *buf, int size, off_t *bad)
+{
+	const struct stm_chip_params *chip = &stm_devids[stl_chip(sl)];
+	uint32_t pgsize = chip->flash_pgsize;
+	int npages = size / pgsize, tail = (size % pgsize) & ~3, i;
+	uint32_t *crcs;
+	uint8_t last[4];
+
+	if (addr < chip->flash_base || (addr & 3) ||
+		addr + size > chip->flash_base + stl_flash_size(sl))
+		return -1;
+	crcs = malloc((npages + 1) * sizeof(uint32_t));
+	if (crcs == NULL || stl_flash_crc(sl, addr, pgsize, npages, crcs) ||
+		(tail && stl_flash_crc(sl, addr + npages*pgsize, tail, 1,
+							   crcs + npages))) {
+		free(crcs);
+		return -1;
+	}
+	for (i = 0; i <= npages; i++) {
+		uint32_t len = i < npages ? pgsize : tail;
+		if (len && crcs[i] != stl_image_crc(addr + i*pgsize, len, addr, buf,
+											size, stl_flash_erased(sl))) {
+			free(crcs);
+			*bad = i * pgsize;
+			return 1;
+		}
+	}
+	free(crcs);
+	/* The CRC unit takes whole words, so compare any last few bytes. */
+	if (size & 3) {
+		if (stl_read(sl, addr + (size & ~3), last, sizeof last))
+			return -1;
+		if (memcmp(last, buf + (size & ~3), size & 3)) {
+			*bad = npages * pgsize;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Verify that ARM memory starting at ADDR matches the SIZE bytes of BUF.
+ * With CRC set, flash is checked with page CRCs computed on the target,
+ * and only read back from the first page that differs, to find the
+ * difference.  That runs a helper in the target SRAM, so it is only for
+ * after programming, when the core has been reset anyway.
+ * The target memory is read in VERIFY_WINDOW sized pieces into a single
+ * heap buffer.
+ */
+#define VERIFY_WINDOW (64*1024)
+static int stl_verify_image(struct stlink *sl, stm32_addr_t addr,
+							const uint8_t *buf, int size, int crc)
+{
+	uint8_t *flashbuf = NULL;
+	off_t offset = 0;
+	int ret = -1;
+
+	if (size == 0)
+		return 0;
+	switch (crc ? stl_flash_check(sl, addr, buf, size, &offset) : -1) {
+	case 0:
+		return 0;
+	case 1:
+		if (sl->verbose)
+			fprintf(stderr, " Flash CRC differs at %8.8x, reading back.\n",
+					(uint32_t)(addr + offset));
+		break;
+	default:
+		offset = 0;
+		break;
+	}
+	flashbuf = malloc(VERIFY_WINDOW);
+	if (flashbuf == NULL)
+		return -1;
+
+	for (; offset < size; offset += VERIFY_WINDOW) {
+		size_t len = size - offset;
+		if (len > VERIFY_WINDOW)
+			len = VERIFY_WINDOW;
+		if (stl_read(sl, addr + offset, flashbuf, len) != 0) {
+			fprintf(stderr, " Failed to read target memory during verify.\n");
+			goto fail;
+		}
+		if (memcmp(buf + offset, flashbuf, len) != 0) {
+			size_t i = 0;
+			while (buf[offset + i] == flashbuf[i])
+				i++;
+			fprintf(stderr, " Failed flash verify at %8.8x.\n",
+					(uint32_t)(addr + offset + i));
+			goto fail;
+		}
+	}
+	ret = 0;
+ fail:
+	free(flashbuf);
+	return ret;
+}
+
+/* Verify that ARM memory starting at ADDR matches the contents of file
+ * PATH, by reading the memory back, leaving the target undisturbed.
+ * The file is mapped rather than copied, see stl_map_image(), and a pipe
+ * is compared a window at a time as it is read.
+ */
+int stlink_fverify(struct stlink* sl, const char* path,
+						stm32_addr_t addr)
+{
+	int size, mapped, fd, err, n = 0, ret;
+	uint8_t *buf;
+
+	if ((fd = stl_open_stream(path, &err)) >= 0) {
+		buf = malloc(VERIFY_WINDOW);
+		ret = buf ? 0 : -1;
+		for (size = 0; ret == 0 &&
+				 (n = stl_read_block(fd, buf, VERIFY_WINDOW)) > 0; size += n)
+			ret = stl_verify_image(sl, addr + size, buf, n, 0);
+		if (ret == 0 && n < 0) {
+			fprintf(stderr, " Failed to read '%s': %s\n", path,
+					strerror(errno));
+			ret = -1;
+		}
+		free(buf);
+		close(fd);
+		return ret;
+	}
+	if (err || (buf = stl_map_image(path, INT_MAX, &size, &mapped)) == NULL)
+		return -1;
+	ret = stl_verify_image(sl, addr, buf, size, 0);
+	stl_unmap_image(buf, size, mapped);
+	return ret;
+}
+
+#if 0
+#define STLINK_XFER_BLKSZ 2048
+static int stl_fread(struct stlink* sl, const char* path,
+						stm32_addr_t addr, size_t size)
+{
+	size_t off;
+
+	const int fd = open(path, O_RDWR | O_TRUNC | O_CREAT, 00664);
+	if (fd == -1) {
+		fprintf(stderr, " Failed to open '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	/* Copy using 1K/2K/4K blocks. */
+	for (off = 0; off < size; off += STLINK_XFER_BLKSZ) {
+		size_t read_size = STLINK_XFER_BLKSZ;
+		if ((off + read_size) > size)
+			read_size = off + read_size;
+
+		/* Round up size to always read whole words. */
+		if (read_size & 3)
+			read_size = (read_size + 4) & ~(3);
+
+		stlink_read_mem32(sl, addr + off, read_size);
+
+		if (write(fd, sl->data_buf, read_size) != (ssize_t)read_size) {
+			fprintf(stderr, "write() != read_size\n");
+			close(fd);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+#endif
+
+/*
+ * Kick a STLink until it is in a workable mode.
+ * If the STLink is not in an expected mode, attempt to have it exit back
+ * to mass storage mode.
+ * The only known unexpected mode is DFU mode, which requires a reset
+ * and re-plug process to exit.
+ * This has many status messages sinces it's ugly, bogus and flakey.
+ */
+static int stl_kick_mode(struct stlink *sl)
+{
+	int i;
+	int stlink_mode = stl_mode(sl);
+
+	/* Check if we are already in a usable mode. */
+	if (stlink_mode == STLinkDevMode_Debug ||
+		stlink_mode == STLinkDevMode_Mass)
+		return 0;
+
+#if 0
+	if (sl->verbose) {
+		sl->core_state = stl_get_status(sl);
+		fprintf(stderr, " STLink mode is %4.4x.\n"
+				" ARM status is 0x%4.4x: %s.\n",
+				stlink_mode, sl->core_state,
+				sl->core_state==STLINK_CORE_RUNNING ? "running" :
+				(sl->core_state==STLINK_CORE_HALTED ? "halted" : "unknown"));
+	}
+#endif
 
 	/* Otherwise assume that we are in DFU mode and attempt to exit back
 	 * to mass storage mode.  This is super painful and slow. */
@@ -1530,493 +5133,2468 @@ int stl_kick_mode(struct stlink *sl)
 #else
 	close(sl->fd);
 #endif
-	/* If this worked, the device has reset and disconnected.
-	 * A disconnect lasts for several seconds.
-	 * Give the kernel time to handle the fresh plug event.
-	 */
-	fprintf(stderr, "Waiting to reopen the STLink device at '%s' ...\n",
-			sl->dev_path);
-	for (i = 0; i < 10; i++) {
-		sl->fd = open(sl->dev_path, O_RDWR);
-		if (sl->fd >= 0) {
-			/* Give the STLink a few rounds to start working. */
-			stl_enter_SWD_mode(sl);
-			sl->core_state = stl_get_status(sl);
-			if (sl->verbose)
-				printf(" ARM status is 0x%4.4x: %s.\n", sl->core_state,
-					   sl->core_state==STLINK_CORE_RUNNING ? "running" :
-					   (sl->core_state==STLINK_CORE_HALTED ? "halted" : "unknown"));
-			if (sl->core_state==STLINK_CORE_RUNNING ||
-				sl->core_state==STLINK_CORE_HALTED)
-					return 0;
-			close(sl->fd);
-			sl->fd = -1;
-		} else {
-			if (sl->verbose)
-				printf(" Reopen failed.\n");
+	/* If this worked, the device has reset and disconnected.
+	 * A disconnect lasts for several seconds.
+	 * Give the kernel time to handle the fresh plug event.
+	 */
+	fprintf(stderr, "Waiting to reopen the STLink device at '%s' ...\n",
+			sl->dev_path);
+	for (i = 0; i < 10; i++) {
+		sl->fd = open(sl->dev_path, O_RDWR);
+		if (sl->fd >= 0) {
+			if (sl->backend->recover)
+				sl->backend->recover(sl);
+			/* Give the STLink a few rounds to start working. */
+			stl_enter_SWD_mode(sl);
+			sl->core_state = stl_get_status(sl);
+			if (sl->verbose)
+				printf(" ARM status is 0x%4.4x: %s.\n", sl->core_state,
+					   sl->core_state==STLINK_CORE_RUNNING ? "running" :
+					   (sl->core_state==STLINK_CORE_HALTED ? "halted" : "unknown"));
+			if (sl->core_state==STLINK_CORE_RUNNING ||
+				sl->core_state==STLINK_CORE_HALTED)
+					return 0;
+			close(sl->fd);
+			sl->fd = -1;
+		} else {
+			if (sl->verbose)
+				printf(" Reopen failed.\n");
+		}
+		sleep(1);
+	}
+	return -1;
+}
+
+/* Set sl->chip_index based on target chip ID or other characteristics.
+ * Called after the STLink type has been determined. */
+/* The index into stm_devids[] for IDCODE, or -1 if it is unknown.  The
+ * XL-density and STM32F105 parts share a device ID, so an entry that
+ * also matches CORE_ID is preferred. */
+static int stm_chip_index(uint32_t idcode, uint32_t core_id)
+{
+	int i, found = -1;
+
+	for (i = 0; stm_devids[i].name; i++)
+		if (idcode == stm_devids[i].dbgmcu_idcode) {
+			if (core_id == stm_devids[i].core_id)
+				return i;
+			if (found < 0)
+				found = i;
+		}
+	return found;
+}
+
+static int stm_id_chip(struct stlink* sl)
+{
+	uint32_t core_id = stl_get_core_id(sl);
+	uint32_t idcode;
+	int i;
+
+	/* This should be conditional on core_id.
+	 * If core_id == 0x0BB11477, then we have a Cortex-M0 and should read
+	 * the idcode from 0x40015800 instead of 0xE0042000. */
+	idcode = sl_rd32(sl, DBGMCU_IDCODE); 			/* At 0xE0042000 */
+	if (idcode == 0)								/* Cortex-M0 */
+		idcode = sl_rd32(sl, 0x40015800);
+	sl->core_id = core_id;
+	sl->cpu_idcode = idcode;
+	sl->chip_known = 1;
+	sl->id_from_cache = 0;
+	sl->flash_mem_size = 0;			/* Read again by stl_flash_size(). */
+
+	if (stl_verbose)
+		printf("SWD core ID %8.8x, MCU ID is %8.8x.\n",
+			   core_id, idcode);
+	for (i = 0; arm_cores[i].core_id; i++)
+		if (arm_cores[i].core_id == core_id)
+			break;
+	if (arm_cores[i].core_id == 0)
+		fprintf(stderr, "Warning: SWD core ID %8.8x did not match the "
+				"expected value of 0x-B--1477.\n", core_id);
+	if (stl_verbose)
+		printf("  %s\n", arm_cores[i].name);
+
+	if ((i = stm_chip_index(idcode, core_id)) >= 0)
+		sl->chip_index = i;
+
+	return 0;
+}
+
+/* Return the target's index into stm_devids[], identifying it first if
+ * that was deferred by a fast connect.  A cached identity is used without
+ * touching the target. */
+static int stl_chip(struct stlink *sl)
+{
+	int i;
+
+	if (sl->chip_known)
+		return sl->chip_index;
+	if (sl->id_from_cache) {
+		if ((i = stm_chip_index(sl->cpu_idcode, sl->core_id)) >= 0)
+			sl->chip_index = i;
+		sl->chip_known = 1;
+	} else
+		stm_id_chip(sl);
+	return sl->chip_index;
+}
+
+static void stm_info(struct stlink* sl)
+{
+	uint32_t cpu_id, devparam;
+
+	printf("Target STM32 MCU information:\n");
+	/* Always report the chip that is actually attached. */
+	if ( ! sl->chip_known || sl->id_from_cache)
+		stm_id_chip(sl);
+
+	/* Should also read the CPU ID base register at 0xe000ed00
+	 * Cortex-M0 0x41--c20-
+	 * Cortex-M3 0x411fc231
+	 */
+	cpu_id = sl_rd32(sl, 0xe000ed00);
+
+	printf(" Target DBGMC_IDCODE %3.3x (Rev ID %4.4x) %s.\n",
+		   sl->cpu_idcode & 0x0FFF, sl->cpu_idcode,
+		   stm_devids[sl->chip_index].name);
+	printf(" CPU ID base %8.8x.\n", cpu_id);
+	if (stl_flash_algo(sl))
+		printf(" Flash algorithm: %s.\n", stl_flash_algo(sl)->name);
+
+	/* Read the device parameters: flash size and serial number. */
+	/* The STM32F1 has the flash size at 0x1FFFf7e0. */
+	devparam = sl_rd32(sl, 0x1FFFf7e0);
+	/* The STM32F2 and STM32F4 have the flash size at 0x1FFF7A22. */
+	if (devparam != 0xffffffff) {
+		sl->flash_mem_size = devparam & 0xffff;
+		printf(" Flash size %dK (register %4.4x).\n",
+			   devparam & 0xff, devparam);
+		printf("  Information block %8.8x %8.8x %8.8x %8.8x.\n",
+			   sl_rd32(sl, 0x1FFFf800), sl_rd32(sl, 0x1FFFf804),
+			   sl_rd32(sl, 0x1FFFf808), sl_rd32(sl, 0x1FFFf80c));
+	} else if (0xffffffff != (devparam = sl_rd32(sl, 0x1FFF7A20))) {
+		sl->flash_mem_size = devparam >> 16;
+		printf(" Flash size %dK (register 0x1FFF7A20 %4.4x).\n",
+			   sl->flash_mem_size, devparam);
+		printf("  Information block %8.8x %8.8x %8.8x %8.8x.\n",
+			   sl_rd32(sl, 0x1FFFC000), sl_rd32(sl, 0x1FFFC004),
+			   sl_rd32(sl, 0x1FFFC008), sl_rd32(sl, 0x1FFFC00c));
+	} else if (0xffffffff != (devparam = sl_rd32(sl, 0x1FFFF7CC))) {
+		sl->flash_mem_size = devparam & 0xFFFF;
+		printf(" Flash size %dK (register 0x1FFFF7CC %4.4x).\n",
+			   sl->flash_mem_size, devparam);
+		printf("  Information block %8.8x %8.8x %8.8x %8.8x.\n",
+			   sl_rd32(sl, 0x1FFFF800), sl_rd32(sl, 0x1FFFF804),
+			   sl_rd32(sl, 0x1FFFF808), sl_rd32(sl, 0x1FFFF80c));
+	}
+
+	return;
+}
+
+/* Blink the LEDs on a STM32VLDiscovery board.
+ * This may be used as a visual liveness test in scripts.
+ * The LEDs are on PortC pins PC8 and PC9
+ * RM0041 Reference manual - STM32F100xx advanced ARM-based 32-bit MCUs
+ */
+#define GPIOB		0x40010C08		/* PortB register base */
+#define GPIOC		0x40011000		/* PortC register base */
+#define GPIOC_CRH	(GPIOC + 0x04)	/* Port configuration register high */
+#define GPIOC_ODR	(GPIOC + 0x0c)	/* Port output data register */
+#define LED_BLUE	(1<<8)
+#define LED_GREEN	(1<<9)
+
+static void stm_discovery_blink(struct stlink* sl)
+{
+	uint32_t PortC_hi_iocfg, APB1ENR_orig, APB2ENR_orig;
+	uint32_t APBnENR_orig[2];
+	int i;
+
+	PortC_hi_iocfg = sl_rd32(sl, GPIOC_CRH);
+	/* Read APB2ENR and APB1ENR at 0x40021018-1F */
+	stl_read(sl, 0x40021018, APBnENR_orig, sizeof APBnENR_orig);
+
+	/* Future: Enable GPIO ports. */
+	APB2ENR_orig = APBnENR_orig[0];  /* 0x40021018 */
+	APB1ENR_orig = APBnENR_orig[1];  /* 0x4002101C (yes, 1 is higher) */
+
+	if (sl->verbose)
+		fprintf(stderr, "GPIOC_CRH = 0x%08x, APB1ENR=%#08x, APB2ENR=%#08x\n",
+				PortC_hi_iocfg, APB1ENR_orig, APB2ENR_orig);
+
+	/* Make certain PC8/PC9 are GPIO outputs -- any speed will do. */
+	if ((PortC_hi_iocfg & 0xCC) != 0x00)
+		sl_wr32(sl, GPIOC_CRH, (PortC_hi_iocfg & ~0xff) | 0x11);
+	for (i = 0; i < 10; i++) {
+		sl_wr32(sl, GPIOC_ODR, LED_GREEN);
+		usleep(100* 1000);
+		sl_wr32(sl, GPIOC_ODR, LED_BLUE);
+		usleep(100* 1000);
+	}
+	/* Conditionally restore original GPIO settings. */
+	if ((PortC_hi_iocfg & 0xCC) != 0x00)
+		sl_wr32(sl, GPIOC_CRH, PortC_hi_iocfg);
+	return;
+}
+
+#if 0
+/* Set an interrupt to pending.  This should be used with caution as some
+ * interrupt handlers expect only hardware events e.g. a serial character
+ * has arrived. */
+/* Bitmap, must write as 32 bit word */
+const int IntrSetPendingBase = 0xE000E200;
+
+static void stm_raise_irq(struct stlink* sl, int irq_num)
+{
+	if (irq_num > 248) {
+		printf("Invalid interrupt number %d.  Cannot set pending.\n", irq_num);
+		return;
+	}
+	sl_wr32(sl, IntrSetPendingBase + ((irq_num & 0xE0)>>3),
+			1 << (irq_num & 0x1F));
+	return;
+}
+#endif
+
+struct dev_peripheral {			/* Peripheral device table */
+	const char *name;			/* TIM1, CAN1 etc */
+	uint32_t addr;				/* Address in STM32 space */
+	int unit_num;				/* Unit number, 0 if sole unit */
+	void (*show_func1)(struct stlink* sl, struct dev_peripheral *dev_per,
+					   uint32_t data_blk[]);
+	int extent;					/* Size of peripheral region */
+	uint32_t avail;				/* Chip feature bitmap */
+	int feature;				/* Dev feature bitmap e.g. ADC2 misisng regs  */
+};
+
+static void stm_show_timer(struct stlink* sl, struct dev_peripheral *dp,
+							 uint32_t data[])
+{
+	char active_map[4] = " H L";
+
+	printf("%s Timer %d at %8.8x:  %4.4x %4.4x %4.4x %4.4x"
+		   "  %4.4x %4.4x %4.4x %4.4x  %4.4x\n"
+		   " IntrEnb:%4.4x Status:%4.4x\n"
+		   " Count: %d Prescale: x%d Top: %d.\n"
+		   " Ch1: %d %c Ch2: %d %c Ch3: %d %c Ch4: %d %c.\n",
+		   dp->name, dp->unit_num, dp->addr,
+		   data[0], data[1], data[2], data[3],
+		   data[4], data[5], data[6], data[7], data[8],
+		   data[3], data[4],
+		   data[9], data[10]+1, data[11],
+		   data[13], active_map[(data[8] >> 0) & 3],
+		   data[14], active_map[(data[8] >> 4) & 3],
+		   data[15], active_map[(data[8] >> 8) & 3],
+		   data[16], active_map[(data[8] >> 12) & 3]);
+}		
+
+static void stm_show_CAN(struct stlink *sl, struct dev_peripheral *dp,
+						 uint32_t data[])
+{
+	uint32_t mode_map, scale_map, fifo_map, active_map;
+	int i;
+
+	printf("%s at %8.8x: MCR %8.8x MSR %8.8x\n"
+		   " Tx/Rx0/Rx1 %8.8x %8.8x %8.8x\n"
+		   " IntrEnb %8.8x Errors %8.8x BitTiming %8.8x\n",
+		   dp->name, dp->addr,
+		   data[0], data[1], data[2], data[3],
+		   data[4], data[5], data[6], data[7]);
+	/* Show FIFO contents. */
+	stl_rd32_cmd(sl, dp->addr + 0x180, 80);
+	printf(" CAN FIFOs\n"
+		   "  Tx0: %8.8x %8.8x %8.8x %8.8x\n"
+		   "  Tx1: %8.8x %8.8x %8.8x %8.8x\n"
+		   "  Tx2: %8.8x %8.8x %8.8x %8.8x\n"
+		   "  Rx0: %8.8x %8.8x %8.8x %8.8x\n"
+		   "  Rx1: %8.8x %8.8x %8.8x %8.8x\n",
+		   data[0], data[1], data[2], data[3],
+		   data[4], data[5], data[6], data[7],
+		   data[8], data[9], data[10], data[11],
+		   data[12], data[13], data[14], data[15],
+		   data[16], data[17], data[18], data[19]);
+
+	/* Show filter, Mode/scale/dest/on %8.8x %8.8x %8.8x.\n */
+	stl_rd32_cmd(sl, 0x40006600, 32);
+	printf(" Rx filter   FMR %8.8x\n"
+		   "  Mode/scale/dest/on %8.8x %8.8x %8.8x %8.8x.\n",
+		   data[0], data[1], data[3], data[5], data[7]);
+	mode_map = data[1];
+	scale_map = data[3];
+	fifo_map = data[5];
+	active_map = data[7];
+	stl_rd32_cmd(sl, 0x40006640, 32);
+	for (i = 0; i < 28; i++)
+		if (active_map & (1<<i)) {
+			printf("  Filter %d FIFO %c ", i, fifo_map & (1<<i) ? '1' : '0');
+			if (scale_map & (1<<i))
+				printf("%8.8x %8.8x\n",
+					   data[i*2], data[i*2 + 1]);
+			else
+				printf("%4.4x %4.4x (%3.3x %3.3x) %4.4x %4.4x (%3.3x %3.3x)\n",
+					   data[i*2] & 0xffff, data[i*2] >> 16,
+					   (data[i*2] >> 5) & 0x7ff, (data[i*2] >> 21) & 0x7ff,
+					   data[i*2 + 1] & 0xffff, data[i*2 + 1] >> 16,
+					   (data[i*2+1]>>5) & 0x7ff, (data[i*2+1]>>21) & 0x7ff);
+		}
+
+	return;
+}
+
+static void stm_show_DMA(struct stlink* sl, struct dev_peripheral *dp,
+						 uint32_t data[])
+{
+	int i;
+	printf("%s at %8.8x: interrupts %8.8x %8.8x\n",
+		   dp->name, dp->addr, data[0], data[1]);
+	for (i = 1; i <= 7; i++) {
+		int cb = i*5-3;
+		printf(" Channel %d: %8.8x  %d words %8.8x%s%s %8.8x%s\n",
+			   i, data[cb], data[cb+1],
+			   data[cb+2], data[cb] & 0x40 ? "++" : "  ",
+			   data[cb] & 0x10 ? "<-" : "->",
+			   data[cb+3], data[cb] & 0x80 ? "++" : "  ");
+	}
+	return;
+}
+
+static void stm_show_SPI(struct stlink* sl, struct dev_peripheral *dp,
+						 uint32_t data[])
+{
+	printf("%s at %8.8x: %8.8x %8.8x\n",
+		   dp->name, dp->addr, data[0], data[1]);
+}
+
+static void stm_show_USART(struct stlink* sl, struct dev_peripheral *dp,
+							 uint32_t data[])
+{
+	printf("%s at %8.8x: %4.4x %4.4x %4.4x %4.4x %4.4x %4.4x %4.4x %4.4x\n",
+		   dp->name, dp->addr, data[0], data[1], data[2], data[3],
+		   data[4], data[5], data[6], data[7]);
+}
+
+static void arm_show_systick(struct stlink* sl, struct dev_peripheral *dp,
+							 uint32_t data_blk[])
+{
+	printf("SysTick at %8.8x: Ctrl %4.4x reload %d, count %d\n"
+		   "  calibration %d (%#x)\n",
+		   dp->addr, data_blk[0], data_blk[1], data_blk[2],
+		   data_blk[3] & 0x00ffffff, data_blk[3]);
+}
+
+static void stm_show_dev(struct stlink* sl, struct dev_peripheral *dp,
+							 uint32_t data[])
+{
+	int i;
+	printf("%s at %8.8x:", dp->name, dp->addr);
+	for (i = 0; i < dp->extent/4; i++)
+		printf(" %4.4x", data[i]);
+	printf("\n");
+}
+
+static struct dev_peripheral dev_per[] = {
+	{"SysTick", 0xE000E010, 0, arm_show_systick, 16},
+	{"CAN1", 0x40006400, 1, stm_show_CAN, 32},
+	{"CAN2", 0x40006800, 2, stm_show_CAN, 32},
+	{"DMA1", 0x40020000, 1, stm_show_DMA, 8 + 20*7},
+	{"DMA2", 0x40020400, 2, stm_show_DMA, 8 + 20*7},
+	{"PORTA", 0x40010800, 0, stm_show_dev, 28},
+	{"PORTB", 0x40010C00, 0, stm_show_dev, 28},
+	{"PORTC", 0x40011000, 0, stm_show_dev, 28},
+	{"PORTD", 0x40011400, 0, stm_show_dev, 28},
+	{"PORTE", 0x40011800, 0, stm_show_dev, 28},
+	{"PORTF", 0x40011C00, 0, stm_show_dev, 28},
+	{"PORTG", 0x40012000, 0, stm_show_dev, 28},
+	{"SPI1", 0x40013000, 1, stm_show_SPI, 36},
+	{"SPI2", 0x40003800, 2, stm_show_SPI, 36},
+	{"SPI3", 0x40003C00, 3, stm_show_SPI, 36},
+	{"TIM1", 0x40012C00, 1, stm_show_timer, 76}, /* Do not read TIMx_DMAR */
+	{"TIM1a",0x40010000, 1, stm_show_timer, 76}, /* 32F4xx only */
+	{"TIM2", 0x40000000, 2, stm_show_timer, 76},
+	{"TIM3", 0x40000400, 3, stm_show_timer, 76},
+	{"TIM4", 0x40000800, 4, stm_show_timer, 76},
+	{"TIM5", 0x40000C00, 5, stm_show_timer, 76},
+	{"TIM6", 0x40001000, 6, stm_show_timer, 76},
+	{"TIM7", 0x40001400, 7, stm_show_timer, 76},
+	{"TIM8", 0x40010400, 8, stm_show_timer, 76}, 	/* 32F4xx */
+	{"TIM9", 0x40014000, 9, stm_show_timer, 76}, 	/* 32F4xx */
+	{"TIM10", 0x40014400, 10, stm_show_timer, 76}, /* 32F4xx */
+	{"TIM11", 0x40014800, 11, stm_show_timer, 76}, /* 32F4xx */
+	{"TIM12", 0x40001800, 12, stm_show_timer, 76},
+	{"TIM13", 0x40001C00, 13, stm_show_timer, 76},
+	{"TIM14", 0x40002000, 14, stm_show_timer, 76},
+	{"TIM15", 0x40014000, 15, stm_show_timer, 76},
+	{"TIM16", 0x40014400, 16, stm_show_timer, 76},
+	{"TIM17", 0x40014800, 17, stm_show_timer, 76},
+	{"USART1", 0x40013800, 1, stm_show_USART, 7*4},
+	{"USART2", 0x40004400, 2, stm_show_USART, 7*4},
+	{"USART3", 0x40004800, 3, stm_show_USART, 7*4},
+	{"USART4", 0x40004C00, 4, stm_show_USART, 7*4},
+	{"USART5", 0x40005000, 5, stm_show_USART, 7*4},
+	{"USART1a", 0x40011000, 1, stm_show_USART, 7*4}, /* 32F4xx */
+	{"USART6", 0x40011400, 6, stm_show_USART, 7*4},
+	{"I2C1", 0x40005400, 1, stm_show_dev, 36},
+	{"I2C2", 0x40005800, 2, stm_show_dev, 36},
+	{"I2C3", 0x40005C00, 3, stm_show_dev, 36},
+	{"DAC",  0x40007400, 3, stm_show_dev, 56},
+#if 0
+	{"I2S2", 0x40003400, 2, stm_show_dev, 0},
+	{"RTC", 0x40002800, 0, stm_show_RTC, 0},
+	{"WWDG", 0x40002C00, 0, stm_show_WWDG, 0},
+	{"IWDG", 0x40003000, 0, stm_show_IWDG, 0},
+#endif
+	/* I/O ports on newer devices. */
+	{"GPIOA", 0x48000000, 0, stm_show_dev, 44},
+	{"GPIOB", 0x48000400, 0, stm_show_dev, 44},
+	{"GPIOC", 0x48000800, 0, stm_show_dev, 44},
+	{"GPIOD", 0x48000C00, 0, stm_show_dev, 44},
+	{"GPIOE", 0x48001000, 0, stm_show_dev, 44},
+	{"GPIOF", 0x48001400, 0, stm_show_dev, 44},
+};
+
+static int stm32_dev_show(struct stlink* sl, const char *cmd_name)
+{
+	int i;
+	for (i = 0; i < sizeof(dev_per)/sizeof(dev_per[0]); i++) {
+		struct dev_peripheral *dp = &dev_per[i];
+		if (strcasecmp(dp->name, cmd_name) == 0) {
+			uint32_t *result = (void*)sl->data_buf;
+			if (dp->extent)
+				stl_rd32_cmd(sl, dp->addr, dp->extent);
+			dp->show_func1(sl, dp, result);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* Describe the USB location of DEV as "<bus>-<port>.<port>...", the same
+ * form the kernel uses in /sys/bus/usb/devices.  This is stable across
+ * re-plugging, unlike the device address.
+ */
+static void stl_usb_path(libusb_device *dev, char *buf, int len)
+{
+	uint8_t ports[8];
+	int nports = libusb_get_port_numbers(dev, ports, sizeof ports);
+	int i, pos;
+
+	pos = snprintf(buf, len, "%d-", libusb_get_bus_number(dev));
+	for (i = 0; i < nports && pos < len; i++)
+		pos += snprintf(buf + pos, len - pos, i ? ".%d" : "%d", ports[i]);
+}
+
+/* Read the probe serial number.  The STLink v2 reports its serial number
+ * as raw binary in the UTF-16 units of the string descriptor, so those are
+ * read directly and printed as hex, each unit as the byte it holds.  The
+ * ASCII conversion in libusb would turn most of them into '?'.  A serial
+ * that is printable ASCII, as from the V2-1, is returned as it is.
+ */
+static void stl_usb_serial(libusb_device_handle *handle,
+						   struct libusb_device_descriptor *desc,
+						   char *buf, int len)
+{
+	unsigned char raw[64];
+	int i, n, langid, printable = 1, pos = 0;
+
+	buf[0] = 0;
+	if (desc->iSerialNumber == 0)
+		return;
+	/* The first language ID, as libusb uses for ASCII strings. */
+	n = libusb_get_string_descriptor(handle, 0, 0, raw, sizeof raw);
+	if (n < 4)
+		return;
+	langid = raw[2] | (raw[3] << 8);
+	n = libusb_get_string_descriptor(handle, desc->iSerialNumber, langid,
+									 raw, sizeof raw);
+	if (n < 2 || raw[1] != LIBUSB_DT_STRING)
+		return;
+	if (n > raw[0])
+		n = raw[0];
+	for (i = 2; i + 1 < n; i += 2)
+		if (raw[i+1] != 0 || raw[i] <= 0x20 || raw[i] > 0x7e)
+			printable = 0;
+	for (i = 2; i + 1 < n && pos < len - 1; i += 2) {
+		unsigned unit = raw[i] | (raw[i+1] << 8);
+		if (printable)
+			buf[pos++] = unit;
+		else if (pos + (unit > 0xff ? 4 : 2) < len)
+			pos += sprintf(buf + pos, unit > 0xff ? "%04X" : "%02X", unit);
+		else
+			break;
+	}
+	buf[pos] = 0;
+}
+
+/* Find the STLink v2 probes on the bus.
+ * With a PROBE_SEL of NULL, return the first one found.  Otherwise match
+ * against the USB location, e.g. "2-1.4", or the probe serial number.
+ * When LIST is non-NULL, every probe is reported and its USB location is
+ * recorded in LIST, up to MAX_LIST entries.
+ * Returns an opened handle for the selected probe, or NULL.
+ */
+static libusb_device_handle *
+stl_usb_find(libusb_context *ctx, const char *probe_sel, char *path_ret,
+			 char *serial_ret, char (*list)[32], int max_list, int *nlist)
+{
+	libusb_device_handle *dev_handle = NULL;
+	libusb_device **devs;
+	ssize_t cnt;
+	int i, found = 0;
+
+	cnt = libusb_get_device_list(ctx, &devs);
+	if (cnt < 0) {
+		fprintf(stderr, "USB access failed, %s.\n", libusb_error_name(cnt));
+		return NULL;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		struct libusb_device_descriptor desc;
+		libusb_device_handle *handle;
+		char path[32], serial[64];
+
+		if (libusb_get_device_descriptor(devs[i], &desc) < 0 ||
+			desc.idVendor != USB_ST_VID || desc.idProduct != USB_STLINKv2_PID)
+			continue;
+		stl_usb_path(devs[i], path, sizeof path);
+		if (probe_sel == NULL && list == NULL) {
+			/* The common case, take the first probe. */
+		} else if (probe_sel && strcmp(probe_sel, path) == 0) {
+			/* Matched by location, no need to open to check. */
+		} else if (probe_sel || list) {
+			if (libusb_open(devs[i], &handle) != 0) {
+				if (stl_verbose)
+					printf("Unable to open the STLink at %s.\n", path);
+				continue;
+			}
+			stl_usb_serial(handle, &desc, serial, sizeof serial);
+			libusb_close(handle);
+			if (list) {
+				printf("STLink v2 at USB %s, serial %s.\n", path,
+					   serial[0] ? serial : "unknown");
+				if (found < max_list)
+					strcpy(list[found], path);
+				found++;
+				continue;
+			}
+			if (strcasecmp(probe_sel, serial) != 0)
+				continue;
+		}
+		if (libusb_open(devs[i], &dev_handle) != 0) {
+			fprintf(stderr, "Unable to open the STLink at USB %s.\n", path);
+			dev_handle = NULL;
+			break;
+		}
+		strcpy(path_ret, path);
+		stl_usb_serial(dev_handle, &desc, serial_ret, 64);
+		break;
+	}
+	libusb_free_device_list(devs, 1);
+	if (nlist)
+		*nlist = found;
+	return dev_handle;
+}
+
+/* Report the attached STLink v2 probes, recording up to MAX of their USB
+ * locations in LIST.  Returns the number found.
+ */
+int stl_usb_list(char (*list)[32], int max)
+{
+	libusb_context *ctx;
+	char none[1][32];
+	int found = 0;
+
+	if (list == NULL) {			/* Only report the probes. */
+		list = none;
+		max = 0;
+	}
+	if (libusb_init(&ctx) < 0) {
+		fprintf(stderr, "Failed to initialize USB access.\n");
+		return 0;
+	}
+	stl_usb_find(ctx, NULL, NULL, NULL, list, max, &found);
+	libusb_exit(ctx);
+	return found;
+}
+
+/* Open the STLink selected by PROBE_SEL (see stl_usb_find()), filling in
+ * the caller-allocated probe context SL.
+ * Unless RESET is set, an already configured probe is attached as-is,
+ * which saves the USB reset and re-enumeration time.
+ * Each probe has its own libusb context, so that probes can be driven
+ * from independent threads without sharing any state.
+ */
+struct stlink *stl_usb_scan(struct stlink *sl, const char *probe_sel,
+							int reset)
+{
+	libusb_device_handle *dev_handle;
+	libusb_context *ctx;
+	int r;
+
+	memset(sl, 0, sizeof *sl);
+	r = libusb_init(&ctx);
+	if (r < 0) {
+		fprintf(stderr, "Failed to scan USB devices: %s\n",
+				libusb_error_name(r));
+		return NULL;
+	}
+
+	dev_handle = stl_usb_find(ctx, probe_sel, sl->usb_path, sl->serial,
+							  NULL, 0, NULL);
+	if (dev_handle == NULL) {
+		if (stl_verbose)
+			printf("No USB STLink %s%sfound.\n", probe_sel ? probe_sel : "",
+				   probe_sel ? " " : "");
+		libusb_exit(ctx);
+		return NULL;
+	}
+
+	if (stl_verbose) {
+		libusb_device *this_dev = libusb_get_device(dev_handle);
+		printf("Found a STLink v2 on USB bus %d device %d (%s).\n",
+			   libusb_get_bus_number(this_dev),
+			   libusb_get_device_address(this_dev), sl->usb_path);
+	}
+
+	/* We know that configuration 1 is the only one.  Setting it again
+	 * is itself a lightweight reset, so a fast attach leaves it alone. */
+	if (reset) {
+		r = libusb_reset_device(dev_handle);
+		r = libusb_set_configuration(dev_handle, 1);
+	} else {
+		int config = 0;
+		libusb_get_configuration(dev_handle, &config);
+		if (config != 1)
+			r = libusb_set_configuration(dev_handle, 1);
+	}
+	r = libusb_claim_interface(dev_handle, 0);
+#if 0
+	if (libusb_set_interface_alt_setting(dev_handle, 0, 0) < 0){
+		printf("usb_set_altinterface failed.\n");
+	}
+#endif
+
+	sl->dev_path = sl->usb_path;
+	sl->fd = -1;
+	sl->verbose = stl_verbose;
+	sl->usb_ctx = ctx;
+	sl->usb_hand = dev_handle;
+	sl->backend = &stl_usb_backend;
+	sl->core_state = STLINK_CORE_UNKNOWN_STATE;
+
+	return sl;
+}
+
+/* The simulated STLink and STM32 target.
+ * This is a transport backend that executes the STLink v2 command set
+ * in-process, against a model of the target: flash and SRAM, the FPEC
+ * flash controller with its unlock/program/erase state machine and
+ * timing, the ID registers, and a Cortex-M core that runs the flash
+ * loaders with a small Thumb interpreter.
+ * It lets us test and benchmark transfer size, pipelining and loader
+ * changes without a probe.  Everything runs on a modelled clock, so the
+ * timing report at close is the same on every run and every machine.
+ *
+ * The timing model is deliberately simple:
+ *  - Each transaction takes a USB latency to reach the STLink, and again
+ *    for the response to return to the host.
+ *  - The STLink handles one command at a time, with a fixed overhead, the
+ *    USB full-speed data rate and a SWD rate for target memory accesses.
+ *  - The host waits only when it blocks on a result, or when it already
+ *    has STL_XFER_DEPTH transactions outstanding.
+ *  - The target core executes one Thumb instruction per SIM_INSN_NS, and
+ *    the flash program and erase times are the typical datasheet values.
+ * The 32L1 flash controller is modelled for page erase, word and
+ * half-page programming, but not the data EEPROM or option bytes.
+ */
+#define SIM_USB_LATENCY_NS	250000	/* Host to STLink, each direction. */
+#define SIM_USB_BYTE_NS		1000	/* ~1MB/sec full-speed bulk */
+#define SIM_SWD_BYTE_NS		2500	/* ~400KB/sec target memory access */
+#define SIM_CMD_NS			20000	/* STLink firmware command overhead */
+#define SIM_SUBMIT_NS		5000	/* Host CPU time to queue a transaction */
+#define SIM_INSN_NS			125		/* 8MHz HSI clock after reset */
+#define F1_PROG_NS			52500	/* Half-word program, 40-70 usec */
+#define F1_ERASE_NS			30000000	/* Page or mass erase, 20-40 msec */
+#define F4_PROG_NS			16000	/* Byte/half/word program */
+#define L1_PROG_NS			3280000	/* Page erase, word or half-page write */
+#define SIM_NEVER			((uint64_t)-1)
+
+/* A F1-style flash program/erase controller, or the F4 or L1 controller.
+ * The XL-density parts have a second controller for the upper bank. */
+struct stl_sim_fpec {
+	uint32_t regs;				/* Register base address */
+	uint32_t lo, hi;			/* The flash addresses controlled. */
+	int key_state;				/* 0 locked, 1 KEY1 seen, 2 unlocked */
+	int prg_key_state;			/* The same, for the L1 PRGKEYR */
+	uint32_t sr, cr, ar;		/* The L1 PECR is kept in CR. */
+	uint32_t hp_addr;			/* The L1 half-page being written */
+	int hp_words;
+	uint64_t busy_until;
+	int op_pending;				/* Report EOP when no longer busy. */
+};
+
+struct stl_sim {
+	const struct stm_chip_params *chip;
+	int f4;						/* Use the F4 flash controller model. */
+	int l1;						/* Use the L1 model, erased to zero. */
+	uint32_t cpuid;
+	uint8_t *flash, *sram;
+	uint32_t flash_size;		/* The part's own, see ",flash=". */
+	int nfpec;
+	struct stl_sim_fpec fpec[2];
+	int mode;					/* STLink mode, see STLink_Device_Modes */
+	int halted;					/* The core is halted in debug state. */
+	int locked_up;				/* The core hit an instruction we can't run */
+	uint32_t reg[21];			/* In struct ARMcoreRegs order. */
+	uint32_t fp_addr[8];		/* Flash patch breakpoints */
+	/* The modelled clocks, in nanoseconds. */
+	uint64_t now;				/* Time of the current target access. */
+	uint64_t core_ns;			/* The core has executed up to here. */
+	uint64_t host_ns;			/* The host program. */
+	uint64_t probe_free_ns;		/* The STLink is busy until. */
+	uint64_t last_done_ns;		/* The final queued response arrives. */
+	uint64_t ring[STL_XFER_DEPTH];	/* Completion times of queued xfers. */
+	int ring_idx;
+	unsigned long fail_every;	/* Lose every Nth response, for testing. */
+	unsigned long late_every;	/* Delay every Nth response past its timeout. */
+	/* Late responses waiting in the STLink, in order.  The next reads
+	 * each take the oldest, unless the host resynchronizes first. */
+	uint8_t late[STL_XFER_DEPTH + 1][Q_BUF_LEN];
+	int late_len[STL_XFER_DEPTH + 1];
+	int nlate;
+	int vdd_mv;					/* The target supply voltage. */
+	uint32_t crc;				/* The CRC unit data register. */
+	/* Statistics for the closing report. */
+	unsigned long lost, late_cnt, shifted, cmds, waits, stalls, insns;
+	unsigned long flash_progs, flash_erases;
+	uint64_t bytes_out, bytes_in, probe_busy_ns;
+};
+
+static int sim_rd(struct stl_sim *sim, uint32_t addr, int size, uint32_t *val);
+static int sim_wr(struct stl_sim *sim, uint32_t addr, int size, uint32_t val);
+
+static uint32_t sim_le_get(const uint8_t *p, int size)
+{
+	uint32_t val = p[0];
+	if (size > 1)
+		val |= p[1] << 8;
+	if (size > 2)
+		val |= (p[2] << 16) | ((uint32_t)p[3] << 24);
+	return val;
+}
+
+static void sim_le_put(uint8_t *p, int size, uint32_t val)
+{
+	p[0] = val;
+	if (size > 1)
+		p[1] = val >> 8;
+	if (size > 2)
+		p[2] = val >> 16, p[3] = val >> 24;
+}
+
+/* Bring the flash controller status up to date with the current time. */
+static void sim_fpec_update(struct stl_sim *sim, struct stl_sim_fpec *fp)
+{
+	if (fp->op_pending && sim->now >= fp->busy_until) {
+		fp->op_pending = 0;
+		/* The F4 only reports EOP with the interrupt enabled. */
+		if (sim->l1)
+			fp->sr |= L15_FLASH_SR_EOP;
+		else if ( ! sim->f4 || (fp->cr & 0x01000000))
+			fp->sr |= sim->f4 ? 0x01 : FLASH_SR_EOP;
+	}
+}
+
+static int sim_fpec_busy(struct stl_sim *sim, struct stl_sim_fpec *fp)
+{
+	return sim->now < fp->busy_until;
+}
+
+static struct stl_sim_fpec *sim_fpec_for(struct stl_sim *sim, uint32_t addr)
+{
+	int i;
+	for (i = 0; i < sim->nfpec; i++)
+		if (addr >= sim->fpec[i].lo && addr < sim->fpec[i].hi)
+			return &sim->fpec[i];
+	return &sim->fpec[0];
+}
+
+/* Start a program or erase operation taking DURATION. */
+static void sim_fpec_start(struct stl_sim *sim, struct stl_sim_fpec *fp,
+						   uint64_t duration)
+{
+	uint64_t start = fp->busy_until > sim->now ? fp->busy_until : sim->now;
+	fp->busy_until = start + duration;
+	fp->op_pending = 1;
+}
+
+/* The F4 sector layout: four 16K, one 64K, then 128K sectors. */
+static uint32_t sim_f4_sector_base(int sector)
+{
+	if (sector < 4)
+		return sector * 16*1024;
+	if (sector == 4)
+		return 64*1024;
+	return (sector - 4) * 128*1024;
+}
+
+static void sim_flash_erase(struct stl_sim *sim, uint32_t base, uint32_t len)
+{
+	uint32_t flash_base = sim->chip->flash_base;
+	uint32_t size = sim->flash_size;
+
+	if (base < flash_base || base >= flash_base + size)
+		return;
+	if (base + len > flash_base + size)
+		len = flash_base + size - base;
+	memset(sim->flash + (base - flash_base), 0xff, len);
+	sim->flash_erases++;
+}
+
+/* A step through a two key unlock sequence. */
+static int sim_key_step(int state, uint32_t val, uint32_t key1, uint32_t key2)
+{
+	if (state == 0 && val == key1)
+		return 1;
+	if (state == 1 && val == key2)
+		return 2;
+	return state == 2 ? 2 : 0;
+}
+
+/* The L1 controller registers.  PECR is unlocked with PEKEYR, and then
+ * the program memory with PRGKEYR.  Setting PELOCK re-locks both. */
+static void sim_l1_fpec_wr(struct stl_sim *sim, struct stl_sim_fpec *fp,
+						   uint32_t reg, uint32_t val)
+{
+	sim_fpec_update(sim, fp);
+	switch (reg) {
+	case 0x04:					/* PECR */
+		if (fp->key_state != 2)
+			break;
+		if (val & L15_FLASH_PECR_PELOCK)
+			fp->key_state = fp->prg_key_state = 0;
+		else if (val & L15_FLASH_PECR_PRGLOCK)
+			fp->prg_key_state = 0;
+		fp->cr = val & ~0x07;
+		fp->hp_words = 0;
+		break;
+	case 0x0c:					/* PEKEYR */
+		fp->key_state = sim_key_step(fp->key_state, val, FLASH_PEKEY1,
+									 FLASH_PEKEY2);
+		break;
+	case 0x10:					/* PRGKEYR, only once PECR is unlocked */
+		if (fp->key_state == 2)
+			fp->prg_key_state = sim_key_step(fp->prg_key_state, val,
+											 FLASH_PRGKEY1, FLASH_PRGKEY2);
+		break;
+	case 0x18:					/* SR, the error and EOP bits clear on 1 */
+		fp->sr &= ~(val & (L15_FLASH_SR_ERRS | L15_FLASH_SR_EOP));
+		break;
+	}
+}
+
+static uint32_t sim_l1_fpec_rd(struct stl_sim *sim, struct stl_sim_fpec *fp,
+							   uint32_t reg)
+{
+	sim_fpec_update(sim, fp);
+	switch (reg) {
+	case 0x04:
+		return fp->cr | 0x04 | (fp->key_state != 2 ? 0x01 : 0) |
+			(fp->prg_key_state != 2 ? 0x02 : 0);
+	case 0x18:					/* BSY, or READY */
+		return fp->sr | (sim_fpec_busy(sim, fp) ? L15_FLASH_SR_BSY : 0x08);
+	}
+	return 0;
+}
+
+/* A word write to the L1 program memory: a page erase with ERASE set, a
+ * word of a half-page with FPRG, or else a single word program. */
+static int sim_l1_flash_wr(struct stl_sim *sim, struct stl_sim_fpec *fp,
+						   uint32_t addr, int size, uint32_t val)
+{
+	uint8_t *p = sim->flash + (addr - sim->chip->flash_base);
+
+	if (fp->prg_key_state != 2) {
+		fp->sr |= L15_FLASH_SR_WRPERR;
+		return 0;
+	}
+	if (sim_fpec_busy(sim, fp))
+		sim->now = fp->busy_until;
+	sim_fpec_update(sim, fp);
+	if (size != 4 || (addr & 3)) {
+		fp->sr |= L15_FLASH_SR_SIZERR;
+		return 0;
+	}
+	if (fp->cr & L15_FLASH_PECR_ERASE) {
+		uint32_t pgsize = sim->chip->flash_pgsize;
+		memset(sim->flash + ((addr - sim->chip->flash_base) & ~(pgsize-1)),
+			   0, pgsize);
+		sim->flash_erases++;
+		sim_fpec_start(sim, fp, L1_PROG_NS);
+		return 0;
+	}
+	if (fp->cr & L15_FLASH_PECR_FPRG) {
+		if (fp->hp_words == 0 ? (addr & (L15_HALF_PAGE - 1)) != 0 :
+			addr != fp->hp_addr + 4*fp->hp_words) {
+			fp->sr |= L15_FLASH_SR_PGAERR;
+			fp->hp_words = 0;
+			return 0;
+		}
+		if (fp->hp_words == 0)
+			fp->hp_addr = addr;
+		sim_le_put(p, 4, val);
+		if (++fp->hp_words < L15_HALF_PAGE / 4)
+			return 0;
+		fp->hp_words = 0;
+	} else
+		sim_le_put(p, 4, val);
+	sim_fpec_start(sim, fp, L1_PROG_NS);
+	sim->flash_progs++;
+	return 0;
+}
+
+/* A write to a flash controller register. */
+static void sim_fpec_wr(struct stl_sim *sim, struct stl_sim_fpec *fp,
+						uint32_t reg, uint32_t val)
+{
+	uint32_t lock_bit = sim->f4 ? 0x80000000 : FLASH_CR_LOCK;
+	uint32_t strt_bit = sim->f4 ? F4_FLASH_CR_STRT : FLASH_CR_STRT;
+
+	if (sim->l1) {
+		sim_l1_fpec_wr(sim, fp, reg, val);
+		return;
+	}
+	sim_fpec_update(sim, fp);
+	switch (reg) {
+	case 0x04:					/* KEYR */
+		if (fp->key_state == 0 && val == FLASH_KEY1)
+			fp->key_state = 1;
+		else if (fp->key_state == 1 && val == FLASH_KEY2) {
+			fp->key_state = 2;
+			fp->cr &= ~lock_bit;
+		} else if (fp->key_state != 2) {
+			/* A bad key sequence locks the FPEC until reset.  We are
+			 * forgiving and allow a fresh attempt. */
+			fp->key_state = 0;
+		}
+		break;
+	case 0x0c:					/* SR, the error and EOP bits clear on 1 */
+		fp->sr &= ~(val & (sim->f4 ? 0xF3 : 0x34));
+		break;
+	case 0x10:					/* CR */
+		if (fp->key_state != 2)
+			break;
+		if (val & lock_bit) {
+			fp->key_state = 0;
+			fp->cr = val;
+			break;
+		}
+		if (sim_fpec_busy(sim, fp)) {
+			fp->cr = (fp->cr & strt_bit) | (val & ~strt_bit);
+			break;
+		}
+		fp->cr = val & ~strt_bit;
+		if ( ! (val & strt_bit))
+			break;
+		if (sim->f4) {
+			if (val & FLASH_CR_MER) {
+				sim_flash_erase(sim, sim->chip->flash_base,
+								sim->flash_size);
+				sim_fpec_start(sim, fp, 8000000000ULL);
+			} else if (val & 0x02) {	/* SER, sector number in SNB */
+				int sector = (val >> 3) & 0x0f;
+				uint32_t base = sim_f4_sector_base(sector);
+				uint32_t len = sim_f4_sector_base(sector+1) - base;
+				sim_flash_erase(sim, sim->chip->flash_base + base, len);
+				sim_fpec_start(sim, fp, len <= 16*1024 ? 400000000ULL :
+							   (len <= 64*1024 ? 1100000000ULL :
+								2000000000ULL));
+			}
+		} else if (val & FLASH_CR_MER) {
+			sim_flash_erase(sim, fp->lo, fp->hi - fp->lo);
+			sim_fpec_start(sim, fp, F1_ERASE_NS);
+		} else if (val & FLASH_CR_PER) {
+			uint32_t pgsize = sim->chip->flash_pgsize;
+			sim_flash_erase(sim, fp->ar & ~(pgsize-1), pgsize);
+			sim_fpec_start(sim, fp, F1_ERASE_NS);
+		}
+		break;
+	case 0x14:					/* AR, F1 only */
+		if ( ! sim->f4 && ! sim_fpec_busy(sim, fp))
+			fp->ar = val;
+		break;
+	}
+}
+
+static uint32_t sim_fpec_rd(struct stl_sim *sim, struct stl_sim_fpec *fp,
+							uint32_t reg)
+{
+	if (sim->l1)
+		return sim_l1_fpec_rd(sim, fp, reg);
+	sim_fpec_update(sim, fp);
+	switch (reg) {
+	case 0x0c:
+		if (sim_fpec_busy(sim, fp))
+			return fp->sr | (sim->f4 ? F4_FLASH_SR_BSY : FLASH_SR_BSY);
+		return fp->sr;
+	case 0x10:	return fp->cr;
+	case 0x14:	return sim->f4 ? 0 : fp->ar;
+	}
+	return 0;
+}
+
+/* A write to the flash memory array itself.  This only does something
+ * when the controller is in programming mode. */
+static int sim_flash_wr(struct stl_sim *sim, uint32_t addr, int size,
+						uint32_t val)
+{
+	struct stl_sim_fpec *fp = sim_fpec_for(sim, addr);
+	uint8_t *p = sim->flash + (addr - sim->chip->flash_base);
+
+	if (sim->l1)
+		return sim_l1_flash_wr(sim, fp, addr, size, val);
+	sim_fpec_update(sim, fp);
+	if ( ! (fp->cr & FLASH_CR_PG) || fp->key_state != 2)
+		return 0;
+	/* The AHB stalls flash writes while an operation is in progress. */
+	if (sim_fpec_busy(sim, fp))
+		sim->now = fp->busy_until;
+	sim_fpec_update(sim, fp);
+	if (sim->f4) {
+		static const int psize_bytes[4] = {1, 2, 4, 8};
+		int psize = psize_bytes[(fp->cr >> 8) & 3];
+		if (size != psize && ! (psize == 8 && size == 4)) {
+			fp->sr |= F4_FLASH_SR_PGPERR;
+			return 0;
 		}
-		sleep(1);
+		if (sim->vdd_mv < (psize == 1 ? 1800 : psize == 2 ? 2100 : 2700)) {
+			fp->sr |= F4_FLASH_SR_PGPERR;
+			return 0;
+		}
+		sim_le_put(p, size, sim_le_get(p, size) & val);
+		/* An x64 double-word is programmed once both words are written. */
+		if (psize == 8 && ! (addr & 4))
+			return 0;
+		sim_fpec_start(sim, fp, F4_PROG_NS);
+	} else {
+		uint32_t old = sim_le_get(p, 2);
+		if (size != 2 || (addr & 1)) {
+			fp->sr |= FLASH_SR_PGERR;
+			return 0;
+		}
+		/* Only an erased half-word, or writing zero, is allowed. */
+		if (old != 0xffff && (val & 0xffff) != 0) {
+			fp->sr |= FLASH_SR_PGERR;
+			return 0;
+		}
+		sim_le_put(p, 2, val);
+		sim_fpec_start(sim, fp, F1_PROG_NS);
 	}
-	return -1;
+	sim->flash_progs++;
+	return 0;
 }
 
-/* Set sl->chip_index based on target chip ID or other characteristics.
- * Called after the STLink type has been determined. */
-static int stm_id_chip(struct stlink* sl)
+/* Target memory and register reads.  SIZE is 1, 2 or 4 bytes.
+ * Returns non-zero for a bus fault.
+ */
+static int sim_rd(struct stl_sim *sim, uint32_t addr, int size, uint32_t *val)
 {
-	uint32_t core_id = stl_get_core_id(sl);
-	uint32_t idcode;
+	const struct stm_chip_params *chip = sim->chip;
+	uint32_t word_addr = addr & ~3, shift = (addr & 3) * 8;
+	uint32_t word;
 	int i;
 
-	/* This should be conditional on core_id.
-	 * If core_id == 0x0BB11477, then we have a Cortex-M0 and should read
-	 * the idcode from 0x40015800 instead of 0xE0042000. */
-	idcode = sl_rd32(sl, DBGMCU_IDCODE); 			/* At 0xE0042000 */
-	if (idcode == 0)								/* Cortex-M0 */
-		idcode = sl_rd32(sl, 0x40015800);
-	sl->cpu_idcode = idcode;
+	if (addr < sim->flash_size)		/* Boot alias of the flash */
+		addr += chip->flash_base;
+	if (addr >= chip->flash_base && addr + size <= chip->flash_base +
+		sim->flash_size) {
+		struct stl_sim_fpec *fp = sim_fpec_for(sim, addr);
+		/* Reads stall while the flash is busy. */
+		if ( ! sim->f4 && sim_fpec_busy(sim, fp))
+			sim->now = fp->busy_until;
+		*val = sim_le_get(sim->flash + (addr - chip->flash_base), size);
+		return 0;
+	}
+	if (addr >= chip->sram_base && addr + size <= chip->sram_base +
+		chip->sram_size) {
+		*val = sim_le_get(sim->sram + (addr - chip->sram_base), size);
+		return 0;
+	}
+	for (i = 0; i < sim->nfpec; i++)
+		if (word_addr >= sim->fpec[i].regs &&
+			word_addr < sim->fpec[i].regs + 0x24) {
+			word = sim_fpec_rd(sim, &sim->fpec[i],
+							   word_addr - sim->fpec[i].regs);
+			goto got_word;
+		}
+	switch (word_addr) {
+	case DBGMCU_IDCODE:
+		word = chip->core_id == 0x0bb11477 ? 0 : chip->dbgmcu_idcode;
+		break;
+	case 0x40015800:			/* The Cortex-M0 DBGMCU */
+		word = chip->core_id == 0x0bb11477 ? chip->dbgmcu_idcode : 0;
+		break;
+	case 0xE000ED00:			/* CPUID base */
+		word = sim->cpuid;
+		break;
+	case CRC_REGS:				/* CRC_DR */
+		word = sim->crc;
+		break;
+	case 0x1FFFF7E0:			/* F1 flash size in KB */
+		word = sim->f4 ? 0xffffffff : 0xffff0000 | (sim->flash_size >> 10);
+		break;
+	case 0x1FFFF7CC:			/* F0 flash size in KB */
+		word = 0xffff0000 | (sim->flash_size >> 10);
+		break;
+	case 0x1FFF7A20:			/* F4 flash size in the upper half */
+		word = sim->f4 ? ((sim->flash_size >> 10) << 16) | 0xffff
+			: 0xffffffff;
+		break;
+	default:
+		/* The system memory reads as erased, peripherals as zero. */
+		word = (word_addr >> 28) == 1 ? 0xffffffff : 0;
+		break;
+	}
+got_word:
+	word >>= shift;
+	*val = size == 4 ? word : word & ((1 << (size*8)) - 1);
+	return 0;
+}
 
-	if (verbose)
-		printf("SWD core ID %8.8x, MCU ID is %8.8x.\n",
-			   core_id, idcode);
-	for (i = 0; arm_cores[i].core_id; i++)
-		if (arm_cores[i].core_id == core_id)
-			break;
-	if (arm_cores[i].core_id == 0)
-		fprintf(stderr, "Warning: SWD core ID %8.8x did not match the "
-				"expected value of 0x-B--1477.\n", core_id);
-	if (verbose)
-		printf("  %s\n", arm_cores[i].name);
+static int sim_wr(struct stl_sim *sim, uint32_t addr, int size, uint32_t val)
+{
+	const struct stm_chip_params *chip = sim->chip;
+	int i;
 
-	for (i = 0; stm_devids[i].name; i++)
-		if (idcode == stm_devids[i].dbgmcu_idcode) {
-			sl->chip_index = i;
-			break;
+	if (addr < sim->flash_size)
+		addr += chip->flash_base;
+	if (addr >= chip->flash_base && addr + size <= chip->flash_base +
+		sim->flash_size)
+		return sim_flash_wr(sim, addr, size, val);
+	if (addr >= chip->sram_base && addr + size <= chip->sram_base +
+		chip->sram_size) {
+		sim_le_put(sim->sram + (addr - chip->sram_base), size, val);
+		return 0;
+	}
+	for (i = 0; i < sim->nfpec; i++)
+		if (addr >= sim->fpec[i].regs && addr < sim->fpec[i].regs + 0x24) {
+			sim_fpec_wr(sim, &sim->fpec[i], addr - sim->fpec[i].regs,
+						val << ((addr & 3) * 8));
+			return 0;
 		}
-
+	if (addr == CRC_REGS && size == 4)
+		sim->crc = stm_crc32_word(sim->crc, val);
+	else if (addr == CRC_REGS + 8 && (val & 1))
+		sim->crc = 0xffffffff;	/* CRC_CR reset */
+	/* Everything else is a peripheral that we ignore. */
 	return 0;
 }
 
-static void stm_info(struct stlink* sl)
+/* The Thumb interpreter.
+ * This covers the Thumb-16 instructions, and the common Thumb-2 load/store,
+ * branch, and immediate data processing forms used by flash loaders.
+ * IT blocks, exceptions and the multiply/divide extensions are not handled.
+ * An instruction we cannot execute locks up the core, as a fault handler
+ * in erased flash would.
+ */
+#define APSR_N	0x80000000
+#define APSR_Z	0x40000000
+#define APSR_C	0x20000000
+#define APSR_V	0x10000000
+
+static int sim_cond(struct stl_sim *sim, int cond)
 {
-	uint32_t cpu_id, devparam;
+	uint32_t f = sim->reg[16];
+	int n = !!(f & APSR_N), z = !!(f & APSR_Z);
+	int c = !!(f & APSR_C), v = !!(f & APSR_V);
+	int res;
+
+	switch (cond >> 1) {
+	case 0: res = z; break;
+	case 1: res = c; break;
+	case 2: res = n; break;
+	case 3: res = v; break;
+	case 4: res = c && ! z; break;
+	case 5: res = n == v; break;
+	case 6: res = ! z && n == v; break;
+	default: return 1;
+	}
+	return (cond & 1) ? ! res : res;
+}
 
-	printf("Target STM32 MCU information:\n");
+static void sim_nz(struct stl_sim *sim, uint32_t res)
+{
+	sim->reg[16] &= ~(APSR_N | APSR_Z);
+	if (res & 0x80000000)
+		sim->reg[16] |= APSR_N;
+	if (res == 0)
+		sim->reg[16] |= APSR_Z;
+}
 
-	/* Should also read the CPU ID base register at 0xe000ed00
-	 * Cortex-M0 0x41--c20-
-	 * Cortex-M3 0x411fc231
-	 */
-	cpu_id = sl_rd32(sl, 0xe000ed00);
+static void sim_nzc(struct stl_sim *sim, uint32_t res, int carry)
+{
+	sim_nz(sim, res);
+	sim->reg[16] = (sim->reg[16] & ~APSR_C) | (carry ? APSR_C : 0);
+}
 
-	printf(" Target DBGMC_IDCODE %3.3x (Rev ID %4.4x) %s.\n",
-		   sl->cpu_idcode & 0x0FFF, sl->cpu_idcode,
-		   stm_devids[sl->chip_index].name);
-	printf(" CPU ID base %8.8x.\n", cpu_id);
+/* AddWithCarry(), setting all four flags when SETFLAGS. */
+static uint32_t sim_adc(struct stl_sim *sim, uint32_t x, uint32_t y,
+						int carry_in, int setflags)
+{
+	uint32_t res = x + y + carry_in;
+	if (setflags) {
+		int carry = carry_in ? res <= x : res < x;
+		int overflow = (~(x ^ y) & (x ^ res)) >> 31;
+		sim_nzc(sim, res, carry);
+		sim->reg[16] = (sim->reg[16] & ~APSR_V) | (overflow ? APSR_V : 0);
+	}
+	return res;
+}
 
-	/* Read the device parameters: flash size and serial number. */
-	/* The STM32F1 has the flash size at 0x1FFFf7e0. */
-	devparam = sl_rd32(sl, 0x1FFFf7e0);
-	/* The STM32F2 and STM32F4 have the flash size at 0x1FFF7A22. */
-	if (devparam != 0xffffffff) {
-		sl->flash_mem_size = devparam & 0xffff;
-		printf(" Flash size %dK (register %4.4x).\n",
-			   devparam & 0xff, devparam);
-		printf("  Information block %8.8x %8.8x %8.8x %8.8x.\n",
-			   sl_rd32(sl, 0x1FFFf800), sl_rd32(sl, 0x1FFFf804),
-			   sl_rd32(sl, 0x1FFFf808), sl_rd32(sl, 0x1FFFf80c));
-	} else if (0xffffffff != (devparam = sl_rd32(sl, 0x1FFF7A20))) {
-		sl->flash_mem_size = devparam >> 16;
-		printf(" Flash size %dK (register 0x1FFF7A20 %4.4x).\n",
-			   sl->flash_mem_size, devparam);
-		printf("  Information block %8.8x %8.8x %8.8x %8.8x.\n",
-			   sl_rd32(sl, 0x1FFFC000), sl_rd32(sl, 0x1FFFC004),
-			   sl_rd32(sl, 0x1FFFC008), sl_rd32(sl, 0x1FFFC00c));
-	} else if (0xffffffff != (devparam = sl_rd32(sl, 0x1FFFF7CC))) {
-		sl->flash_mem_size = devparam & 0xFFFF;
-		printf(" Flash size %dK (register 0x1FFFF7CC %4.4x).\n",
-			   sl->flash_mem_size, devparam);
-		printf("  Information block %8.8x %8.8x %8.8x %8.8x.\n",
-			   sl_rd32(sl, 0x1FFFF800), sl_rd32(sl, 0x1FFFF804),
-			   sl_rd32(sl, 0x1FFFF808), sl_rd32(sl, 0x1FFFF80c));
+/* Shift VAL by AMOUNT with the ARM shift TYPE (LSL/LSR/ASR/ROR),
+ * returning the carry out in *CARRY. */
+static uint32_t sim_shift(uint32_t val, int type, int amount, int *carry)
+{
+	if (amount == 0)
+		return val;
+	switch (type) {
+	case 0:
+		*carry = amount <= 32 ? (amount == 32 ? val & 1 :
+								 (val >> (32 - amount)) & 1) : 0;
+		return amount >= 32 ? 0 : val << amount;
+	case 1:
+		*carry = amount <= 32 ? (val >> (amount - 1)) & 1 : 0;
+		return amount >= 32 ? 0 : val >> amount;
+	case 2:
+		if (amount >= 32) {
+			*carry = val >> 31;
+			return (int32_t)val >> 31;
+		}
+		*carry = (val >> (amount - 1)) & 1;
+		return (int32_t)val >> amount;
+	default:
+		amount &= 31;
+		val = amount ? (val >> amount) | (val << (32 - amount)) : val;
+		*carry = val >> 31;
+		return val;
 	}
+}
 
-	return;
+/* ThumbExpandImm_C() for the 12 bit modified immediate. */
+static uint32_t sim_expand_imm(uint32_t imm12, int *carry)
+{
+	uint32_t imm8 = imm12 & 0xff;
+	int rot;
+
+	if ((imm12 & 0xc00) == 0) {
+		switch ((imm12 >> 8) & 3) {
+		case 0: return imm8;
+		case 1: return imm8 | (imm8 << 16);
+		case 2: return (imm8 << 8) | (imm8 << 24);
+		default: return imm8 * 0x01010101;
+		}
+	}
+	rot = imm12 >> 7;
+	imm8 = 0x80 | (imm12 & 0x7f);
+	imm8 = (imm8 >> rot) | (imm8 << (32 - rot));
+	*carry = imm8 >> 31;
+	return imm8;
 }
 
-/* Blink the LEDs on a STM32VLDiscovery board.
- * This may be used as a visual liveness test in scripts.
- * The LEDs are on PortC pins PC8 and PC9
- * RM0041 Reference manual - STM32F100xx advanced ARM-based 32-bit MCUs
- */
-#define GPIOB		0x40010C08		/* PortB register base */
-#define GPIOC		0x40011000		/* PortC register base */
-#define GPIOC_CRH	(GPIOC + 0x04)	/* Port configuration register high */
-#define GPIOC_ODR	(GPIOC + 0x0c)	/* Port output data register */
-#define LED_BLUE	(1<<8)
-#define LED_GREEN	(1<<9)
+/* Execute the Thumb-2 data processing operation OP, shared by the
+ * modified immediate and shifted register forms.
+ * Returns non-zero for an unsupported operation. */
+static int sim_dp32(struct stl_sim *sim, int op, int s, int rn, int rd,
+					uint32_t opnd, int carry)
+{
+	uint32_t *r = sim->reg;
+	uint32_t res, n = rn == 15 ? 0 : r[rn];
+	int c = !!(sim->reg[16] & APSR_C);
+
+	switch (op) {
+	case 0x0: res = n & opnd; break;				/* AND, TST */
+	case 0x1: res = n & ~opnd; break;				/* BIC */
+	case 0x2: res = n | opnd; break;				/* ORR, MOV */
+	case 0x3: res = n | ~opnd; break;				/* ORN, MVN */
+	case 0x4: res = n ^ opnd; break;				/* EOR, TEQ */
+	case 0x8: res = sim_adc(sim, n, opnd, 0, s); break;		/* ADD, CMN */
+	case 0xA: res = sim_adc(sim, n, opnd, c, s); break;		/* ADC */
+	case 0xB: res = sim_adc(sim, n, ~opnd, c, s); break;	/* SBC */
+	case 0xD: res = sim_adc(sim, n, ~opnd, 1, s); break;	/* SUB, CMP */
+	case 0xE: res = sim_adc(sim, opnd, ~n, 1, s); break;	/* RSB */
+	default: return -1;
+	}
+	if (s && op < 8)
+		sim_nzc(sim, res, carry);
+	if (rd != 15)
+		r[rd] = res;
+	else if ( ! s)
+		return -1;
+	return 0;
+}
 
-static void stm_discovery_blink(struct stlink* sl)
+/* Execute a single instruction.
+ * Returns 0 normally, 1 for a breakpoint, or -1 if unsupported.
+ */
+static int sim_step(struct stl_sim *sim)
 {
-	uint32_t PortC_hi_iocfg, APB1ENR_orig, APB2ENR_orig;
-	uint32_t APBnENR_orig[2];
-	int i;
+	uint32_t *r = sim->reg;
+	uint32_t pc = r[15], ins, val, addr;
+	int rd, rn, rm, imm, carry;
 
-	PortC_hi_iocfg = sl_rd32(sl, GPIOC_CRH);
-	/* Read APB2ENR and APB1ENR at 0x40021018-1F */
-	stl_read(sl, 0x40021018, APBnENR_orig, sizeof APBnENR_orig);
+	if (sim_rd(sim, pc, 2, &ins))
+		return -1;
+	r[15] = pc + 2;
+	pc += 4;					/* The architectural PC value. */
+	sim->insns++;
+	carry = !!(sim->reg[16] & APSR_C);
+	rd = ins & 7;
+	rn = (ins >> 3) & 7;
+
+	switch (ins >> 11) {
+	case 0x00: case 0x01: case 0x02:		/* LSL, LSR, ASR immediate */
+		imm = (ins >> 6) & 0x1f;
+		if (imm == 0 && (ins >> 11))
+			imm = 32;
+		r[rd] = sim_shift(r[rn], ins >> 11, imm, &carry);
+		sim_nzc(sim, r[rd], carry);
+		return 0;
+	case 0x03:								/* ADD/SUB reg or imm3 */
+		val = (ins & 0x400) ? (ins >> 6) & 7 : r[(ins >> 6) & 7];
+		if (ins & 0x200)
+			r[rd] = sim_adc(sim, r[rn], ~val, 1, 1);
+		else
+			r[rd] = sim_adc(sim, r[rn], val, 0, 1);
+		return 0;
+	case 0x04:								/* MOVS imm8 */
+		rd = (ins >> 8) & 7;
+		r[rd] = ins & 0xff;
+		sim_nz(sim, r[rd]);
+		return 0;
+	case 0x05:								/* CMP imm8 */
+		sim_adc(sim, r[(ins >> 8) & 7], ~(ins & 0xff), 1, 1);
+		return 0;
+	case 0x06:								/* ADDS imm8 */
+		rd = (ins >> 8) & 7;
+		r[rd] = sim_adc(sim, r[rd], ins & 0xff, 0, 1);
+		return 0;
+	case 0x07:								/* SUBS imm8 */
+		rd = (ins >> 8) & 7;
+		r[rd] = sim_adc(sim, r[rd], ~(ins & 0xff), 1, 1);
+		return 0;
+	case 0x08:
+		if ((ins & 0xfc00) == 0x4000) {		/* Data processing */
+			uint32_t a = r[rd], b = r[rn];
+			switch ((ins >> 6) & 15) {
+			case 0x0: sim_nz(sim, r[rd] = a & b); break;
+			case 0x1: sim_nz(sim, r[rd] = a ^ b); break;
+			case 0x2: case 0x3: case 0x4: case 0x7:
+				r[rd] = sim_shift(a, ((ins >> 6) & 15) == 7 ? 3 :
+								  ((ins >> 6) & 15) - 2, b & 0xff, &carry);
+				sim_nzc(sim, r[rd], carry);
+				break;
+			case 0x5: r[rd] = sim_adc(sim, a, b, carry, 1); break;
+			case 0x6: r[rd] = sim_adc(sim, a, ~b, carry, 1); break;
+			case 0x8: sim_nz(sim, a & b); break;
+			case 0x9: r[rd] = sim_adc(sim, ~b, 0, 1, 1); break;
+			case 0xA: sim_adc(sim, a, ~b, 1, 1); break;
+			case 0xB: sim_adc(sim, a, b, 0, 1); break;
+			case 0xC: sim_nz(sim, r[rd] = a | b); break;
+			case 0xD: sim_nz(sim, r[rd] = a * b); break;
+			case 0xE: sim_nz(sim, r[rd] = a & ~b); break;
+			case 0xF: sim_nz(sim, r[rd] = ~b); break;
+			}
+			return 0;
+		}
+		/* Special data processing and branch/exchange, high registers */
+		rd = (ins & 7) | ((ins >> 4) & 8);
+		rm = (ins >> 3) & 15;
+		val = rm == 15 ? pc : r[rm];
+		switch ((ins >> 8) & 3) {
+		case 0:
+			if (rd == 15) {
+				r[15] = (pc + val) & ~1;
+				return 0;
+			}
+			r[rd] += val;
+			return 0;
+		case 1:
+			sim_adc(sim, rd == 15 ? pc : r[rd], ~val, 1, 1);
+			return 0;
+		case 2:
+			r[rd] = rd == 15 ? val & ~1 : val;
+			return 0;
+		default:							/* BX, BLX */
+			if ((val & 1) == 0)
+				return -1;					/* No ARM state on Cortex-M. */
+			if (ins & 0x80)
+				r[14] = (pc - 2) | 1;
+			r[15] = val & ~1;
+			return 0;
+		}
+	case 0x09:								/* LDR literal */
+		addr = (pc & ~3) + ((ins & 0xff) << 2);
+		return sim_rd(sim, addr, 4, &r[(ins >> 8) & 7]);
+	case 0x0A: case 0x0B: {					/* Load/store register offset */
+		static const int size[8] = {4, 2, 1, 1, 4, 2, 1, 2};
+		int op = (ins >> 9) & 7;
+		addr = r[rn] + r[(ins >> 6) & 7];
+		if (op < 3)
+			return sim_wr(sim, addr, size[op], r[rd]);
+		if (sim_rd(sim, addr, size[op], &val))
+			return -1;
+		if (op == 3)
+			val = (int8_t)val;
+		else if (op == 7)
+			val = (int16_t)val;
+		r[rd] = val;
+		return 0;
+	}
+	case 0x0C: case 0x0D:					/* STR/LDR imm5, words */
+		addr = r[rn] + ((ins >> 4) & 0x7c);
+		goto ldst_size4;
+	case 0x0E: case 0x0F:					/* STRB/LDRB imm5 */
+		addr = r[rn] + ((ins >> 6) & 0x1f);
+		if (ins & 0x800)
+			return sim_rd(sim, addr, 1, &r[rd]);
+		return sim_wr(sim, addr, 1, r[rd]);
+	case 0x10: case 0x11:					/* STRH/LDRH imm5 */
+		addr = r[rn] + ((ins >> 5) & 0x3e);
+		if (ins & 0x800)
+			return sim_rd(sim, addr, 2, &r[rd]);
+		return sim_wr(sim, addr, 2, r[rd]);
+	case 0x12: case 0x13:					/* STR/LDR SP-relative */
+		rd = (ins >> 8) & 7;
+		addr = r[13] + ((ins & 0xff) << 2);
+	ldst_size4:
+		if (ins & 0x800)
+			return sim_rd(sim, addr, 4, &r[rd]);
+		return sim_wr(sim, addr, 4, r[rd]);
+	case 0x14:								/* ADR */
+		r[(ins >> 8) & 7] = (pc & ~3) + ((ins & 0xff) << 2);
+		return 0;
+	case 0x15:								/* ADD Rd, SP, imm8 */
+		r[(ins >> 8) & 7] = r[13] + ((ins & 0xff) << 2);
+		return 0;
+	case 0x16: case 0x17:					/* Miscellaneous */
+		if ((ins & 0xff00) == 0xb000) {		/* ADD/SUB SP, imm7 */
+			if (ins & 0x80)
+				r[13] -= (ins & 0x7f) << 2;
+			else
+				r[13] += (ins & 0x7f) << 2;
+			return 0;
+		}
+		if ((ins & 0xf500) == 0xb100) {		/* CBZ, CBNZ */
+			if (( ! r[rd]) != !!(ins & 0x800))
+				r[15] = pc + (((ins >> 3) & 0x40) | ((ins >> 2) & 0x3e));
+			return 0;
+		}
+		if ((ins & 0xff00) == 0xb200) {		/* SXTH, SXTB, UXTH, UXTB */
+			val = r[rn];
+			switch ((ins >> 6) & 3) {
+			case 0: r[rd] = (int16_t)val; break;
+			case 1: r[rd] = (int8_t)val; break;
+			case 2: r[rd] = val & 0xffff; break;
+			case 3: r[rd] = val & 0xff; break;
+			}
+			return 0;
+		}
+		if ((ins & 0xfe00) == 0xb400) {		/* PUSH */
+			int i;
+			addr = r[13];
+			for (i = 8; i >= 0; i--)
+				if (ins & (1 << i)) {
+					addr -= 4;
+					if (sim_wr(sim, addr, 4, r[i == 8 ? 14 : i]))
+						return -1;
+				}
+			r[13] = addr;
+			return 0;
+		}
+		if ((ins & 0xfe00) == 0xbc00) {		/* POP */
+			int i;
+			addr = r[13];
+			for (i = 0; i <= 8; i++)
+				if (ins & (1 << i)) {
+					if (sim_rd(sim, addr, 4, &val))
+						return -1;
+					r[i == 8 ? 15 : i] = i == 8 ? val & ~1 : val;
+					addr += 4;
+				}
+			r[13] = addr;
+			return 0;
+		}
+		if ((ins & 0xffc0) == 0xba00) {		/* REV */
+			val = r[rn];
+			r[rd] = (val >> 24) | ((val >> 8) & 0xff00) |
+				((val << 8) & 0xff0000) | (val << 24);
+			return 0;
+		}
+		if ((ins & 0xff00) == 0xbe00) {		/* BKPT */
+			r[15] = pc - 4;
+			return 1;
+		}
+		if ((ins & 0xff0f) == 0xbf00)		/* NOP and other hints */
+			return 0;
+		if ((ins & 0xffe8) == 0xb660)		/* CPSIE, CPSID */
+			return 0;
+		return -1;
+	case 0x18: case 0x19: {					/* STM, LDM */
+		int i;
+		rn = (ins >> 8) & 7;
+		addr = r[rn];
+		for (i = 0; i < 8; i++)
+			if (ins & (1 << i)) {
+				if (ins & 0x800 ? sim_rd(sim, addr, 4, &r[i])
+					: sim_wr(sim, addr, 4, r[i]))
+					return -1;
+				addr += 4;
+			}
+		if ( ! (ins & 0x800) || ! (ins & (1 << rn)))
+			r[rn] = addr;
+		return 0;
+	}
+	case 0x1A: case 0x1B:					/* Bcc, SVC, UDF */
+		if ((ins & 0x0e00) == 0x0e00)
+			return -1;
+		if (sim_cond(sim, (ins >> 8) & 15))
+			r[15] = pc + ((int8_t)(ins & 0xff) << 1);
+		return 0;
+	case 0x1C:								/* B */
+		r[15] = pc + (((int32_t)(ins << 21)) >> 20);
+		return 0;
+	}
 
-	/* Future: Enable GPIO ports. */
-	APB2ENR_orig = APBnENR_orig[0];  /* 0x40021018 */
-	APB1ENR_orig = APBnENR_orig[1];  /* 0x4002101C (yes, 1 is higher) */
+	/* The 32 bit Thumb-2 instructions. */
+	{
+		uint32_t hw1 = ins, hw2;
+		int rt, s, op;
 
-	if (sl->verbose)
-		fprintf(stderr, "GPIOC_CRH = 0x%08x, APB1ENR=%#08x, APB2ENR=%#08x\n",
-				PortC_hi_iocfg, APB1ENR_orig, APB2ENR_orig);
+		if (sim_rd(sim, r[15], 2, &hw2))
+			return -1;
+		r[15] += 2;
+		rn = hw1 & 15;
+		rt = (hw2 >> 12) & 15;
+		rd = (hw2 >> 8) & 15;
+		s = (hw1 >> 4) & 1;
+		op = (hw1 >> 5) & 15;
+
+		if ((hw1 & 0xf800) == 0xf000 && (hw2 & 0x8000)) {	/* Branches */
+			int32_t sign = (hw1 >> 10) & 1;
+			int32_t j1 = (hw2 >> 13) & 1, j2 = (hw2 >> 11) & 1;
+			int32_t offset;
+			if ((hw2 & 0x5000) == 0) {		/* B<cond>.W */
+				if (((hw1 >> 7) & 7) == 7)
+					return -1;
+				offset = (sign << 20) | (j2 << 19) | (j1 << 18) |
+					((hw1 & 0x3f) << 12) | ((hw2 & 0x7ff) << 1);
+				if (sim_cond(sim, (hw1 >> 6) & 15))
+					r[15] += (int32_t)((uint32_t)offset << 11) >> 11;
+				return 0;
+			}
+			if ((hw2 & 0x1000) == 0)
+				return -1;
+			offset = (sign << 24) | (( ! (j1 ^ sign)) << 23) |
+				(( ! (j2 ^ sign)) << 22) | ((hw1 & 0x3ff) << 12) |
+				((hw2 & 0x7ff) << 1);
+			if (hw2 & 0x4000)				/* BL */
+				r[14] = r[15] | 1;
+			r[15] += (int32_t)((uint32_t)offset << 7) >> 7;
+			return 0;
+		}
+		if ((hw1 & 0xfa00) == 0xf000) {		/* Modified immediate */
+			uint32_t imm12 = ((hw1 & 0x400) << 1) | ((hw2 >> 4) & 0x700) |
+				(hw2 & 0xff);
+			val = sim_expand_imm(imm12, &carry);
+			return sim_dp32(sim, op, s, rn, rd, val, carry);
+		}
+		if ((hw1 & 0xfa00) == 0xf200) {		/* Plain binary immediate */
+			uint32_t imm12 = ((hw1 & 0x400) << 1) | ((hw2 >> 4) & 0x700) |
+				(hw2 & 0xff);
+			uint32_t imm16 = ((hw1 & 15) << 12) | imm12;
+			switch ((hw1 >> 4) & 0x1f) {
+			case 0x00: r[rd] = (rn == 15 ? pc & ~3 : r[rn]) + imm12; return 0;
+			case 0x0A: r[rd] = (rn == 15 ? pc & ~3 : r[rn]) - imm12; return 0;
+			case 0x04: r[rd] = imm16; return 0;
+			case 0x0C: r[rd] = (r[rd] & 0xffff) | (imm16 << 16); return 0;
+			}
+			return -1;
+		}
+		if ((hw1 & 0xfe00) == 0xea00) {		/* Shifted register */
+			int type = (hw2 >> 4) & 3;
+			int amount = ((hw2 >> 10) & 0x1c) | ((hw2 >> 6) & 3);
+			if (amount == 0 && type != 0)
+				amount = 32;				/* RRX is not handled. */
+			if (type == 3 && amount == 32)
+				return -1;
+			val = sim_shift(r[hw2 & 15], type, amount, &carry);
+			return sim_dp32(sim, op, s, rn, rd, val, carry);
+		}
+		if ((hw1 & 0xfe00) == 0xf800) {		/* Load/store single */
+			int size = 1 << ((hw1 >> 5) & 3);
+			int load = (hw1 >> 4) & 1, sign = (hw1 >> 8) & 1;
+			uint32_t base = rn == 15 ? pc & ~3 : r[rn];
+			int writeback = 0;
+			if (size > 4 || (sign && ! load))
+				return -1;
+			if (rn == 15)
+				addr = (hw1 & 0x80) ? base + (hw2 & 0xfff)
+					: base - (hw2 & 0xfff);
+			else if (hw1 & 0x80)
+				addr = base + (hw2 & 0xfff);
+			else if (hw2 & 0x800) {			/* imm8, P U W */
+				uint32_t off = hw2 & 0xff;
+				uint32_t offaddr = (hw2 & 0x200) ? base + off : base - off;
+				addr = (hw2 & 0x400) ? offaddr : base;
+				writeback = (hw2 & 0x100) ? 1 : 0;
+				if (writeback)
+					base = offaddr;
+			} else if ((hw2 & 0xfc0) == 0)	/* Register offset */
+				addr = base + (r[hw2 & 15] << ((hw2 >> 4) & 3));
+			else
+				return -1;
+			if (load) {
+				if (sim_rd(sim, addr, size, &val))
+					return -1;
+				if (sign)
+					val = size == 1 ? (uint32_t)(int8_t)val
+						: (uint32_t)(int16_t)val;
+				if (writeback)
+					r[rn] = base;
+				if (rt == 15)
+					r[15] = val & ~1;
+				else
+					r[rt] = val;
+				return 0;
+			}
+			if (sim_wr(sim, addr, size, r[rt]))
+				return -1;
+			if (writeback)
+				r[rn] = base;
+			return 0;
+		}
+		return -1;
+	}
+}
 
-	/* Make certain PC8/PC9 are GPIO outputs -- any speed will do. */
-	if ((PortC_hi_iocfg & 0xCC) != 0x00)
-		sl_wr32(sl, GPIOC_CRH, (PortC_hi_iocfg & ~0xff) | 0x11);
-	for (i = 0; i < 10; i++) {
-		sl_wr32(sl, GPIOC_ODR, LED_GREEN);
-		usleep(100* 1000);
-		sl_wr32(sl, GPIOC_ODR, LED_BLUE);
-		usleep(100* 1000);
+/* Run the core forward to the current time, unless halted. */
+static void sim_core_catch_up(struct stl_sim *sim)
+{
+	uint64_t target = sim->now;
+
+	while ( ! sim->halted && ! sim->locked_up && sim->core_ns < target) {
+		int i, ret;
+		sim->now = sim->core_ns;
+		for (i = 0; i < 8; i++)
+			if (sim->fp_addr[i] && sim->fp_addr[i] == sim->reg[15])
+				break;
+		ret = i < 8 ? 1 : sim_step(sim);
+		/* A stalled access moved sim->now forward. */
+		sim->core_ns = (sim->now > sim->core_ns ? sim->now : sim->core_ns)
+			+ SIM_INSN_NS;
+		if (ret > 0)
+			sim->halted = 1;
+		else if (ret < 0) {
+			sim->locked_up = 1;
+			if (stl_verbose)
+				fprintf(stderr, "Simulated core stopped at unsupported "
+						"instruction, PC %8.8x.\n", sim->reg[15]);
+		}
 	}
-	/* Conditionally restore original GPIO settings. */
-	if ((PortC_hi_iocfg & 0xCC) != 0x00)
-		sl_wr32(sl, GPIOC_CRH, PortC_hi_iocfg);
-	return;
+	sim->now = target;
 }
 
-#if 0
-/* Set an interrupt to pending.  This should be used with caution as some
- * interrupt handlers expect only hardware events e.g. a serial character
- * has arrived. */
-/* Bitmap, must write as 32 bit word */
-const int IntrSetPendingBase = 0xE000E200;
+static void sim_core_reset(struct stl_sim *sim)
+{
+	uint32_t sp = 0, pc = 0;
+	int i;
+
+	sim_rd(sim, sim->chip->flash_base, 4, &sp);
+	sim_rd(sim, sim->chip->flash_base + 4, 4, &pc);
+	memset(&sim->reg, 0, sizeof sim->reg);
+	sim->reg[13] = sim->reg[17] = sp;
+	sim->reg[14] = 0xffffffff;
+	sim->reg[15] = pc & ~1;
+	sim->reg[16] = 0x01000000;
+	sim->locked_up = 0;
+	sim->core_ns = sim->now;
+	/* A system reset re-locks the flash controller. */
+	for (i = 0; i < sim->nfpec; i++) {
+		sim->fpec[i].key_state = sim->fpec[i].prg_key_state = 0;
+		sim->fpec[i].cr = sim->f4 ? 0x80000000 : sim->l1 ? 0 : FLASH_CR_LOCK;
+	}
+}
+
+/* Execute one STLink command against the simulated target.
+ * Returns the time the STLink spends on it, beyond the fixed overhead.
+ */
+static uint64_t sim_exec(struct stl_sim *sim, struct stl_xfer *xf)
+{
+	uint8_t *cmd = xf->cmd_buf, *data = xf->data;
+	uint32_t addr = read_uint32(cmd, 2);
+	int len = xf->data_len, i;
+	uint64_t start = sim->now;
+	uint32_t *regs = sim->reg;
+
+	if (xf->dir == STLinkParamFromDev)
+		memset(data, 0, len);
+	sim_core_catch_up(sim);
+
+	switch (cmd[0]) {
+	case STLinkGetVersion: {
+		struct STLinkVersion ver = {2, 17, 0, USB_ST_VID, USB_STLINKv2_PID};
+		memcpy(data, &ver, len < (int)sizeof ver ? len : (int)sizeof ver);
+		break;
+	}
+	case STLinkGetCurrentMode:
+		write_uint16(data, sim->mode);
+		break;
+	case STLinkGetTargetVoltage:	/* The 1.2V reference, and VDD/2 */
+		write_uint32(data, 1489);
+		write_uint32(data + 4, 1489 * sim->vdd_mv / 2400);
+		break;
+	case STLinkDFUCommand:
+		break;
+	case STLinkDebugCommand:
+		switch (cmd[1]) {
+		case STLinkDebugEnterMode:
+			sim->mode = STLinkDevMode_Debug;
+			break;
+		case STLinkDebugExit:
+			sim->mode = STLinkDevMode_Mass;
+			break;
+		case STLinkDebugReadCoreID:
+			write_uint32(data, sim->chip->core_id);
+			break;
+		case STLinkDebugGetStatus:
+			data[0] = sim->halted ? STLINK_CORE_HALTED : STLINK_CORE_RUNNING;
+			break;
+		case STLinkDebugForceDebug:
+			/* Halting also takes the core out of lockup. */
+			sim->halted = 1;
+			sim->locked_up = 0;
+			data[0] = STLINK_OK;
+			break;
+		case STLinkDebugResetSys:
+			sim_core_reset(sim);
+			data[0] = STLINK_OK;
+			break;
+		case STLinkDebugReadAllRegs:
+			for (i = 0; i < 21 && i*4 + 4 <= len; i++)
+				write_uint32(data + i*4, regs[i]);
+			break;
+		case STLinkDebugReadOneReg:
+			if (cmd[2] < 21)
+				write_uint32(data, regs[cmd[2]]);
+			break;
+		case STLinkDebugWriteReg:
+			if (cmd[2] < 21)
+				regs[cmd[2]] = read_uint32(cmd, 3) & (cmd[2] == 15 ? ~1 : ~0);
+			data[0] = STLINK_OK;
+			break;
+		case STLinkDebugReadMem32bit:
+			addr &= ~3;
+			for (i = 0; i + 4 <= len; i += 4) {
+				uint32_t val = 0;
+				sim_rd(sim, addr + i, 4, &val);
+				write_uint32(data + i, val);
+			}
+			break;
+		case STLinkDebugWriteMem32bit:
+			for (i = 0; i + 4 <= len; i += 4)
+				sim_wr(sim, addr + i, 4, read_uint32(data, i));
+			break;
+		case STLinkDebugWriteMem8bit:
+			for (i = 0; i < len; i++)
+				sim_wr(sim, addr + i, 1, data[i]);
+			break;
+		case STLinkDebugRunCore:
+			sim->halted = 0;
+			sim->core_ns = sim->now;
+			data[0] = STLINK_OK;
+			break;
+		case STLinkDebugStepCore:
+			if (sim->halted && ! sim->locked_up && sim_step(sim) < 0)
+				sim->locked_up = 1;
+			data[0] = STLINK_OK;
+			break;
+		case STLinkDebugSetFP:
+			if (cmd[2] < 8)
+				sim->fp_addr[cmd[2]] = read_uint32(cmd, 3);
+			data[0] = STLINK_OK;
+			break;
+		case STLinkDebugClearFP:
+			if (cmd[2] < 8)
+				sim->fp_addr[cmd[2]] = 0;
+			data[0] = STLINK_OK;
+			break;
+		default:
+			if (len)
+				data[0] = STLINK_OK;
+			break;
+		}
+		break;
+	default:
+		break;
+	}
+	return sim->now - start;
+}
 
-static void stm_raise_irq(struct stlink* sl, int irq_num)
+/* Model a response that arrives after the host gave up on it.  It stays
+ * in the STLink until the next read takes it as its own, with that read's
+ * response left in turn for the one after.
+ */
+static void stl_sim_late(struct stl_sim *sim, struct stl_xfer *xf)
 {
-	if (irq_num > 248) {
-		printf("Invalid interrupt number %d.  Cannot set pending.\n", irq_num);
+	int len;
+
+	if (sim->late_every && sim->cmds % sim->late_every == 0 &&
+		sim->nlate < STL_XFER_DEPTH) {
+		memcpy(sim->late[sim->nlate], xf->data, xf->data_len);
+		sim->late_len[sim->nlate++] = xf->data_len;
+		xf->done_ns = xf->submit_ns + (uint64_t)xf->timeout_ms * 1000000;
+		memset(xf->data, 0x55, xf->data_len);
+		xf->actual_len = 0;
+		xf->status = LIBUSB_ERROR_TIMEOUT;
+		sim->late_cnt++;
 		return;
 	}
-	sl_wr32(sl, IntrSetPendingBase + ((irq_num & 0xE0)>>3),
-			1 << (irq_num & 0x1F));
-	return;
+	if (sim->nlate == 0)
+		return;
+	/* Swap this response for the oldest late one, which moves up. */
+	len = sim->late_len[0];
+	memcpy(sim->late[sim->nlate], xf->data, xf->data_len);
+	sim->late_len[sim->nlate] = xf->data_len;
+	memcpy(xf->data, sim->late[0], len < xf->data_len ? len : xf->data_len);
+	memmove(sim->late[0], sim->late[1], sim->nlate * sizeof sim->late[0]);
+	memmove(sim->late_len, sim->late_len + 1, sim->nlate * sizeof(int));
+	if (len < xf->data_len) {
+		xf->actual_len = len;
+		xf->status = STL_ERR_SHORT;
+	} else if (len > xf->data_len)
+		xf->status = LIBUSB_ERROR_OVERFLOW;
+	sim->shifted++;
 }
-#endif
-
-struct dev_peripheral {			/* Peripheral device table */
-	const char *name;			/* TIM1, CAN1 etc */
-	uint32_t addr;				/* Address in STM32 space */
-	int unit_num;				/* Unit number, 0 if sole unit */
-	void (*show_func1)(struct stlink* sl, struct dev_peripheral *dev_per,
-					   uint32_t data_blk[]);
-	int extent;					/* Size of peripheral region */
-	uint32_t avail;				/* Chip feature bitmap */
-	int feature;				/* Dev feature bitmap e.g. ADC2 misisng regs  */
-};
 
-static void stm_show_timer(struct stlink* sl, struct dev_peripheral *dp,
-							 uint32_t data[])
+/* Queue a transaction to the simulated STLink.  The command runs
+ * immediately, with its modelled completion time recorded in xf->done_ns.
+ */
+static int stl_sim_submit(struct stl_xfer *xf)
 {
-	char active_map[4] = " H L";
-
-	printf("%s Timer %d at %8.8x:  %4.4x %4.4x %4.4x %4.4x"
-		   "  %4.4x %4.4x %4.4x %4.4x  %4.4x\n"
-		   " IntrEnb:%4.4x Status:%4.4x\n"
-		   " Count: %d Prescale: x%d Top: %d.\n"
-		   " Ch1: %d %c Ch2: %d %c Ch3: %d %c Ch4: %d %c.\n",
-		   dp->name, dp->unit_num, dp->addr,
-		   data[0], data[1], data[2], data[3],
-		   data[4], data[5], data[6], data[7], data[8],
-		   data[3], data[4],
-		   data[9], data[10]+1, data[11],
-		   data[13], active_map[(data[8] >> 0) & 3],
-		   data[14], active_map[(data[8] >> 4) & 3],
-		   data[15], active_map[(data[8] >> 8) & 3],
-		   data[16], active_map[(data[8] >> 12) & 3]);
-}		
+	struct stl_sim *sim = xf->sl->sim;
+	uint64_t usb_ns = (uint64_t)xf->data_len * SIM_USB_BYTE_NS;
+	uint64_t oldest = sim->ring[sim->ring_idx];
+	uint64_t start, end;
+
+	/* With every transaction slot in use, the host waits for the oldest. */
+	if (oldest > sim->host_ns) {
+		sim->host_ns = oldest;
+		sim->stalls++;
+	}
+	sim->host_ns += SIM_SUBMIT_NS;
+	xf->submit_ns = sim->host_ns;
+	start = sim->host_ns + SIM_USB_LATENCY_NS;
+	if (xf->dir == STLinkParamToDev) {
+		start += usb_ns;
+		sim->bytes_out += xf->data_len;
+	} else
+		sim->bytes_in += xf->data_len;
+	if (start < sim->probe_free_ns)
+		start = sim->probe_free_ns;
+	sim->now = start + SIM_CMD_NS;
+	if (xf->cmd_buf[0] == STLinkDebugCommand &&
+		(xf->cmd_buf[1] == STLinkDebugReadMem32bit ||
+		 xf->cmd_buf[1] == STLinkDebugWriteMem32bit ||
+		 xf->cmd_buf[1] == STLinkDebugWriteMem8bit))
+		sim->now += (uint64_t)xf->data_len * SIM_SWD_BYTE_NS;
+	end = sim->now + sim_exec(sim, xf);
+	if (xf->dir == STLinkParamFromDev)
+		end += usb_ns;
+	sim->probe_busy_ns += end - start;
+	sim->probe_free_ns = end;
+	xf->done_ns = end + SIM_USB_LATENCY_NS;
+	sim->cmds++;
+
+	xf->actual_len = xf->data_len;
+	xf->status = 0;
+	/* The command has run on the target, but the host gives up on the
+	 * response. */
+	if ((sim->fail_every && sim->cmds % sim->fail_every == 0) ||
+		xf->done_ns - xf->submit_ns > (uint64_t)xf->timeout_ms * 1000000) {
+		xf->done_ns = xf->submit_ns + (uint64_t)xf->timeout_ms * 1000000;
+		if (xf->dir == STLinkParamFromDev)
+			memset(xf->data, 0x55, xf->data_len);
+		xf->actual_len = 0;
+		xf->status = LIBUSB_ERROR_TIMEOUT;
+		sim->lost++;
+	} else if (xf->dir == STLinkParamFromDev && xf->data_len > 0)
+		stl_sim_late(sim, xf);
+	if (xf->done_ns > sim->last_done_ns)
+		sim->last_done_ns = xf->done_ns;
+	sim->ring[sim->ring_idx] = xf->done_ns;
+	sim->ring_idx = (sim->ring_idx + 1) % STL_XFER_DEPTH;
+	stl_xfer_finish(xf);
+	return 0;
+}
 
-static void stm_show_CAN(struct stlink *sl, struct dev_peripheral *dp,
-						 uint32_t data[])
+/* Everything completes at submit, so there is never anything to wait for. */
+static int stl_sim_events(struct stlink *sl, int *complete)
 {
-	uint32_t mode_map, scale_map, fifo_map, active_map;
-	int i;
-
-	printf("%s at %8.8x: MCR %8.8x MSR %8.8x\n"
-		   " Tx/Rx0/Rx1 %8.8x %8.8x %8.8x\n"
-		   " IntrEnb %8.8x Errors %8.8x BitTiming %8.8x\n",
-		   dp->name, dp->addr,
-		   data[0], data[1], data[2], data[3],
-		   data[4], data[5], data[6], data[7]);
-	/* Show FIFO contents. */
-	stl_rd32_cmd(sl, dp->addr + 0x180, 80);
-	printf(" CAN FIFOs\n"
-		   "  Tx0: %8.8x %8.8x %8.8x %8.8x\n"
-		   "  Tx1: %8.8x %8.8x %8.8x %8.8x\n"
-		   "  Tx2: %8.8x %8.8x %8.8x %8.8x\n"
-		   "  Rx0: %8.8x %8.8x %8.8x %8.8x\n"
-		   "  Rx1: %8.8x %8.8x %8.8x %8.8x\n",
-		   data[0], data[1], data[2], data[3],
-		   data[4], data[5], data[6], data[7],
-		   data[8], data[9], data[10], data[11],
-		   data[12], data[13], data[14], data[15],
-		   data[16], data[17], data[18], data[19]);
-
-	/* Show filter, Mode/scale/dest/on %8.8x %8.8x %8.8x.\n */
-	stl_rd32_cmd(sl, 0x40006600, 32);
-	printf(" Rx filter   FMR %8.8x\n"
-		   "  Mode/scale/dest/on %8.8x %8.8x %8.8x %8.8x.\n",
-		   data[0], data[1], data[3], data[5], data[7]);
-	mode_map = data[1];
-	scale_map = data[3];
-	fifo_map = data[5];
-	active_map = data[7];
-	stl_rd32_cmd(sl, 0x40006640, 32);
-	for (i = 0; i < 28; i++)
-		if (active_map & (1<<i)) {
-			printf("  Filter %d FIFO %c ", i, fifo_map & (1<<i) ? '1' : '0');
-			if (scale_map & (1<<i))
-				printf("%8.8x %8.8x\n",
-					   data[i*2], data[i*2 + 1]);
-			else
-				printf("%4.4x %4.4x (%3.3x %3.3x) %4.4x %4.4x (%3.3x %3.3x)\n",
-					   data[i*2] & 0xffff, data[i*2] >> 16,
-					   (data[i*2] >> 5) & 0x7ff, (data[i*2] >> 21) & 0x7ff,
-					   data[i*2 + 1] & 0xffff, data[i*2 + 1] >> 16,
-					   (data[i*2+1]>>5) & 0x7ff, (data[i*2+1]>>21) & 0x7ff);
-		}
-
-	return;
+	return 0;
 }
 
-static void stm_show_DMA(struct stlink* sl, struct dev_peripheral *dp,
-						 uint32_t data[])
+/* The host blocked until XF, or all queued transactions, completed. */
+static void stl_sim_waited(struct stlink *sl, struct stl_xfer *xf)
 {
-	int i;
-	printf("%s at %8.8x: interrupts %8.8x %8.8x\n",
-		   dp->name, dp->addr, data[0], data[1]);
-	for (i = 1; i <= 7; i++) {
-		int cb = i*5-3;
-		printf(" Channel %d: %8.8x  %d words %8.8x%s%s %8.8x%s\n",
-			   i, data[cb], data[cb+1],
-			   data[cb+2], data[cb] & 0x40 ? "++" : "  ",
-			   data[cb] & 0x10 ? "<-" : "->",
-			   data[cb+3], data[cb] & 0x80 ? "++" : "  ");
+	struct stl_sim *sim = sl->sim;
+	uint64_t done = xf ? xf->done_ns : sim->last_done_ns;
+
+	if (done > sim->host_ns) {
+		sim->host_ns = done;
+		sim->waits++;
 	}
-	return;
 }
 
-static void stm_show_SPI(struct stlink* sl, struct dev_peripheral *dp,
-						 uint32_t data[])
+static void stl_sim_close(struct stlink *sl)
 {
-	printf("%s at %8.8x: %8.8x %8.8x\n",
-		   dp->name, dp->addr, data[0], data[1]);
+	struct stl_sim *sim = sl->sim;
+	uint64_t total;
+
+	if (sim == NULL)
+		return;
+	total = sim->host_ns > sim->last_done_ns ? sim->host_ns : sim->last_done_ns;
+	printf("Simulated %s: %lu commands, %lu round-trip waits, "
+		   "%lu queue-full stalls, %lu lost responses.\n", sim->chip->name,
+		   sim->cmds, sim->waits, sim->stalls, sim->lost);
+	if (sim->late_every)
+		printf(" %lu late responses, %lu taken by a later read.\n",
+			   sim->late_cnt, sim->shifted);
+	printf(" %llu bytes to and %llu bytes from the STLink, "
+		   "%lu instructions executed.\n",
+		   (unsigned long long)sim->bytes_out,
+		   (unsigned long long)sim->bytes_in, sim->insns);
+	printf(" %lu flash writes, %lu erases.  Modelled time %llu.%03llu ms, "
+		   "STLink busy %llu%%.\n", sim->flash_progs, sim->flash_erases,
+		   (unsigned long long)(total / 1000000),
+		   (unsigned long long)(total / 1000 % 1000),
+		   (unsigned long long)(total ? sim->probe_busy_ns * 100 / total : 0));
+	free(sim->flash);
+	free(sim->sram);
+	free(sim);
+	sl->sim = NULL;
 }
 
-static void stm_show_USART(struct stlink* sl, struct dev_peripheral *dp,
-							 uint32_t data[])
+static uint64_t stl_sim_clock(struct stlink *sl)
 {
-	printf("%s at %8.8x: %4.4x %4.4x %4.4x %4.4x %4.4x %4.4x %4.4x %4.4x\n",
-		   dp->name, dp->addr, data[0], data[1], data[2], data[3],
-		   data[4], data[5], data[6], data[7]);
+	return sl->sim->host_ns;
 }
 
-static void arm_show_systick(struct stlink* sl, struct dev_peripheral *dp,
-							 uint32_t data_blk[])
+/* The host sleeps without using the STLink. */
+static void stl_sim_sleep(struct stlink *sl, uint64_t ns)
 {
-	printf("SysTick at %8.8x: Ctrl %4.4x reload %d, count %d\n"
-		   "  calibration %d (%#x)\n",
-		   dp->addr, data_blk[0], data_blk[1], data_blk[2],
-		   data_blk[3] & 0x00ffffff, data_blk[3]);
+	sl->sim->host_ns += ns;
 }
 
-static void stm_show_dev(struct stlink* sl, struct dev_peripheral *dp,
-							 uint32_t data[])
+/* As stl_usb_recover(): read and discard the late responses, then wait
+ * out the read that finds none. */
+static void stl_sim_recover(struct stlink *sl)
 {
-	int i;
-	printf("%s at %8.8x:", dp->name, dp->addr);
-	for (i = 0; i < dp->extent/4; i++)
-		printf(" %4.4x", data[i]);
-	printf("\n");
+	struct stl_sim *sim = sl->sim;
+
+	if (sim->last_done_ns > sim->host_ns)
+		sim->host_ns = sim->last_done_ns;
+	sim->host_ns += (uint64_t)sim->nlate * SIM_USB_LATENCY_NS +
+		STL_RESYNC_MSEC * 1000000ULL;
+	sim->nlate = 0;
 }
 
-struct dev_peripheral dev_per[] = {
-	{"SysTick", 0xE000E010, 0, arm_show_systick, 16},
-	{"CAN1", 0x40006400, 1, stm_show_CAN, 32},
-	{"CAN2", 0x40006800, 2, stm_show_CAN, 32},
-	{"DMA1", 0x40020000, 1, stm_show_DMA, 8 + 20*7},
-	{"DMA2", 0x40020400, 2, stm_show_DMA, 8 + 20*7},
-	{"PORTA", 0x40010800, 0, stm_show_dev, 28},
-	{"PORTB", 0x40010C00, 0, stm_show_dev, 28},
-	{"PORTC", 0x40011000, 0, stm_show_dev, 28},
-	{"PORTD", 0x40011400, 0, stm_show_dev, 28},
-	{"PORTE", 0x40011800, 0, stm_show_dev, 28},
-	{"PORTF", 0x40011C00, 0, stm_show_dev, 28},
-	{"PORTG", 0x40012000, 0, stm_show_dev, 28},
-	{"SPI1", 0x40013000, 1, stm_show_SPI, 36},
-	{"SPI2", 0x40003800, 2, stm_show_SPI, 36},
-	{"SPI3", 0x40003C00, 3, stm_show_SPI, 36},
-	{"TIM1", 0x40012C00, 1, stm_show_timer, 76}, /* Do not read TIMx_DMAR */
-	{"TIM1a",0x40010000, 1, stm_show_timer, 76}, /* 32F4xx only */
-	{"TIM2", 0x40000000, 2, stm_show_timer, 76},
-	{"TIM3", 0x40000400, 3, stm_show_timer, 76},
-	{"TIM4", 0x40000800, 4, stm_show_timer, 76},
-	{"TIM5", 0x40000C00, 5, stm_show_timer, 76},
-	{"TIM6", 0x40001000, 6, stm_show_timer, 76},
-	{"TIM7", 0x40001400, 7, stm_show_timer, 76},
-	{"TIM8", 0x40010400, 8, stm_show_timer, 76}, 	/* 32F4xx */
-	{"TIM9", 0x40014000, 9, stm_show_timer, 76}, 	/* 32F4xx */
-	{"TIM10", 0x40014400, 10, stm_show_timer, 76}, /* 32F4xx */
-	{"TIM11", 0x40014800, 11, stm_show_timer, 76}, /* 32F4xx */
-	{"TIM12", 0x40001800, 12, stm_show_timer, 76},
-	{"TIM13", 0x40001C00, 13, stm_show_timer, 76},
-	{"TIM14", 0x40002000, 14, stm_show_timer, 76},
-	{"TIM15", 0x40014000, 15, stm_show_timer, 76},
-	{"TIM16", 0x40014400, 16, stm_show_timer, 76},
-	{"TIM17", 0x40014800, 17, stm_show_timer, 76},
-	{"USART1", 0x40013800, 1, stm_show_USART, 7*4},
-	{"USART2", 0x40004400, 2, stm_show_USART, 7*4},
-	{"USART3", 0x40004800, 3, stm_show_USART, 7*4},
-	{"USART4", 0x40004C00, 4, stm_show_USART, 7*4},
-	{"USART5", 0x40005000, 5, stm_show_USART, 7*4},
-	{"USART1a", 0x40011000, 1, stm_show_USART, 7*4}, /* 32F4xx */
-	{"USART6", 0x40011400, 6, stm_show_USART, 7*4},
-	{"I2C1", 0x40005400, 1, stm_show_dev, 36},
-	{"I2C2", 0x40005800, 2, stm_show_dev, 36},
-	{"I2C3", 0x40005C00, 3, stm_show_dev, 36},
-	{"DAC",  0x40007400, 3, stm_show_dev, 56},
-#if 0
-	{"I2S2", 0x40003400, 2, stm_show_dev, 0},
-	{"RTC", 0x40002800, 0, stm_show_RTC, 0},
-	{"WWDG", 0x40002C00, 0, stm_show_WWDG, 0},
-	{"IWDG", 0x40003000, 0, stm_show_IWDG, 0},
-#endif
-	/* I/O ports on newer devices. */
-	{"GPIOA", 0x48000000, 0, stm_show_dev, 44},
-	{"GPIOB", 0x48000400, 0, stm_show_dev, 44},
-	{"GPIOC", 0x48000800, 0, stm_show_dev, 44},
-	{"GPIOD", 0x48000C00, 0, stm_show_dev, 44},
-	{"GPIOE", 0x48001000, 0, stm_show_dev, 44},
-	{"GPIOF", 0x48001400, 0, stm_show_dev, 44},
+static const struct stl_backend stl_sim_backend = {
+	"sim", stl_sim_submit, stl_sim_events, stl_sim_waited, stl_sim_close,
+	stl_sim_recover, NULL, stl_sim_clock, stl_sim_sleep,
 };
 
-static int stm32_dev_show(struct stlink* sl, const char *cmd_name)
+/* Open a simulated STLink with a target chip selected by SPEC: a
+ * DBGMCU_IDCODE value, or a name from stm_devids[].  The default is the
+ * STM32F100 on the VLDiscovery board.  A ",fail=N" suffix loses the
+ * response to every Nth transaction, to exercise the retry paths,
+ * ",late=N" delivers it after the timeout instead, to the next read,
+ * ",vdd=<mV>" sets the target supply voltage, by default 3300, and
+ * ",flash=<KB>" a flash size other than the table's, such as an F4 part
+ * larger than the smallest of its line.
+ * The flash starts erased and the core running, as with a blank part.
+ */
+struct stlink *stl_sim_open(struct stlink *sl, const char *spec)
 {
+	struct stl_sim *sim;
+	const struct stm_chip_params *chip;
+	const char *opts;
+	char name[32];
+	unsigned long fail_every = 0, late_every = 0;
+	uint32_t flash_kb = 0;
+	int vdd_mv = 3300;
 	int i;
-	for (i = 0; i < sizeof(dev_per)/sizeof(dev_per[0]); i++) {
-		struct dev_peripheral *dp = &dev_per[i];
-		if (strcasecmp(dp->name, cmd_name) == 0) {
-			uint32_t *result = (void*)sl->data_buf;
-			if (dp->extent)
-				stl_rd32_cmd(sl, dp->addr, dp->extent);
-			dp->show_func1(sl, dp, result);
-			return 0;
+
+	if (spec == NULL || *spec == 0 || *spec == ',')
+		snprintf(name, sizeof name, "STM32F100");
+	else
+		snprintf(name, sizeof name, "%.*s", (int)strcspn(spec, ","), spec);
+	for (opts = spec ? strchr(spec, ',') : NULL; opts;
+		 opts = strchr(opts + 1, ',')) {
+		if (strncmp(opts, ",fail=", 6) == 0)
+			fail_every = strtoul(opts + 6, NULL, 0);
+		else if (strncmp(opts, ",late=", 6) == 0)
+			late_every = strtoul(opts + 6, NULL, 0);
+		else if (strncmp(opts, ",vdd=", 5) == 0)
+			vdd_mv = strtoul(opts + 5, NULL, 0);
+		else if (strncmp(opts, ",flash=", 7) == 0)
+			flash_kb = strtoul(opts + 7, NULL, 0);
+		else {
+			fprintf(stderr, "Unknown simulator option '%s'.\n", opts + 1);
+			return NULL;
 		}
 	}
-	return -1;
-}
+	for (i = 0; stm_devids[i].name; i++)
+		if (strtoul(name, NULL, 16) == stm_devids[i].dbgmcu_idcode ||
+			strcasecmp(name, stm_devids[i].name) == 0)
+			break;
+	if (stm_devids[i].name == NULL) {
+		fprintf(stderr, "Unknown simulated chip '%s'.\n", name);
+		return NULL;
+	}
+	chip = &stm_devids[i];
 
-struct stlink *stl_usb_scan(struct stlink *sl, const char *dev_name)
-{
-	libusb_device_handle *dev_handle;
-	libusb_device **devs;
-	int r;
-	ssize_t cnt;
+	memset(sl, 0, sizeof *sl);
+	sim = calloc(1, sizeof *sim);
+	if (sim == NULL)
+		return NULL;
+	sim->chip = chip;
+	sim->flash_size = flash_kb ? flash_kb * 1024 : chip->flash_size;
+	sim->fail_every = fail_every;
+	sim->late_every = late_every;
+	sim->vdd_mv = vdd_mv;
+	sim->crc = 0xffffffff;
+	sim->f4 = (chip->cap_flags & ChipCapF4Flash) != 0;
+	sim->l1 = (chip->cap_flags & ChipCapL1Flash) != 0;
+	sim->cpuid = chip->core_id == 0x0bb11477 ? 0x410cc200 :
+		(chip->core_id == 0x2ba01477 ? 0x410fc241 : 0x411fc231);
+	sim->flash = malloc(sim->flash_size);
+	sim->sram = calloc(1, chip->sram_size);
+	if (sim->flash == NULL || sim->sram == NULL) {
+		free(sim->flash);
+		free(sim->sram);
+		free(sim);
+		return NULL;
+	}
+	memset(sim->flash, sim->l1 ? 0 : 0xff, sim->flash_size);
+	sim->nfpec = 1;
+	sim->fpec[0].regs = sim->f4 ? F4_FLASH_REGS :
+		sim->l1 ? L15_FLASH_REGS : FLASH_REGS_ADDR;
+	sim->fpec[0].lo = chip->flash_base;
+	sim->fpec[0].hi = chip->flash_base + sim->flash_size;
+	if ( ! sim->f4 && sim->flash_size > 512*1024) {
+		/* XL-density: the second bank has its own controller. */
+		sim->nfpec = 2;
+		sim->fpec[0].hi = sim->fpec[1].lo = chip->flash_base + 512*1024;
+		sim->fpec[1].regs = FLASH_REGS_ADDR + 0x40;
+		sim->fpec[1].hi = chip->flash_base + sim->flash_size;
+	}
+	sim->mode = STLinkDevMode_Mass;
+	sim_core_reset(sim);
+	sim->locked_up = 1;			/* Running code we don't model. */
+
+	sl->dev_path = "sim";
+	sl->fd = -1;
+	sl->verbose = stl_verbose;
+	sl->sim = sim;
+	sl->backend = &stl_sim_backend;
+	sl->core_state = STLINK_CORE_UNKNOWN_STATE;
+	return sl;
+}
 
-	r = libusb_init(NULL);
+/* The trace replay backend.
+ * This feeds a session recorded with --trace back to the program, without
+ * a probe.  Each queued transaction consumes the next record, which must
+ * be the same command.  Read data and status come from the record, and
+ * the recorded latency is kept so that timing reports match the session.
+ * A replay that diverges, for instance from a changed algorithm, reports
+ * the first mismatch and fails from there on.
+ */
 
-	if (r < 0) {
-		fprintf(stderr, "Failed to scan USB devices: %s\n",
-				strerror(errno));
-		return NULL;
+/* The number of command bytes that identify a transaction.  The rest of
+ * the block may be left over from earlier commands. */
+static int stl_cmd_key_len(const uint8_t *cmd)
+{
+	if (cmd[0] != STLinkDebugCommand)
+		return 2;
+	switch (cmd[1]) {
+	case STLinkDebugReadMem32bit:
+	case STLinkDebugWriteMem32bit:
+	case STLinkDebugWriteMem8bit:
+		return 8;
+	case STLinkDebugWriteReg:
+		return 7;
 	}
+	return 3;
+}
 
-	cnt = libusb_get_device_list(NULL, &devs);
-	if (cnt < 0) {
-		fprintf(stderr, "USB access failed, %s.\n", strerror(errno));
-		
-		return 0;
+static int stl_replay_submit(struct stl_xfer *xf)
+{
+	struct stlink *sl = xf->sl;
+	struct stl_trace_rec rec;
+	int len;
+
+	if (sl->replay_diverged ||
+		fread(&rec, sizeof rec, 1, sl->replay) != 1) {
+		if ( ! sl->replay_diverged)
+			fprintf(stderr, "Replay trace ended after %lu transactions.\n",
+					sl->replay_rec);
+		sl->replay_diverged = 1;
+		xf->status = LIBUSB_ERROR_NO_DEVICE;
+		stl_xfer_finish(xf);
+		return xf->status;
 	}
+	sl->replay_rec++;
+	if (rec.dir != xf->dir || rec.data_len != xf->data_len ||
+		memcmp(rec.cmd, xf->cmd_buf, stl_cmd_key_len(xf->cmd_buf))) {
+		fprintf(stderr, "Replay diverged at transaction %lu: recorded "
+				"command %2.2x %2.2x length %d, now %2.2x %2.2x length %d.\n",
+				sl->replay_rec, rec.cmd[0], rec.cmd[1], rec.data_len,
+				xf->cmd_buf[0], xf->cmd_buf[1], xf->data_len);
+		sl->replay_diverged = 1;
+		xf->status = LIBUSB_ERROR_IO;
+		stl_xfer_finish(xf);
+		return xf->status;
+	}
+	len = rec.actual_len;
+	if (xf->dir == STLinkParamFromDev) {
+		int n = len < xf->data_len ? len : xf->data_len;
+		if (n > 0 && fread(xf->data, n, 1, sl->replay) != 1)
+			n = 0;
+		len -= n;
+		xf->actual_len = rec.actual_len;
+	} else
+		xf->actual_len = xf->data_len;
+	if (len > 0)
+		fseek(sl->replay, len, SEEK_CUR);
+	xf->status = rec.status;
+	xf->submit_ns = rec.submit_ns;
+	xf->done_ns = rec.submit_ns + rec.latency_ns;
+	if (xf->done_ns > sl->replay_clock)
+		sl->replay_clock = xf->done_ns;
+	stl_xfer_finish(xf);
+	return 0;
+}
+
+/* Every transaction has completed by the time it is queued. */
+static int stl_replay_events(struct stlink *sl, int *complete)
+{
+	return 0;
+}
+
+static void stl_replay_close(struct stlink *sl)
+{
+	if (sl->verbose)
+		printf("Replayed %lu transactions%s.\n", sl->replay_rec,
+			   sl->replay_diverged ? ", then diverged" : "");
+}
+
+/* The recorded time at which the host saw the latest completion. */
+static uint64_t stl_replay_clock(struct stlink *sl)
+{
+	return sl->replay_clock;
+}
+
+/* The recorded clock already includes any sleeps. */
+static void stl_replay_sleep(struct stlink *sl, uint64_t ns)
+{
+}
+
+static const struct stl_backend stl_replay_backend = {
+	"replay", stl_replay_submit, stl_replay_events, NULL, stl_replay_close,
+	NULL, NULL, stl_replay_clock, stl_replay_sleep,
+};
 
-	dev_handle = libusb_open_device_with_vid_pid(NULL,
-												 USB_ST_VID, USB_STLINKv2_PID);
+static FILE *stl_trace_read_hdr(const char *path, struct stl_trace_hdr *hdr)
+{
+	FILE *fp = fopen(path, "rb");
 
-	if (dev_handle == NULL) {
-		if (verbose)
-			printf("No USB STLink found.\n");
-		libusb_free_device_list(devs, 0);
+	if (fp == NULL) {
+		fprintf(stderr, "Failed to open trace file '%s': %s.\n",
+				path, strerror(errno));
 		return NULL;
 	}
-
-	if (verbose) {
-		libusb_device *this_dev = libusb_get_device(dev_handle);
-		printf("Found a STLink v2 on USB bus %d device %d.\n",
-			   libusb_get_bus_number(this_dev),
-			   libusb_get_device_address(this_dev));
+	if (fread(hdr, sizeof *hdr, 1, fp) != 1 ||
+		memcmp(hdr->magic, STL_TRACE_MAGIC, 4) != 0 ||
+		hdr->version != STL_TRACE_VERSION ||
+		hdr->rec_size != sizeof(struct stl_trace_rec)) {
+		fprintf(stderr, "The file '%s' is not a STLink trace.\n", path);
+		fclose(fp);
+		return NULL;
 	}
+	return fp;
+}
 
-	/* We know that configuration 1 is the only one. */
-	r = libusb_reset_device(dev_handle);
-	r = libusb_set_configuration(dev_handle, 1);
-	r = libusb_claim_interface(dev_handle, 0);
-#if 0
-	if (libusb_set_interface_alt_setting(dev_handle, 0, 0) < 0){
-		printf("usb_set_altinterface failed.\n");
-	}
-#endif
+/* Open the recorded session PATH as if it were a probe. */
+struct stlink *stl_replay_open(struct stlink *sl, const char *path)
+{
+	struct stl_trace_hdr hdr;
+	FILE *fp = stl_trace_read_hdr(path, &hdr);
 
+	if (fp == NULL)
+		return NULL;
 	memset(sl, 0, sizeof *sl);
-	sl->dev_path = "/dev/stlink";
+	memcpy(sl->usb_path, hdr.probe, sizeof sl->usb_path - 1);
+	memcpy(sl->serial, hdr.serial, sizeof sl->serial - 1);
+	sl->replay = fp;
+	sl->dev_path = path;
 	sl->fd = -1;
-	sl->verbose = verbose;
-	sl->usb_hand = dev_handle;
+	sl->verbose = stl_verbose;
+	sl->backend = &stl_replay_backend;
 	sl->core_state = STLINK_CORE_UNKNOWN_STATE;
-
 	return sl;
 }
 
+/* Print an analysis of the trace PATH.
+ * The interesting figure is usually the idle time: the gaps with no
+ * transaction in flight, where the probe waits on the host.  The largest
+ * gaps are listed with the transactions on either side.
+ * With --verbose every transaction is listed.
+ */
+#define TRACE_TOP_GAPS 8
+int stl_trace_show(const char *path)
+{
+	struct stl_trace_hdr hdr;
+	struct stl_trace_rec rec, prev;
+	FILE *fp = stl_trace_read_hdr(path, &hdr);
+	struct {
+		uint64_t gap;
+		unsigned long idx;
+		uint8_t before[2], after[2];
+	} top[TRACE_TOP_GAPS];
+	uint64_t busy_until = 0, idle = 0, end = 0, bytes_out = 0, bytes_in = 0;
+	unsigned long n = 0, errors = 0;
+	time_t start_time;
+	int i;
 
-int main(int argc, char *argv[])
+	if (fp == NULL)
+		return -1;
+	memset(top, 0, sizeof top);
+	memset(&prev, 0, sizeof prev);
+	start_time = hdr.start_time;
+	printf("Trace of %s%s%s, recorded %s", hdr.probe,
+		   hdr.serial[0] ? " serial " : "", hdr.serial, ctime(&start_time));
+	if (stl_verbose)
+		printf("   Index  Queued(ms)  Gap(us)  Latency(us)  Command  "
+			   "Length  Status\n");
+	while (fread(&rec, sizeof rec, 1, fp) == 1) {
+		uint64_t gap = 0, done = rec.submit_ns + rec.latency_ns;
+		if (n > 0 && rec.submit_ns > busy_until) {
+			gap = rec.submit_ns - busy_until;
+			idle += gap;
+			for (i = TRACE_TOP_GAPS - 1; i >= 0 && gap > top[i].gap; i--)
+				if (i < TRACE_TOP_GAPS - 1)
+					top[i+1] = top[i];
+			if (++i < TRACE_TOP_GAPS) {
+				top[i].gap = gap;
+				top[i].idx = n;
+				memcpy(top[i].before, prev.cmd, 2);
+				memcpy(top[i].after, rec.cmd, 2);
+			}
+		}
+		if (stl_verbose)
+			printf("%8lu %11.3f %8.1f %12.1f  %2.2x %2.2x %s %6d  %d\n", n,
+				   rec.submit_ns / 1e6, gap / 1e3, rec.latency_ns / 1e3,
+				   rec.cmd[0], rec.cmd[1],
+				   rec.dir == STLinkParamToDev ? ">" : "<",
+				   rec.data_len, rec.status);
+		if (done > busy_until)
+			busy_until = done;
+		if (done > end)
+			end = done;
+		if (rec.dir == STLinkParamToDev)
+			bytes_out += rec.actual_len;
+		else
+			bytes_in += rec.actual_len;
+		if (rec.status)
+			errors++;
+		fseek(fp, rec.actual_len, SEEK_CUR);
+		prev = rec;
+		n++;
+	}
+	fclose(fp);
+
+	printf("%lu transactions, %lu failed, %llu bytes out, %llu bytes in.\n",
+		   n, errors, (unsigned long long)bytes_out,
+		   (unsigned long long)bytes_in);
+	printf("Session %.3f ms, with nothing in flight for %.3f ms (%.1f%%).\n",
+		   end / 1e6, idle / 1e6, end ? idle * 100.0 / end : 0.0);
+	for (i = 0; i < TRACE_TOP_GAPS && top[i].gap; i++)
+		printf(" Gap of %9.1f us before transaction %lu: "
+			   "%2.2x %2.2x then %2.2x %2.2x.\n", top[i].gap / 1e3,
+			   top[i].idx, top[i].before[0], top[i].before[1],
+			   top[i].after[0], top[i].after[1]);
+	return 0;
+}
+
+/* The probe and target identity cache.
+ * A fast connect reuses the STLink version and the target IDs recorded by
+ * an earlier session on the same USB path, rather than asking again.  Each
+ * line is
+ *   <usb-path> <serial> <stlink> <jtag> <swim> <vid> <pid> <core-id> <idcode>
+ *     <read-size> <write-size>
+ * The serial number guards against a different probe in the same port.
+ * The transfer sizes are from the calibrate command, or 0 for the default,
+ * and are only used with the same firmware version.
+ */
+static char *stl_id_cache_path(char *path, int len)
 {
-    char *program;				/* Program name without path. */
-    int c, errflag = 0;
-	char *dev_name;				/* Path of STLink device e.g. "/dev/stlink" */
-	char *upload_path = 0, *download_path = 0, *verify_path = 0;
-	int do_blink = 0;
-	struct stlink *sl;
+	const char *env;
+
+	if ((env = getenv("STLINK_ID_CACHE")) != NULL)
+		snprintf(path, len, "%s", env);
+	else if ((env = getenv("XDG_CACHE_HOME")) != NULL && *env)
+		snprintf(path, len, "%s/stlinkv2-util-ids", env);
+	else if ((env = getenv("HOME")) != NULL)
+		snprintf(path, len, "%s/.cache/stlinkv2-util-ids", env);
+	else
+		return NULL;
+	return path;
+}
 
-    program = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+/* Format the cache line for SL into LINE. */
+static void stl_id_cache_line(struct stlink *sl, char *line, int len)
+{
+	snprintf(line, len, "%s %s %x %x %x %4.4x %4.4x %8.8x %8.8x %d %d\n",
+			 sl->usb_path, sl->serial[0] ? sl->serial : "-",
+			 sl->ver.STLink_ver, sl->ver.JTAG_ver, sl->ver.SWIM_ver,
+			 sl->ver.ST_VendorID, sl->ver.ST_ProductID,
+			 sl->core_id, sl->cpu_idcode, sl->read_blk, sl->write_blk);
+}
 
-	while ((c = getopt_long(argc, argv, short_opts, long_options, 0)) != -1) {
-		switch (c) {
-		case 'B': do_blink++; break;
-		case 'C': verify_path = optarg; break;
-		case 'D': download_path = optarg; break;
-		case 'U': upload_path = optarg; break;
-		case 'h':
-		case 'u': printf(usage_msg, program); return 0;
-		case 'v': verbose++; break;
-		case 'V': printf("%s\n", version_msg); return 0;
-		default:
-		case '?': errflag++; break;
+/* Fill in the identity of SL from the cache, for a fast connect, or
+ * else only the tuned transfer sizes.  Returns 0 on a hit. */
+static int stl_id_cache_load(struct stlink *sl, int fast)
+{
+	char path[256], line[256], upath[32], serial[64];
+	unsigned int stl_v, jtag_v, swim_v, vid, pid, core_id, idcode;
+	int read_blk, write_blk;
+	int found = -1;
+	FILE *fp;
+
+	if (sl->backend != &stl_usb_backend || sl->usb_path[0] == 0 ||
+		stl_id_cache_path(path, sizeof path) == NULL ||
+		(fp = fopen(path, "r")) == NULL)
+		return -1;
+	while (fgets(line, sizeof line, fp))
+		if (sscanf(line, "%31s %63s %x %x %x %x %x %x %x", upath, serial,
+				   &stl_v, &jtag_v, &swim_v, &vid, &pid, &core_id,
+				   &idcode) == 9 &&
+			strcmp(upath, sl->usb_path) == 0 &&
+			strcmp(serial, sl->serial[0] ? sl->serial : "-") == 0) {
+			if (sscanf(line, "%*s %*s %*x %*x %*x %*x %*x %*x %*x %d %d",
+					   &read_blk, &write_blk) != 2)
+				read_blk = write_blk = 0;
+			if (fast) {
+				sl->ver.STLink_ver = stl_v;
+				sl->ver.JTAG_ver = jtag_v;
+				sl->ver.SWIM_ver = swim_v;
+				sl->ver.ST_VendorID = vid;
+				sl->ver.ST_ProductID = pid;
+				sl->core_id = core_id;
+				sl->cpu_idcode = idcode;
+				sl->id_from_cache = 1;
+			} else if (sl->ver.STLink_ver != stl_v ||
+					   sl->ver.JTAG_ver != jtag_v ||
+					   sl->ver.SWIM_ver != swim_v)
+				break;			/* Calibrated with other firmware. */
+			sl->read_blk = read_blk;
+			sl->write_blk = write_blk;
+			found = 0;
+			break;
 		}
-    }
+	fclose(fp);
+	return found;
+}
 
-    if (errflag || argv[optind] == NULL) {
-		fprintf(stderr, usage_msg, program);
-		return errflag ? 1 : 2;
-    }
+/* Record the identity of SL in the cache, if it has changed.
+ * The file is rewritten to a unique temporary file and renamed into
+ * place, so that parallel jobs never see a partial file.  The --parallel
+ * threads take turns, so that none loses another's entry.
+ */
+static pthread_mutex_t id_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static void stl_id_cache_save(struct stlink *sl)
+{
+	char path[256], tmp_path[280], line[256], entry[256];
+	int len = strlen(sl->usb_path), fd;
+	FILE *fp, *out;
 
-	sl = stl_usb_scan(&global_stlink, "USB STLink");
-	if (sl == NULL) {
-		fprintf(stderr, "Could not find a STLink.\n");
-		return EXIT_FAILURE;
+	if (sl->backend != &stl_usb_backend || sl->usb_path[0] == 0 ||
+		( ! sl->chip_known && ! sl->id_from_cache) ||
+		stl_id_cache_path(path, sizeof path) == NULL)
+		return;
+	stl_id_cache_line(sl, entry, sizeof entry);
+	pthread_mutex_lock(&id_cache_lock);
+	if ((fp = fopen(path, "r")) != NULL) {
+		while (fgets(line, sizeof line, fp))
+			if (strcmp(line, entry) == 0) {
+				fclose(fp);
+				pthread_mutex_unlock(&id_cache_lock);
+				return;
+			}
+		rewind(fp);
+	}
+	snprintf(tmp_path, sizeof tmp_path, "%s.XXXXXX", path);
+	if ((fd = mkstemp(tmp_path)) < 0 || (out = fdopen(fd, "w")) == NULL) {
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp_path);
+		}
+		if (fp)
+			fclose(fp);
+		pthread_mutex_unlock(&id_cache_lock);
+		return;
 	}
+	if (fp) {
+		while (fgets(line, sizeof line, fp))
+			if (strncmp(line, sl->usb_path, len) != 0 || line[len] != ' ')
+				fputs(line, out);
+		fclose(fp);
+	}
+	fputs(entry, out);
+	if (fclose(out) != 0 || rename(tmp_path, path) != 0)
+		unlink(tmp_path);
+	pthread_mutex_unlock(&id_cache_lock);
+}
 
+/* Verify that we are talking to a working STLink, switch it into SWD
+ * debug mode and identify the target.
+ * A fast connect (sl->fast) takes the STLink version and target identity
+ * from the ID cache when it has them, and skips the mode switch if the
+ * probe is still in debug mode.  Only the target IDCODE is read, to catch
+ * a different board on the same probe, which is then fully identified.
+ */
+int stl_connect(struct stlink *sl)
+{
+	if (sl->fast && stl_id_cache_load(sl, 1) == 0) {
+		uint32_t idcode;
+
+		if (sl->verbose) {
+			printf("Using the cached identity of %s.\n", sl->usb_path);
+			stl_print_version(&sl->ver);
+		}
+		if (stl_mode(sl) != STLinkDevMode_Debug) {
+			stl_kick_mode(sl);
+			stl_enter_SWD_mode(sl);
+		}
+		idcode = sl_rd32(sl, DBGMCU_IDCODE);
+		if (sl->cmd_err == 0 && idcode == 0)		/* Cortex-M0 */
+			idcode = sl_rd32(sl, 0x40015800);
+		if (sl->cmd_err || idcode != sl->cpu_idcode) {
+			if (sl->verbose)
+				printf("The target is not the cached %8.8x, "
+					   "identifying it.\n", sl->cpu_idcode);
+			sl->id_from_cache = 0;
+			stm_id_chip(sl);
+		}
+		return 0;
+	}
 	stl_get_version(sl);
 	sl->ver = *(struct STLinkVersion *)sl->data_buf;
 	if (sl->ver.ST_VendorID == 0 && sl->ver.ST_ProductID == 0) {
@@ -2024,7 +7602,7 @@ int main(int argc, char *argv[])
 				"  Either the STLink is not plugged in or it is still "
 				"being initialized.\n",
 				sl->dev_path);
-		return EXIT_FAILURE;
+		return -1;
 	}
 
 	if (sl->verbose)
@@ -2035,10 +7613,12 @@ int main(int argc, char *argv[])
 		 sl->ver.ST_ProductID != USB_STLINKv2_PID)) {
 		fprintf(stderr, "The device %s is not a STLink\n"
 				"       VID/PID %04x/%04x instead of %04x/%04x.\n",
-				dev_name, sl->ver.ST_VendorID, sl->ver.ST_ProductID,
+				sl->dev_path, sl->ver.ST_VendorID, sl->ver.ST_ProductID,
 				USB_ST_VID, USB_STLINK_PID);
-		return EXIT_FAILURE;
+		return -1;
 	}
+	/* Use any transfer sizes calibrated for this probe and firmware. */
+	stl_id_cache_load(sl, 0);
 
 	/* When we open the device it is in an unknown mode.
 	 * The v1 is likely in mass storage mode.
@@ -2061,22 +7641,24 @@ int main(int argc, char *argv[])
 	}
 
 	/* At this point we have identified a working STLink programmer.
-	 * We now check on the target chip ID and state. */
-	stm_id_chip(sl);
+	 * We now check on the target chip ID and state.  A fast connect that
+	 * missed the cache still identifies a real probe's target, so that
+	 * the next one hits. */
+	if ( ! sl->fast || sl->backend == &stl_usb_backend)
+		stm_id_chip(sl);
+	return 0;
+}
 
-	/* Do any -C/-D/-U operations. */
-	if (upload_path) {
-		uint32_t flash_base = stm_devids[sl->chip_index].flash_base;
-		uint32_t flash_size = stm_devids[sl->chip_index].flash_size;
-		/* Read the program area. */
-		fprintf(stderr, " Reading ARM memory 0x%8.8x..0x%8.8x into %s.\n",
-				flash_base, flash_base+flash_size, upload_path);
-		stl_fread(sl, upload_path, flash_base, flash_size);
-	}
+/* Execute the command-line commands CMDS on the probe SL.
+ * Returns the number of commands that failed.
+ */
+int stl_run_cmds(struct stlink *sl, char **cmds)
+{
+	int failures = 0;
 
-	while (argv[optind]) {
-		char *cmd = argv[optind];
-		if (verbose) printf("Executing command %s.\n", argv[optind]);
+	for (; *cmds; cmds++) {
+		char *cmd = *cmds;
+		if (stl_verbose) printf("Executing command %s.\n", cmd);
 
 		if (strcmp("regs", cmd) == 0) {
 			/* We must be stopped for this to work! */
@@ -2096,22 +7678,31 @@ int main(int argc, char *argv[])
 						cmd);
 		} else if (strncmp("program=", cmd, 8) == 0) {
 			char *path = cmd + 8;
-			uint32_t flash_base = stm_devids[0].flash_base;
-			uint32_t flash_size = stm_devids[0].flash_size;
-			int res;
+			uint32_t flash_base = stm_devids[stl_chip(sl)].flash_base;
+			uint32_t flash_size = stl_flash_size(sl);
+			uint8_t *image;
+			int res = -1, size, mapped;
 			/* Write the user flash area. */
 			fprintf(stderr, " Writing program from %s into STM32 memory at "
 					"0x%8.8x.\n", path, flash_base);
 			stl_enter_debug(sl);
 			stl_reset(sl);
-			stl_flash_erase_page(sl, 0xa11);
-			stl_flash_erase_page(sl, 0xa11);
-			stl_flash_fwrite(sl, path, flash_base, flash_size);
-			printf(" Verifying flash write...");
-			fflush(stdout);
-			res = stlink_fverify(sl, path, flash_base);
-			printf("file %s %s flash contents\n", path,
-				   res == 0 ? "matched" : "did not match");
+			/* Read the image once, so that a pipe can be verified too. */
+			image = stl_map_image(path, flash_size, &size, &mapped);
+			if (image) {
+				/* Erase and write only the pages that change. */
+				stl_flash_update(sl, flash_base, image, size);
+				printf(" Verifying flash write...");
+				fflush(stdout);
+				stl_phase(sl, PhaseVerify);
+				res = stl_verify_image(sl, flash_base, image, size, 1);
+				stl_phase(sl, PhaseOther);
+				stl_unmap_image(image, size, mapped);
+				printf("file %s %s flash contents\n", path,
+					   res == 0 ? "matched" : "did not match");
+			}
+			if (res)
+				failures++;
 		} else if (strncmp("read", cmd, 4) == 0) {
 			/* Read memory location */
 			int memaddr = strtoul(cmd+4, 0, 0); /* Super sleazy */
@@ -2135,34 +7726,43 @@ int main(int argc, char *argv[])
 						cmd);
 		} else if (strncmp("flash:r:", cmd, 8) == 0) {
 			char *path = cmd + 8;
-			uint32_t flash_base = stm_devids[0].flash_base;
-			uint32_t flash_size = stm_devids[0].flash_size;
+			uint32_t flash_base = stm_devids[stl_chip(sl)].flash_base;
+			uint32_t flash_size = stl_flash_size(sl);
 			/* Read the program area. */
 			fprintf(stderr, " Reading ARM memory 0x%8.8x..0x%8.8x into %s.\n",
 					flash_base, flash_base+flash_size, path);
+			stl_phase(sl, PhaseRead);
 			stl_fread(sl, path, flash_base, flash_size);
+			stl_phase(sl, PhaseOther);
 		} else if (strncmp("flash:w:", cmd, 8) == 0) {
 			char *path = cmd + 8;
-			uint32_t flash_base = stm_devids[0].flash_base;
-			uint32_t flash_size = stm_devids[0].flash_size;
+			uint32_t flash_base = stm_devids[stl_chip(sl)].flash_base;
+			uint32_t flash_size = stl_flash_size(sl);
 			/* Write the user flash area. */
 			fprintf(stderr, " Writing ARM memory 0x%8.8x..0x%8.8x from %s.\n",
 					flash_base, flash_base+flash_size, path);
 			stl_flash_fwrite(sl, path, flash_base, flash_size);
 		} else if (strncmp("flash:v:", cmd, 8) == 0) {
 			char *path = cmd + 8;
-			uint32_t flash_base = stm_devids[0].flash_base;
-			const int res = stlink_fverify(sl, path, flash_base);
+			uint32_t flash_base = stm_devids[stl_chip(sl)].flash_base;
+			int res;
+			stl_phase(sl, PhaseVerify);
+			res = stlink_fverify(sl, path, flash_base);
+			stl_phase(sl, PhaseOther);
 			printf("  Check flash: file %s %s flash contents\n", path,
 				   res == 0 ? "matched" : "did not match");
+			if (res)
+				failures++;
 		} else if (strncmp("sys:r:", cmd, 6) == 0) {
 			char *path = cmd + 6;
-			uint32_t membase = stm_devids[0].sysflash_base;
-			uint32_t size = stm_devids[0].sysflash_size;
+			uint32_t membase = stm_devids[stl_chip(sl)].sysflash_base;
+			uint32_t size = stm_devids[stl_chip(sl)].sysflash_size;
 			/* Read the system flash memory. */
 			fprintf(stderr, " Reading ARM memory 0x%8.8x..0x%8.8x into %s.\n",
 					membase, membase+size, path);
+			stl_phase(sl, PhaseRead);
 			stl_fread(sl, path, membase, size);
+			stl_phase(sl, PhaseOther);
 		} else if (strcmp("status", cmd) == 0) {
 			sl->core_state = stl_get_status(sl);
 			printf("ARM status is 0x%4.4x: %s.\n", sl->core_state,
@@ -2172,6 +7772,9 @@ int main(int argc, char *argv[])
 			stm_discovery_blink(sl);
 		} else if (strcmp("info", cmd) == 0) {
 			stm_info(sl);
+		} else if (strcmp("calibrate", cmd) == 0) {
+			if (stl_calibrate(sl))
+				failures++;
 		} else if (strcmp("reset", cmd) == 0) {
 			stl_reset(sl);
 		} else if (strcmp("version", cmd) == 0) {
@@ -2213,9 +7816,9 @@ int main(int argc, char *argv[])
 		}
 		else {
 			fprintf(stderr, "Unrecognized command '%s'.\n", cmd);
+			failures++;
 			break;
 		}
-		optind++;
 	}
 
 	/* A list of the features/bugs that I still need to check.
@@ -2231,6 +7834,115 @@ int main(int argc, char *argv[])
 	 * Check what happens with unaligned mem32 transfers, read and write.
 	 *  - Note state of STLink after failure, including next command response.
 	 */
+	return failures;
+}
+
+#if ! defined(STLINK_LIBRARY)
+/* A programming job, run on a single probe. */
+struct stl_job {
+	char **cmds;				/* Command-line commands, NULL terminated. */
+	const char *upload_path;	/* Optional -U flash read-back file. */
+	const char *sim_spec;		/* Use the simulator, with this chip. */
+	const char *replay_path;	/* Use a recorded trace instead of a probe. */
+	const char *trace_path;		/* Record a trace of the session. */
+	const char *stats_mode;		/* --stats report: text, json or a file. */
+	int fast;					/* Attach without a reset, see stl_connect(). */
+	int compress;				/* Compress flash blocks, --compress. */
+	int vpp;					/* F4 VPP is supplied, --vpp. */
+};
+
+/* Print the --stats report for the finished job.  A report file is
+ * appended to, one JSON object per probe session. */
+static void stl_job_stats(struct stlink *sl, struct stl_job *job)
+{
+	int json = strcmp(job->stats_mode, "text") != 0;
+	FILE *fp = stdout;
+
+	if (json && strcmp(job->stats_mode, "json") != 0 &&
+		(fp = fopen(job->stats_mode, "a")) == NULL) {
+		fprintf(stderr, "Failed to open the statistics file '%s': %s.\n",
+				job->stats_mode, strerror(errno));
+		return;
+	}
+	flockfile(fp);
+	stl_stats_report(sl, fp, json);
+	funlockfile(fp);
+	if (fp != stdout)
+		fclose(fp);
+}
+
+/* Apply the JOB options to the probe context SL, before connecting.
+ * Used for both single jobs and daemon stations.
+ */
+static void stl_job_setup(struct stlink *sl, struct stl_job *job)
+{
+	if (job->stats_mode)
+		stl_stats_enable(sl);
+	sl->fast = job->fast;
+	sl->compress = job->compress;
+	sl->vpp = job->vpp;
+}
+
+/* Open the probe selected by PROBE_SEL, run JOB, and close it again.
+ * A PROBE_SEL that is a device path, such as /dev/sg2, is a STLink v1.
+ * Returns zero if everything succeeded.
+ */
+static int stl_probe_job(const char *probe_sel, struct stl_job *job)
+{
+	struct stlink *sl;
+	int failures;
+
+	sl = calloc(1, sizeof *sl);
+	if (sl && (job->sim_spec || job->replay_path)) {
+		if ((job->sim_spec ? stl_sim_open(sl, job->sim_spec)
+			 : stl_replay_open(sl, job->replay_path)) == NULL) {
+			free(sl);
+			return -1;
+		}
+#if defined(__linux__)
+	} else if (sl && probe_sel && probe_sel[0] == '/') {
+		if (stl_sg_open(sl, probe_sel) == NULL) {
+			free(sl);
+			return -1;
+		}
+#endif
+	} else if (sl == NULL ||
+			   stl_usb_scan(sl, probe_sel, ! job->fast) == NULL) {
+		fprintf(stderr, "Could not find a STLink%s%s.\n",
+				probe_sel ? " at " : "", probe_sel ? probe_sel : "");
+		free(sl);
+		return -1;
+	}
+
+	if (job->trace_path && stl_trace_open(sl, job->trace_path) < 0) {
+		stl_close(sl);
+		free(sl);
+		return -1;
+	}
+
+	stl_job_setup(sl, job);
+
+	stl_phase(sl, PhaseConnect);
+	if (stl_connect(sl) < 0) {
+		stl_close(sl);
+		free(sl);
+		return -1;
+	}
+	stl_phase(sl, PhaseOther);
+
+	/* Do any -C/-D/-U operations. */
+	if (job->upload_path) {
+		uint32_t flash_base = stm_devids[stl_chip(sl)].flash_base;
+		uint32_t flash_size = stl_flash_size(sl);
+		/* Read the program area. */
+		fprintf(stderr, " Reading ARM memory 0x%8.8x..0x%8.8x into %s.\n",
+				flash_base, flash_base+flash_size, job->upload_path);
+		stl_phase(sl, PhaseRead);
+		stl_fread(sl, job->upload_path, flash_base, flash_size);
+		stl_phase(sl, PhaseOther);
+	}
+
+	failures = stl_run_cmds(sl, job->cmds);
 
 #if 0
 	/* Switch back to mass storage mode before closing. */
@@ -2239,14 +7951,385 @@ int main(int argc, char *argv[])
 #endif
 	/* Commands tend to 'stick' in the stlink.  Flush them. */
 	stl_get_status(sl);
+	if (sl->stats)
+		stl_job_stats(sl, job);
+	stl_close(sl);
+	free(sl);
+	return failures ? -1 : 0;
+}
+
+/* Parallel programming of every attached probe.
+ * Each probe gets its own worker thread and libusb context, so the only
+ * shared state is the read-only job description and chip tables.
+ */
+#define MAX_PROBES 32
+struct stl_worker {
+	pthread_t thread;
+	char usb_path[32];
+	struct stl_job *job;
+	int result;
+};
+
+static void *stl_worker_thread(void *arg)
+{
+	struct stl_worker *w = arg;
+
+	w->result = stl_probe_job(w->usb_path, w->job);
+	return NULL;
+}
+
+static int stl_parallel_jobs(struct stl_job *job)
+{
+	static struct stl_worker workers[MAX_PROBES];
+	char paths[MAX_PROBES][32];
+	int i, nprobes, failed = 0;
+
+	nprobes = stl_usb_list(paths, MAX_PROBES);
+	if (nprobes > MAX_PROBES)
+		nprobes = MAX_PROBES;
+	if (nprobes == 0) {
+		fprintf(stderr, "Could not find a STLink.\n");
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < nprobes; i++) {
+		strcpy(workers[i].usb_path, paths[i]);
+		workers[i].job = job;
+		if (pthread_create(&workers[i].thread, NULL, stl_worker_thread,
+						   &workers[i]) != 0) {
+			fprintf(stderr, "Failed to start a worker for %s.\n", paths[i]);
+			workers[i].result = -1;
+			workers[i].thread = 0;
+		}
+	}
+	for (i = 0; i < nprobes; i++) {
+		if (workers[i].thread)
+			pthread_join(workers[i].thread, NULL);
+		printf("STLink %s: %s.\n", workers[i].usb_path,
+			   workers[i].result == 0 ? "passed" : "FAILED");
+		if (workers[i].result)
+			failed++;
+	}
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+/* The production-line daemon.
+ * Rather than start a fresh process, with a libusb_init(), full bus scan
+ * and device reset for every board, the daemon keeps running and reacts to
+ * hotplug events.  Each STLink that appears gets a station thread that
+ * opens the probe once, then waits for a target to be connected, runs the
+ * job on it, and waits for it to be removed before starting over.
+ * Stations are independent, so one slow board does not hold up the rest.
+ */
+struct stl_station {
+	char usb_path[32];
+	int active;					/* A thread is running this station. */
+	int boards, failed;			/* Jobs run, and how many failed. */
+	struct stl_job *job;
+};
+static struct stl_station stations[MAX_PROBES];
+static pthread_mutex_t station_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Return true if a target responds on the SWD interface. */
+static int stl_target_present(struct stlink *sl)
+{
+	uint32_t core_id;
+	int i;
+
+	stl_enter_SWD_mode(sl);
+	core_id = stl_get_core_id(sl);
+	for (i = 0; arm_cores[i].core_id; i++)
+		if (arm_cores[i].core_id == core_id)
+			return 1;
+	return 0;
+}
+
+#define STATION_POLL_USEC	(250*1000)
+
+static void *stl_station_thread(void *arg)
+{
+	struct stl_station *st = arg;
+	struct stlink *sl = calloc(1, sizeof *sl);
+	int i;
+
+	/* A freshly plugged STLink takes a moment to start responding. */
+	for (i = 0; sl && i < 10; i++) {
+		if (stl_usb_scan(sl, st->usb_path, 1) != NULL)
+			break;
+		usleep(STATION_POLL_USEC);
+	}
+	if (sl && i < 10)
+		stl_job_setup(sl, st->job);
+	if (sl == NULL || i == 10 || stl_connect(sl) < 0) {
+		fprintf(stderr, "Station %s: unable to use the STLink.\n",
+				st->usb_path);
+		if (sl && i < 10)
+			stl_close(sl);
+		goto done;
+	}
+	printf("Station %s: STLink ready, serial %s.\n", st->usb_path,
+		   sl->serial[0] ? sl->serial : "unknown");
+
+	while ( ! sl->usb_gone) {
+		struct timeval start, end;
+		int failures;
+
+		/* Wait for a board. */
+		while ( ! sl->usb_gone && ! stl_target_present(sl))
+			usleep(STATION_POLL_USEC);
+		if (sl->usb_gone)
+			break;
+		gettimeofday(&start, NULL);
+		if (sl->stats) {
+			/* A report for each board, not the station's lifetime. */
+			memset(sl->stats, 0, sizeof *sl->stats);
+			stl_stats_enable(sl);
+		}
+		stm_id_chip(sl);
+		printf("Station %s: found %s target, running job.\n",
+			   st->usb_path, stm_devids[sl->chip_index].name);
+		failures = stl_run_cmds(sl, st->job->cmds);
+		gettimeofday(&end, NULL);
+		pthread_mutex_lock(&station_lock);
+		st->boards++;
+		if (failures)
+			st->failed++;
+		pthread_mutex_unlock(&station_lock);
+		printf("Station %s: board %d %s in %ld ms (%d of %d failed).\n",
+			   st->usb_path, st->boards, failures ? "FAILED" : "passed",
+			   (end.tv_sec - start.tv_sec) * 1000 +
+			   (end.tv_usec - start.tv_usec) / 1000,
+			   st->failed, st->boards);
+		if (sl->stats)
+			stl_job_stats(sl, st->job);
+		/* Wait for the board to be removed. */
+		while ( ! sl->usb_gone && stl_target_present(sl))
+			usleep(STATION_POLL_USEC);
+	}
+	printf("Station %s: STLink removed.\n", st->usb_path);
 	stl_close(sl);
+ done:
+	free(sl);
+	pthread_mutex_lock(&station_lock);
+	st->active = 0;
+	pthread_mutex_unlock(&station_lock);
+	return NULL;
+}
+
+/* Record up to MAX USB locations of the attached STLink v2 probes in LIST,
+ * quietly and without opening them, so a probe already in use is left
+ * alone.  Returns the number found.
+ */
+static int stl_usb_locations(libusb_context *ctx, char (*list)[32], int max)
+{
+	libusb_device **devs;
+	ssize_t cnt;
+	int i, found = 0;
 
+	cnt = libusb_get_device_list(ctx, &devs);
+	if (cnt < 0)
+		return 0;
+	for (i = 0; i < cnt && found < max; i++) {
+		struct libusb_device_descriptor desc;
+
+		if (libusb_get_device_descriptor(devs[i], &desc) < 0 ||
+			desc.idVendor != USB_ST_VID || desc.idProduct != USB_STLINKv2_PID)
+			continue;
+		stl_usb_path(devs[i], list[found++], 32);
+	}
+	libusb_free_device_list(devs, 1);
+	return found;
+}
+
+/* Return true if a station thread is running for USB_PATH. */
+static int stl_station_busy(const char *usb_path)
+{
+	int i, busy = 0;
+
+	pthread_mutex_lock(&station_lock);
+	for (i = 0; i < MAX_PROBES; i++)
+		if (stations[i].active && strcmp(stations[i].usb_path, usb_path) == 0)
+			busy = 1;
+	pthread_mutex_unlock(&station_lock);
+	return busy;
+}
+
+/* Start a station thread for the probe at USB_PATH, unless one is
+ * already running. */
+static void stl_station_start(const char *usb_path, struct stl_job *job)
+{
+	struct stl_station *st = NULL;
+	pthread_t thread;
+	int i;
+
+	pthread_mutex_lock(&station_lock);
+	for (i = 0; i < MAX_PROBES; i++) {
+		if (strcmp(stations[i].usb_path, usb_path) == 0) {
+			st = &stations[i];	/* Keep the board counts for the location. */
+			break;
+		}
+		if (st == NULL && ! stations[i].active && stations[i].boards == 0)
+			st = &stations[i];
+	}
+	if (st == NULL || st->active) {
+		pthread_mutex_unlock(&station_lock);
+		return;
+	}
+	strcpy(st->usb_path, usb_path);
+	st->job = job;
+	st->active = 1;
+	pthread_mutex_unlock(&station_lock);
+	if (pthread_create(&thread, NULL, stl_station_thread, st) != 0) {
+		fprintf(stderr, "Failed to start a station for %s.\n", usb_path);
+		st->active = 0;
+		return;
+	}
+	pthread_detach(thread);
+}
+
+/* Hotplug arrivals are only recorded here, and the stations are started
+ * from the event loop.  libusb does not allow device I/O from inside a
+ * hotplug callback. */
+static char hotplug_pending[MAX_PROBES][32];
+static int hotplug_npending;
+
+static int LIBUSB_CALL stl_hotplug_cb(libusb_context *ctx, libusb_device *dev,
+									  libusb_hotplug_event event,
+									  void *user_data)
+{
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED &&
+		hotplug_npending < MAX_PROBES)
+		stl_usb_path(dev, hotplug_pending[hotplug_npending++], 32);
+	return 0;					/* Stay registered. */
+}
+
+static int stl_daemon(struct stl_job *job)
+{
+	libusb_context *ctx;
+	libusb_hotplug_callback_handle cb_handle;
+	int i, use_hotplug;
+
+	/* The station reports are a log, so do not hold them back. */
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	if (libusb_init(&ctx) < 0) {
+		fprintf(stderr, "Failed to initialize USB access.\n");
+		return EXIT_FAILURE;
+	}
+	use_hotplug = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+		libusb_hotplug_register_callback(ctx,
+										 LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+										 LIBUSB_HOTPLUG_ENUMERATE,
+										 USB_ST_VID, USB_STLINKv2_PID,
+										 LIBUSB_HOTPLUG_MATCH_ANY,
+										 stl_hotplug_cb, NULL,
+										 &cb_handle) == 0;
+	if ( ! use_hotplug)
+		fprintf(stderr, "USB hotplug is not available, polling for "
+				"new STLinks instead.\n");
+	printf("Waiting for STLinks and targets.\n");
+
+	for (;;) {
+		if (use_hotplug) {
+			struct timeval tv = {1, 0};
+			libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+		} else {
+			/* Only look for new probes: the stations own the rest. */
+			char paths[MAX_PROBES][32];
+			int n = stl_usb_locations(ctx, paths, MAX_PROBES);
+			for (i = 0; i < n; i++)
+				if ( ! stl_station_busy(paths[i]))
+					stl_station_start(paths[i], job);
+			sleep(1);
+		}
+		for (i = 0; i < hotplug_npending; i++)
+			stl_station_start(hotplug_pending[i], job);
+		hotplug_npending = 0;
+	}
 	return EXIT_SUCCESS;
 }
-
+
+
+int main(int argc, char *argv[])
+{
+    char *program;				/* Program name without path. */
+    int c, errflag = 0;
+	char *upload_path = 0, *download_path = 0, *verify_path = 0;
+	char *probe_sel = NULL;		/* USB location or serial of the probe. */
+	char *sim_spec = NULL;		/* Simulated target chip, if any. */
+	char *replay_path = NULL, *trace_path = NULL;
+	char *stats_mode = NULL;	/* --stats=text|json|<file> */
+	int do_blink = 0, do_list = 0, do_parallel = 0, do_daemon = 0;
+	int fast = 0, compress = 0, vpp = 0;
+	struct stl_job job;
+
+    program = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+
+	while ((c = getopt_long(argc, argv, short_opts, long_options, 0)) != -1) {
+		switch (c) {
+		case 'A':
+			if (stl_algo_load(optarg))
+				return 1;
+			break;
+		case 'B': do_blink++; break;
+		case 'C': verify_path = optarg; break;
+		case 'D': download_path = optarg; break;
+		case 'L': do_list++; break;
+		case 'd': do_daemon++; break;
+		case 'f': fast++; break;
+		case 'z': compress++; break;
+		case 'W': vpp++; break;
+		case 'P': do_parallel++; break;
+		case 'U': upload_path = optarg; break;
+		case 'p': probe_sel = optarg; break;
+		case 'R': replay_path = optarg; break;
+		case 'S': sim_spec = optarg ? optarg : ""; break;
+		case 'T': trace_path = optarg; break;
+		case 's': stats_mode = optarg ? optarg : "text"; break;
+		case 'Z': return stl_trace_show(optarg) ? EXIT_FAILURE : EXIT_SUCCESS;
+		case 'h':
+		case 'u': printf(usage_msg, program, program, program, program); return 0;
+		case 'v': stl_verbose++; break;
+		case 'V': printf("%s\n", version_msg); return 0;
+		default:
+		case '?': errflag++; break;
+		}
+    }
+
+	if (do_list)
+		return stl_usb_list(NULL, 0) > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    if (errflag || argv[optind] == NULL) {
+		fprintf(stderr, usage_msg, program, program, program, program);
+		return errflag ? 1 : 2;
+    }
+
+	job.cmds = argv + optind;
+	job.upload_path = upload_path;
+	job.sim_spec = sim_spec;
+	job.replay_path = replay_path;
+	job.trace_path = trace_path;
+	job.stats_mode = stats_mode;
+	job.fast = fast;
+	job.compress = compress;
+	job.vpp = vpp;
+	if (trace_path && (do_daemon || do_parallel)) {
+		fprintf(stderr, "A trace records a single probe session, and may "
+				"not be used with --daemon or --parallel.\n");
+		return 1;
+	}
+	if (sim_spec || replay_path)
+		return stl_probe_job(NULL, &job) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	if (do_daemon)
+		return stl_daemon(&job);
+	if (do_parallel)
+		return stl_parallel_jobs(&job);
+	return stl_probe_job(probe_sel, &job) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+#endif
+
 /*
  * Local variables:
- *  compile-command: "cc -O -Wall -Wstrict-prototypes -o stlinkv2-util stlinkv2-util.c -lusb-1.0"
+ *  compile-command: "cc -O -Wall -Wstrict-prototypes -o stlinkv2-util stlinkv2-util.c -lusb-1.0 -lpthread"
  *  c-indent-level: 4
  *  c-basic-offset: 4
  *  tab-width: 4